@@ -0,0 +1,213 @@
+#include <stdio.h>
+#include <string.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "account_index.h"
+
+int index_init(AccountIndex* index, int shared, uint32_t max_capacity) {
+    memset(index, 0, sizeof(*index));
+    index->shared = shared;
+    index->capacity = INDEX_MIN_CAPACITY;
+    index->max_capacity = max_capacity > INDEX_MIN_CAPACITY ? max_capacity : INDEX_MIN_CAPACITY;
+    size_t region_bytes = (size_t)index->max_capacity * sizeof(IndexEntry);
+
+    // Zero-filled, so every bucket starts INDEX_EMPTY. MAP_NORESERVE: only
+    // the buckets of the current table are ever touched.
+    int flags = MAP_ANONYMOUS | MAP_NORESERVE | (shared ? MAP_SHARED : MAP_PRIVATE);
+    for (int r = 0; r < 2; r++) {
+        void* region = mmap(NULL, region_bytes, PROT_READ | PROT_WRITE, flags, -1, 0);
+        if (region == MAP_FAILED) {
+            perror("Failed to reserve account index");
+            return 1;
+        }
+        index->regions[r] = region;
+    }
+    return 0;
+}
+
+// FNV-1a: cheap, and mixes the low digits that distinguish account numbers
+uint32_t account_hash(const char* account_number) {
+    uint32_t hash = 2166136261u;
+    for (const unsigned char* p = (const unsigned char*)account_number; *p; p++) {
+        hash ^= *p;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+int index_lookup(const AccountIndex* index, const AccountStore* store, const char* account_number) {
+    uint32_t hash = account_hash(account_number);
+
+    while (1) {
+        unsigned int seq = __atomic_load_n(&index->seq, __ATOMIC_ACQUIRE);
+        if (seq & 1) {
+            sched_yield(); // Live table being swapped
+            continue;
+        }
+
+        const IndexEntry* entries = index->regions[__atomic_load_n(&index->active, __ATOMIC_RELAXED)];
+        uint32_t mask = __atomic_load_n(&index->capacity, __ATOMIC_RELAXED) - 1;
+        uint32_t pos = hash & mask;
+        for (uint32_t probes = 0; probes <= mask; probes++, pos = (pos + 1) & mask) {
+            int32_t slot = __atomic_load_n(&entries[pos].slot, __ATOMIC_ACQUIRE);
+            if (slot == INDEX_EMPTY) {
+                break;
+            }
+            if (slot == INDEX_TOMBSTONE || entries[pos].hash != hash) {
+                continue;
+            }
+            slot -= 1;
+            if (store_slot_valid(store, slot) &&
+                strcmp(store_account(store, slot)->account_number, account_number) == 0) {
+                return slot;
+            }
+        }
+
+        // Only trust a miss if the live table did not change under us
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&index->seq, __ATOMIC_RELAXED) == seq) {
+            return -1;
+        }
+    }
+}
+
+// Store an entry; the release store on slot publishes the hash with it.
+// Returns 1 if a tombstone was reused.
+static int put_entry(IndexEntry* entries, uint32_t mask, uint32_t hash, int slot) {
+    uint32_t pos = hash & mask;
+    while (1) {
+        IndexEntry* entry = &entries[pos];
+        if (entry->slot == INDEX_EMPTY || entry->slot == INDEX_TOMBSTONE) {
+            int reused = entry->slot == INDEX_TOMBSTONE;
+            entry->hash = hash;
+            __atomic_store_n(&entry->slot, slot + 1, __ATOMIC_RELEASE);
+            return reused;
+        }
+        pos = (pos + 1) & mask;
+    }
+}
+
+// Smallest table that keeps `entries` at most a quarter full
+static uint32_t capacity_for(const AccountIndex* index, int entries) {
+    uint32_t capacity = INDEX_MIN_CAPACITY;
+    while (capacity < (uint32_t)entries * 4 && capacity < index->max_capacity) {
+        capacity <<= 1;
+    }
+    return capacity;
+}
+
+// Make the idle region, now holding a table of `capacity` buckets, live
+static void swap_live(AccountIndex* index, uint32_t capacity) {
+    __atomic_store_n(&index->seq, index->seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    __atomic_store_n(&index->active, !index->active, __ATOMIC_RELAXED);
+    __atomic_store_n(&index->capacity, capacity, __ATOMIC_RELAXED);
+    __atomic_store_n(&index->seq, index->seq + 1, __ATOMIC_RELEASE);
+}
+
+// Give the pages of a retired table back to the kernel. A lookup still
+// probing it reads empty buckets and retries because seq has moved on.
+static void release_region(AccountIndex* index, IndexEntry* entries, uint32_t capacity) {
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    size_t bytes = ((capacity * sizeof(IndexEntry)) + page - 1) & ~(page - 1);
+    madvise(entries, bytes, index->shared ? MADV_REMOVE : MADV_DONTNEED);
+}
+
+// Copy the live entries into a fresh table of `capacity` buckets, dropping
+// tombstones, and swap it in
+static void resize(AccountIndex* index, uint32_t capacity) {
+    IndexEntry* old = index->regions[index->active];
+    uint32_t old_capacity = index->capacity;
+    IndexEntry* fresh = index->regions[!index->active];
+
+    memset(fresh, 0, capacity * sizeof(IndexEntry));
+    for (uint32_t i = 0; i < old_capacity; i++) {
+        if (old[i].slot > 0) {
+            put_entry(fresh, capacity - 1, old[i].hash, old[i].slot - 1);
+        }
+    }
+
+    swap_live(index, capacity);
+    index->tombstones = 0;
+    release_region(index, old, old_capacity);
+}
+
+void index_insert(AccountIndex* index, const AccountStore* store, int slot) {
+    // Keep the load factor (live entries and tombstones) at most 1/2
+    if ((uint32_t)(index->used + index->tombstones + 1) * 2 > index->capacity) {
+        uint32_t capacity = capacity_for(index, index->used + 1);
+        if (capacity < index->capacity) {
+            capacity = index->capacity;
+        }
+        resize(index, capacity);
+    }
+
+    IndexEntry* entries = index->regions[index->active];
+    uint32_t hash = account_hash(store_account(store, slot)->account_number);
+    if (put_entry(entries, index->capacity - 1, hash, slot)) {
+        index->tombstones--;
+    }
+    index->used++;
+}
+
+void index_remove(AccountIndex* index, const AccountStore* store, int slot) {
+    IndexEntry* entries = index->regions[index->active];
+    uint32_t mask = index->capacity - 1;
+    uint32_t pos = account_hash(store_account(store, slot)->account_number) & mask;
+
+    for (uint32_t probes = 0; probes <= mask; probes++, pos = (pos + 1) & mask) {
+        if (entries[pos].slot == INDEX_EMPTY) {
+            return; // Not indexed
+        }
+        if (entries[pos].slot == slot + 1) {
+            // Leave a tombstone so probe chains running through this
+            // bucket stay intact for concurrent lookups
+            __atomic_store_n(&entries[pos].slot, INDEX_TOMBSTONE, __ATOMIC_RELEASE);
+            index->used--;
+            index->tombstones++;
+            break;
+        }
+    }
+
+    // Too many tombstones lengthen every probe; a mostly empty table
+    // wastes memory. Either way, rebuild at the right size.
+    if (index->tombstones > (int)(index->capacity / 4) || capacity_for(index, index->used) < index->capacity / 4) {
+        resize(index, capacity_for(index, index->used));
+    }
+}
+
+void index_rebuild(AccountIndex* indexes, int shards, const AccountStore* store) {
+    int active[MAX_SHARDS] = { 0 };
+    uint32_t capacity[MAX_SHARDS];
+    for (int slot = 0; slot < store->slot_count; slot++) {
+        const Account* account = store_account(store, slot);
+        if (account->is_active) {
+            active[index_shard(account_hash(account->account_number), shards)]++;
+        }
+    }
+
+    for (int i = 0; i < shards; i++) {
+        capacity[i] = capacity_for(&indexes[i], active[i]);
+        memset(indexes[i].regions[!indexes[i].active], 0, capacity[i] * sizeof(IndexEntry));
+    }
+    for (int slot = 0; slot < store->slot_count; slot++) {
+        const Account* account = store_account(store, slot);
+        if (account->is_active) {
+            uint32_t hash = account_hash(account->account_number);
+            int i = index_shard(hash, shards);
+            put_entry(indexes[i].regions[!indexes[i].active], capacity[i] - 1, hash, slot);
+        }
+    }
+
+    for (int i = 0; i < shards; i++) {
+        AccountIndex* index = &indexes[i];
+        IndexEntry* old = index->regions[index->active];
+        uint32_t old_capacity = index->capacity;
+        swap_live(index, capacity[i]);
+        index->used = active[i];
+        index->tombstones = 0;
+        release_region(index, old, old_capacity);
+    }
+}
@@ -0,0 +1,66 @@
+#ifndef ACCOUNT_INDEX_H
+#define ACCOUNT_INDEX_H
+
+#include <stdint.h>
+#include "account_store.h"
+
+#define INDEX_MIN_CAPACITY 1024
+#define INDEX_MAX_CAPACITY (2 * (uint32_t)MAX_ACCOUNTS) // Power of two
+
+// Open-addressing (linear probing) index from account number to slot.
+// The header is plain data so it can sit inside the shared account table.
+//
+// Writers (insert/remove/rebuild) must be serialized by the caller.
+// Lookups take no lock: a hit may be stale by the time it is used, so the
+// caller re-checks the slot under its account lock.
+//
+// The index grows by doubling. Two regions, each reserved for the largest
+// possible table, take turns: the next table is built in the idle region
+// while lookups keep using the live one, then the two are swapped. The
+// swap bumps `seq`, and a lookup that misses while `seq` changed is
+// retried instead of reporting a false "not found".
+typedef struct {
+    uint32_t hash;
+    int32_t slot; // INDEX_EMPTY, INDEX_TOMBSTONE or slot + 1
+} IndexEntry;
+
+#define INDEX_EMPTY 0
+#define INDEX_TOMBSTONE -1
+
+typedef struct {
+    unsigned int seq;   // Odd while the live table is being swapped
+    int active;         // Region holding the live table
+    uint32_t capacity;  // Buckets in the live table (power of two)
+    int used;           // Live entries
+    int tombstones;     // Removed entries still occupying a bucket
+    int shared;
+    uint32_t max_capacity; // Buckets each region is reserved for
+    IndexEntry* regions[2];
+} __attribute__((aligned(64))) AccountIndex; // Apart from the next shard's
+
+// Reserve both regions for up to max_capacity buckets (a power of two, at
+// most INDEX_MAX_CAPACITY), MAP_SHARED in shared mode, before any fork
+// Returns 0 on success, 1 on failure
+int index_init(AccountIndex* index, int shared, uint32_t max_capacity);
+
+uint32_t account_hash(const char* account_number);
+
+// Which of `shards` indexes (a power of two) holds an account with this
+// hash. Taken from the top bits, as the low ones pick its bucket.
+static inline uint32_t index_shard(uint32_t hash, int shards) {
+    return (uint32_t)(((uint64_t)hash * (uint32_t)shards) >> 32);
+}
+
+// Returns the slot holding account_number, or -1 if there is none
+int index_lookup(const AccountIndex* index, const AccountStore* store, const char* account_number);
+
+// Add/remove the entry for a slot (its account_number must be set).
+// Inserting may grow the index; removing may compact it.
+void index_insert(AccountIndex* index, const AccountStore* store, int slot);
+void index_remove(AccountIndex* index, const AccountStore* store, int slot);
+
+// Recreate `shards` indexes from the active slots of the store, each
+// account going to indexes[index_shard(its hash, shards)]
+void index_rebuild(AccountIndex* indexes, int shards, const AccountStore* store);
+
+#endif
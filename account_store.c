@@ -0,0 +1,137 @@
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "account_store.h"
+
+#define SLAB_BYTES (sizeof(AccountSlot) * SLAB_SIZE)
+#define COLUMN_BYTES sizeof(AccountColumns)
+
+int store_init(AccountStore* store, int shared, int free_lists) {
+    memset(store, 0, sizeof(*store));
+    store->shared = shared;
+    store->free_list_count = free_lists;
+    for (int i = 0; i < MAX_SHARDS; i++) {
+        store->free_lists[i].head = -1;
+    }
+
+    if (shared) {
+        // Slabs allocated after a fork must be visible to every process, so
+        // the address range for all of them is mapped before any fork
+        void* arena = mmap(NULL, SLAB_BYTES * MAX_SLABS, PROT_READ | PROT_WRITE,
+                           MAP_SHARED | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (arena == MAP_FAILED) {
+            perror("Failed to reserve shared account arena");
+            return 1;
+        }
+        store->arena = arena;
+        arena = mmap(NULL, COLUMN_BYTES * MAX_SLABS, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (arena == MAP_FAILED) {
+            perror("Failed to reserve shared account columns");
+            return 1;
+        }
+        store->column_arena = arena;
+    }
+    return 0;
+}
+
+// Map one more slab and initialize the locks of its slots
+static int add_slab(AccountStore* store) {
+    if (store->slab_count == MAX_SLABS) {
+        return 1;
+    }
+
+    AccountSlot* slab;
+    AccountColumns* columns;
+    if (store->shared) {
+        slab = (AccountSlot*)(store->arena + SLAB_BYTES * store->slab_count);
+        columns = (AccountColumns*)(store->column_arena + COLUMN_BYTES * store->slab_count);
+    } else {
+        slab = mmap(NULL, SLAB_BYTES, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (slab == MAP_FAILED) {
+            perror("Failed to allocate account slab");
+            return 1;
+        }
+        columns = mmap(NULL, COLUMN_BYTES, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (columns == MAP_FAILED) {
+            perror("Failed to allocate account columns");
+            munmap(slab, SLAB_BYTES);
+            return 1;
+        }
+    }
+
+    // Robust so that a process dying with a slot locked cannot wedge it
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    if (store->shared) {
+        pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    }
+    for (int i = 0; i < SLAB_SIZE; i++) {
+        pthread_mutex_init(&slab[i].lock, &attr);
+        slab[i].next_free = -1;
+    }
+    pthread_mutexattr_destroy(&attr);
+
+    // Publish only once the slab is usable: lock-free readers may follow
+    // a slot number into it as soon as the pointer is visible. Its columns
+    // (all zero: closed) go first, so a valid slot always has them.
+    __atomic_store_n(&store->columns[store->slab_count], columns, __ATOMIC_RELEASE);
+    __atomic_store_n(&store->slabs[store->slab_count], slab, __ATOMIC_RELEASE);
+    store->slab_count++;
+    return 0;
+}
+
+int store_take_free(AccountStore* store, int list) {
+    StoreFreeList* free_list = &store->free_lists[list];
+    int slot = free_list->head;
+    if (slot != -1) {
+        free_list->head = store_slot(store, slot)->next_free;
+        free_list->count--;
+        store_slot(store, slot)->next_free = -1;
+    }
+    return slot;
+}
+
+int store_alloc(AccountStore* store) {
+    if (store->slot_count == store->slab_count * SLAB_SIZE && add_slab(store) != 0) {
+        return -1; // Store full
+    }
+    return store->slot_count++;
+}
+
+void store_free(AccountStore* store, int list, int slot) {
+    StoreFreeList* free_list = &store->free_lists[list];
+    store_slot(store, slot)->next_free = free_list->head;
+    free_list->head = slot;
+    free_list->count++;
+}
+
+int store_reserve(AccountStore* store, int count) {
+    if (count > MAX_ACCOUNTS) {
+        return 1;
+    }
+    while (store->slab_count * SLAB_SIZE < count) {
+        if (add_slab(store) != 0) {
+            return 1;
+        }
+    }
+    if (count > store->slot_count) {
+        store->slot_count = count;
+    }
+    return 0;
+}
+
+void store_rebuild_free_list(AccountStore* store) {
+    for (int i = 0; i < store->free_list_count; i++) {
+        store->free_lists[i].head = -1;
+        store->free_lists[i].count = 0;
+    }
+    // Walk backwards so the lowest free slot of each list is handed out first
+    for (int slot = store->slot_count - 1; slot >= 0; slot--) {
+        if (!store_account(store, slot)->is_active) {
+            store_free(store, slot % store->free_list_count, slot);
+        }
+    }
+}
@@ -0,0 +1,113 @@
+#ifndef ACCOUNT_STORE_H
+#define ACCOUNT_STORE_H
+
+#include <stdint.h>
+#include <pthread.h>
+#include "bank.h"
+#include "ledger.h"
+
+#define SLAB_SHIFT 16 // 65536 accounts per slab
+#define SLAB_SIZE (1 << SLAB_SHIFT)
+#define SLAB_MASK (SLAB_SIZE - 1)
+#define MAX_SLABS (MAX_ACCOUNTS / SLAB_SIZE)
+
+typedef struct {
+    pthread_mutex_t lock; // Guards account, see the locking rules in banking.c
+    uint32_t seq;         // Odd while a writer is changing account, see check_balance()
+    int32_t next_free;    // Free-list link while the slot is closed
+    int32_t preimage;     // Saved copy of account for the running checkpoint...
+    uint64_t preimage_lsn; // ...whose mark this is; see keep_preimage()
+    LedgerChain ledger;   // The account's history; reset when the slot is reused
+    Account account;
+} AccountSlot;
+
+// Column copies of the fields whole-table scans read (see bank_audit()),
+// one per slab, so a scan streams through a few bytes per account instead
+// of every slot's strings. The Account in the slot stays the record of
+// truth; these are rewritten under the slot lock whenever it changes and
+// read without locks.
+typedef struct {
+    int64_t balance[SLAB_SIZE]; // Hundredths; 0 while the slot is closed
+    uint8_t active[SLAB_SIZE];  // 1 while the slot holds an open account
+    uint8_t type[SLAB_SIZE];    // Account type code, see bank_audit()
+} AccountColumns;
+
+// A LIFO list of closed slots, linked through next_free. On a cache line
+// of its own: each is taken and released under a different shard lock.
+typedef struct {
+    int head;  // Most recently freed slot, -1 if none
+    int count;
+} __attribute__((aligned(64))) StoreFreeList;
+
+// Growable account storage. Accounts live in fixed-size slabs that are
+// never moved or freed, so a slot's address stays valid for the life of
+// the process and lookups need no lock to reach it. Slots released by
+// close_account() go on one of free_list_count free lists (one per shard
+// of the bank table) and are reused first.
+//
+// The struct itself is plain data so it can be placed in the shared bank
+// table. In shared mode the slabs are carved from one MAP_SHARED arena
+// reserved up front (MAP_NORESERVE, so untouched slabs cost nothing),
+// which keeps slab pointers valid in every forked child.
+//
+// store_take_free/store_free must be serialized per free list by the
+// caller, and store_alloc/store_reserve/store_rebuild_free_list across the
+// whole store.
+typedef struct {
+    int shared;
+    int slab_count;   // Slabs allocated so far
+    int slot_count;   // Slots ever used (highest used slot + 1)
+    int free_list_count;
+    StoreFreeList free_lists[MAX_SHARDS];
+    char* arena;      // Shared mode only: MAX_SLABS slabs reserved up front
+    char* column_arena; // Likewise for their columns
+    AccountSlot* slabs[MAX_SLABS];
+    AccountColumns* columns[MAX_SLABS]; // Published before the slab itself
+} AccountStore;
+
+// free_lists: 1 to MAX_SHARDS
+// Returns 0 on success, 1 on failure
+int store_init(AccountStore* store, int shared, int free_lists);
+
+// Take a closed slot from free list `list`.
+// Returns the slot, or -1 if that list is empty.
+int store_take_free(AccountStore* store, int list);
+
+// Hand out a never used slot, adding a slab if needed. Its lock is
+// initialized; the caller fills in the account while holding that lock.
+// Returns the slot, or -1 when the store is full.
+int store_alloc(AccountStore* store);
+
+// Return a closed slot to free list `list`
+void store_free(AccountStore* store, int list, int slot);
+
+// Make slots [0, count) exist without putting any on the free list.
+// Used when loading a saved table; call store_rebuild_free_list() after.
+// Returns 0 on success, 1 if count exceeds MAX_ACCOUNTS.
+int store_reserve(AccountStore* store, int count);
+
+// Put every inactive slot below slot_count on a free list, dealing them
+// out over the lists in turn
+void store_rebuild_free_list(AccountStore* store);
+
+// True if slot lies in an allocated slab. Used to vet slot numbers read
+// without locks before following them.
+static inline int store_slot_valid(const AccountStore* store, int slot) {
+    return slot >= 0 && slot < MAX_ACCOUNTS &&
+           __atomic_load_n(&store->slabs[slot >> SLAB_SHIFT], __ATOMIC_ACQUIRE) != NULL;
+}
+
+static inline AccountSlot* store_slot(const AccountStore* store, int slot) {
+    return &store->slabs[slot >> SLAB_SHIFT][slot & SLAB_MASK];
+}
+
+static inline Account* store_account(const AccountStore* store, int slot) {
+    return &store_slot(store, slot)->account;
+}
+
+// Columns of slab number slab, NULL if it is not allocated yet
+static inline AccountColumns* store_columns(const AccountStore* store, int slab) {
+    return __atomic_load_n(&store->columns[slab], __ATOMIC_ACQUIRE);
+}
+
+#endif
@@ -0,0 +1,60 @@
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include "admission.h"
+#include "metrics.h"
+#include "rate_limit.h"
+
+ConnectionLimits connection_limits = {
+    DEFAULT_MAX_CONNECTIONS, DEFAULT_IDLE_TIMEOUT, DEFAULT_REQUEST_TIMEOUT, 0
+};
+
+_Static_assert(TIMEOUT_REASONS == METRICS_TIMEOUT_REASONS, "every timeout reason must be counted");
+
+static int open_connections = 0;
+
+static const char busy_reply[] = "ERROR 7 Server busy, try again later.;\n";
+static const char rate_reply[] = "ERROR 9 Too many connections from your address, slow down.;\n";
+
+int admission_enter(int fd, uint32_t address) {
+    if (!rate_limit_allow(RATE_CONNECT, rate_key_address(address), 1)) {
+        send(fd, rate_reply, sizeof(rate_reply) - 1, MSG_DONTWAIT | MSG_NOSIGNAL);
+        close(fd);
+        metrics_syscalls(2);
+        return 0;
+    }
+    int limit = connection_limits.max_connections;
+    if (__atomic_add_fetch(&open_connections, 1, __ATOMIC_RELAXED) > limit && limit > 0) {
+        __atomic_sub_fetch(&open_connections, 1, __ATOMIC_RELAXED);
+        // A fresh socket's buffer is empty: the reply never blocks
+        send(fd, busy_reply, sizeof(busy_reply) - 1, MSG_DONTWAIT | MSG_NOSIGNAL);
+        close(fd);
+        metrics_rejected();
+        metrics_syscalls(2);
+        return 0;
+    }
+    if (connection_limits.send_buffer > 0) {
+        setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &connection_limits.send_buffer, sizeof(int));
+        metrics_syscalls(1);
+    }
+    return 1;
+}
+
+void admission_leave(void) {
+    __atomic_sub_fetch(&open_connections, 1, __ATOMIC_RELAXED);
+}
+
+uint64_t timeout_now(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+    return ((uint64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000) / TIMEOUT_TICK_MS;
+}
+
+uint64_t connection_deadline(uint64_t now, int busy, uint64_t busy_since) {
+    int seconds = busy ? connection_limits.request_timeout : connection_limits.idle_timeout;
+    if (seconds <= 0) {
+        return 0;
+    }
+    return (busy ? busy_since : now) + (uint64_t)seconds * 1000 / TIMEOUT_TICK_MS;
+}
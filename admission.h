@@ -0,0 +1,58 @@
+#ifndef ADMISSION_H
+#define ADMISSION_H
+
+#include <stdint.h>
+#include "framing.h"
+
+#define DEFAULT_MAX_CONNECTIONS 10000
+#define DEFAULT_IDLE_TIMEOUT 300   // Seconds a connection may sit with nothing to do
+#define DEFAULT_REQUEST_TIMEOUT 30 // Seconds a request may take to arrive and its reply to be read
+#define TIMEOUT_TICK_MS 100        // Resolution of the timeouts
+
+// Limits every event loop (and the fork mode acceptor) applies to client
+// connections. Set once by the server before any loop starts.
+typedef struct {
+    int max_connections; // Open at once, over every loop; 0 for no cap
+    int idle_timeout;    // Seconds, 0 for none
+    int request_timeout; // Seconds, 0 for none
+    int send_buffer;     // SO_SNDBUF of client sockets in bytes, 0 to leave it to the kernel
+} ConnectionLimits;
+
+extern ConnectionLimits connection_limits;
+
+// Why a connection was timed out
+typedef enum {
+    TIMEOUT_IDLE,    // Nothing received and nothing to send for idle_timeout
+    TIMEOUT_REQUEST, // A request, or the reading of replies, stalled for request_timeout
+    TIMEOUT_REASONS
+} TimeoutReason;
+
+// Take a place for a newly accepted connection on fd, from IPv4 address
+// (network order), and apply the socket limits to it. Over max_connections,
+// the client is sent a busy reply (ERROR 7), and over its address's
+// connection rate (see rate_limit.h) a rate reply (ERROR 9); fd is then
+// closed at once, costing no more than the accept.
+// Returns 1 if admitted (call admission_leave() when it closes), 0 if
+// rejected.
+int admission_enter(int fd, uint32_t address);
+
+// Give back the place of a closed connection. Async-signal-safe, for fork
+// mode's SIGCHLD handler.
+void admission_leave(void);
+
+// Current time in timeout ticks (CLOCK_MONOTONIC_COARSE: no system call)
+uint64_t timeout_now(void);
+
+// Deadline, in ticks, of a connection seen at tick now. A connection is
+// busy while it holds part of a request or replies not yet sent: it must
+// then make progress (execute a request or get replies read) within
+// request_timeout, counted from busy_since. Otherwise it may stay idle
+// for idle_timeout. Returns 0 for no deadline.
+uint64_t connection_deadline(uint64_t now, int busy, uint64_t busy_since);
+
+// Whether a stream holds part of a request or unsent replies
+static inline int stream_busy(const RequestStream* stream) {
+    return stream->input_len > stream->input_start || stream_unsent(stream) > 0;
+}
+
+#endif
@@ -0,0 +1,138 @@
+// Benchmark BALANCE reads against writers on the same hot accounts.
+//
+//   balancebench [-r readers] [-w writers] [-a accounts] [-s seconds]
+//
+// Opens `accounts` in-memory accounts (no log) and runs `readers` threads
+// checking the balance of random ones while `writers` threads deposit
+// into and withdraw from them. The run is made twice for `seconds` each:
+// first with reads taking the account lock (check_balance_locked()), then
+// with the lock-free reads of check_balance(). Every balance read must be
+// one a writer left behind: a whole multiple of 500 above the initial one.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "bank.h"
+
+#define INITIAL_BALANCE 1000000.0
+#define BENCH_PIN 4321
+
+typedef struct {
+    pthread_t thread;
+    unsigned int seed;
+    long operations;
+    long torn; // Reads of a balance no writer left
+} Runner;
+
+static char (*numbers)[MAX_ACCOUNT_NUMBER_LEN];
+static int account_count = 4;
+static int locked_reads = 0;
+static volatile int running = 1;
+
+static void* reader_main(void* arg) {
+    Runner* runner = arg;
+    while (running) {
+        const char* number = numbers[rand_r(&runner->seed) % account_count];
+        double balance = locked_reads ? check_balance_locked(number, BENCH_PIN) : check_balance(number, BENCH_PIN);
+        long steps = (long)(balance - INITIAL_BALANCE);
+        runner->torn += balance < INITIAL_BALANCE || steps % 500 != 0;
+        runner->operations++;
+    }
+    return NULL;
+}
+
+static void* writer_main(void* arg) {
+    Runner* runner = arg;
+    while (running) {
+        const char* number = numbers[rand_r(&runner->seed) % account_count];
+        if (deposit(number, BENCH_PIN, 500.0) == 0 && withdraw(number, BENCH_PIN, 500.0) == 0) {
+            runner->operations += 2;
+        }
+    }
+    return NULL;
+}
+
+// Run the readers and writers for seconds with reads locked or not and
+// print the throughput of each side
+// Returns the number of torn reads
+static long run(Runner* runners, int reader_count, int writer_count, int seconds, int locked) {
+    locked_reads = locked;
+    running = 1;
+    for (int i = 0; i < reader_count + writer_count; i++) {
+        runners[i].seed = (unsigned int)rand();
+        runners[i].operations = runners[i].torn = 0;
+        pthread_create(&runners[i].thread, NULL, i < reader_count ? reader_main : writer_main, &runners[i]);
+    }
+    sleep(seconds);
+    running = 0;
+
+    long reads = 0, writes = 0, torn = 0;
+    for (int i = 0; i < reader_count + writer_count; i++) {
+        pthread_join(runners[i].thread, NULL);
+        if (i < reader_count) {
+            reads += runners[i].operations;
+            torn += runners[i].torn;
+        } else {
+            writes += runners[i].operations;
+        }
+    }
+    printf("%-9s reads: %10.0f reads/s, %9.0f writes/s%s\n", locked ? "locked" : "lock-free",
+           (double)reads / seconds, (double)writes / seconds, torn > 0 ? " -- TORN READS" : "");
+    return torn;
+}
+
+static void usage(const char* prog) {
+    fprintf(stderr, "Usage: %s [-r readers] [-w writers] [-a accounts] [-s seconds]\n", prog);
+}
+
+int main(int argc, char* argv[]) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int reader_count = cpus > 1 ? (int)cpus - 1 : 1;
+    int writer_count = 1;
+    int seconds = 3;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "r:w:a:s:")) != -1) {
+        switch (opt) {
+        case 'r': reader_count = atoi(optarg); break;
+        case 'w': writer_count = atoi(optarg); break;
+        case 'a': account_count = atoi(optarg); break;
+        case 's': seconds = atoi(optarg); break;
+        default:
+            usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+    if (reader_count < 1 || writer_count < 0 || account_count < 1 || seconds < 1) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    srand(time(NULL));
+    bank_set_pin_iterations(1); // Time the table, not PIN hashing
+    if (bank_init(0, DEFAULT_SHARDS) != 0) {
+        return EXIT_FAILURE;
+    }
+    numbers = calloc(account_count, sizeof(*numbers));
+    Runner* runners = calloc(reader_count + writer_count, sizeof(Runner));
+    if (numbers == NULL || runners == NULL) {
+        perror("calloc");
+        return EXIT_FAILURE;
+    }
+    for (int i = 0; i < account_count; i++) {
+        Account acc = open_account("Bench", "0", "savings", INITIAL_BALANCE, BENCH_PIN);
+        if (!acc.is_active) {
+            fprintf(stderr, "Could not open account %d\n", i);
+            return EXIT_FAILURE;
+        }
+        memcpy(numbers[i], acc.account_number, MAX_ACCOUNT_NUMBER_LEN);
+    }
+
+    printf("%d readers, %d writers, %d accounts:\n", reader_count, writer_count, account_count);
+    long torn = run(runners, reader_count, writer_count, seconds, 1);
+    torn += run(runners, reader_count, writer_count, seconds, 0);
+    return torn == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -2,39 +2,230 @@
 #define BANK_H
 
 #include <stddef.h>
+#include <stdint.h>
+#include "wal.h"
+#include "pin_hash.h"
 
 #define MAX_NAME_LEN 50
 #define MAX_ID_LEN 20
 #define MAX_ACCOUNT_TYPE_LEN 10
-#define MAX_ACCOUNTS 100
-#define MAX_TRANSACTIONS 5
-
-typedef struct {
-    double transactions[MAX_TRANSACTIONS];
-    int transaction_count;
-} Statement;
+#define MAX_ACCOUNT_NUMBER_LEN 20 // Stored inline so the table can live in shared memory
+#define MAX_ACCOUNTS (1 << 26) // Upper bound on slots; memory grows with the accounts actually opened
+#define MAX_TRANSACTIONS 5 // Entries in a default STATEMENT and in the text format
+#define MAX_SHARDS 256 // Upper bound on the shard count given to bank_init()
+#define DEFAULT_SHARDS 16
 
 typedef struct {
     char name[MAX_NAME_LEN];
     char national_id[MAX_ID_LEN];
     char account_type[MAX_ACCOUNT_TYPE_LEN];
-    char* account_number;
+    char account_number[MAX_ACCOUNT_NUMBER_LEN];
     double balance;
-    int pin;
-    Statement statement;
+    PinHash pin;            // Never the PIN itself
+    uint64_t ledger_serial; // When its history began (us); tells its ledger chunks apart
+    uint64_t ledger_count;  // Transactions recorded in the ledger (see ledger.h)
     int is_active;
 } Account;
 
-extern Account accounts[MAX_ACCOUNTS];
-extern int account_count;
+// Map the account table. With shared set, the table is placed in a
+// MAP_SHARED mapping guarded by process-shared robust locks, so every
+// process forked afterwards sees the same accounts. Must be called once,
+// before load_accounts_from_file() and before any fork.
+//
+// Accounts are spread over `shards` shards (a power of two up to
+// MAX_SHARDS) by a hash of the account number. Each has its own lock,
+// index and free slots, so opening and closing accounts in different
+// shards run in parallel.
+// Returns 0 on success, 1 on failure.
+int bank_init(int shared, int shards);
+
+// PBKDF2 rounds for the PINs of accounts opened (or migrated from an
+// older format) from now on; DEFAULT_PIN_ITERATIONS until called. Call
+// before loading and before any fork.
+void bank_set_pin_iterations(int iterations);
+
+// Read access to the table by slot number, replacing direct indexing of
+// the old fixed accounts[] array. Slots run from 0 to
+// bank_account_count() - 1; closed slots have is_active == 0.
+int bank_account_count(void); // Highest used slot + 1
+const Account* bank_account(int slot); // NULL if slot is out of range
 
 Account open_account(const char* name, const char* national_id, const char* account_type, double initial_deposit, int pin);
 int close_account(const char* account_number, int pin);
 int deposit(const char* account_number, int pin, double amount);
 int withdraw(const char* account_number, int pin, double amount);
+// Reads without taking any lock: the account's sequence counter tells
+// whether a change ran meanwhile, and the read is retried if so. Falls
+// back to check_balance_locked() if the account stays mid-change.
 double check_balance(const char* account_number, int pin);
-int get_statement(const char* account_number, int pin, char* output, size_t output_size);
+// The same under the account lock, for comparison (see balancebench.c)
+double check_balance_locked(const char* account_number, int pin);
+
+// Slot of the open account with this number and PIN, -1 if there is none.
+// Takes no locks, so the answer may be stale by the time it is used; the
+// operations above look again under the account lock.
+int find_account_index(const char* account_number, int pin);
+
+// An account whose PIN a client has proven (see bank_login()): its slot
+// and the serial of its history, which no later account in the slot
+// shares. Every operation taking an account number and PIN pays for a
+// PIN hash; the *_as() variants below take a handle instead and skip both
+// the lookup and the hash. Once the account is closed its handles find
+// nothing.
+typedef struct {
+    int slot;
+    uint64_t serial;
+} AccountHandle;
+
+// Look up an account and check its PIN (one PIN hash, no locks)
+// Returns 0 with *handle set, 1 on account not found/PIN incorrect.
+int bank_login(const char* account_number, int pin, AccountHandle* handle);
+
+// The operations above on the account of a handle, with the same results
+int close_account_as(const AccountHandle* handle);
+int deposit_as(const AccountHandle* handle, double amount);
+int withdraw_as(const AccountHandle* handle, double amount);
+double check_balance_as(const AccountHandle* handle);
+
+// Which transactions a statement lists. Transactions are numbered from 0,
+// oldest first; those timed within [from_us, to_us] (microseconds since
+// the epoch) are the candidates, of which the first `offset` are skipped
+// and at most `limit` listed. With latest set, offset is ignored and the
+// last `limit` transactions are listed.
+typedef struct {
+    uint64_t offset;
+    uint64_t limit;
+    int64_t from_us;
+    int64_t to_us;
+    int latest;
+} StatementQuery;
+
+// Position of a statement being read
+typedef struct {
+    uint32_t chunk;     // Ledger chunk of the next entry, 0 when done
+    uint32_t index;     // Its index in the chunk
+    uint64_t end;       // Entries that existed when the statement began
+    uint64_t skip;      // Candidates still to skip
+    uint64_t remaining; // Entries still to list
+    int64_t from_us;
+    int64_t to_us;
+} StatementCursor;
+
+// One transaction of a statement
+typedef struct {
+    uint64_t id;      // Transaction number, from 0
+    int64_t time_us;  // 0 if unknown (imported from an older format)
+    double amount;    // Positive; type gives the direction
+    double balance;   // Balance after the transaction
+    int type;         // LedgerType (ledger.h)
+} StatementEntry;
+
+// Start a statement. Only the account lookup and the capture of the
+// ledger's end take the account lock: entries are read afterwards without
+// it, however many there are, while the account stays open to changes.
+// Returns 0 on success with *balance and *total (transactions ever
+// recorded) set, 1 on account not found/PIN incorrect.
+int statement_begin(const char* account_number, int pin, const StatementQuery* query,
+                    StatementCursor* cursor, double* balance, uint64_t* total);
+int statement_begin_as(const AccountHandle* handle, const StatementQuery* query,
+                       StatementCursor* cursor, double* balance, uint64_t* total);
+
+// Read the next transaction of a statement
+// Returns 1 with *entry filled in, 0 once the statement is complete.
+int statement_next(StatementCursor* cursor, StatementEntry* entry);
+
+// Move amount from one account to another atomically. The source must
+// allow it as a withdrawal (positive multiple of 500, leaving at least
+// 1000); each account's ledger records its side of the transfer.
+// The two accounts are locked in slot order, so concurrent transfers in
+// opposite directions neither deadlock nor serialize on a global lock.
+// Returns 0 on success, 1 if the source is not found or the PIN is wrong,
+// 2 if the destination is not found, 3 on insufficient funds, 4 if the
+// amount is not a positive multiple of 500, 5 if both are the same account.
+int transfer(const char* from_account, int pin, const char* to_account, double amount);
+int transfer_as(const AccountHandle* from, const char* to_account, double amount);
+
+#define MAX_BATCH_ITEMS 256
+
+// One operation of a batch
+typedef struct {
+    const char* account_number;
+    int pin;
+    double amount;
+    int withdrawal; // 1: withdraw amount, 0: deposit it
+} BatchItem;
+
+// Apply deposits and withdrawals as one unit: either all of them take
+// effect, with a single log commit, or none does. Items are checked in
+// order under the same rules as deposit() and withdraw(), each against the
+// balance the items before it leave; statuses[i] gets the code that call
+// would return for item i (0 if it passed).
+// Returns 0 if the batch was applied, 1 if any item failed (nothing was
+// applied), 2 if count is not between 1 and MAX_BATCH_ITEMS.
+int apply_batch(const BatchItem* items, int count, int* statuses);
+
+#define AUDIT_TYPES 32  // Distinct account types told apart; the rest count as "other"
+#define AUDIT_BUCKETS 8 // Balance ranges: below 1,000, then one per power of ten up to 1,000,000,000 and up
+
+// Whole-bank aggregates. Amounts are in hundredths.
+typedef struct {
+    uint64_t accounts;  // Open accounts
+    int64_t total;      // Sum of their balances
+    int64_t min;        // Lowest balance, 0 with no accounts
+    int64_t max;        // Highest balance, 0 with no accounts
+    int type_count;     // Entries of types[] in use, one per type with open accounts
+    struct {
+        char name[MAX_ACCOUNT_TYPE_LEN]; // "" for the types beyond AUDIT_TYPES - 1
+        uint64_t accounts;
+    } types[AUDIT_TYPES];
+    uint64_t histogram[AUDIT_BUCKETS]; // Open accounts per balance range
+} BankAudit;
+
+// Aggregate every open account while requests keep running: the scan takes
+// no locks and reads only the balance, status and type columns (see
+// account_store.h). Each balance is read whole, from before or after any
+// change in flight, but the result is not a snapshot of one instant: a
+// transfer may be counted half done.
+void bank_audit(BankAudit* audit);
+
+// Text format (accounts_data.txt), kept for migration and inspection
 int save_accounts_to_file(const char* filename);
 int load_accounts_from_file(const char* filename);
 
+// Open the ledger file holding every account's transaction history (see
+// ledger.h). Call after bank_init() and before loading, so history in
+// older formats can be imported. Without a ledger, balances are kept but
+// history is not.
+// Returns 0 on success, 1 on failure.
+int bank_open_ledger(const char* filename);
+
+// Binary snapshot (see snapshot.h): fixed-width checksummed records that
+// load with one mmap. Both files are replaced atomically when saved.
+// Return 0 on success, 1 on failure.
+int save_snapshot(const char* filename);
+int load_snapshot(const char* filename);
+
+// Replay the write-ahead log at log_file onto the loaded accounts, fold
+// the result into a fresh snapshot_file, then append every later change
+// to the log instead of rewriting a file. policy decides when a change
+// counts as committed (see wal.h). Call after loading and before any
+// fork. Without a log, changes stay in memory until the next save.
+// Returns 0 on success, 1 on failure.
+int bank_open_log(const char* snapshot_file, const char* log_file, WalPolicy policy, int interval_ms);
+
+// Commit several changes of the calling thread with one wait for the log:
+// between these calls, operations return once their change is logged,
+// and bank_end_commit_group() waits until all of them are durable. Their
+// results must not be reported before it returns.
+// bank_end_commit_group() returns 0 on success, 1 if the log failed.
+void bank_begin_commit_group(void);
+int bank_end_commit_group(void);
+
+// Every interval_seconds (when something was logged), write a new
+// snapshot from a background thread and drop the log records it covers.
+// The snapshot holds the table exactly as of one point in the log, taken
+// without pausing writers. Call after bank_open_log() and before any fork.
+// Returns 0 on success, 1 on failure.
+int bank_start_checkpoints(int interval_seconds);
+
 #endif
@@ -0,0 +1,650 @@
+// Load generator for the banking server.
+//
+//   bankbench [-H host] [-p port] [-c connections] [-t threads] [-d seconds]
+//             [-r rate] [-a accounts] [-z skew] [-m mix] [-M metrics_port]
+//
+// Opens `accounts` accounts, then keeps `connections` connections busy for
+// `seconds` with a mix of OPEN, DEPOSIT, WITHDRAW, BALANCE and STATEMENT
+// requests on them, one request in flight per connection. The connections
+// are spread over `threads` epoll loops.
+//
+// Closed loop (the default): a connection sends its next request as soon as
+// the reply to the last one arrives, so the server sets the pace. Open
+// loop (-r): requests fall due at `rate` per second in total, as Poisson
+// arrivals split evenly over the connections. A request that falls due
+// while its connection still waits for a reply is sent late, and latency
+// counts from when it fell due, not when it was sent, so a stalling server
+// is charged for the queue it builds.
+//
+// Requests pick their account with a Zipf distribution of exponent
+// `skew`: 0 is uniform, around 1 a few hot accounts take most of the load.
+// The mix gives a weight per command, e.g. -m open=1,deposit=30,balance=60.
+//
+// At the end it prints the throughput and, per command, the latency
+// percentiles from a log-linear histogram accurate to within 1%. With -M,
+// given the server's metrics port (server -M), it also reads the server's
+// counters before and after the run and prints the system calls its event
+// loops made, and the log writes and syncs, per request: the numbers that
+// tell the epoll and io_uring backends apart.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+
+#define DEFAULT_HOST "127.0.0.1"
+#define DEFAULT_PORT 8080
+#define BENCH_PIN 4321
+#define INITIAL_BALANCE "1000000000" // Withdrawals of 500 never run out
+#define MAX_ACCOUNT_NUMBER_LEN 20
+#define REQUEST_SIZE 128
+#define REPLY_SIZE 4096
+#define SETUP_PIPELINE 64 // OPENs in flight while creating accounts
+
+typedef enum {
+    OP_OPEN,
+    OP_DEPOSIT,
+    OP_WITHDRAW,
+    OP_BALANCE,
+    OP_STATEMENT,
+    OP_COUNT
+} Operation;
+
+static const char* op_names[OP_COUNT] = { "open", "deposit", "withdraw", "balance", "statement" };
+
+// Latency histogram: values below 2^HIST_SUB_BITS have a bucket each, and
+// every power of two above is split into 2^(HIST_SUB_BITS - 1) buckets,
+// so a bucket is less than 1% wide relative to the values in it
+#define HIST_SUB_BITS 8
+#define HIST_HALF (1 << (HIST_SUB_BITS - 1))
+#define HIST_BUCKETS ((64 - HIST_SUB_BITS + 2) * HIST_HALF)
+
+typedef struct {
+    uint32_t counts[HIST_BUCKETS];
+    uint64_t total;
+    uint64_t errors; // Replies starting with ERROR
+    uint64_t max;
+} Histogram;
+
+static int hist_index(uint64_t value) {
+    if (value < 2 * HIST_HALF) {
+        return (int)value;
+    }
+    int shift = 63 - __builtin_clzll(value) - (HIST_SUB_BITS - 1);
+    return shift * HIST_HALF + (int)(value >> shift);
+}
+
+// Lowest value of a bucket
+static uint64_t hist_value(int index) {
+    if (index < 2 * HIST_HALF) {
+        return (uint64_t)index;
+    }
+    int shift = index / HIST_HALF - 1;
+    return (uint64_t)(index - shift * HIST_HALF) << shift;
+}
+
+static void hist_record(Histogram* hist, uint64_t value) {
+    hist->counts[hist_index(value)]++;
+    hist->total++;
+    hist->max = value > hist->max ? value : hist->max;
+}
+
+static void hist_merge(Histogram* into, const Histogram* from) {
+    for (int i = 0; i < HIST_BUCKETS; i++) {
+        into->counts[i] += from->counts[i];
+    }
+    into->total += from->total;
+    into->errors += from->errors;
+    into->max = from->max > into->max ? from->max : into->max;
+}
+
+// Highest value of the bucket holding the given fraction of the samples
+static uint64_t hist_percentile(const Histogram* hist, double fraction) {
+    uint64_t rank = (uint64_t)ceil(fraction * hist->total);
+    uint64_t seen = 0;
+    for (int i = 0; i < HIST_BUCKETS; i++) {
+        seen += hist->counts[i];
+        if (seen >= rank && seen > 0) {
+            uint64_t top = hist_value(i + 1) - 1;
+            return top < hist->max ? top : hist->max;
+        }
+    }
+    return hist->max;
+}
+
+// Settings, fixed once the run starts
+static struct sockaddr_in server_addr;
+static int account_count = 10000;
+static char (*accounts)[MAX_ACCOUNT_NUMBER_LEN];
+static double skew = 0.0;
+static double* zipf_cdf;    // Cumulative weights of accounts[0..i]; NULL if uniform
+static int mix[OP_COUNT] = { 1, 30, 20, 40, 9 };
+static int mix_total;
+static double rate = 0.0;   // Requests per second over all connections; 0: closed loop
+static int connection_count = 64;
+static int metrics_port = 0; // Server metrics to read around the run; 0: none
+
+typedef struct {
+    int fd;
+    int busy;               // Waiting for a reply
+    Operation op;           // Of the request in flight
+    uint64_t due_ns;        // When the next (or current) request fell due
+    size_t reply_len;
+    char reply[REPLY_SIZE];
+} Connection;
+
+typedef struct {
+    pthread_t thread;
+    int count;              // Connections it drives
+    uint64_t seed;
+    uint64_t end_ns;
+    Histogram hist[OP_COUNT];
+} Runner;
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+// xorshift64*: uniform 64-bit values
+static uint64_t next_random(uint64_t* state) {
+    uint64_t x = *state;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    *state = x;
+    return x * 0x2545F4914F6CDD1Dull;
+}
+
+static double random_unit(uint64_t* state) {
+    return (next_random(state) >> 11) * (1.0 / 9007199254740992.0); // [0, 1)
+}
+
+static int pick_account(uint64_t* state) {
+    if (zipf_cdf == NULL) {
+        return (int)(next_random(state) % account_count);
+    }
+    double target = random_unit(state) * zipf_cdf[account_count - 1];
+    int lo = 0, hi = account_count - 1;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (zipf_cdf[mid] > target) {
+            hi = mid;
+        } else {
+            lo = mid + 1;
+        }
+    }
+    return lo;
+}
+
+static Operation pick_operation(uint64_t* state) {
+    int n = (int)(next_random(state) % mix_total);
+    Operation op = 0;
+    while (n >= mix[op]) {
+        n -= mix[op++];
+    }
+    return op;
+}
+
+// Format one request
+// Returns its length
+static int format_request(char* out, Operation op, const char* account) {
+    switch (op) {
+    case OP_OPEN:
+        return snprintf(out, REQUEST_SIZE, "OPEN,Bench,0,savings,%s,%d;", INITIAL_BALANCE, BENCH_PIN);
+    case OP_DEPOSIT:
+        return snprintf(out, REQUEST_SIZE, "DEPOSIT,%s,%d,500;", account, BENCH_PIN);
+    case OP_WITHDRAW:
+        return snprintf(out, REQUEST_SIZE, "WITHDRAW,%s,%d,500;", account, BENCH_PIN);
+    case OP_BALANCE:
+        return snprintf(out, REQUEST_SIZE, "BALANCE,%s,%d;", account, BENCH_PIN);
+    default:
+        return snprintf(out, REQUEST_SIZE, "STATEMENT,%s,%d;", account, BENCH_PIN);
+    }
+}
+
+// Length of the first complete reply in buf, 0 if it is not all there.
+// Replies end with ";\n", except some errors, which are one line.
+static size_t reply_length(const char* buf, size_t len) {
+    int error = len >= 5 && memcmp(buf, "ERROR", 5) == 0;
+    for (size_t i = 0; i < len; i++) {
+        if (buf[i] == '\n' && (error || (i > 0 && buf[i - 1] == ';'))) {
+            return i + 1;
+        }
+    }
+    return 0;
+}
+
+static int connect_server(void) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) {
+        perror("socket");
+        return -1;
+    }
+    if (connect(fd, (struct sockaddr*)&server_addr, sizeof(server_addr)) < 0) {
+        perror("Error connecting to server");
+        close(fd);
+        return -1;
+    }
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    return fd;
+}
+
+// Counters read from the server's metrics
+typedef struct {
+    double requests;
+    double syscalls;
+    double log_writes;
+    double log_syncs;
+} ServerCounters;
+
+// Sum of every sample of metric name (over all its labels) in text
+static double metric_sum(const char* text, const char* name) {
+    double sum = 0;
+    size_t len = strlen(name);
+    const char* line = text;
+    while (*line != '\0') {
+        const char* end = strchr(line, '\n');
+        if (end == NULL) {
+            end = line + strlen(line);
+        }
+        if (strncmp(line, name, len) == 0 && (line[len] == ' ' || line[len] == '{')) {
+            const char* value = end; // The value follows the last space
+            while (value > line && value[-1] != ' ') {
+                value--;
+            }
+            sum += atof(value);
+        }
+        line = *end != '\0' ? end + 1 : end;
+    }
+    return sum;
+}
+
+// Fetch the server's metrics over HTTP from metrics_port
+// Returns 0 on success, 1 on failure
+static int read_server_counters(ServerCounters* counters) {
+    struct sockaddr_in addr = server_addr;
+    addr.sin_port = htons(metrics_port);
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0 || connect(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+        perror("Error connecting to the metrics port");
+        if (fd >= 0) {
+            close(fd);
+        }
+        return 1;
+    }
+    const char* request = "GET /metrics HTTP/1.0\r\n\r\n";
+    if (send(fd, request, strlen(request), MSG_NOSIGNAL) < 0) {
+        close(fd);
+        return 1;
+    }
+
+    size_t size = 1 << 16, len = 0;
+    char* text = malloc(size);
+    ssize_t n = 0;
+    while (text != NULL && (n = read(fd, text + len, size - len - 1)) > 0) {
+        len += n;
+        if (len + 1 == size) {
+            char* bigger = realloc(text, size * 2);
+            if (bigger == NULL) {
+                free(text);
+                text = NULL;
+                break;
+            }
+            text = bigger;
+            size *= 2;
+        }
+    }
+    close(fd);
+    if (text == NULL || n < 0) {
+        free(text);
+        return 1;
+    }
+    text[len] = '\0';
+
+    counters->requests = metric_sum(text, "bank_requests_total");
+    counters->syscalls = metric_sum(text, "bank_loop_syscalls_total");
+    counters->log_writes = metric_sum(text, "bank_log_write_duration_seconds_count");
+    counters->log_syncs = metric_sum(text, "bank_log_sync_duration_seconds_count");
+    free(text);
+    return 0;
+}
+
+static int send_all(int fd, const char* data, size_t len) {
+    while (len > 0) {
+        ssize_t n = send(fd, data, len, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return 1;
+        }
+        data += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// Open the account population over one connection, SETUP_PIPELINE OPENs
+// at a time
+// Returns 0 on success, 1 on failure
+static int create_accounts(void) {
+    int fd = connect_server();
+    if (fd < 0) {
+        return 1;
+    }
+    static char buf[SETUP_PIPELINE * REPLY_SIZE];
+    int opened = 0;
+    while (opened < account_count) {
+        int batch = account_count - opened < SETUP_PIPELINE ? account_count - opened : SETUP_PIPELINE;
+        char requests[SETUP_PIPELINE * REQUEST_SIZE];
+        size_t len = 0;
+        for (int i = 0; i < batch; i++) {
+            len += format_request(requests + len, OP_OPEN, NULL);
+        }
+        if (send_all(fd, requests, len) != 0) {
+            perror("Error sending");
+            close(fd);
+            return 1;
+        }
+
+        size_t have = 0;
+        for (int i = 0; i < batch; i++) {
+            size_t reply;
+            while ((reply = reply_length(buf, have)) == 0) {
+                ssize_t n = recv(fd, buf + have, sizeof(buf) - have, 0);
+                if (n <= 0) {
+                    fprintf(stderr, "Server closed the connection while opening accounts.\n");
+                    close(fd);
+                    return 1;
+                }
+                have += n;
+            }
+            char* number = strstr(buf, "Account Number:");
+            if (strncmp(buf, "OK", 2) != 0 || number == NULL) {
+                fprintf(stderr, "Could not open account %d: %.*s", opened, (int)reply, buf);
+                close(fd);
+                return 1;
+            }
+            sscanf(number + 15, "%19[^,]", accounts[opened++]);
+            memmove(buf, buf + reply, have - reply);
+            have -= reply;
+        }
+    }
+    close(fd);
+    return 0;
+}
+
+// Exponential gap between arrivals at rate / connection_count per second
+static uint64_t arrival_gap_ns(uint64_t* state) {
+    double per_connection = rate / connection_count;
+    return (uint64_t)(-log(1.0 - random_unit(state)) / per_connection * 1e9);
+}
+
+static int send_request(Runner* runner, Connection* conn) {
+    char request[REQUEST_SIZE];
+    conn->op = pick_operation(&runner->seed);
+    int len = format_request(request, conn->op, accounts[pick_account(&runner->seed)]);
+    conn->busy = 1;
+    conn->reply_len = 0;
+    return send_all(conn->fd, request, len);
+}
+
+static void* runner_main(void* arg) {
+    Runner* runner = arg;
+    Connection* conns = calloc(runner->count, sizeof(Connection));
+    int epoll_fd = epoll_create1(0);
+    if (conns == NULL || epoll_fd < 0) {
+        perror("Runner setup");
+        return NULL;
+    }
+
+    uint64_t start = now_ns();
+    for (int i = 0; i < runner->count; i++) {
+        conns[i].fd = connect_server();
+        if (conns[i].fd < 0) {
+            exit(EXIT_FAILURE);
+        }
+        struct epoll_event ev = { .events = EPOLLIN, .data.u32 = (uint32_t)i };
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, conns[i].fd, &ev);
+        conns[i].due_ns = rate > 0 ? start + arrival_gap_ns(&runner->seed) : start;
+    }
+
+    struct epoll_event events[256];
+    while (1) {
+        uint64_t now = now_ns();
+        if (now >= runner->end_ns) {
+            break;
+        }
+        // Send whatever has fallen due on idle connections
+        uint64_t next_due = runner->end_ns;
+        for (int i = 0; i < runner->count; i++) {
+            Connection* conn = &conns[i];
+            if (conn->busy) {
+                continue;
+            }
+            if (conn->due_ns <= now) {
+                if (send_request(runner, conn) != 0) {
+                    fprintf(stderr, "Error sending request: %s\n", strerror(errno));
+                    exit(EXIT_FAILURE);
+                }
+            } else if (conn->due_ns < next_due) {
+                next_due = conn->due_ns;
+            }
+        }
+
+        int timeout_ms = (int)((next_due - now + 999999) / 1000000);
+        int n = epoll_wait(epoll_fd, events, 256, timeout_ms);
+        for (int e = 0; e < n; e++) {
+            Connection* conn = &conns[events[e].data.u32];
+            ssize_t got = recv(conn->fd, conn->reply + conn->reply_len, REPLY_SIZE - conn->reply_len, 0);
+            if (got <= 0) {
+                fprintf(stderr, "Server closed a connection.\n");
+                exit(EXIT_FAILURE);
+            }
+            conn->reply_len += got;
+            size_t reply = reply_length(conn->reply, conn->reply_len);
+            if (reply == 0 && conn->reply_len == REPLY_SIZE) {
+                // A long STATEMENT: keep only what could end it
+                conn->reply[0] = conn->reply[REPLY_SIZE - 1];
+                conn->reply_len = 1;
+            }
+            if (reply == 0) {
+                continue;
+            }
+
+            uint64_t done = now_ns();
+            Histogram* hist = &runner->hist[conn->op];
+            hist_record(hist, done - conn->due_ns);
+            hist->errors += memcmp(conn->reply, "ERROR", 5) == 0;
+            conn->busy = 0;
+            // Open loop keeps to the schedule however late the reply was
+            conn->due_ns = rate > 0 ? conn->due_ns + arrival_gap_ns(&runner->seed) : done;
+        }
+    }
+
+    for (int i = 0; i < runner->count; i++) {
+        close(conns[i].fd);
+    }
+    close(epoll_fd);
+    free(conns);
+    return NULL;
+}
+
+// Parse "name=weight,..." into mix[]
+// Returns 0 on success, 1 on an unknown command or bad weight
+static int parse_mix(char* text) {
+    memset(mix, 0, sizeof(mix));
+    for (char* item = strtok(text, ","); item != NULL; item = strtok(NULL, ",")) {
+        char* eq = strchr(item, '=');
+        if (eq == NULL) {
+            return 1;
+        }
+        *eq = '\0';
+        int op = 0;
+        while (op < OP_COUNT && strcasecmp(item, op_names[op]) != 0) {
+            op++;
+        }
+        if (op == OP_COUNT || atoi(eq + 1) < 0) {
+            return 1;
+        }
+        mix[op] = atoi(eq + 1);
+    }
+    return 0;
+}
+
+static void usage(const char* prog) {
+    fprintf(stderr, "Usage: %s [-H host] [-p port] [-c connections] [-t threads] [-d seconds] "
+                    "[-r rate] [-a accounts] [-z skew] [-m mix] [-M metrics_port]\n", prog);
+    fprintf(stderr, "  -c connections  concurrent connections (default 64)\n");
+    fprintf(stderr, "  -t threads      event loops driving them (default: online CPUs)\n");
+    fprintf(stderr, "  -d seconds      length of the run (default 10)\n");
+    fprintf(stderr, "  -r rate         open loop at rate requests/s in total (default: closed loop)\n");
+    fprintf(stderr, "  -a accounts     accounts opened before the run (default 10000)\n");
+    fprintf(stderr, "  -z skew         Zipf exponent of account popularity (default 0: uniform)\n");
+    fprintf(stderr, "  -m mix          command weights (default open=1,deposit=30,withdraw=20,balance=40,statement=9)\n");
+    fprintf(stderr, "  -M port         server metrics port: report its system calls per request\n");
+}
+
+int main(int argc, char* argv[]) {
+    const char* host = DEFAULT_HOST;
+    int port = DEFAULT_PORT;
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int thread_count = cpus > 0 ? (int)cpus : 1;
+    int seconds = 10;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "H:p:c:t:d:r:a:z:m:M:h")) != -1) {
+        switch (opt) {
+        case 'H': host = optarg; break;
+        case 'p': port = atoi(optarg); break;
+        case 'c': connection_count = atoi(optarg); break;
+        case 't': thread_count = atoi(optarg); break;
+        case 'd': seconds = atoi(optarg); break;
+        case 'r': rate = atof(optarg); break;
+        case 'a': account_count = atoi(optarg); break;
+        case 'z': skew = atof(optarg); break;
+        case 'M': metrics_port = atoi(optarg); break;
+        case 'm':
+            if (parse_mix(optarg) != 0) {
+                usage(argv[0]);
+                return EXIT_FAILURE;
+            }
+            break;
+        default:
+            usage(argv[0]);
+            return opt == 'h' ? EXIT_SUCCESS : EXIT_FAILURE;
+        }
+    }
+    for (int op = 0; op < OP_COUNT; op++) {
+        mix_total += mix[op];
+    }
+    if (port <= 0 || port > 65535 || connection_count < 1 || thread_count < 1 || seconds < 1 ||
+        rate < 0 || account_count < 1 || skew < 0 || mix_total == 0 || metrics_port < 0 || metrics_port > 65535) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+    if (thread_count > connection_count) {
+        thread_count = connection_count;
+    }
+
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_port = htons(port);
+    if (inet_pton(AF_INET, host, &server_addr.sin_addr) <= 0) {
+        fprintf(stderr, "Invalid address: %s\n", host);
+        return EXIT_FAILURE;
+    }
+
+    accounts = calloc(account_count, sizeof(*accounts));
+    Runner* runners = calloc(thread_count, sizeof(Runner));
+    if (accounts == NULL || runners == NULL) {
+        perror("calloc");
+        return EXIT_FAILURE;
+    }
+    if (skew > 0) {
+        zipf_cdf = malloc(account_count * sizeof(double));
+        if (zipf_cdf == NULL) {
+            perror("malloc");
+            return EXIT_FAILURE;
+        }
+        double sum = 0;
+        for (int i = 0; i < account_count; i++) {
+            sum += 1.0 / pow(i + 1, skew);
+            zipf_cdf[i] = sum;
+        }
+    }
+
+    printf("Opening %d accounts...\n", account_count);
+    fflush(stdout);
+    if (create_accounts() != 0) {
+        return EXIT_FAILURE;
+    }
+
+    printf("%d connections on %d threads, %s, Zipf skew %.2f, %d s\n", connection_count, thread_count,
+           rate > 0 ? "open loop" : "closed loop", skew, seconds);
+    if (rate > 0) {
+        printf("Target rate %.0f requests/s\n", rate);
+    }
+    fflush(stdout);
+
+    ServerCounters before, after;
+    if (metrics_port > 0 && read_server_counters(&before) != 0) {
+        return EXIT_FAILURE;
+    }
+
+    uint64_t seed = (uint64_t)time(NULL) * 0x9E3779B97F4A7C15ull;
+    uint64_t start = now_ns();
+    uint64_t end = start + (uint64_t)seconds * 1000000000ull;
+    for (int i = 0; i < thread_count; i++) {
+        runners[i].count = connection_count * (i + 1) / thread_count - connection_count * i / thread_count;
+        runners[i].seed = (seed += 0x9E3779B97F4A7C15ull) | 1;
+        runners[i].end_ns = end;
+        pthread_create(&runners[i].thread, NULL, runner_main, &runners[i]);
+    }
+
+    static Histogram totals[OP_COUNT];
+    Histogram all;
+    memset(&all, 0, sizeof(all));
+    for (int i = 0; i < thread_count; i++) {
+        pthread_join(runners[i].thread, NULL);
+        for (int op = 0; op < OP_COUNT; op++) {
+            hist_merge(&totals[op], &runners[i].hist[op]);
+            hist_merge(&all, &runners[i].hist[op]);
+        }
+    }
+    double elapsed = (now_ns() - start) / 1e9;
+
+    printf("%.0f requests/s (%llu requests, %llu errors)\n", all.total / elapsed,
+           (unsigned long long)all.total, (unsigned long long)all.errors);
+    printf("%-10s %10s %10s %8s %10s %10s %10s %10s\n", "command", "requests", "req/s", "errors",
+           "p50 us", "p99 us", "p99.9 us", "max us");
+    for (int op = 0; op <= OP_COUNT; op++) {
+        const Histogram* hist = op < OP_COUNT ? &totals[op] : &all;
+        if (hist->total == 0) {
+            continue;
+        }
+        printf("%-10s %10llu %10.0f %8llu %10.1f %10.1f %10.1f %10.1f\n", op < OP_COUNT ? op_names[op] : "all",
+               (unsigned long long)hist->total, hist->total / elapsed, (unsigned long long)hist->errors,
+               hist_percentile(hist, 0.50) / 1e3, hist_percentile(hist, 0.99) / 1e3,
+               hist_percentile(hist, 0.999) / 1e3, hist->max / 1e3);
+    }
+
+    if (metrics_port > 0 && read_server_counters(&after) == 0 && after.requests > before.requests) {
+        double requests = after.requests - before.requests;
+        printf("Server, per request: %.3f event loop system calls, %.3f log writes, %.3f log syncs\n",
+               (after.syscalls - before.syscalls) / requests, (after.log_writes - before.log_writes) / requests,
+               (after.log_syncs - before.log_syncs) / requests);
+    }
+    return EXIT_SUCCESS;
+}
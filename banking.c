@@ -1,69 +1,589 @@
 #include "bank.h" // Include the header file
+#include "account_store.h"
+#include "account_index.h"
+#include "wal.h"
+#include "snapshot.h"
+#include "crc32c.h"
+#include "column_scan.h"
+#include "trace.h"
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
 #include <time.h> 
 #include <stdbool.h> 
+#include <stddef.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// Everything the server processes/threads share. In shared mode this lives
+// (with the store's slabs and the index tables) in MAP_SHARED mappings
+// created before the first fork, so every child sees the same accounts.
+//
+// Accounts are split into shards by the top bits of their number's hash.
+// Each shard has its own index and free list of closed slots, so opening
+// and closing accounts only contend within a shard.
+//
+// Locking rules:
+// - A shard's lock serializes opening and closing accounts in it: updates
+//   of its index and free list. It is taken before any account lock.
+// - table_lock serializes growing the store (taking never used slots) and
+//   reloads, which also hold every shard lock. It comes after shard locks.
+// - Each slot's lock guards every field of its account. Lookups go through
+//   the index without locks, check the PIN against its hash, and re-validate
+//   the slot by its serial once its lock is held, so requests on existing
+//   accounts take no shard lock at all and hash no PIN under a lock.
+// - A writer also makes the slot's seq odd from its first change to the
+//   account until it unlocks it (see begin_write()), which lets
+//   check_balance() read balances without the lock.
+// - save_lock serializes writers of the accounts file.
+// - Changes are appended to the log while the account lock is held, so the
+//   log orders them as they happened, and committed after every lock is
+//   released, so a commit waiting on the disk blocks no one else.
+// - All locks are robust: if a process dies while holding one, the next
+//   locker takes it over instead of deadlocking.
+//
+// Checkpoints capture the table as it stood at a mark in the log without
+// stopping writers. While one runs, the first change to each slot after
+// the mark saves the slot's previous state as a pre-image, and the
+// checkpoint writes pre-images where they exist and live accounts
+// elsewhere (see log_change() and write_snapshot()).
+//
+// Transaction history lives in the ledger, appended to under the account
+// lock. Entries are never moved or freed while the server runs, so
+// statements read them without the lock.
+//
+// The store's columns mirror each account's balance, status and type code
+// for bank_audit(). They are written under the slot lock wherever the
+// account changes and rebuilt wholesale after loading and replay.
+typedef struct {
+    pthread_mutex_t lock;
+} __attribute__((aligned(64))) BankShard;
+
+typedef struct {
+    pthread_mutex_t table_lock;
+    pthread_mutex_t save_lock;
+    pthread_mutex_t type_lock; // Serializes registering type codes
+    int shard_count;           // Power of two
+    BankShard shards[MAX_SHARDS];
+    AccountIndex indexes[MAX_SHARDS]; // Per shard: account_number -> slot
+    AccountStore store; // Slab-allocated slots, one free list per shard
+    Wal* wal;           // NULL until bank_open_log()
+    Ledger ledger;      // No-op until bank_open_ledger()
+    int ledger_linked;  // Chains rebuilt from the ledger file (see link_ledger())
+    uint64_t last_serial; // Last account serial handed out (see new_serial())
+    int type_count;       // Account type codes handed out (see type_code())
+    char type_names[AUDIT_TYPES][MAX_ACCOUNT_TYPE_LEN];
+
+    uint64_t checkpoint_lsn; // Log mark of the running checkpoint, 0 if none
+    int preimage_writers;    // Threads inside the pre-image path
+    int preimage_count;      // Entries of preimages in use
+    Account* preimages;      // Room for one pre-image per slot
+    int checkpoint_interval; // Seconds between checkpoints
+    char snapshot_file[WAL_MAX_PATH];
+    char log_file[WAL_MAX_PATH];
+} BankTable;
+
+_Static_assert(AUDIT_TYPES == SCAN_TYPES, "every type code must be counted");
+
+// Spare pre-images for writers still finishing a previous checkpoint
+#define PREIMAGE_SLACK 4096
+#define PREIMAGE_BYTES ((size_t)(MAX_ACCOUNTS + PREIMAGE_SLACK) * sizeof(Account))
+
+static BankTable* table = NULL;
+
+// PBKDF2 rounds of PINs hashed from now on
+static int pin_iterations = DEFAULT_PIN_ITERATIONS;
+
+void bank_set_pin_iterations(int iterations) {
+    pin_iterations = iterations;
+}
+
+static inline Account* slot_account(int slot) {
+    return store_account(&table->store, slot);
+}
+
+static inline pthread_mutex_t* slot_lock(int slot) {
+    return &store_slot(&table->store, slot)->lock;
+}
+
+static inline LedgerChain* slot_chain(int slot) {
+    return &store_slot(&table->store, slot)->ledger;
+}
+
+// Shard of an account number
+static inline int shard_of(const char* account_number) {
+    return (int)index_shard(account_hash(account_number), table->shard_count);
+}
+
+static inline AccountIndex* shard_index(const char* account_number) {
+    return &table->indexes[shard_of(account_number)];
+}
+
+// Map and initialize the account table (see bank.h)
+int bank_init(int shared, int shards) {
+    if (shards < 1 || shards > MAX_SHARDS || (shards & (shards - 1)) != 0) {
+        fprintf(stderr, "Error: the shard count must be a power of two from 1 to %d.\n", MAX_SHARDS);
+        return 1;
+    }
+    int flags = MAP_ANONYMOUS | (shared ? MAP_SHARED : MAP_PRIVATE);
+    BankTable* t = mmap(NULL, sizeof(BankTable), PROT_READ | PROT_WRITE, flags, -1, 0);
+    if (t == MAP_FAILED) {
+        perror("Failed to map account table");
+        return 1;
+    }
+    if (store_init(&t->store, shared, shards) != 0) {
+        return 1;
+    }
+    // Room for four times a shard's share of MAX_ACCOUNTS: hashing spreads
+    // accounts far more evenly than that
+    uint32_t index_capacity = INDEX_MAX_CAPACITY / shards * 2;
+    if (index_capacity > INDEX_MAX_CAPACITY) {
+        index_capacity = INDEX_MAX_CAPACITY;
+    }
+    t->shard_count = shards;
+    for (int i = 0; i < shards; i++) {
+        if (index_init(&t->indexes[i], shared, index_capacity) != 0) {
+            return 1;
+        }
+    }
+    ledger_init(&t->ledger);
+    t->type_count = 1; // Code 0 is "other", see type_code()
+    // Reserved only: pages are touched by writers during checkpoints
+    t->preimages = mmap(NULL, PREIMAGE_BYTES, PROT_READ | PROT_WRITE, flags | MAP_NORESERVE, -1, 0);
+    if (t->preimages == MAP_FAILED) {
+        perror("Failed to reserve checkpoint pre-images");
+        return 1;
+    }
+
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    if (shared) {
+        pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    }
+    pthread_mutex_init(&t->table_lock, &attr);
+    pthread_mutex_init(&t->save_lock, &attr);
+    pthread_mutex_init(&t->type_lock, &attr);
+    for (int i = 0; i < shards; i++) {
+        pthread_mutex_init(&t->shards[i].lock, &attr);
+    }
+    pthread_mutexattr_destroy(&attr);
+
+    table = t;
+    return 0;
+}
+
+int bank_account_count(void) {
+    return table->store.slot_count;
+}
+
+const Account* bank_account(int slot) {
+    if (slot < 0 || slot >= table->store.slot_count) {
+        return NULL;
+    }
+    return slot_account(slot);
+}
+
+// Lock a robust mutex. If its previous owner died mid-update, the fields it
+// protects were written one at a time and are still usable, so mark the
+// mutex consistent and carry on.
+static void robust_lock(pthread_mutex_t* mutex) {
+    if (pthread_mutex_lock(mutex) == EOWNERDEAD) {
+        fprintf(stderr, "Warning: recovered a lock held by a terminated process.\n");
+        pthread_mutex_consistent(mutex);
+    }
+}
+
+// Take every shard lock, then table_lock, for work on the whole table
+static void lock_table(void) {
+    for (int i = 0; i < table->shard_count; i++) {
+        robust_lock(&table->shards[i].lock);
+    }
+    robust_lock(&table->table_lock);
+}
+
+static void unlock_table(void) {
+    pthread_mutex_unlock(&table->table_lock);
+    for (int i = table->shard_count - 1; i >= 0; i--) {
+        pthread_mutex_unlock(&table->shards[i].lock);
+    }
+}
+
+// Log record types. Each record carries the state its change left behind
+// rather than the change itself, so replaying a record that the snapshot
+// already reflects is harmless. The ledger entry a change adds travels
+// with it: the log, not the ledger file, makes history durable.
+enum {
+    LOG_LEGACY_OPEN = 1, // LegacyOpenRecord, see below
+    LOG_LEGACY_UPDATE,   // LegacyUpdateRecord
+    LOG_CLOSE,           // CloseRecord
+    LOG_LEGACY_UPDATES,  // int32_t count, then count LegacyUpdateRecords
+    LOG_PLAIN_PIN_OPEN,  // PlainPinOpenRecord
+    LOG_UPDATE,          // UpdateRecord: deposit or withdrawal
+    LOG_UPDATES,         // int32_t count, then count UpdateRecords applied together
+    LOG_OPEN             // OpenRecord
+};
+
+typedef struct {
+    int32_t slot;
+    Account account;
+    LedgerEntry entry; // Entry 0, the initial deposit
+} OpenRecord;
+
+// One ledger entry and the state it left; a batch changing an account
+// several times logs one per change
+typedef struct {
+    int32_t slot;
+    double balance;
+    uint64_t ledger_count; // The entry's id + 1
+    LedgerEntry entry;
+} UpdateRecord;
+
+// Records written before the ledger existed, when each account kept its
+// last MAX_TRANSACTIONS amounts, are still replayed so that a log left by
+// an older server is not lost on upgrade. Their history is imported like
+// that of a version 1 snapshot.
+typedef struct {
+    double transactions[MAX_TRANSACTIONS];
+    int transaction_count;
+} LegacyStatement;
+
+typedef struct {
+    char name[MAX_NAME_LEN];
+    char national_id[MAX_ID_LEN];
+    char account_type[MAX_ACCOUNT_TYPE_LEN];
+    char account_number[MAX_ACCOUNT_NUMBER_LEN];
+    double balance;
+    int pin;
+    LegacyStatement statement;
+    int is_active;
+} LegacyAccount;
+
+typedef struct {
+    int32_t slot;
+    LegacyAccount account;
+} LegacyOpenRecord;
+
+typedef struct {
+    int32_t slot;
+    double balance;
+    LegacyStatement statement;
+} LegacyUpdateRecord;
+
+typedef struct {
+    int32_t slot;
+} CloseRecord;
+
+// Openings logged while PINs were kept in the clear; their PIN is hashed
+// on replay
+typedef struct {
+    char name[MAX_NAME_LEN];
+    char national_id[MAX_ID_LEN];
+    char account_type[MAX_ACCOUNT_TYPE_LEN];
+    char account_number[MAX_ACCOUNT_NUMBER_LEN];
+    double balance;
+    int pin;
+    uint64_t ledger_serial;
+    uint64_t ledger_count;
+    int is_active;
+} PlainPinAccount;
+
+typedef struct {
+    int32_t slot;
+    PlainPinAccount account;
+    LedgerEntry entry;
+} PlainPinOpenRecord;
+
+// Save before as the pre-image of slot if the change logged at lsn is the
+// first one to the slot since a running checkpoint's mark. Caller holds
+// the slot lock.
+static void keep_preimage(int slot, const Account* before, uint64_t lsn) {
+    if (__atomic_load_n(&table->checkpoint_lsn, __ATOMIC_ACQUIRE) == 0) {
+        return; // No checkpoint running
+    }
+
+    // Announce ourselves before looking again, so a checkpoint that ends
+    // now waits for us before recycling the pre-images
+    __atomic_fetch_add(&table->preimage_writers, 1, __ATOMIC_SEQ_CST);
+    uint64_t mark = __atomic_load_n(&table->checkpoint_lsn, __ATOMIC_SEQ_CST);
+    AccountSlot* s = store_slot(&table->store, slot);
+    if (mark != 0 && lsn > mark && s->preimage_lsn != mark) {
+        int i = __atomic_fetch_add(&table->preimage_count, 1, __ATOMIC_RELAXED);
+        table->preimages[i] = *before;
+        s->preimage = i;
+        s->preimage_lsn = mark;
+    }
+    __atomic_fetch_sub(&table->preimage_writers, 1, __ATOMIC_RELEASE);
+}
+
+// Append the record for a change to slot and keep its pre-image for a
+// running checkpoint; caller holds the slot lock. before is the account
+// as it was prior to the change (NULL for a slot that was free), entry
+// the ledger entry the change added (NULL for a closure).
+// Returns the LSN to pass to log_commit(), 0 if logging is off.
+static uint64_t log_change(uint16_t type, int slot, const Account* before, const LedgerEntry* entry) {
+    static const Account free_slot; // All zero: inactive
+    uint64_t lsn;
+
+    if (table->wal == NULL) {
+        return 0;
+    }
+
+    uint64_t traced = trace_begin();
+    const Account* acc = slot_account(slot);
+    if (type == LOG_OPEN) {
+        OpenRecord record = { slot, *acc, *entry };
+        lsn = wal_append(table->wal, type, &record, sizeof(record));
+    } else if (type == LOG_UPDATE) {
+        UpdateRecord record = { slot, acc->balance, acc->ledger_count, *entry };
+        lsn = wal_append(table->wal, type, &record, sizeof(record));
+    } else {
+        CloseRecord record = { slot };
+        lsn = wal_append(table->wal, type, &record, sizeof(record));
+    }
+    trace_end(TRACE_LOG_APPEND, 0, traced);
+
+    keep_preimage(slot, before != NULL ? before : &free_slot, lsn);
+    return lsn;
+}
+
+// Append one record of several changes to locked slots, so replay applies
+// all of them or none; keeps the pre-images of the distinct slots[] like
+// log_change(). befores[i] is slots[i] prior to the changes.
+// Returns the LSN to pass to log_commit(), 0 if logging is off.
+_Static_assert(sizeof(int32_t) + MAX_BATCH_ITEMS * sizeof(UpdateRecord) <= WAL_MAX_RECORD,
+               "a full batch must fit in one log record");
+
+static uint64_t log_updates(const UpdateRecord* records, int record_count,
+                            const int* slots, const Account* befores, int slot_count) {
+    char payload[sizeof(int32_t) + MAX_BATCH_ITEMS * sizeof(UpdateRecord)];
+
+    if (table->wal == NULL) {
+        return 0;
+    }
+
+    uint64_t traced = trace_begin();
+    int32_t n = record_count;
+    memcpy(payload, &n, sizeof(n));
+    memcpy(payload + sizeof(n), records, record_count * sizeof(UpdateRecord));
+    uint64_t lsn = wal_append(table->wal, LOG_UPDATES, payload, sizeof(n) + record_count * sizeof(UpdateRecord));
+    trace_end(TRACE_LOG_APPEND, 0, traced);
+
+    for (int i = 0; i < slot_count; i++) {
+        keep_preimage(slots[i], &befores[i], lsn);
+    }
+    return lsn;
+}
+
+// Commit group of the calling thread (see bank_begin_commit_group())
+static __thread int commit_group_open = 0;
+static __thread uint64_t commit_group_lsn = 0;
+
+// Wait for a logged change to be durable; call with no locks held
+static void log_commit(uint64_t lsn) {
+    if (lsn == 0) {
+        return;
+    }
+    if (commit_group_open) {
+        // The caller holds the replies until bank_end_commit_group()
+        if (lsn > commit_group_lsn) {
+            commit_group_lsn = lsn;
+        }
+        return;
+    }
+    uint64_t traced = trace_begin();
+    wal_commit(table->wal, lsn);
+    trace_end(TRACE_LOG_COMMIT, 0, traced);
+}
+
+void bank_begin_commit_group(void) {
+    commit_group_open = 1;
+}
+
+int bank_end_commit_group(void) {
+    uint64_t lsn = commit_group_lsn;
+    commit_group_open = 0;
+    commit_group_lsn = 0;
+    if (lsn == 0) {
+        return 0;
+    }
+    uint64_t traced = trace_begin();
+    int result = wal_commit(table->wal, lsn);
+    trace_end(TRACE_LOG_COMMIT, 0, traced);
+    return result;
+}
+
+// Mark slot as being changed, so lock-free readers retry until the lock
+// is released. Caller holds the slot lock and calls this before its first
+// change to the account; later calls until the unlock do nothing.
+static void begin_write(int slot) {
+    AccountSlot* s = store_slot(&table->store, slot);
+    if ((s->seq & 1) == 0) {
+        __atomic_store_n(&s->seq, s->seq + 1, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_RELEASE); // Odd is seen before any change
+    }
+}
+
+// Release a slot lock, ending its write section if one was begun. A
+// section left open by a process that died holding the lock is ended by
+// whoever next locks and unlocks the slot.
+static void unlock_account(int index) {
+    AccountSlot* s = store_slot(&table->store, index);
+    if (s->seq & 1) {
+        __atomic_store_n(&s->seq, s->seq + 1, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&s->lock);
+}
+
+// Optimistic reads of a slot before giving up on one that stays
+// mid-change and taking its lock
+#define OPTIMISTIC_READ_ATTEMPTS 64
+
+// Copy out what checking a PIN for account_number needs from slot: its PIN
+// hash and serial, read between two reads of the slot's seq so that both
+// belong to one account
+// Returns 1 if the slot holds that open account, 0 if not.
+static int read_credentials(int slot, const char* account_number, PinHash* hash, uint64_t* serial) {
+    const AccountSlot* s = store_slot(&table->store, slot);
+    const Account* acc = &s->account;
+    for (int attempt = 0; attempt < OPTIMISTIC_READ_ATTEMPTS; attempt++) {
+        unsigned int seq = __atomic_load_n(&s->seq, __ATOMIC_ACQUIRE);
+        if (seq & 1) {
+            sched_yield(); // A writer holds the lock; let it finish
+            continue;
+        }
+        int found = __atomic_load_n(&acc->is_active, __ATOMIC_RELAXED) &&
+                    strncmp(acc->account_number, account_number, MAX_ACCOUNT_NUMBER_LEN) == 0;
+        memcpy(hash, &acc->pin, sizeof(*hash));
+        *serial = __atomic_load_n(&acc->ledger_serial, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&s->seq, __ATOMIC_RELAXED) == seq) {
+            return found;
+        }
+    }
 
-Account accounts[MAX_ACCOUNTS];
-int account_count = 0; 
+    robust_lock(slot_lock(slot));
+    int found = acc->is_active && strcmp(acc->account_number, account_number) == 0;
+    *hash = acc->pin;
+    *serial = acc->ledger_serial;
+    unlock_account(slot);
+    return found;
+}
+
+// Look up an account and check its PIN (see bank.h). The hash is checked
+// with no lock held; a slot closed or reused meanwhile is caught when the
+// handle is used.
+int bank_login(const char* account_number, int pin, AccountHandle* handle) {
+    uint64_t traced = trace_begin();
+    PinHash hash;
+    uint64_t serial;
+    int index = index_lookup(shard_index(account_number), &table->store, account_number);
+    int found = index != -1 && read_credentials(index, account_number, &hash, &serial);
+    trace_end(TRACE_LOOKUP, 0, traced);
+    if (!found) {
+        return 1;
+    }
+
+    traced = trace_begin();
+    int match = pin_hash_verify(&hash, pin);
+    trace_end(TRACE_PIN_HASH, 0, traced);
+    if (!match) {
+        return 1;
+    }
+    handle->slot = index;
+    handle->serial = serial;
+    return 0;
+}
 
 // Helper function to find an account index by account number and PIN
+// Reads without locks: the result must be re-checked under the account lock
 int find_account_index(const char* account_number, int pin) {
-    for (int i = 0; i < account_count; i++) {
-        // Check if the slot is active and account number matches
-        if (accounts[i].is_active && accounts[i].account_number != NULL &&
-            strcmp(accounts[i].account_number, account_number) == 0 &&
-            accounts[i].pin == pin) {
-            return i; // Account found
-        }
+    AccountHandle handle;
+    return bank_login(account_number, pin, &handle) == 0 ? handle.slot : -1;
+}
+
+// Whether slot still holds the account of handle; caller holds the slot lock
+static inline int holds(int slot, const AccountHandle* handle) {
+    const Account* acc = slot_account(slot);
+    return acc->is_active && acc->ledger_serial == handle->serial;
+}
+
+// Lock the account of a handle
+// Returns its slot with the slot lock held, -1 if the account is closed
+static int lock_handle(const AccountHandle* handle) {
+    if (handle->slot < 0 || handle->slot >= __atomic_load_n(&table->store.slot_count, __ATOMIC_ACQUIRE)) {
+        return -1;
+    }
+    uint64_t traced = trace_begin();
+    robust_lock(slot_lock(handle->slot));
+    trace_end(TRACE_LOOKUP, 0, traced);
+    if (!holds(handle->slot, handle)) {
+        pthread_mutex_unlock(slot_lock(handle->slot));
+        return -1;
     }
-    return -1; // Account not found or PIN incorrect
+    return handle->slot;
 }
 
+// Balance of the account of a handle, read under its lock
+static double balance_locked(const AccountHandle* handle) {
+    int index = lock_handle(handle);
+    if (index == -1) {
+        return -1.0;
+    }
+    double balance = slot_account(index)->balance;
+    unlock_account(index);
+    return balance;
+}
 
-// Helper function to generate a unique account number 
-char* generate_account_number() {
-    // srand() should be called once in main server process
-    char* acc_num = NULL;
+// Helper function to generate a unique account number into acc_num
+// Returns its shard, locked so that the number stays unique until it is
+// indexed, or -1 if no unique number could be found
+static int generate_account_number(char* acc_num, size_t size) {
+    // Each thread draws from a generator of its own, seeded once from
+    // rand(): rand() itself takes a process-wide lock on every call.
+    // srand() should be called once in main server process.
+    static __thread unsigned int seed;
+    static __thread bool seeded = false;
+    if (!seeded) {
+        seed = (unsigned int)rand() ^ (unsigned int)getpid() ^ (unsigned int)(uintptr_t)&seed;
+        seeded = true;
+    }
     bool unique = false;
     int attempts = 0;
+    int shard = -1;
     const int max_attempts = 100; // Prevent infinite loops
 
     while (!unique && attempts < max_attempts) {
-        // Generate a large number based on time and random component
-        long long random_num = time(NULL) + (rand() % 100000) + attempts;
-
-        // Allocate memory for the account number string
-        // Max possible long long is around 19 digits, plus null terminator
-        acc_num = malloc(20);
-        if (acc_num == NULL) {
-            perror("Failed to allocate memory for account number");
-            return NULL; // Return NULL on allocation failure
-        }
+        // Generate a large number based on time and random component. The
+        // random part spans a billion values so that millions of accounts
+        // opened within a second still find a free number quickly.
+        long long random_num = time(NULL) + (((long long)rand_r(&seed) << 15 ^ rand_r(&seed)) % 1000000000LL) + attempts;
 
         // Convert the number to a string
-        sprintf(acc_num, "%lld", random_num);
+        snprintf(acc_num, size, "%lld", random_num);
 
         // Check for uniqueness against existing active accounts
-        unique = true; // Assume unique until a match is found
-        for(int i = 0; i < account_count; ++i) {
-            if(accounts[i].is_active && accounts[i].account_number != NULL && strcmp(accounts[i].account_number, acc_num) == 0) {
-                unique = false; // Found a duplicate
-                free(acc_num); // Free the non-unique number
-                acc_num = NULL;
-                break; // Exit inner loop and try generating again
-            }
+        shard = shard_of(acc_num);
+        robust_lock(&table->shards[shard].lock);
+        unique = index_lookup(&table->indexes[shard], &table->store, acc_num) == -1;
+        if (!unique) {
+            pthread_mutex_unlock(&table->shards[shard].lock);
         }
         attempts++;
     }
 
     if (!unique) {
          fprintf(stderr, "Warning: Could not generate a unique account number after %d attempts.\n", max_attempts);
-         // acc_num is already NULL at this point if attempts failed
+         acc_num[0] = '\0';
+         return -1;
     }
 
-    return acc_num;
+    return shard;
 }
 
 int generate_pin_internal() {
@@ -72,8 +592,104 @@ int generate_pin_internal() {
 }
 
 
+static int64_t to_hundredths(double amount) {
+    return (int64_t)(amount * 100.0 + (amount < 0 ? -0.5 : 0.5));
+}
+
+// Wall-clock time for a new entry of slot, held back from running
+// backwards so that an account's entries stay in time order
+static int64_t entry_time(int slot) {
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    int64_t us = (int64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+    int64_t last = ledger_last_time(&table->ledger, slot_chain(slot));
+    return us > last ? us : last;
+}
+
+// A serial for a new history of an account: its start time, made unique
+// within a slot by never repeating
+static uint64_t new_serial(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    uint64_t serial = (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+    uint64_t last = __atomic_load_n(&table->last_serial, __ATOMIC_RELAXED);
+    do {
+        if (serial <= last) {
+            serial = last + 1;
+        }
+    } while (!__atomic_compare_exchange_n(&table->last_serial, &last, serial, 1,
+                                          __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+    return serial;
+}
+
+// Append entry to the history of the account in slot
+// Caller holds the slot lock
+static void append_entry(int slot, const LedgerEntry* entry) {
+    Account* acc = slot_account(slot);
+    // On failure the entry is lost but the change stands: history has a gap
+    ledger_append(&table->ledger, slot_chain(slot), slot, acc->ledger_serial, acc->ledger_count, entry);
+    acc->ledger_count++;
+}
+
+// Registered code of an account type, 0 if it has none yet
+static uint8_t find_type_code(const char* account_type) {
+    int count = __atomic_load_n(&table->type_count, __ATOMIC_ACQUIRE);
+    for (int code = 1; code < count; code++) {
+        if (strncmp(table->type_names[code], account_type, MAX_ACCOUNT_TYPE_LEN) == 0) {
+            return (uint8_t)code;
+        }
+    }
+    return 0;
+}
+
+// Code of an account type for the scan columns, registering it on first
+// use. Code 0 stands for every type beyond the AUDIT_TYPES - 1 that fit.
+static uint8_t type_code(const char* account_type) {
+    uint8_t code = find_type_code(account_type);
+    if (code != 0 || __atomic_load_n(&table->type_count, __ATOMIC_ACQUIRE) == AUDIT_TYPES) {
+        return code;
+    }
+    robust_lock(&table->type_lock);
+    code = find_type_code(account_type); // Registered meanwhile?
+    if (code == 0 && table->type_count < AUDIT_TYPES) {
+        code = (uint8_t)table->type_count;
+        memcpy(table->type_names[code], account_type, MAX_ACCOUNT_TYPE_LEN - 1); // Stays NUL-terminated
+        // Lock-free readers see the name before the code
+        __atomic_store_n(&table->type_count, code + 1, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&table->type_lock);
+    return code;
+}
+
+// Rewrite the scan columns of slot from its account. An opened account's
+// balance and type are in place before it shows as active, and a closed
+// one stops showing as active before its balance is cleared.
+// Caller holds the slot lock.
+static void set_columns(int slot) {
+    AccountColumns* columns = store_columns(&table->store, slot >> SLAB_SHIFT);
+    const Account* acc = slot_account(slot);
+    int i = slot & SLAB_MASK;
+    if (acc->is_active) {
+        __atomic_store_n(&columns->type[i], type_code(acc->account_type), __ATOMIC_RELAXED);
+        __atomic_store_n(&columns->balance[i], to_hundredths(acc->balance), __ATOMIC_RELAXED);
+        __atomic_store_n(&columns->active[i], 1, __ATOMIC_RELEASE);
+    } else {
+        __atomic_store_n(&columns->active[i], 0, __ATOMIC_RELEASE);
+        __atomic_store_n(&columns->balance[i], 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&columns->type[i], 0, __ATOMIC_RELAXED);
+    }
+}
+
+// Rebuild the columns of every slot after loading or replay
+// Caller holds table_lock
+static void refresh_columns(void) {
+    for (int i = 0; i < table->store.slot_count; i++) {
+        set_columns(i);
+    }
+}
+
 // Open a new bank account
-// Returns Account struct on success, Account with is_active=0 and account_number=NULL on failure
+// Returns Account struct on success, Account with is_active=0 and an empty account_number on failure
 Account open_account(const char* name, const char* national_id, const char* account_type, double initial_deposit, int pin) {
     Account new_account_details;
     // Initialize to a "failure" state by default as per bank.h struct
@@ -86,59 +702,75 @@ Account open_account(const char* name, const char* national_id, const char* acco
         return new_account_details; // Return failure state
     }
 
-    // Find an available slot in the accounts array
-    int account_index = -1;
-    for(int i = 0; i < MAX_ACCOUNTS; ++i) {
-        if (!accounts[i].is_active) {
-            account_index = i;
-            break;
-        }
+    // Hashed before any lock is taken: it is the slow part
+    PinHash pin_hash;
+    if (pin_hash_create(pin, pin_iterations, &pin_hash) != 0) {
+        fprintf(stderr, "Error: could not hash the PIN.\n");
+        return new_account_details;
+    }
+
+    // Generate account number; this locks its shard
+    char account_number[MAX_ACCOUNT_NUMBER_LEN];
+    int shard = generate_account_number(account_number, sizeof(account_number));
+    if (shard == -1) {
+        return new_account_details; // Return failure state
+    }
+
+    // Take a free slot from the store (O(1): the shard's free list, or
+    // else the next unused slot)
+    int account_index = store_take_free(&table->store, shard);
+    if (account_index == -1) {
+        robust_lock(&table->table_lock);
+        account_index = store_alloc(&table->store);
+        pthread_mutex_unlock(&table->table_lock);
     }
 
     if (account_index == -1) {
         fprintf(stderr, "Error: Maximum number of accounts reached.\n");
+        pthread_mutex_unlock(&table->shards[shard].lock);
         return new_account_details; // Return failure state
     }
 
-    // Populate the account structure in the global array
-    strncpy(accounts[account_index].name, name, MAX_NAME_LEN - 1);
-    accounts[account_index].name[MAX_NAME_LEN - 1] = '\0';
+    robust_lock(slot_lock(account_index));
+    begin_write(account_index);
+    Account* acc = slot_account(account_index);
+    memset(acc, 0, sizeof(Account));
+    memcpy(acc->account_number, account_number, MAX_ACCOUNT_NUMBER_LEN);
 
-    strncpy(accounts[account_index].national_id, national_id, MAX_ID_LEN - 1);
-    accounts[account_index].national_id[MAX_ID_LEN - 1] = '\0';
+    // Populate the account structure in the store
+    strncpy(acc->name, name, MAX_NAME_LEN - 1);
+    acc->name[MAX_NAME_LEN - 1] = '\0';
 
-    strncpy(accounts[account_index].account_type, account_type, MAX_ACCOUNT_TYPE_LEN - 1);
-    accounts[account_index].account_type[MAX_ACCOUNT_TYPE_LEN - 1] = '\0';
+    strncpy(acc->national_id, national_id, MAX_ID_LEN - 1);
+    acc->national_id[MAX_ID_LEN - 1] = '\0';
 
-    // Generate account number
-    accounts[account_index].account_number = generate_account_number();
-    if (accounts[account_index].account_number == NULL) {
-        // Allocation or generation failed for account_number
-        accounts[account_index].is_active = 0; // Mark slot as inactive
-        return new_account_details; // Return failure state
-    }
+    strncpy(acc->account_type, account_type, MAX_ACCOUNT_TYPE_LEN - 1);
+    acc->account_type[MAX_ACCOUNT_TYPE_LEN - 1] = '\0';
 
-    // Use the provided PIN as per bank.h signature
-    accounts[account_index].pin = pin;
-    accounts[account_index].balance = initial_deposit;
-    accounts[account_index].is_active = 1; // Mark as active
+    acc->pin = pin_hash;
+    acc->balance = initial_deposit;
+    acc->is_active = 1; // Mark as active
+    index_insert(&table->indexes[shard], &table->store, account_index);
 
-    // Initialize transaction history (Statement struct)
-    accounts[account_index].statement.transaction_count = 0;
-    // Record initial deposit as the first transaction
-    if (accounts[account_index].statement.transaction_count < MAX_TRANSACTIONS) {
-        accounts[account_index].statement.transactions[accounts[account_index].statement.transaction_count] = initial_deposit; // Store as positive for deposit
-        accounts[account_index].statement.transaction_count++;
-    }
+    // Start a fresh history, with the initial deposit as its first entry.
+    // Chunks of an earlier account in this slot are left for the next
+    // startup to reclaim: a statement may still be reading them.
+    *slot_chain(account_index) = (LedgerChain){ 0, 0 };
+    LedgerEntry entry = { entry_time(account_index), to_hundredths(initial_deposit),
+                          to_hundredths(initial_deposit), LEDGER_OPEN, 0 };
+    acc->ledger_serial = new_serial();
+    acc->ledger_count = 0;
+    append_entry(account_index, &entry);
 
+    set_columns(account_index);
 
-    // If this is the first account in this slot, increment account_count
-    if (account_index >= account_count) {
-         account_count = account_index + 1;
-    }
-    new_account_details = accounts[account_index];
+    new_account_details = *acc;
+    uint64_t lsn = log_change(LOG_OPEN, account_index, NULL, &entry);
 
-    save_accounts_to_file("accounts_data.txt"); 
+    unlock_account(account_index);
+    pthread_mutex_unlock(&table->shards[shard].lock);
+
+    log_commit(lsn);
 
     return new_account_details; // Return the populated Account struct
 }
@@ -146,60 +778,132 @@ Account open_account(const char* name, const char* national_id, const char* acco
 // Close an account
 // Returns 0 on success, 1 on account not found/PIN incorrect
 int close_account(const char* account_number, int pin) {
-    int index = find_account_index(account_number, pin);
+    AccountHandle handle;
+    return bank_login(account_number, pin, &handle) == 0 ? close_account_as(&handle) : 1;
+}
 
-    if (index != -1) {
-        // Account found, proceed to close
-        free(accounts[index].account_number); // Free dynamically allocated account number
-        accounts[index].account_number = NULL;
-        accounts[index].is_active = 0; // Mark slot as inactive
+int close_account_as(const AccountHandle* handle) {
+    // The shard lock comes first, so the shard is found from a lock-free
+    // read of the number and checked once the account is locked
+    int index = -1;
+    int shard = -1;
+    while (index == -1) {
+        if (handle->slot < 0 || handle->slot >= __atomic_load_n(&table->store.slot_count, __ATOMIC_ACQUIRE)) {
+            return 1;
+        }
+        char number[MAX_ACCOUNT_NUMBER_LEN];
+        memcpy(number, slot_account(handle->slot)->account_number, sizeof(number));
+        number[MAX_ACCOUNT_NUMBER_LEN - 1] = '\0';
+        shard = shard_of(number);
+        robust_lock(&table->shards[shard].lock);
+        index = lock_handle(handle);
+        if (index == -1) {
+            pthread_mutex_unlock(&table->shards[shard].lock);
+            return 1; // Account not found or PIN incorrect
+        }
+        if (shard_of(slot_account(index)->account_number) != shard) {
+            // Read mid-change: the account is there, in another shard
+            unlock_account(index);
+            pthread_mutex_unlock(&table->shards[shard].lock);
+            index = -1;
+        }
+    }
 
-        // No need to shift array elements if we use the is_active flag
+    // Account found, proceed to close
+    Account* acc = slot_account(index);
+    Account before = *acc;
+    index_remove(&table->indexes[shard], &table->store, index);
+    begin_write(index);
+    acc->account_number[0] = '\0';
+    acc->is_active = 0; // Mark slot as inactive
+    set_columns(index);
+
+    // The slot goes back on the shard's free list for its next opening
+    store_free(&table->store, shard, index);
+    uint64_t lsn = log_change(LOG_CLOSE, index, &before, NULL);
+    unlock_account(index);
+    pthread_mutex_unlock(&table->shards[shard].lock);
+
+    // Make the closure durable before reporting success
+    log_commit(lsn);
+    return 0; // Success
+}
 
-        // Save accounts to file after a successful closure
-        save_accounts_to_file("accounts_data.txt"); // Use a default filename
-        return 0; // Success
+// Rules shared by withdraw(), deposit() and apply_batch()
+// Return 0 if the change is allowed, else the error code of the operation
+static int withdrawal_error(double balance, double amount) {
+    // Check withdrawal amount multiple (Ksh 500)
+    if ((int)amount % 500 != 0 || amount <= 0) { // Also ensure amount is positive
+        return 4; // Withdrawal amount not multiple of 500
+    }
+    // Check minimum balance requirement (must leave at least 1000)
+    if (balance - amount < 1000.0) {
+        return 3; // Insufficient funds
     }
+    return 0;
+}
+
+static int deposit_error(double amount) {
+    // Check minimum deposit amount (Ksh 500)
+    return amount < 500.0 ? 3 : 0;
+}
 
-    return 1; // Failure (Account not found or incorrect PIN)
+// Add amount (negative for a withdrawal) to the balance of slot and
+// append it to the account's history as an entry of the given type
+// Caller holds the slot lock. Returns the log record of the change.
+static UpdateRecord record_transaction(int slot, double amount, LedgerType type) {
+    Account* acc = slot_account(slot);
+    begin_write(slot);
+    acc->balance += amount;
+    AccountColumns* columns = store_columns(&table->store, slot >> SLAB_SHIFT);
+    __atomic_store_n(&columns->balance[slot & SLAB_MASK], to_hundredths(acc->balance), __ATOMIC_RELAXED);
+
+    UpdateRecord record;
+    memset(&record, 0, sizeof(record)); // No stray bytes in the log
+    record.slot = slot;
+    record.balance = acc->balance;
+    record.entry.time_us = entry_time(slot);
+    record.entry.amount = to_hundredths(amount < 0 ? -amount : amount);
+    record.entry.balance = to_hundredths(acc->balance);
+    record.entry.type = type;
+    append_entry(slot, &record.entry);
+    record.ledger_count = acc->ledger_count;
+    return record;
 }
 
 // Withdraw from account
 // Returns 0 on success, non-zero on failure (1: account/pin, 3: insufficient funds, 4: not multiple of 500)
 int withdraw(const char* account_number, int pin, double amount) {
-    int index = find_account_index(account_number, pin);
+    AccountHandle handle;
+    return bank_login(account_number, pin, &handle) == 0 ? withdraw_as(&handle, amount) : 1;
+}
+
+int withdraw_as(const AccountHandle* handle, double amount) {
+    int index = lock_handle(handle);
 
     if (index != -1) {
         // Account found
-        // Check withdrawal amount multiple (Ksh 500)
-        if ((int)amount % 500 != 0 || amount <= 0) { // Also ensure amount is positive
+        Account* acc = slot_account(index);
+        int error = withdrawal_error(acc->balance, amount);
+        if (error == 4) {
             fprintf(stderr, "Error: Withdrawal amount must be a positive multiple of 500.\n");
-            return 4; // Withdrawal amount not multiple of 500
-        }
-
-        // Check minimum balance requirement (must leave at least 1000)
-        if (accounts[index].balance - amount < 1000.0) {
+        } else if (error == 3) {
             fprintf(stderr, "Error: Insufficient funds or minimum balance requirement not met.\n");
-            return 3; // Insufficient funds
+        }
+        if (error != 0) {
+            unlock_account(index);
+            return error;
         }
 
         // Perform withdrawal
-        accounts[index].balance -= amount;
+        Account before = *acc;
+        UpdateRecord change = record_transaction(index, -amount, LEDGER_WITHDRAWAL);
 
-        // Record transaction (circular buffer for last MAX_TRANSACTIONS)
-        if (accounts[index].statement.transaction_count < MAX_TRANSACTIONS) {
-            accounts[index].statement.transactions[accounts[index].statement.transaction_count] = -amount; // Store as negative for withdrawal
-            accounts[index].statement.transaction_count++;
-        } else {
-            // Shift older transactions to make space for the new one
-            for (int j = 0; j < MAX_TRANSACTIONS - 1; j++) {
-                accounts[index].statement.transactions[j] = accounts[index].statement.transactions[j + 1];
-            }
-            accounts[index].statement.transactions[MAX_TRANSACTIONS - 1] = -amount; // Store as negative
-        }
+        uint64_t lsn = log_change(LOG_UPDATE, index, &before, &change.entry);
+        unlock_account(index);
 
-        // Save accounts to file after a successful withdrawal
-        save_accounts_to_file("accounts_data.txt"); // Use a default filename
+        // Make the withdrawal durable before reporting success
+        log_commit(lsn);
         return 0; // Success
     }
 
@@ -209,145 +913,621 @@ int withdraw(const char* account_number, int pin, double amount) {
 // Deposit into account
 // Returns 0 on success, non-zero on failure (1: account/pin, 3: minimum deposit not met)
 int deposit(const char* account_number, int pin, double amount) {
-    int index = find_account_index(account_number, pin);
+    AccountHandle handle;
+    return bank_login(account_number, pin, &handle) == 0 ? deposit_as(&handle, amount) : 1;
+}
+
+int deposit_as(const AccountHandle* handle, double amount) {
+    int index = lock_handle(handle);
 
     if (index != -1) {
         // Account found
-        // Check minimum deposit amount (Ksh 500)
-        if (amount < 500.0) {
+        Account* acc = slot_account(index);
+        if (deposit_error(amount) != 0) {
             fprintf(stderr, "Error: Minimum deposit amount is 500.\n");
+            unlock_account(index);
             return 3; // Minimum deposit amount not met
         }
 
         // Perform deposit
-        accounts[index].balance += amount;
+        Account before = *acc;
+        UpdateRecord change = record_transaction(index, amount, LEDGER_DEPOSIT);
 
-        // Record transaction (circular buffer for last MAX_TRANSACTIONS)
-        if (accounts[index].statement.transaction_count < MAX_TRANSACTIONS) {
-            accounts[index].statement.transactions[accounts[index].statement.transaction_count] = amount; // Store as positive for deposit
-            accounts[index].statement.transaction_count++;
-        } else {
-            // Shift older transactions to make space for the new one
-            for (int j = 0; j < MAX_TRANSACTIONS - 1; j++) {
-                accounts[index].statement.transactions[j] = accounts[index].statement.transactions[j + 1];
-            }
-            accounts[index].statement.transactions[MAX_TRANSACTIONS - 1] = amount; // Store as positive
-        }
+        uint64_t lsn = log_change(LOG_UPDATE, index, &before, &change.entry);
+        unlock_account(index);
 
-        // Save accounts to file after a successful deposit
-        save_accounts_to_file("accounts_data.txt"); // Use a default filename
+        // Make the deposit durable before reporting success
+        log_commit(lsn);
         return 0; // Success
     }
 
     return 1; // Account not found or PIN incorrect
 }
 
-// Check account balance
-// Returns balance on success, -1.0 on error (account not found/PIN incorrect)
-double check_balance(const char* account_number, int pin) {
-    int index = find_account_index(account_number, pin);
+// Find both accounts of a transfer and lock them, lower slot first, so
+// transfers running in opposite directions cannot deadlock
+// Returns 0 with both locks held, or the error code of transfer()
+static int lock_transfer_accounts(const AccountHandle* source, const char* to_account, int* from, int* to) {
+    while (1) {
+        *from = source->slot;
+        if (*from < 0 || *from >= __atomic_load_n(&table->store.slot_count, __ATOMIC_ACQUIRE)) {
+            return 1;
+        }
+        *to = index_lookup(shard_index(to_account), &table->store, to_account);
+        if (*to == -1 || !slot_account(*to)->is_active) {
+            return 2;
+        }
+        if (*to == *from) {
+            return 5;
+        }
 
-    if (index != -1) {
-        // Account found, return balance
-        return accounts[index].balance;
+        int first = *from < *to ? *from : *to;
+        int second = *from < *to ? *to : *from;
+        robust_lock(slot_lock(first));
+        robust_lock(slot_lock(second));
+        const Account* dst = slot_account(*to);
+        int error = !holds(*from, source) ? 1 : !(dst->is_active && strcmp(dst->account_number, to_account) == 0) ? -1 : 0;
+        if (error == 0) {
+            return 0;
+        }
+        unlock_account(second);
+        unlock_account(first);
+        if (error == 1) {
+            return 1; // The source was closed
+        }
+        // The destination slot was closed or reused since the lookup, look again
     }
+}
 
-    return -1.0; // Error indicator as per bank.h signature
+// Move money between two accounts (see bank.h)
+int transfer(const char* from_account, int pin, const char* to_account, double amount) {
+    AccountHandle source;
+    return bank_login(from_account, pin, &source) == 0 ? transfer_as(&source, to_account, amount) : 1;
 }
 
-// Get account statement (last MAX_TRANSACTIONS)
-// Returns 0 on success, 1 on account not found/PIN incorrect, 2 on buffer too small
-int get_statement(const char* account_number, int pin, char* output, size_t output_size) {
-    int index = find_account_index(account_number, pin);
+int transfer_as(const AccountHandle* source, const char* to_account, double amount) {
+    int from, to;
+    uint64_t traced = trace_begin();
+    int error = lock_transfer_accounts(source, to_account, &from, &to);
+    trace_end(TRACE_LOOKUP, 0, traced);
+    if (error != 0) {
+        return error;
+    }
 
-    if (index != -1) {
-        // Account found, generate statement string
-        int written = 0;
-        written += snprintf(output + written, output_size - written, "Statement for Account %s (Balance: %.2f):\n",
-                            account_number, accounts[index].balance);
+    // The money leaves the source like a withdrawal
+    error = withdrawal_error(slot_account(from)->balance, amount);
+    if (error == 0) {
+        int slots[2] = { from < to ? from : to, from < to ? to : from };
+        Account befores[2] = { *slot_account(slots[0]), *slot_account(slots[1]) };
+        UpdateRecord changes[2] = { record_transaction(from, -amount, LEDGER_TRANSFER_OUT),
+                                    record_transaction(to, amount, LEDGER_TRANSFER_IN) };
+
+        // Both halves in one record: replay never sees just one of them
+        uint64_t lsn = log_updates(changes, 2, slots, befores, 2);
+        unlock_account(from);
+        unlock_account(to);
+        log_commit(lsn);
+        return 0;
+    }
 
-        if (written >= output_size) return 2; // Buffer too small
+    unlock_account(from);
+    unlock_account(to);
+    return error;
+}
 
-        if (accounts[index].statement.transaction_count == 0) {
-            written += snprintf(output + written, output_size - written, "No transactions yet.\n");
-             if (written >= output_size) return 2; // Buffer too small
+// Position of slot in the ascending array slots[0, count), which holds it
+static int slot_position(const int* slots, int count, int slot) {
+    int low = 0, high = count - 1;
+    while (low < high) {
+        int mid = (low + high) / 2;
+        if (slots[mid] < slot) {
+            low = mid + 1;
         } else {
-            written += snprintf(output + written, output_size - written, "Last %d Transactions:\n", accounts[index].statement.transaction_count);
-             if (written >= output_size) return 2; // Buffer too small
+            high = mid;
+        }
+    }
+    return low;
+}
 
-            for (int j = 0; j < accounts[index].statement.transaction_count; j++) {
-                // Determine transaction type based on sign (as type is not stored in bank.h Statement)
-                const char* type = (accounts[index].statement.transactions[j] >= 0) ? "Deposit" : "Withdrawal";
-                double amount = (accounts[index].statement.transactions[j] >= 0) ? accounts[index].statement.transactions[j] : -accounts[index].statement.transactions[j]; // Use absolute value for display
+// Lock the accounts named by the items, in ascending slot order so that
+// two batches can never wait for each other in a cycle. slots[i] gets the
+// slot of item i (-1 if not found or PIN incorrect), locked[] the distinct
+// slots in locking order.
+// Returns the number of slots locked.
+static int lock_batch_accounts(const BatchItem* items, int count, int* slots, int* locked) {
+    // Each PIN is hashed once, before any lock is taken
+    AccountHandle handles[MAX_BATCH_ITEMS];
+    for (int i = 0; i < count; i++) {
+        slots[i] = bank_login(items[i].account_number, items[i].pin, &handles[i]) == 0 ? handles[i].slot : -1;
+    }
+    while (1) {
+        int locked_count = 0;
+        for (int i = 0; i < count; i++) {
+            if (slots[i] == -1) {
+                continue;
+            }
+            // Insertion into the sorted distinct set; batches are small
+            int pos = locked_count;
+            while (pos > 0 && locked[pos - 1] > slots[i]) {
+                pos--;
+            }
+            if (pos > 0 && locked[pos - 1] == slots[i]) {
+                continue;
+            }
+            memmove(&locked[pos + 1], &locked[pos], (locked_count - pos) * sizeof(int));
+            locked[pos] = slots[i];
+            locked_count++;
+        }
+
+        for (int k = 0; k < locked_count; k++) {
+            robust_lock(slot_lock(locked[k]));
+        }
 
-                written += snprintf(output + written, output_size - written, "%d. %s: %.2f\n",
-                                    j + 1, type, amount);
-                 if (written >= output_size) return 2; // Buffer too small
+        // An account may have been closed since the lookups: its items
+        // fail as not found, and the rest are locked again without it
+        int stale = 0;
+        for (int i = 0; i < count; i++) {
+            if (slots[i] != -1 && !holds(slots[i], &handles[i])) {
+                slots[i] = -1;
+                stale = 1;
             }
         }
+        if (!stale) {
+            return locked_count;
+        }
+        for (int k = 0; k < locked_count; k++) {
+            unlock_account(locked[k]);
+        }
+    }
+}
 
-        return 0; // Success
+// Apply a batch of deposits and withdrawals atomically (see bank.h)
+int apply_batch(const BatchItem* items, int count, int* statuses) {
+    int slots[MAX_BATCH_ITEMS];
+    int locked[MAX_BATCH_ITEMS];
+    double balances[MAX_BATCH_ITEMS]; // Running balance of each locked slot
+    Account befores[MAX_BATCH_ITEMS];
+    UpdateRecord changes[MAX_BATCH_ITEMS];
+
+    if (count < 1 || count > MAX_BATCH_ITEMS) {
+        return 2;
+    }
+
+    uint64_t traced = trace_begin();
+    int locked_count = lock_batch_accounts(items, count, slots, locked);
+    trace_end(TRACE_LOOKUP, 0, traced);
+    for (int k = 0; k < locked_count; k++) {
+        balances[k] = slot_account(locked[k])->balance;
+    }
+
+    // Check every item against the balance the items before it leave
+    int rejected = 0;
+    for (int i = 0; i < count; i++) {
+        if (slots[i] == -1) {
+            statuses[i] = 1;
+        } else {
+            double* balance = &balances[slot_position(locked, locked_count, slots[i])];
+            if (items[i].withdrawal) {
+                statuses[i] = withdrawal_error(*balance, items[i].amount);
+                *balance -= statuses[i] == 0 ? items[i].amount : 0;
+            } else {
+                statuses[i] = deposit_error(items[i].amount);
+                *balance += statuses[i] == 0 ? items[i].amount : 0;
+            }
+        }
+        rejected |= statuses[i] != 0;
+    }
+
+    uint64_t lsn = 0;
+    if (!rejected) {
+        for (int k = 0; k < locked_count; k++) {
+            befores[k] = *slot_account(locked[k]);
+        }
+        for (int i = 0; i < count; i++) {
+            changes[i] = items[i].withdrawal ? record_transaction(slots[i], -items[i].amount, LEDGER_WITHDRAWAL)
+                                             : record_transaction(slots[i], items[i].amount, LEDGER_DEPOSIT);
+        }
+        lsn = log_updates(changes, count, locked, befores, locked_count);
+    }
+
+    for (int k = 0; k < locked_count; k++) {
+        unlock_account(locked[k]);
+    }
+
+    // One commit makes the whole batch durable
+    log_commit(lsn);
+    return rejected;
+}
+
+// Check account balance without locks (see bank.h)
+// Returns balance on success, -1.0 on error (account not found/PIN incorrect)
+double check_balance(const char* account_number, int pin) {
+    AccountHandle handle;
+    return bank_login(account_number, pin, &handle) == 0 ? check_balance_as(&handle) : -1.0;
+}
+
+double check_balance_as(const AccountHandle* handle) {
+    if (handle->slot < 0 || handle->slot >= __atomic_load_n(&table->store.slot_count, __ATOMIC_ACQUIRE)) {
+        return -1.0;
+    }
+    uint64_t traced = trace_begin();
+    const AccountSlot* s = store_slot(&table->store, handle->slot);
+    const Account* acc = &s->account;
+    for (int attempt = 0; attempt < OPTIMISTIC_READ_ATTEMPTS; attempt++) {
+        unsigned int seq = __atomic_load_n(&s->seq, __ATOMIC_ACQUIRE);
+        if (seq & 1) {
+            sched_yield(); // A writer holds the lock; let it finish
+            continue;
+        }
+        int found = __atomic_load_n(&acc->is_active, __ATOMIC_RELAXED) &&
+                    __atomic_load_n(&acc->ledger_serial, __ATOMIC_RELAXED) == handle->serial;
+        double balance;
+        __atomic_load(&acc->balance, &balance, __ATOMIC_RELAXED);
+
+        // Only trust what was read if no write section began meanwhile
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&s->seq, __ATOMIC_RELAXED) == seq) {
+            trace_end(TRACE_LOOKUP, 0, traced);
+            // A slot closed or reused since the lookup reads as not found,
+            // the same answer as a lookup an instant later
+            return found ? balance : -1.0;
+        }
+    }
+    trace_end(TRACE_LOOKUP, 0, traced);
+    return balance_locked(handle);
+}
+
+// Check account balance under the account lock
+// Returns balance on success, -1.0 on error (account not found/PIN incorrect)
+double check_balance_locked(const char* account_number, int pin) {
+    AccountHandle handle;
+    return bank_login(account_number, pin, &handle) == 0 ? balance_locked(&handle) : -1.0;
+}
+
+// Aggregate every open account from the scan columns (see bank.h)
+void bank_audit(BankAudit* audit) {
+    // Hundredths: 1,000, 10,000, ... 1,000,000,000
+    static const int64_t thresholds[SCAN_THRESHOLDS] = {
+        100000LL, 1000000LL, 10000000LL, 100000000LL, 1000000000LL, 10000000000LL, 100000000000LL
+    };
+    _Static_assert(AUDIT_BUCKETS == SCAN_THRESHOLDS + 1, "one bucket below each threshold, one above");
+
+    ScanTotals totals;
+    scan_totals_init(&totals);
+    int type_count = __atomic_load_n(&table->type_count, __ATOMIC_ACQUIRE);
+    int slot_count = __atomic_load_n(&table->store.slot_count, __ATOMIC_ACQUIRE);
+    for (int slab = 0; slab * SLAB_SIZE < slot_count; slab++) {
+        const AccountColumns* columns = store_columns(&table->store, slab);
+        if (columns == NULL) {
+            break;
+        }
+        int count = slot_count - slab * SLAB_SIZE < SLAB_SIZE ? slot_count - slab * SLAB_SIZE : SLAB_SIZE;
+        scan_columns(columns->balance, columns->active, columns->type, count, thresholds, type_count, &totals);
+    }
+
+    memset(audit, 0, sizeof(*audit));
+    audit->accounts = totals.accounts;
+    audit->total = totals.total;
+    audit->min = totals.accounts > 0 ? totals.min : 0;
+    audit->max = totals.accounts > 0 ? totals.max : 0;
+    // Named types first, "other" last
+    for (int code = 1; code <= type_count; code++) {
+        int t = code % type_count;
+        if (totals.per_type[t] > 0) {
+            if (t != 0) {
+                memcpy(audit->types[audit->type_count].name, table->type_names[t], MAX_ACCOUNT_TYPE_LEN);
+            }
+            audit->types[audit->type_count++].accounts = totals.per_type[t];
+        }
+    }
+    audit->histogram[0] = totals.accounts - totals.at_least[0];
+    for (int k = 1; k < SCAN_THRESHOLDS; k++) {
+        audit->histogram[k] = totals.at_least[k - 1] - totals.at_least[k];
+    }
+    audit->histogram[SCAN_THRESHOLDS] = totals.at_least[SCAN_THRESHOLDS - 1];
+}
+
+// Position cursor at the start of query over the history of slot
+// Caller holds the slot lock
+static void statement_start(int slot, const StatementQuery* query, StatementCursor* cursor) {
+    const LedgerChain* chain = slot_chain(slot);
+    cursor->end = ledger_end(&table->ledger, chain);
+    cursor->skip = 0;
+    cursor->remaining = query->limit;
+    cursor->from_us = query->from_us;
+    cursor->to_us = query->to_us;
+
+    uint64_t first;
+    if (query->latest) {
+        first = cursor->end > query->limit ? cursor->end - query->limit : 0;
+    } else if (query->from_us > 0) {
+        // Which entry is the offset-th in the time range is only known by
+        // reading up to it
+        first = 0;
+        cursor->skip = query->offset;
+    } else {
+        first = query->offset;
+    }
+    ledger_seek(&table->ledger, chain, first, &cursor->chunk, &cursor->index);
+}
+
+// Start a statement (see bank.h)
+int statement_begin(const char* account_number, int pin, const StatementQuery* query,
+                    StatementCursor* cursor, double* balance, uint64_t* total) {
+    AccountHandle handle;
+    return bank_login(account_number, pin, &handle) == 0 ? statement_begin_as(&handle, query, cursor, balance, total) : 1;
+}
+
+int statement_begin_as(const AccountHandle* handle, const StatementQuery* query,
+                       StatementCursor* cursor, double* balance, uint64_t* total) {
+    int index = lock_handle(handle);
+
+    if (index != -1) {
+        *balance = slot_account(index)->balance;
+        *total = slot_account(index)->ledger_count;
+        statement_start(index, query, cursor);
+        unlock_account(index);
+        return 0;
     }
 
     return 1; // Account not found or PIN incorrect
 }
 
+// Read the next entry of a statement (see bank.h). Entries below
+// cursor->end are complete and never change, so no lock is needed.
+int statement_next(StatementCursor* cursor, StatementEntry* entry) {
+    while (cursor->remaining > 0 && cursor->chunk != 0) {
+        const LedgerChunk* chunk = ledger_chunk(&table->ledger, cursor->chunk);
+        uint32_t count = __atomic_load_n(&chunk->header.count, __ATOMIC_ACQUIRE);
+        if (cursor->index >= count || chunk->entries[count - 1].time_us < cursor->from_us) {
+            // Done with this chunk, or all of it is before the time range
+            cursor->chunk = __atomic_load_n(&chunk->header.next, __ATOMIC_ACQUIRE);
+            cursor->index = 0;
+            continue;
+        }
+
+        uint64_t id = chunk->header.first_id + cursor->index;
+        const LedgerEntry* e = &chunk->entries[cursor->index++];
+        if (id >= cursor->end || e->time_us > cursor->to_us) {
+            break; // Entries are in time order: nothing later matches
+        }
+        if (e->time_us < cursor->from_us) {
+            continue;
+        }
+        if (cursor->skip > 0) {
+            cursor->skip--;
+            continue;
+        }
+
+        cursor->remaining--;
+        entry->id = id;
+        entry->time_us = e->time_us;
+        entry->amount = e->amount / 100.0;
+        entry->balance = e->balance / 100.0;
+        entry->type = (int)e->type;
+        return 1;
+    }
+
+    cursor->chunk = 0;
+    return 0;
+}
+
+// Signed amounts (negative for money leaving) of the last MAX_TRANSACTIONS
+// entries of slot, oldest first, as the text format stores them
+// Caller holds the slot lock. Returns how many were found.
+static int recent_amounts(int slot, double* amounts) {
+    StatementQuery query = { 0, MAX_TRANSACTIONS, 0, INT64_MAX, 1 };
+    StatementCursor cursor;
+    StatementEntry entry;
+    int count = 0;
+
+    statement_start(slot, &query, &cursor);
+    while (statement_next(&cursor, &entry)) {
+        int out = entry.type == LEDGER_WITHDRAWAL || entry.type == LEDGER_TRANSFER_OUT;
+        amounts[count++] = out ? -entry.amount : entry.amount;
+    }
+    return count;
+}
+
+// Finish a file written to tmp_filename: sync it and rename it over
+// filename, so a crash leaves either the old file or the new one, never a
+// half-written one. Closes file.
+// Returns 0 on success, 1 on failure
+static int replace_file(FILE* file, const char* tmp_filename, const char* filename) {
+    int failed = ferror(file) || fflush(file) != 0 || fsync(fileno(file)) != 0;
+    failed |= fclose(file) != 0;
+    if (failed || rename(tmp_filename, filename) != 0) {
+        perror("Error writing accounts file");
+        unlink(tmp_filename);
+        return 1;
+    }
+    sync_parent_dir(filename);
+    return 0;
+}
+
 // Save accounts data to file
 // Returns 0 on success, 1 on failure
 int save_accounts_to_file(const char* filename) {
-    FILE* file = fopen(filename, "w");
+    char tmp_filename[4096];
+    snprintf(tmp_filename, sizeof(tmp_filename), "%s.tmp", filename);
+
+    robust_lock(&table->save_lock);
+    FILE* file = fopen(tmp_filename, "w");
     if (file == NULL) {
         perror("Error opening file for writing");
+        pthread_mutex_unlock(&table->save_lock);
         return 1; // Failure
     }
 
     // Write the highest index used + 1 (which is account_count)
-    fprintf(file, "%d\n", account_count);
+    int count = table->store.slot_count;
+    fprintf(file, "%d\n", count);
 
     // Iterate through all possible slots up to account_count
-    for (int i = 0; i < account_count; i++) {
+    for (int i = 0; i < count; i++) {
+         robust_lock(slot_lock(i));
+         const Account* acc = slot_account(i);
          // Write account data only if the slot is active
-         if (accounts[i].is_active) {
-            fprintf(file, "%d\n", accounts[i].is_active); // Write active status
-            fprintf(file, "%s\n", accounts[i].name);
-            fprintf(file, "%s\n", accounts[i].national_id);
-            fprintf(file, "%s\n", accounts[i].account_type);
-            // Ensure account_number is not NULL before writing
-            fprintf(file, "%s\n", accounts[i].account_number ? accounts[i].account_number : "NULL");
-            fprintf(file, "%d\n", accounts[i].pin);
-            fprintf(file, "%.2f\n", accounts[i].balance);
-            fprintf(file, "%d\n", accounts[i].statement.transaction_count);
-            for (int j = 0; j < accounts[i].statement.transaction_count; j++) {
-                // Save only the amount as per bank.h Statement struct
-                fprintf(file, "%.2f\n", accounts[i].statement.transactions[j]);
+         if (acc->is_active) {
+            fprintf(file, "%d\n", acc->is_active); // Write active status
+            fprintf(file, "%s\n", acc->name);
+            fprintf(file, "%s\n", acc->national_id);
+            fprintf(file, "%s\n", acc->account_type);
+            fprintf(file, "%s\n", acc->account_number);
+            char pin_text[PIN_HASH_TEXT_LEN];
+            pin_hash_format(&acc->pin, pin_text);
+            fprintf(file, "%s\n", pin_text);
+            fprintf(file, "%.2f\n", acc->balance);
+            // Only the most recent history fits this format
+            double amounts[MAX_TRANSACTIONS];
+            int transaction_count = recent_amounts(i, amounts);
+            fprintf(file, "%d\n", transaction_count);
+            for (int j = 0; j < transaction_count; j++) {
+                fprintf(file, "%.2f\n", amounts[j]);
             }
             fprintf(file, "---\n"); // Separator
          } else {
              // If the slot is not active, still write the is_active status
              // This helps maintain the correct index when loading
-             fprintf(file, "%d\n", accounts[i].is_active);
+             fprintf(file, "%d\n", acc->is_active);
              // For simplicity in loading, we'll just write the inactive flag and separator.
              fprintf(file, "---\n");
          }
+         unlock_account(i);
     }
 
-    fclose(file);
-    return 0; // Success
+    int result = replace_file(file, tmp_filename, filename);
+    pthread_mutex_unlock(&table->save_lock);
+    return result;
 }
 
-// Load accounts data from file
+// Write slots [0, count) as a binary snapshot (see snapshot.h). With a
+// checkpoint mark lsn, slots changed since the mark are written as their
+// pre-images, so the file holds the table exactly as it was at the mark.
 // Returns 0 on success, 1 on failure
-int load_accounts_from_file(const char* filename) {
+static int write_snapshot(const char* filename, int count, uint64_t lsn) {
+    char tmp_filename[4096];
+    snprintf(tmp_filename, sizeof(tmp_filename), "%s.tmp", filename);
+
+    robust_lock(&table->save_lock);
+    FILE* file = fopen(tmp_filename, "wb");
+    if (file == NULL) {
+        perror("Error opening snapshot for writing");
+        pthread_mutex_unlock(&table->save_lock);
+        return 1;
+    }
+    char* buffer = malloc(1 << 20); // Large sequential writes
+    if (buffer != NULL) {
+        setvbuf(file, buffer, _IOFBF, 1 << 20);
+    }
+
+    SnapshotHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+    header.version = SNAPSHOT_VERSION;
+    header.record_size = sizeof(SnapshotRecord);
+    header.record_count = count;
+    uint32_t crc = crc32c(0, &header, offsetof(SnapshotHeader, crc));
+
+    // The header goes in last, once the checksum is known
+    fseek(file, sizeof(header), SEEK_SET);
+    for (int i = 0; i < (int)header.record_count; i++) {
+        SnapshotRecord record;
+        memset(&record, 0, sizeof(record)); // Zero padding and string tails
+
+        robust_lock(slot_lock(i));
+        const AccountSlot* s = store_slot(&table->store, i);
+        const Account* acc = &s->account;
+        if (lsn != 0 && s->preimage_lsn == lsn) {
+            acc = &table->preimages[s->preimage];
+        }
+        if (acc->is_active) {
+            record.balance = acc->balance;
+            record.ledger_serial = acc->ledger_serial;
+            record.ledger_count = acc->ledger_count;
+            record.pin = acc->pin;
+            record.is_active = 1;
+            memcpy(record.name, acc->name, sizeof(record.name));
+            memcpy(record.national_id, acc->national_id, sizeof(record.national_id));
+            memcpy(record.account_type, acc->account_type, sizeof(record.account_type));
+            memcpy(record.account_number, acc->account_number, sizeof(record.account_number));
+        }
+        unlock_account(i);
+
+        crc = crc32c(crc, &record, sizeof(record));
+        fwrite(&record, sizeof(record), 1, file);
+    }
+
+    header.crc = crc;
+    fseek(file, 0, SEEK_SET);
+    fwrite(&header, sizeof(header), 1, file);
+
+    int result = replace_file(file, tmp_filename, filename);
+    free(buffer);
+    pthread_mutex_unlock(&table->save_lock);
+    return result;
+}
+
+// Save the table as a binary snapshot (see snapshot.h)
+// Returns 0 on success, 1 on failure
+int save_snapshot(const char* filename) {
+    return write_snapshot(filename, table->store.slot_count, 0);
+}
+
+// History read from formats older than the ledger (the last
+// MAX_TRANSACTIONS amounts of an account), held until bank_open_log() has
+// linked the ledger and replayed the log, which may replace it
+typedef struct {
+    int32_t slot;
+    int32_t count;
+    double amounts[MAX_TRANSACTIONS];
+} LegacyHistory;
+
+static LegacyHistory* legacy_histories = NULL;
+static int legacy_count = 0;
+static int legacy_capacity = 0;
+
+// Queue the last count amounts (signed, oldest first) of the account in
+// slot for import into the ledger; caller holds table_lock
+static void queue_legacy_history(int slot, const double* amounts, int count) {
+    if (count <= 0) {
+        return;
+    }
+    if (count > MAX_TRANSACTIONS) {
+        count = MAX_TRANSACTIONS;
+    }
+    if (legacy_count == legacy_capacity) {
+        int capacity = legacy_capacity > 0 ? legacy_capacity * 2 : 1024;
+        LegacyHistory* grown = realloc(legacy_histories, capacity * sizeof(LegacyHistory));
+        if (grown == NULL) {
+            fprintf(stderr, "Warning: out of memory; the history of account slot %d is not imported.\n", slot);
+            return;
+        }
+        legacy_histories = grown;
+        legacy_capacity = capacity;
+    }
+    LegacyHistory* history = &legacy_histories[legacy_count++];
+    history->slot = slot;
+    history->count = count;
+    memcpy(history->amounts, amounts, count * sizeof(double));
+}
+
+// Mark every slot the store has handed out as inactive
+static void clear_slots(void) {
+    for (int i = 0; i < table->store.slot_count; i++) {
+        slot_account(i)->is_active = 0;
+        slot_account(i)->account_number[0] = '\0';
+    }
+}
+
+// Body of load_accounts_from_file(); caller holds table_lock
+static int load_accounts_locked(const char* filename) {
     FILE* file = fopen(filename, "r");
     if (file == NULL) {
         // No existing accounts file, start fresh. This is not an error.
         // fprintf(stderr, "No existing accounts file found. Starting again\n"); - verbose for no reason
-        account_count = 0;
         // Initialize all account slots as inactive
-        for(int i = 0; i < MAX_ACCOUNTS; ++i) {
-            accounts[i].is_active = 0;
-            accounts[i].account_number = NULL; // Ensure pointers are NULL
-        }
+        clear_slots();
         return 0; // Not an error if file doesn't exist
     }
 
@@ -355,11 +1535,7 @@ int load_accounts_from_file(const char* filename) {
     if (fscanf(file, "%d\n", &loaded_account_count) != 1) {
         fprintf(stderr, "Error reading number of accounts from file. Starting fresh.\n");
         fclose(file);
-        account_count = 0;
-         for(int i = 0; i < MAX_ACCOUNTS; ++i) {
-            accounts[i].is_active = 0;
-            accounts[i].account_number = NULL;
-        }
+        clear_slots();
         return 1; // Indicate file read error
     }
 
@@ -370,81 +1546,79 @@ int load_accounts_from_file(const char* filename) {
     }
 
     // Initialize all account slots as inactive before loading
-    for(int i = 0; i < MAX_ACCOUNTS; ++i) {
-        accounts[i].is_active = 0;
-        if (accounts[i].account_number != NULL) {
-            free(accounts[i].account_number); // Free any existing allocated memory
-            accounts[i].account_number = NULL;
-        }
-    }
-
+    clear_slots();
 
-    account_count = 0; // Reset account_count before loading
+    // Allocate slabs for every slot in the file up front
+    if (store_reserve(&table->store, loaded_account_count) != 0) {
+        fprintf(stderr, "Error allocating %d account slots. Starting fresh.\n", loaded_account_count);
+        fclose(file);
+        return 1;
+    }
 
     for (int i = 0; i < loaded_account_count; i++) {
+        Account* acc = slot_account(i);
         int is_active;
         if (fscanf(file, "%d\n", &is_active) != 1) {
             fprintf(stderr, "Error reading active status for account %d. Stopping load.\n", i);
             break; // Stop loading if active status can't be read
         }
 
-        accounts[i].is_active = is_active; // Set active status
+        acc->is_active = is_active; // Set active status
 
-        if (accounts[i].is_active) {
+        if (acc->is_active) {
             // Read active account data
             char name_buf[MAX_NAME_LEN], nat_id_buf[MAX_ID_LEN], acc_type_buf[MAX_ACCOUNT_TYPE_LEN], acc_num_buf[50]; // Increased buffer for account number just in case
 
             if (fgets(name_buf, sizeof(name_buf), file) == NULL) { fprintf(stderr, "Error reading name for account %d. Stopping load.\n", i); break; }
             name_buf[strcspn(name_buf, "\n")] = 0;
-            strncpy(accounts[i].name, name_buf, MAX_NAME_LEN - 1);
-            accounts[i].name[MAX_NAME_LEN - 1] = '\0';
+            strncpy(acc->name, name_buf, MAX_NAME_LEN - 1);
+            acc->name[MAX_NAME_LEN - 1] = '\0';
 
             if (fgets(nat_id_buf, sizeof(nat_id_buf), file) == NULL) { fprintf(stderr, "Error reading national ID for account %d. Stopping load.\n", i); break; }
             nat_id_buf[strcspn(nat_id_buf, "\n")] = 0;
-            strncpy(accounts[i].national_id, nat_id_buf, MAX_ID_LEN - 1);
-            accounts[i].national_id[MAX_ID_LEN - 1] = '\0';
+            strncpy(acc->national_id, nat_id_buf, MAX_ID_LEN - 1);
+            acc->national_id[MAX_ID_LEN - 1] = '\0';
 
             if (fgets(acc_type_buf, sizeof(acc_type_buf), file) == NULL) { fprintf(stderr, "Error reading account type for account %d. Stopping load.\n", i); break; }
             acc_type_buf[strcspn(acc_type_buf, "\n")] = 0;
-            strncpy(accounts[i].account_type, acc_type_buf, MAX_ACCOUNT_TYPE_LEN - 1);
-            accounts[i].account_type[MAX_ACCOUNT_TYPE_LEN - 1] = '\0';
+            strncpy(acc->account_type, acc_type_buf, MAX_ACCOUNT_TYPE_LEN - 1);
+            acc->account_type[MAX_ACCOUNT_TYPE_LEN - 1] = '\0';
 
             if (fgets(acc_num_buf, sizeof(acc_num_buf), file) == NULL) { fprintf(stderr, "Error reading account number for account %d. Stopping load.\n", i); break; }
             acc_num_buf[strcspn(acc_num_buf, "\n")] = 0;
-            accounts[i].account_number = strdup(acc_num_buf);
-            if(accounts[i].account_number == NULL) {
-                perror("strdup failed for account number during load");
-                accounts[i].is_active = 0; // Mark as inactive if allocation fails
-                // Attempt to read separator line before breaking
-                 char separator_buf[10];
-                 fgets(separator_buf, sizeof(separator_buf), file);
-                break; // Stop loading
-            }
-
-            if (fscanf(file, "%d\n", &accounts[i].pin) != 1) { fprintf(stderr, "Error reading pin for account %d. Stopping load.\n", i); free(accounts[i].account_number); accounts[i].account_number = NULL; accounts[i].is_active = 0; break; }
-            if (fscanf(file, "%lf\n", &accounts[i].balance) != 1) { fprintf(stderr, "Error reading balance for account %d. Stopping load.\n", i); free(accounts[i].account_number); accounts[i].account_number = NULL; accounts[i].is_active = 0; break; }
-            if (fscanf(file, "%d\n", &accounts[i].statement.transaction_count) != 1) { fprintf(stderr, "Error reading transaction count for account %d. Stopping load.\n", i); free(accounts[i].account_number); accounts[i].account_number = NULL; accounts[i].is_active = 0; break; }
+            strncpy(acc->account_number, acc_num_buf, MAX_ACCOUNT_NUMBER_LEN - 1);
+            acc->account_number[MAX_ACCOUNT_NUMBER_LEN - 1] = '\0';
+
+            // A hash, or a PIN in the clear from an older file
+            char pin_buf[PIN_HASH_TEXT_LEN + 1];
+            int plain_pin;
+            char extra;
+            if (fgets(pin_buf, sizeof(pin_buf), file) == NULL) { fprintf(stderr, "Error reading pin for account %d. Stopping load.\n", i); acc->account_number[0] = '\0'; acc->is_active = 0; break; }
+            pin_buf[strcspn(pin_buf, "\n")] = 0;
+            if (sscanf(pin_buf, "%d%c", &plain_pin, &extra) == 1) {
+                pin_hash_set_plain(&acc->pin, plain_pin);
+            } else if (pin_hash_parse(pin_buf, &acc->pin) != 0) { fprintf(stderr, "Error reading pin for account %d. Stopping load.\n", i); acc->account_number[0] = '\0'; acc->is_active = 0; break; }
+            if (fscanf(file, "%lf\n", &acc->balance) != 1) { fprintf(stderr, "Error reading balance for account %d. Stopping load.\n", i); acc->account_number[0] = '\0'; acc->is_active = 0; break; }
+            int transaction_count;
+            if (fscanf(file, "%d\n", &transaction_count) != 1) { fprintf(stderr, "Error reading transaction count for account %d. Stopping load.\n", i); acc->account_number[0] = '\0'; acc->is_active = 0; break; }
 
             // Basic sanity check for transaction count
-            if (accounts[i].statement.transaction_count < 0 || accounts[i].statement.transaction_count > MAX_TRANSACTIONS) {
-                 fprintf(stderr, "Warning: Invalid transaction_count %d for account %s. Setting to 0.\n", accounts[i].statement.transaction_count, accounts[i].account_number);
-                 accounts[i].statement.transaction_count = 0;
+            if (transaction_count < 0 || transaction_count > MAX_TRANSACTIONS) {
+                 fprintf(stderr, "Warning: Invalid transaction_count %d for account %s. Setting to 0.\n", transaction_count, acc->account_number);
+                 transaction_count = 0;
             }
 
-            for (int j = 0; j < accounts[i].statement.transaction_count; j++) {
-                // Load only the amount as per bank.h Statement struct
-                if (fscanf(file, "%lf\n", &accounts[i].statement.transactions[j]) != 1) {
-                    fprintf(stderr, "Error reading transaction %d amount for account %s. Truncating transactions.\n", j+1, accounts[i].account_number);
-                    accounts[i].statement.transaction_count = j; // Truncate transactions
-                    // Attempt to read remaining transaction lines for this account to reach separator
-                    char dummy_buf[100];
-                    while(j < accounts[i].statement.transaction_count) {
-                         fgets(dummy_buf, sizeof(dummy_buf), file); // Read and discard
-                         j++;
-                    }
+            // The file keeps only the latest amounts; they become the
+            // start of the account's ledger
+            double amounts[MAX_TRANSACTIONS];
+            for (int j = 0; j < transaction_count; j++) {
+                if (fscanf(file, "%lf\n", &amounts[j]) != 1) {
+                    fprintf(stderr, "Error reading transaction %d amount for account %s. Truncating transactions.\n", j+1, acc->account_number);
+                    transaction_count = j; // Truncate transactions
                     break; // Stop reading transactions for this account
                 }
             }
+            queue_legacy_history(i, amounts, transaction_count);
         }
 
         // Read the separator line regardless of whether the account was active or not
@@ -455,17 +1629,567 @@ int load_accounts_from_file(const char* filename) {
                  fprintf(stderr, "Warning: File format error or premature EOF at account %d (expected separator).\n", i+1);
              }
              // Stop loading
-             account_count = i + 1; 
              break;
         }
          if (strncmp(separator_buf, "---", 3) != 0) {
              fprintf(stderr, "Warning: Missing or incorrect separator after account %d. File might be corrupt.\n", i+1);
              // Continue loading but be aware of potential issues
          }
-
-        account_count = i + 1;
     }
 
     fclose(file);
     return 0; 
 }
+
+// Fill in the strings of an account being loaded and mark it active.
+// The stored fields need not be NUL-terminated.
+static void load_identity(Account* acc, const char* name, const char* national_id,
+                          const char* account_type, const char* account_number) {
+    acc->is_active = 1;
+    memcpy(acc->name, name, MAX_NAME_LEN - 1);
+    memcpy(acc->national_id, national_id, MAX_ID_LEN - 1);
+    memcpy(acc->account_type, account_type, MAX_ACCOUNT_TYPE_LEN - 1);
+    memcpy(acc->account_number, account_number, MAX_ACCOUNT_NUMBER_LEN - 1);
+}
+
+// Body of load_snapshot(); caller holds table_lock.
+// The file is mapped and checked while its records are copied into the
+// store, so every byte is touched exactly once.
+static int load_snapshot_locked(const char* filename) {
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        perror("Error opening snapshot");
+        return 1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(SnapshotHeader)) {
+        fprintf(stderr, "Error: snapshot %s is truncated.\n", filename);
+        close(fd);
+        return 1;
+    }
+    const char* map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        perror("Error mapping snapshot");
+        return 1;
+    }
+    madvise((void*)map, st.st_size, MADV_SEQUENTIAL);
+
+    const SnapshotHeader* header = (const SnapshotHeader*)map;
+    const char* records = map + sizeof(SnapshotHeader);
+    size_t record_size = header->version == 1 ? sizeof(SnapshotRecordV1) :
+                         header->version == 2 ? sizeof(SnapshotRecordV2) : sizeof(SnapshotRecord);
+    int result = 1;
+    if (memcmp(header->magic, SNAPSHOT_MAGIC, sizeof(header->magic)) != 0 ||
+        header->version < 1 || header->version > SNAPSHOT_VERSION || header->record_size != record_size) {
+        fprintf(stderr, "Error: %s is not a version 1-%d snapshot.\n", filename, SNAPSHOT_VERSION);
+    } else if (header->record_count > MAX_ACCOUNTS ||
+               (uint64_t)st.st_size != sizeof(SnapshotHeader) + header->record_count * record_size) {
+        fprintf(stderr, "Error: snapshot %s is truncated.\n", filename);
+    } else if (store_reserve(&table->store, (int)header->record_count) != 0) {
+        fprintf(stderr, "Error allocating %d account slots.\n", (int)header->record_count);
+    } else {
+        uint32_t crc = crc32c(0, header, offsetof(SnapshotHeader, crc));
+        for (int i = 0; i < (int)header->record_count; i++) {
+            const char* record = records + (size_t)i * record_size;
+            crc = crc32c(crc, record, record_size);
+
+            Account* acc = slot_account(i);
+            memset(acc, 0, sizeof(*acc));
+            if (header->version == 1) {
+                const SnapshotRecordV1* old = (const SnapshotRecordV1*)record;
+                if (old->is_active) {
+                    load_identity(acc, old->name, old->national_id, old->account_type, old->account_number);
+                    acc->balance = old->balance;
+                    pin_hash_set_plain(&acc->pin, old->pin);
+                    queue_legacy_history(i, old->transactions, old->transaction_count);
+                }
+            } else if (header->version == 2) {
+                const SnapshotRecordV2* old = (const SnapshotRecordV2*)record;
+                if (old->is_active) {
+                    load_identity(acc, old->name, old->national_id, old->account_type, old->account_number);
+                    acc->balance = old->balance;
+                    pin_hash_set_plain(&acc->pin, old->pin);
+                    acc->ledger_serial = old->ledger_serial;
+                    acc->ledger_count = old->ledger_count;
+                }
+            } else {
+                const SnapshotRecord* current = (const SnapshotRecord*)record;
+                if (current->is_active) {
+                    load_identity(acc, current->name, current->national_id, current->account_type, current->account_number);
+                    acc->balance = current->balance;
+                    acc->pin = current->pin;
+                    acc->ledger_serial = current->ledger_serial;
+                    acc->ledger_count = current->ledger_count;
+                }
+            }
+        }
+
+        if (crc == header->crc) {
+            result = 0;
+        } else {
+            fprintf(stderr, "Error: snapshot %s fails its checksum.\n", filename);
+            clear_slots();
+        }
+    }
+
+    munmap((void*)map, st.st_size);
+    return result;
+}
+
+// ledger_rebuild() callbacks
+static int64_t ledger_owner_count(int slot, uint64_t serial, void* ctx) {
+    (void)ctx;
+    if (slot >= table->store.slot_count) {
+        return -1;
+    }
+    const Account* acc = slot_account(slot);
+    return acc->is_active && acc->ledger_serial == serial ? (int64_t)acc->ledger_count : -1;
+}
+
+static LedgerChain* ledger_chain_of(int slot, void* ctx) {
+    (void)ctx;
+    return slot_chain(slot);
+}
+
+// Link the loaded accounts to their history in the ledger file
+// Caller holds table_lock
+static void link_ledger(void) {
+    if (table->ledger.fd < 0) {
+        return;
+    }
+    for (int i = 0; i < table->store.slot_count; i++) {
+        *slot_chain(i) = (LedgerChain){ 0, 0 };
+    }
+    ledger_rebuild(&table->ledger, ledger_owner_count, ledger_chain_of, NULL);
+    table->ledger_linked = 1;
+}
+
+// Turn the queued legacy histories into ledger entries. Only the last
+// one queued for a slot counts; it becomes a new history (with a new
+// serial) replacing whatever the account had. Entry times are unknown
+// (0); the balances are worked back from the account's current balance.
+// Caller holds table_lock. Returns the number of histories imported.
+static int import_legacy_histories(void) {
+    int imported = 0;
+    int slot_count = table->store.slot_count;
+    unsigned char* seen = legacy_count > 0 ? calloc(slot_count / 8 + 1, 1) : NULL;
+    for (int k = legacy_count - 1; k >= 0 && seen != NULL; k--) {
+        const LegacyHistory* history = &legacy_histories[k];
+        if (history->slot >= slot_count || !slot_account(history->slot)->is_active ||
+            (seen[history->slot / 8] & (1 << (history->slot % 8)))) {
+            continue;
+        }
+        seen[history->slot / 8] |= 1 << (history->slot % 8);
+
+        Account* acc = slot_account(history->slot);
+        acc->ledger_serial = new_serial();
+        acc->ledger_count = 0;
+        *slot_chain(history->slot) = (LedgerChain){ 0, 0 };
+
+        double balance = acc->balance;
+        for (int j = 0; j < history->count; j++) {
+            balance -= history->amounts[j];
+        }
+        for (int j = 0; j < history->count; j++) {
+            double amount = history->amounts[j];
+            balance += amount;
+            LedgerEntry entry = { 0, to_hundredths(amount < 0 ? -amount : amount), to_hundredths(balance),
+                                  amount < 0 ? LEDGER_WITHDRAWAL : LEDGER_DEPOSIT, 0 };
+            append_entry(history->slot, &entry);
+        }
+        imported++;
+    }
+    if (legacy_count > 0 && seen == NULL) {
+        fprintf(stderr, "Warning: out of memory; older transaction history is not imported.\n");
+    }
+
+    free(seen);
+    free(legacy_histories);
+    legacy_histories = NULL;
+    legacy_count = legacy_capacity = 0;
+    return imported;
+}
+
+// Run a loader with the whole table locked, then rebuild the free lists
+// and indexes
+// A share of the slots whose plain PINs one thread hashes
+typedef struct {
+    pthread_t thread;
+    int first;
+    int stride;
+    int started;
+    int hashed;
+    int failed;
+} PinHasher;
+
+static void* pin_hasher_main(void* arg) {
+    PinHasher* hasher = arg;
+    for (int i = hasher->first; i < table->store.slot_count; i += hasher->stride) {
+        Account* acc = slot_account(i);
+        if (acc->is_active && acc->pin.iterations == 0) {
+            PinHash hash;
+            if (pin_hash_create(pin_hash_plain(&acc->pin), pin_iterations, &hash) == 0) {
+                acc->pin = hash;
+                hasher->hashed++;
+            } else {
+                hasher->failed++;
+            }
+        }
+    }
+    return NULL;
+}
+
+// Hash the PINs that an older file or log kept in the clear, spread over
+// a thread per CPU since each costs a full PIN hash. Until hashed, such a
+// PIN never verifies. Caller holds table_lock.
+// Returns the number hashed.
+static int hash_plain_pins(void) {
+    int pending = 0;
+    for (int i = 0; i < table->store.slot_count && pending == 0; i++) {
+        pending = slot_account(i)->is_active && slot_account(i)->pin.iterations == 0;
+    }
+    if (!pending) {
+        return 0;
+    }
+
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int thread_count = cpus < 1 ? 1 : cpus > 64 ? 64 : (int)cpus;
+    PinHasher hashers[64];
+    for (int i = 0; i < thread_count; i++) {
+        hashers[i] = (PinHasher){ .first = i, .stride = thread_count };
+        hashers[i].started = pthread_create(&hashers[i].thread, NULL, pin_hasher_main, &hashers[i]) == 0;
+    }
+    int hashed = 0, failed = 0;
+    for (int i = 0; i < thread_count; i++) {
+        if (hashers[i].started) {
+            pthread_join(hashers[i].thread, NULL);
+        } else {
+            pin_hasher_main(&hashers[i]); // Out of threads: do its share here
+        }
+        hashed += hashers[i].hashed;
+        failed += hashers[i].failed;
+    }
+    printf("Hashed the PINs of %d accounts kept in the clear.\n", hashed);
+    if (failed > 0) {
+        fprintf(stderr, "Error: could not hash the PINs of %d accounts; they cannot log in.\n", failed);
+    }
+    return hashed;
+}
+
+// PINs hashed while loading, for bank_open_log() to fold into a snapshot
+static int loaded_plain_pins = 0;
+
+static int load_table(int (*loader)(const char*), const char* filename) {
+    lock_table();
+    int result = loader(filename);
+    loaded_plain_pins += hash_plain_pins();
+    store_rebuild_free_list(&table->store);
+    index_rebuild(table->indexes, table->shard_count, &table->store);
+    refresh_columns();
+    if (table->ledger.fd >= 0) {
+        link_ledger();
+    } else {
+        // Nowhere to keep imported history
+        free(legacy_histories);
+        legacy_histories = NULL;
+        legacy_count = legacy_capacity = 0;
+    }
+    unlock_table();
+    return result;
+}
+
+// Load accounts data from file
+// Returns 0 on success, 1 on failure
+int load_accounts_from_file(const char* filename) {
+    return load_table(load_accounts_locked, filename);
+}
+
+// Load a binary snapshot written by save_snapshot()
+// Returns 0 on success, 1 on failure
+int load_snapshot(const char* filename) {
+    return load_table(load_snapshot_locked, filename);
+}
+
+static int replay_slot_active(int32_t slot) {
+    return slot >= 0 && slot < table->store.slot_count && slot_account(slot)->is_active;
+}
+
+// Redo an opening; caller holds table_lock
+static void replay_open(int32_t slot, const Account* account, const LedgerEntry* entry) {
+    if (slot < 0 || store_reserve(&table->store, slot + 1) != 0) {
+        return;
+    }
+    Account* acc = slot_account(slot);
+    if (!(acc->is_active && acc->ledger_serial == account->ledger_serial)) {
+        // A new account in the slot (not one the snapshot already has)
+        *slot_chain(slot) = (LedgerChain){ 0, 0 };
+    }
+    *acc = *account;
+    if (entry != NULL) {
+        ledger_append(&table->ledger, slot_chain(slot), slot, acc->ledger_serial, 0, entry);
+    }
+}
+
+// Redo one ledger entry and the state it left; caller holds table_lock
+static void replay_update(const UpdateRecord* record) {
+    if (!replay_slot_active(record->slot) || record->ledger_count == 0) {
+        return;
+    }
+    Account* acc = slot_account(record->slot);
+    acc->balance = record->balance;
+    acc->ledger_count = record->ledger_count;
+    ledger_append(&table->ledger, slot_chain(record->slot), record->slot, acc->ledger_serial,
+                  record->ledger_count - 1, &record->entry);
+}
+
+// Redo an opening logged before the ledger existed
+static void replay_legacy_open(const LegacyOpenRecord* record) {
+    const LegacyAccount* old = &record->account;
+    Account account;
+    memset(&account, 0, sizeof(account));
+    if (old->is_active) {
+        load_identity(&account, old->name, old->national_id, old->account_type, old->account_number);
+    }
+    account.balance = old->balance;
+    pin_hash_set_plain(&account.pin, old->pin);
+    replay_open(record->slot, &account, NULL);
+    queue_legacy_history(record->slot, old->statement.transactions, old->statement.transaction_count);
+}
+
+// Redo an opening logged while PINs were kept in the clear
+static void replay_plain_pin_open(const PlainPinOpenRecord* record) {
+    const PlainPinAccount* old = &record->account;
+    Account account;
+    memset(&account, 0, sizeof(account));
+    if (old->is_active) {
+        load_identity(&account, old->name, old->national_id, old->account_type, old->account_number);
+    }
+    account.balance = old->balance;
+    pin_hash_set_plain(&account.pin, old->pin);
+    account.ledger_serial = old->ledger_serial;
+    account.ledger_count = old->ledger_count;
+    account.is_active = old->is_active;
+    replay_open(record->slot, &account, &record->entry);
+}
+
+static void replay_legacy_update(const LegacyUpdateRecord* record) {
+    if (replay_slot_active(record->slot)) {
+        slot_account(record->slot)->balance = record->balance;
+        queue_legacy_history(record->slot, record->statement.transactions, record->statement.transaction_count);
+    }
+}
+
+// Redo one log record during bank_open_log(); caller holds table_lock.
+// Payloads are copied out since the log buffer is not aligned.
+static void apply_log_record(uint16_t type, const void* payload, size_t length, void* ctx) {
+    int* replayed = ctx;
+
+    if (type == LOG_OPEN && length == sizeof(OpenRecord)) {
+        OpenRecord record;
+        memcpy(&record, payload, sizeof(record));
+        replay_open(record.slot, &record.account, &record.entry);
+    } else if (type == LOG_UPDATE && length == sizeof(UpdateRecord)) {
+        UpdateRecord record;
+        memcpy(&record, payload, sizeof(record));
+        replay_update(&record);
+    } else if ((type == LOG_UPDATES || type == LOG_LEGACY_UPDATES) && length >= sizeof(int32_t)) {
+        int32_t count;
+        memcpy(&count, payload, sizeof(count));
+        size_t record_size = type == LOG_UPDATES ? sizeof(UpdateRecord) : sizeof(LegacyUpdateRecord);
+        if (count < 0 || length != sizeof(count) + count * record_size) {
+            fprintf(stderr, "Warning: skipping malformed log record (type %u, %zu bytes).\n", type, length);
+            return;
+        }
+        for (int32_t i = 0; i < count; i++) {
+            const char* item = (const char*)payload + sizeof(count) + i * record_size;
+            if (type == LOG_UPDATES) {
+                UpdateRecord record;
+                memcpy(&record, item, sizeof(record));
+                replay_update(&record);
+            } else {
+                LegacyUpdateRecord record;
+                memcpy(&record, item, sizeof(record));
+                replay_legacy_update(&record);
+            }
+        }
+    } else if (type == LOG_PLAIN_PIN_OPEN && length == sizeof(PlainPinOpenRecord)) {
+        PlainPinOpenRecord record;
+        memcpy(&record, payload, sizeof(record));
+        replay_plain_pin_open(&record);
+    } else if (type == LOG_LEGACY_OPEN && length == sizeof(LegacyOpenRecord)) {
+        LegacyOpenRecord record;
+        memcpy(&record, payload, sizeof(record));
+        replay_legacy_open(&record);
+    } else if (type == LOG_LEGACY_UPDATE && length == sizeof(LegacyUpdateRecord)) {
+        LegacyUpdateRecord record;
+        memcpy(&record, payload, sizeof(record));
+        replay_legacy_update(&record);
+    } else if (type == LOG_CLOSE && length == sizeof(CloseRecord)) {
+        CloseRecord record;
+        memcpy(&record, payload, sizeof(record));
+        if (record.slot >= 0 && record.slot < table->store.slot_count) {
+            slot_account(record.slot)->account_number[0] = '\0';
+            slot_account(record.slot)->is_active = 0;
+        }
+    } else {
+        fprintf(stderr, "Warning: skipping unknown log record (type %u, %zu bytes).\n", type, length);
+        return;
+    }
+    (*replayed)++;
+}
+
+// Open the ledger file (see bank.h)
+int bank_open_ledger(const char* filename) {
+    return ledger_open(&table->ledger, filename, table->store.shared);
+}
+
+// Replay the log onto the loaded snapshot and start logging (see bank.h)
+int bank_open_log(const char* snapshot_file, const char* log_file, WalPolicy policy, int interval_ms) {
+    int replayed = 0;
+    char old_log[WAL_MAX_PATH + 8];
+    snprintf(table->snapshot_file, sizeof(table->snapshot_file), "%s", snapshot_file);
+    snprintf(table->log_file, sizeof(table->log_file), "%s", log_file);
+    snprintf(old_log, sizeof(old_log), "%s.old", log_file);
+
+    // A checkpoint that did not finish leaves the log it rotated away from;
+    // its records come before those of the current log
+    lock_table();
+    if (!table->ledger_linked) {
+        link_ledger(); // Nothing was loaded
+    }
+    off_t old_intact = wal_replay(old_log, apply_log_record, &replayed);
+    off_t intact = wal_replay(log_file, apply_log_record, &replayed);
+    int imported = import_legacy_histories();
+    int hashed = hash_plain_pins() + loaded_plain_pins;
+    loaded_plain_pins = 0;
+    store_rebuild_free_list(&table->store);
+    index_rebuild(table->indexes, table->shard_count, &table->store);
+    refresh_columns();
+    unlock_table();
+
+    if (intact < 0 || old_intact < 0) {
+        perror("Error reading log");
+        return 1;
+    }
+    if (replayed > 0) {
+        printf("Replayed %d log records.\n", replayed);
+    }
+    if (imported > 0) {
+        printf("Imported the recent transactions of %d accounts into the ledger.\n", imported);
+    }
+
+    // Fold the replayed records into a fresh snapshot so the log can start
+    // empty; the entries they added must be on disk first. If that fails,
+    // keep the intact records and append after them.
+    off_t keep = intact;
+    if ((intact > 0 || old_intact > 0 || imported > 0 || hashed > 0) && ledger_sync(&table->ledger) == 0 &&
+        save_snapshot(snapshot_file) == 0) {
+        unlink(old_log);
+        keep = 0;
+    }
+
+    table->wal = wal_open(log_file, keep, table->store.shared, policy, interval_ms);
+    return table->wal == NULL ? 1 : 0;
+}
+
+static double elapsed_ms(const struct timespec* since) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - since->tv_sec) * 1e3 + (now.tv_nsec - since->tv_nsec) / 1e6;
+}
+
+// Write a checkpoint of the table as of the current end of the log, then
+// drop the log records it covers. Requests keep running throughout; the
+// only wait imposed on them is the moment the log is marked, which holds
+// table_lock and the log lock while the log buffer is flushed.
+// Returns 0 on success, 1 on failure
+static int run_checkpoint(void) {
+    char old_log[WAL_MAX_PATH + 8];
+    snprintf(old_log, sizeof(old_log), "%s.old", table->log_file);
+
+    // Normally the records up to the mark move to old_log, to be deleted
+    // with it. If a failed checkpoint left old_log behind, keep everything
+    // in the current log instead: replaying records the snapshot already
+    // covers is harmless.
+    int rotate = access(old_log, F_OK) != 0;
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    // table_lock pins slot_count to its value at the mark
+    robust_lock(&table->table_lock);
+    table->preimage_count = 0;
+    int result = wal_mark(table->wal, rotate ? old_log : NULL, &table->checkpoint_lsn);
+    int count = table->store.slot_count;
+    pthread_mutex_unlock(&table->table_lock);
+    double pause_ms = elapsed_ms(&start);
+    if (result != 0) {
+        return 1;
+    }
+
+    uint64_t lsn = table->checkpoint_lsn;
+    result = write_snapshot(table->snapshot_file, count, lsn);
+
+    // Stop taking pre-images, wait out writers still saving one, and give
+    // the pre-image pages back
+    __atomic_store_n(&table->checkpoint_lsn, 0, __ATOMIC_SEQ_CST);
+    while (__atomic_load_n(&table->preimage_writers, __ATOMIC_SEQ_CST) != 0) {
+        sched_yield();
+    }
+    int preimages = table->preimage_count;
+    if (preimages > 0) {
+        size_t page = (size_t)sysconf(_SC_PAGESIZE);
+        size_t bytes = (preimages * sizeof(Account) + page - 1) & ~(page - 1);
+        madvise(table->preimages, bytes, table->store.shared ? MADV_REMOVE : MADV_DONTNEED);
+    }
+
+    // History up to the mark is recorded only in the ledger once the log
+    // before the mark is gone
+    if (result != 0 || ledger_sync(&table->ledger) != 0) {
+        fprintf(stderr, "Checkpoint failed; the log is kept until the next one.\n");
+        return 1;
+    }
+    unlink(old_log);
+
+    printf("Checkpoint: %d slots up to log position %llu in %.1f ms "
+           "(requests paused %.3f ms, %d pre-images kept)\n",
+           count, (unsigned long long)lsn, elapsed_ms(&start), pause_ms, preimages);
+    fflush(stdout);
+    return 0;
+}
+
+static void* checkpoint_thread(void* arg) {
+    // Everything logged so far is in the snapshot bank_open_log() wrote
+    uint64_t covered = wal_position(table->wal);
+
+    while (1) {
+        sleep(table->checkpoint_interval);
+        uint64_t position = wal_position(table->wal);
+        if (position != covered) {
+            uint64_t traced = trace_begin();
+            if (run_checkpoint() == 0) {
+                covered = position;
+            }
+            trace_end(TRACE_CHECKPOINT, 0, traced);
+        }
+    }
+    return NULL;
+}
+
+// Start checkpointing in the background (see bank.h)
+int bank_start_checkpoints(int interval_seconds) {
+    if (table->wal == NULL || interval_seconds <= 0) {
+        return 1;
+    }
+    table->checkpoint_interval = interval_seconds;
+
+    pthread_t thread;
+    int err = pthread_create(&thread, NULL, checkpoint_thread, NULL);
+    if (err != 0) {
+        fprintf(stderr, "Error starting checkpoint thread: %s\n", strerror(err));
+        return 1;
+    }
+    pthread_detach(thread);
+    return 0;
+}
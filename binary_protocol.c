@@ -0,0 +1,151 @@
+#include <string.h>
+#include <endian.h>
+
+#include "bank.h"
+#include "binary_protocol.h"
+#include "rate_limit.h"
+
+#define MAX_BIN_AMOUNT 100000000000000LL // Hundredths, as in the text protocol
+
+// Write the decimal form of id into buffer (at least 21 bytes)
+static void format_account_id(uint64_t id, char* buffer) {
+    char digits[20];
+    int n = 0;
+    do {
+        digits[n++] = '0' + id % 10;
+        id /= 10;
+    } while (id != 0);
+    for (int i = 0; i < n; i++) {
+        buffer[i] = digits[n - 1 - i];
+    }
+    buffer[n] = '\0';
+}
+
+// Map a deposit()/withdraw() result to a status
+static uint8_t change_status(int result) {
+    switch (result) {
+    case 0: return BIN_OK;
+    case 1: return BIN_ERR_ACCOUNT;
+    case 3: return BIN_ERR_REFUSED;
+    default: return BIN_ERR_MULTIPLE;
+    }
+}
+
+// Take the token of a frame from the buckets of the client's address and
+// of its account, as the text protocol does
+// Returns 1 if within both rates, 0 if not.
+static int frame_within_rate(uint8_t opcode, const Session* session, const char* account_number) {
+    RateClass rate_class;
+    switch (opcode) {
+    case BIN_OP_BALANCE:
+    case BIN_OP_LOGIN:
+        rate_class = RATE_READ;
+        break;
+    case BIN_OP_DEPOSIT:
+    case BIN_OP_WITHDRAW:
+    case BIN_OP_CLOSE:
+        rate_class = RATE_WRITE;
+        break;
+    default:
+        return 1;
+    }
+    return !rate_limit_enabled(rate_class) ||
+           (rate_limit_allow(rate_class, rate_key_address(session->client), 1) &&
+            rate_limit_allow(rate_class, rate_key_account(account_number), 1));
+}
+
+int process_frame(const char* request, char* response, Session* session) {
+    BinFrame in, out;
+    memcpy(&in, request, sizeof(in));
+
+    memset(&out, 0, sizeof(out));
+    out.length = htole16(BIN_FRAME_SIZE);
+    out.opcode = in.opcode;
+    out.request_id = in.request_id; // Echoed as sent
+    out.account_id = in.account_id;
+
+    int close_after = 0;
+    if (le16toh(in.length) != BIN_FRAME_SIZE) {
+        // Frame boundaries are lost: nothing after this can be read
+        out.status = BIN_ERR_FRAME;
+        close_after = 1;
+    } else {
+        char account_number[21];
+        format_account_id(le64toh(in.account_id), account_number);
+        int pin = (int)le32toh(in.pin);
+        int64_t amount = (int64_t)le64toh((uint64_t)in.amount);
+        int money = in.opcode == BIN_OP_DEPOSIT || in.opcode == BIN_OP_WITHDRAW;
+        int account_op = money || in.opcode == BIN_OP_BALANCE || in.opcode == BIN_OP_CLOSE;
+        int bad_amount = money && (amount < 0 || amount > MAX_BIN_AMOUNT);
+
+        // The logged-in account is used without its PIN; any other is
+        // checked against the PIN of the frame
+        AccountHandle handle;
+        int logged_in = 0;
+        uint8_t auth = BIN_OK;
+        if (!frame_within_rate(in.opcode, session, account_number)) {
+            auth = BIN_ERR_RATE;
+        } else if (account_op && !bad_amount) {
+            switch (session_account(session, account_number, &handle)) {
+            case SESSION_ACCOUNT:
+                logged_in = 1;
+                break;
+            case SESSION_EXPIRED:
+                auth = BIN_ERR_SESSION;
+                break;
+            default:
+                auth = bank_login(account_number, pin, &handle) == 0 ? BIN_OK : BIN_ERR_ACCOUNT;
+                break;
+            }
+        }
+
+        if (bad_amount) {
+            out.status = BIN_ERR_AMOUNT;
+        } else if (auth != BIN_OK) {
+            out.status = auth;
+        } else {
+            switch (in.opcode) {
+            case BIN_OP_DEPOSIT:
+                out.status = change_status(deposit_as(&handle, amount / 100.0));
+                break;
+            case BIN_OP_WITHDRAW:
+                out.status = change_status(withdraw_as(&handle, amount / 100.0));
+                break;
+            case BIN_OP_BALANCE: {
+                double balance = check_balance_as(&handle);
+                if (balance >= 0.0) {
+                    out.amount = (int64_t)htole64((uint64_t)(int64_t)(balance * 100.0 + 0.5));
+                } else {
+                    out.status = BIN_ERR_ACCOUNT;
+                }
+                break;
+            }
+            case BIN_OP_CLOSE:
+                out.status = close_account_as(&handle) == 0 ? BIN_OK : BIN_ERR_ACCOUNT;
+                if (out.status == BIN_OK && logged_in) {
+                    session_logout(session);
+                }
+                break;
+            case BIN_OP_LOGIN:
+                if (bank_login(account_number, pin, &handle) == 0) {
+                    session_login(session, account_number, &handle);
+                } else {
+                    out.status = BIN_ERR_ACCOUNT;
+                }
+                break;
+            case BIN_OP_LOGOUT:
+                session_logout(session);
+                break;
+            case BIN_OP_QUIT:
+                close_after = 1;
+                break;
+            default:
+                out.status = BIN_ERR_OPCODE;
+                break;
+            }
+        }
+    }
+
+    memcpy(response, &out, sizeof(out));
+    return close_after;
+}
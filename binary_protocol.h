@@ -0,0 +1,71 @@
+#ifndef BINARY_PROTOCOL_H
+#define BINARY_PROTOCOL_H
+
+#include <stdint.h>
+#include "protocol.h"
+
+// Binary protocol for machine-to-machine clients. A connection whose first
+// byte is BIN_MAGIC speaks it for the rest of its life; any other first
+// byte selects the text protocol.
+//
+// After the magic byte, requests and responses are fixed-size BinFrames,
+// little-endian. Each response carries the request_id of its request.
+// Responses currently come back in request order, but clients should
+// match them by request_id: later versions may complete requests out of
+// order.
+//
+// OPEN and STATEMENT carry strings and stay text-only. Accounts are
+// addressed by their number as an integer, so only accounts whose number
+// is a plain decimal (as generated by the server) are reachable.
+//
+// LOGIN (account_id and pin) logs the connection in to an account, as
+// the text protocol's LOGIN does: frames for that account then skip the
+// PIN check and their pin field is ignored, until LOGOUT or another
+// LOGIN. Once the login expires they fail with BIN_ERR_SESSION.
+#define BIN_MAGIC 0xBA
+#define BIN_FRAME_SIZE 32
+
+typedef enum {
+    BIN_OP_DEPOSIT = 1,
+    BIN_OP_WITHDRAW = 2,
+    BIN_OP_BALANCE = 3,
+    BIN_OP_CLOSE = 4,
+    BIN_OP_QUIT = 5,
+    BIN_OP_LOGIN = 6,
+    BIN_OP_LOGOUT = 7
+} BinOpcode;
+
+// Status codes 1-9 match the codes of the text protocol's ERROR replies
+typedef enum {
+    BIN_OK = 0,
+    BIN_ERR_ACCOUNT = 1,  // Account not found or incorrect PIN
+    BIN_ERR_REFUSED = 3,  // Deposit below the minimum, or withdrawal past the balance floor
+    BIN_ERR_MULTIPLE = 4, // Withdrawal not a positive multiple of 500
+    BIN_ERR_SESSION = 8,  // The login to this account has expired
+    BIN_ERR_RATE = 9,     // Over the request rate of the client or account (see rate_limit.h)
+    BIN_ERR_AMOUNT = 16,  // Amount negative or too large
+    BIN_ERR_OPCODE = 17,  // Unknown opcode
+    BIN_ERR_FRAME = 18    // Bad length field; the connection is closed
+} BinStatus;
+
+typedef struct {
+    uint16_t length;     // BIN_FRAME_SIZE
+    uint8_t opcode;      // BinOpcode, echoed in the response
+    uint8_t status;      // BinStatus in responses, 0 in requests
+    uint32_t request_id; // Chosen by the client, echoed in the response
+    uint64_t account_id; // Account number
+    int64_t amount;      // In hundredths; BALANCE responses carry the balance
+    uint32_t pin;        // Requests only
+    uint32_t reserved;   // 0
+} BinFrame;
+
+_Static_assert(sizeof(BinFrame) == BIN_FRAME_SIZE, "BinFrame must have no padding");
+
+// Execute the request frame at `request` (BIN_FRAME_SIZE bytes, any
+// alignment) and write its response frame to `response`. session holds
+// the connection's login.
+// Returns 1 if the connection must be closed once the response is sent
+// (QUIT, or a frame that cannot be trusted), 0 otherwise.
+int process_frame(const char* request, char* response, Session* session);
+
+#endif
@@ -7,6 +7,7 @@
 #include <ctype.h> 
 
 //declare variables (serverIP, serverPort, buffer for sending/receiving data)
+//the address and port can be overridden: ./client [ip] [port]
 #define SERVER_IP "192.168.1.99" 
 #define PORT 8080 
 #define BUFFER_SIZE 1024 
@@ -27,7 +28,9 @@ void trim_whitespace(char *str) {
 }
 
 
-int main() {
+int main(int argc, char* argv[]) {
+    const char* server_ip = argc > 1 ? argv[1] : SERVER_IP;
+    int port = argc > 2 ? atoi(argv[2]) : PORT;
     int client_socket;
     struct sockaddr_in server_addr;
     char buffer[BUFFER_SIZE] = {0};
@@ -42,10 +45,10 @@ int main() {
 
     // Configure server address
     server_addr.sin_family = AF_INET;
-    server_addr.sin_port = htons(PORT);
+    server_addr.sin_port = htons(port);
 
     // Convert IP address from string to binary form
-    if (inet_pton(AF_INET, SERVER_IP, &server_addr.sin_addr) <= 0) {
+    if (inet_pton(AF_INET, server_ip, &server_addr.sin_addr) <= 0) {
         perror("Invalid address/Address not supported");
         close(client_socket);
         exit(EXIT_FAILURE);
@@ -58,7 +61,7 @@ int main() {
         exit(EXIT_FAILURE);
     }
 
-    printf("Connected to the banking server at %s:%d\n", SERVER_IP, PORT);
+    printf("Connected to the banking server at %s:%d\n", server_ip, port);
     printf("Available commands: OPEN, CLOSE, WITHDRAW, DEPOSIT, BALANCE, STATEMENT, QUIT\n");
 
     // Send requests and receive responses
@@ -95,16 +98,27 @@ int main() {
         // Clear the buffer for receiving
         memset(buffer, 0, BUFFER_SIZE);
 
-        // Receive the response from the server
-        bytes_received = read(client_socket, buffer, BUFFER_SIZE - 1);
-        if (bytes_received <= 0) {
+        // Receive the response from the server. A long STATEMENT arrives in
+        // several reads; every reply ends with ";\n".
+        int complete = 0;
+        char before_last = '\0'; // Last two bytes received so far
+        char last = '\0';
+        while (!complete) {
+            bytes_received = read(client_socket, buffer, BUFFER_SIZE - 1);
+            if (bytes_received <= 0) {
+                break;
+            }
+            // print response
+            buffer[bytes_received] = '\0';
+            printf("%s", buffer);
+            before_last = bytes_received >= 2 ? buffer[bytes_received - 2] : last;
+            last = buffer[bytes_received - 1];
+            complete = before_last == ';' && last == '\n';
+        }
+        if (!complete) {
             printf("Server disconnected.\n");
             break; 
         }
-
-        // print response
-        buffer[bytes_received] = '\0';
-        printf("%s", buffer);
     }
 
     // Close the client socket
@@ -0,0 +1,127 @@
+#include <string.h>
+
+#include "column_scan.h"
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+void scan_totals_init(ScanTotals* totals) {
+    memset(totals, 0, sizeof(*totals));
+    totals->min = INT64_MAX;
+    totals->max = INT64_MIN;
+}
+
+// Portable path: one slot at a time
+static void scan_scalar(const int64_t* balance, const uint8_t* active, const uint8_t* type, size_t count,
+                        const int64_t* thresholds, int type_count, ScanTotals* totals) {
+    for (size_t i = 0; i < count; i++) {
+        if (!active[i]) {
+            continue;
+        }
+        int64_t b = balance[i];
+        totals->accounts++;
+        totals->total += b;
+        totals->min = b < totals->min ? b : totals->min;
+        totals->max = b > totals->max ? b : totals->max;
+        if (type[i] < type_count) {
+            totals->per_type[type[i]]++;
+        }
+        for (int k = 0; k < SCAN_THRESHOLDS; k++) {
+            totals->at_least[k] += b >= thresholds[k];
+        }
+    }
+}
+
+#if defined(__x86_64__)
+// 32 slots per step: their active and type bytes fill one register each,
+// their balances four. Inactive slots are masked out of every sum, so a
+// slot closed mid-scan is counted consistently one way or the other.
+// Counters are per lane and only added up at the end.
+__attribute__((target("avx2")))
+static size_t scan_avx2(const int64_t* balance, const uint8_t* active, const uint8_t* type, size_t count,
+                        const int64_t* thresholds, int type_count, ScanTotals* totals) {
+    const __m256i zero = _mm256_setzero_si256();
+    __m256i sum = zero;
+    __m256i min = _mm256_set1_epi64x(INT64_MAX);
+    __m256i max = _mm256_set1_epi64x(INT64_MIN);
+    __m256i below[SCAN_THRESHOLDS]; // Compared with >, hence threshold - 1
+    __m256i at_least[SCAN_THRESHOLDS];
+    for (int k = 0; k < SCAN_THRESHOLDS; k++) {
+        below[k] = _mm256_set1_epi64x(thresholds[k] - 1);
+        at_least[k] = zero;
+    }
+    uint64_t accounts = 0;
+    uint64_t per_type[SCAN_TYPES] = { 0 };
+
+    size_t i = 0;
+    for (; i + 32 <= count; i += 32) {
+        __m256i on = _mm256_cmpgt_epi8(_mm256_loadu_si256((const __m256i*)(active + i)), zero);
+        unsigned int on_bits = (unsigned int)_mm256_movemask_epi8(on);
+        if (on_bits == 0) {
+            continue; // A run of closed or never used slots
+        }
+        accounts += __builtin_popcount(on_bits);
+
+        __m256i types = _mm256_loadu_si256((const __m256i*)(type + i));
+        for (int t = 0; t < type_count; t++) {
+            __m256i match = _mm256_cmpeq_epi8(types, _mm256_set1_epi8((char)t));
+            per_type[t] += __builtin_popcount((unsigned int)_mm256_movemask_epi8(match) & on_bits);
+        }
+
+        // Widen the same flags for the balances, rather than reading them
+        // again, so every count agrees on which slots were active
+        uint8_t on_bytes[32];
+        _mm256_storeu_si256((__m256i*)on_bytes, on);
+        for (int j = 0; j < 32; j += 4) {
+            int32_t flags;
+            memcpy(&flags, on_bytes + j, sizeof(flags));
+            __m256i mask = _mm256_cvtepi8_epi64(_mm_cvtsi32_si128(flags));
+            __m256i b = _mm256_loadu_si256((const __m256i*)(balance + i + j));
+
+            sum = _mm256_add_epi64(sum, _mm256_and_si256(b, mask));
+            min = _mm256_blendv_epi8(min, b, _mm256_and_si256(mask, _mm256_cmpgt_epi64(min, b)));
+            max = _mm256_blendv_epi8(max, b, _mm256_and_si256(mask, _mm256_cmpgt_epi64(b, max)));
+            for (int k = 0; k < SCAN_THRESHOLDS; k++) {
+                // Matching lanes are all ones, -1
+                at_least[k] = _mm256_sub_epi64(at_least[k], _mm256_and_si256(mask, _mm256_cmpgt_epi64(b, below[k])));
+            }
+        }
+    }
+
+    int64_t lanes[4];
+    _mm256_storeu_si256((__m256i*)lanes, sum);
+    totals->total += lanes[0] + lanes[1] + lanes[2] + lanes[3];
+    _mm256_storeu_si256((__m256i*)lanes, min);
+    for (int l = 0; l < 4; l++) {
+        totals->min = lanes[l] < totals->min ? lanes[l] : totals->min;
+    }
+    _mm256_storeu_si256((__m256i*)lanes, max);
+    for (int l = 0; l < 4; l++) {
+        totals->max = lanes[l] > totals->max ? lanes[l] : totals->max;
+    }
+    for (int k = 0; k < SCAN_THRESHOLDS; k++) {
+        _mm256_storeu_si256((__m256i*)lanes, at_least[k]);
+        totals->at_least[k] += lanes[0] + lanes[1] + lanes[2] + lanes[3];
+    }
+    totals->accounts += accounts;
+    for (int t = 0; t < type_count; t++) {
+        totals->per_type[t] += per_type[t];
+    }
+    return i; // Slots done; the caller finishes the rest
+}
+#endif
+
+void scan_columns(const int64_t* balance, const uint8_t* active, const uint8_t* type, size_t count,
+                  const int64_t thresholds[SCAN_THRESHOLDS], int type_count, ScanTotals* totals) {
+    size_t done = 0;
+    if (type_count > SCAN_TYPES) {
+        type_count = SCAN_TYPES;
+    }
+#if defined(__x86_64__)
+    if (__builtin_cpu_supports("avx2")) {
+        done = scan_avx2(balance, active, type, count, thresholds, type_count, totals);
+    }
+#endif
+    scan_scalar(balance + done, active + done, type + done, count - done, thresholds, type_count, totals);
+}
@@ -0,0 +1,29 @@
+#ifndef COLUMN_SCAN_H
+#define COLUMN_SCAN_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define SCAN_TYPES 32      // Type codes counted, 0 to SCAN_TYPES - 1
+#define SCAN_THRESHOLDS 7  // Balance thresholds of the histogram
+
+// Aggregates of the active slots of one or more column ranges
+typedef struct {
+    uint64_t accounts;                   // Active slots
+    int64_t total;                       // Sum of their balances
+    int64_t min;                         // INT64_MAX if no slot was active
+    int64_t max;                         // INT64_MIN if no slot was active
+    uint64_t per_type[SCAN_TYPES];       // Active slots by type code
+    uint64_t at_least[SCAN_THRESHOLDS];  // Active slots with balance >= thresholds[k]
+} ScanTotals;
+
+void scan_totals_init(ScanTotals* totals);
+
+// Add slots [0, count) of the balance/active/type columns to totals.
+// Slots are active where active[] is non-zero; only type codes below
+// type_count are counted. Uses AVX2 when the CPU has it: 32 slots per
+// step, with no branch on the data.
+void scan_columns(const int64_t* balance, const uint8_t* active, const uint8_t* type, size_t count,
+                  const int64_t thresholds[SCAN_THRESHOLDS], int type_count, ScanTotals* totals);
+
+#endif
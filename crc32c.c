@@ -0,0 +1,54 @@
+#include "crc32c.h"
+
+// Portable path: one table lookup per byte
+static uint32_t crc_table[256];
+static int crc_table_ready = 0;
+
+static void crc_init(void) {
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t c = i;
+        for (int k = 0; k < 8; k++) {
+            c = (c & 1) ? 0x82F63B78u ^ (c >> 1) : c >> 1;
+        }
+        crc_table[i] = c;
+    }
+    __atomic_store_n(&crc_table_ready, 1, __ATOMIC_RELEASE);
+}
+
+static uint32_t crc32c_table(uint32_t crc, const unsigned char* p, size_t length) {
+    if (!__atomic_load_n(&crc_table_ready, __ATOMIC_ACQUIRE)) {
+        crc_init(); // Idempotent, so racing initializers are harmless
+    }
+    while (length--) {
+        crc = crc_table[(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+    }
+    return crc;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_sse42(uint32_t crc, const unsigned char* p, size_t length) {
+    uint64_t c = crc;
+    while (length >= 8) {
+        uint64_t word;
+        __builtin_memcpy(&word, p, 8);
+        c = __builtin_ia32_crc32di(c, word);
+        p += 8;
+        length -= 8;
+    }
+    while (length--) {
+        c = __builtin_ia32_crc32qi((uint32_t)c, *p++);
+    }
+    return (uint32_t)c;
+}
+#endif
+
+uint32_t crc32c(uint32_t crc, const void* data, size_t length) {
+    crc = ~crc;
+#if defined(__x86_64__)
+    if (__builtin_cpu_supports("sse4.2")) {
+        return ~crc32c_sse42(crc, data, length);
+    }
+#endif
+    return ~crc32c_table(crc, data, length);
+}
@@ -0,0 +1,287 @@
+#define _GNU_SOURCE // accept4()
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+
+#include "event_loop.h"
+#include "framing.h"
+#include "admission.h"
+#include "timer_wheel.h"
+#include "metrics.h"
+#include "trace.h"
+
+// Per-connection state machine:
+//   READING -> (requests executed) -> responses flushed? -> READING
+//                                  -> socket full        -> WRITING
+//   WRITING -> (EPOLLOUT, responses flushed)             -> READING
+// Every complete request in a read is executed and all their responses go
+// out in one send(). A QUIT closes the connection as soon as its response
+// has been flushed.
+//
+// Each connection has one timer on the loop's timer wheel for its idle or
+// request deadline (see connection_deadline()). Activity only records the
+// new deadline; the timer is moved when it fires early or when the
+// deadline comes forward, so a busy connection costs no timer work per
+// request.
+typedef enum {
+    CONN_READING, // Waiting for more requests (EPOLLIN)
+    CONN_WRITING  // Responses partially sent, waiting for EPOLLOUT
+} ConnectionState;
+
+// One loop per thread; loops share nothing but the account table
+typedef struct {
+    int epoll_fd;
+    int listen_socket;
+    TimerWheel timers;
+} EventLoop;
+
+typedef struct {
+    Timer timer; // First, so an expired timer is its connection
+    EventLoop* loop;
+    int fd;
+    ConnectionState state;
+    int busy;            // Holding part of a request or unsent replies...
+    uint64_t busy_since; // ...without progress since this tick
+    uint64_t deadline;   // Tick to time out at, 0 for none
+    int progressed;      // A request was executed since the last update_deadline()
+    RequestStream stream; // Buffered requests and their responses
+} Connection;
+
+static void close_connection(Connection* conn) {
+    // Closing the descriptor also removes it from the epoll set
+    wheel_remove(&conn->loop->timers, &conn->timer);
+    close(conn->fd);
+    free(conn);
+    admission_leave();
+    metrics_closed();
+    metrics_syscalls(1);
+}
+
+// Work out the connection's deadline after an event, moving its timer
+// only if the deadline came forward
+static void update_deadline(Connection* conn) {
+    TimerWheel* timers = &conn->loop->timers;
+    uint64_t now = timeout_now(); // The wheel only catches up after the events
+    int busy = stream_busy(&conn->stream);
+    if (busy && (!conn->busy || conn->progressed)) {
+        conn->busy_since = now;
+    }
+    conn->busy = busy;
+    conn->progressed = 0;
+    conn->deadline = connection_deadline(now, busy, conn->busy_since);
+
+    if (conn->deadline == 0) {
+        wheel_remove(timers, &conn->timer);
+    } else if (!timer_armed(&conn->timer) || conn->deadline < conn->timer.expires) {
+        wheel_remove(timers, &conn->timer);
+        wheel_add(timers, &conn->timer, conn->deadline);
+    }
+}
+
+// Timer callback: close the connection if its deadline has come, else
+// re-arm for the deadline it has moved to
+static void on_timer(Timer* timer, void* arg) {
+    Connection* conn = (Connection*)timer;
+    TimerWheel* timers = arg;
+    if (conn->deadline > timers->now) {
+        wheel_add(timers, timer, conn->deadline);
+        return;
+    }
+    metrics_timed_out(conn->busy ? TIMEOUT_REQUEST : TIMEOUT_IDLE);
+    close_connection(conn);
+}
+
+static int watch_connection(Connection* conn, int op, unsigned int events) {
+    struct epoll_event ev;
+    ev.events = events;
+    ev.data.ptr = conn;
+    metrics_syscalls(1);
+    if (epoll_ctl(conn->loop->epoll_fd, op, conn->fd, &ev) < 0) {
+        perror("epoll_ctl");
+        return 1;
+    }
+    return 0;
+}
+
+// Send as much of the pending responses as the socket accepts. Requests
+// held back for lack of output room are executed as room frees up.
+// Returns 0 if the connection stays open, 1 if it was closed.
+static int flush_connection(Connection* conn) {
+    RequestStream* stream = &conn->stream;
+    while (stream_unsent(stream) > 0) {
+        uint64_t traced = trace_begin();
+        ssize_t sent = send(conn->fd, stream->output + stream->output_sent,
+                            stream_unsent(stream), MSG_NOSIGNAL);
+        trace_end(TRACE_SEND, 0, traced);
+        metrics_syscalls(1);
+        if (sent < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                // Socket buffer full: wait until the client drains it
+                if (conn->state != CONN_WRITING) {
+                    conn->state = CONN_WRITING;
+                    if (watch_connection(conn, EPOLL_CTL_MOD, EPOLLOUT) != 0) {
+                        close_connection(conn);
+                        return 1;
+                    }
+                }
+                return 0;
+            }
+            close_connection(conn);
+            return 1;
+        }
+        stream_sent(stream, (size_t)sent);
+        conn->progressed = 1; // Replies being read count as progress
+        if (stream_unsent(stream) == 0) {
+            stream_process(stream);
+        }
+    }
+
+    if (stream->session.quit) {
+        close_connection(conn);
+        return 1;
+    }
+
+    if (conn->state == CONN_WRITING) {
+        conn->state = CONN_READING;
+        if (watch_connection(conn, EPOLL_CTL_MOD, EPOLLIN) != 0) {
+            close_connection(conn);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Read what has arrived, execute every complete request in it and start
+// sending the responses
+// Returns 0 if the connection stays open, 1 if it was closed.
+static int on_readable(Connection* conn) {
+    size_t room;
+    char* buffer = stream_read_buffer(&conn->stream, &room);
+    ssize_t bytes_read = read(conn->fd, buffer, room);
+    metrics_syscalls(1);
+
+    if (bytes_read < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+        return 0; // Spurious wakeup, wait for the next event
+    }
+    if (bytes_read <= 0) {
+        close_connection(conn); // Connection closed or error
+        return 1;
+    }
+
+    stream_received(&conn->stream, (size_t)bytes_read);
+    if (stream_process(&conn->stream) > 0) {
+        conn->progressed = 1;
+    }
+    return flush_connection(conn);
+}
+
+// Accept every pending connection on the (non-blocking) listening socket
+static void accept_connections(EventLoop* loop) {
+    while (1) {
+        struct sockaddr_in client_addr;
+        socklen_t addr_size = sizeof(client_addr);
+        int client_socket = accept4(loop->listen_socket, (struct sockaddr*)&client_addr, &addr_size,
+                                    SOCK_NONBLOCK | SOCK_CLOEXEC);
+        metrics_syscalls(1);
+        if (client_socket < 0) {
+            if (errno == EINTR) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                perror("Error in accepting connection");
+            }
+            return;
+        }
+
+        if (!admission_enter(client_socket, client_addr.sin_addr.s_addr)) {
+            continue; // Over the connection cap or rate; already answered and closed
+        }
+        printf("Accepted connection from %s:%d\n", inet_ntoa(client_addr.sin_addr), ntohs(client_addr.sin_port));
+        metrics_accepted();
+
+        Connection* conn = malloc(sizeof(Connection));
+        if (conn == NULL) {
+            perror("Failed to allocate connection");
+            close(client_socket);
+            admission_leave();
+            metrics_closed();
+            continue;
+        }
+        timer_init(&conn->timer);
+        conn->loop = loop;
+        conn->fd = client_socket;
+        conn->state = CONN_READING;
+        conn->busy = 0;
+        conn->progressed = 0;
+        stream_init(&conn->stream, client_addr.sin_addr.s_addr);
+
+        if (watch_connection(conn, EPOLL_CTL_ADD, EPOLLIN) != 0) {
+            close_connection(conn);
+            continue;
+        }
+        update_deadline(conn);
+    }
+}
+
+int run_event_loop(int listen_socket) {
+    struct epoll_event events[MAX_EVENTS];
+    EventLoop loop;
+
+    loop.listen_socket = listen_socket;
+    wheel_init(&loop.timers, timeout_now());
+    loop.epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (loop.epoll_fd < 0) {
+        perror("epoll_create1");
+        return 1;
+    }
+
+    // The listening socket is registered with a NULL pointer to tell it
+    // apart from client connections
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL;
+    if (epoll_ctl(loop.epoll_fd, EPOLL_CTL_ADD, listen_socket, &ev) < 0) {
+        perror("epoll_ctl");
+        close(loop.epoll_fd);
+        return 1;
+    }
+
+    while (1) {
+        // Sleep no longer than the timer wheel allows
+        int64_t ticks = wheel_next(&loop.timers);
+        int ready = epoll_wait(loop.epoll_fd, events, MAX_EVENTS, ticks < 0 ? -1 : (int)ticks * TIMEOUT_TICK_MS);
+        metrics_syscalls(1);
+        if (ready < 0) {
+            if (errno == EINTR) continue;
+            perror("epoll_wait");
+            close(loop.epoll_fd);
+            return 1;
+        }
+
+        for (int i = 0; i < ready; i++) {
+            Connection* conn = events[i].data.ptr;
+            if (conn == NULL) {
+                accept_connections(&loop);
+                continue;
+            }
+
+            int closed = 0;
+            if (conn->state == CONN_WRITING) {
+                if (events[i].events & (EPOLLOUT | EPOLLERR | EPOLLHUP)) {
+                    closed = flush_connection(conn);
+                }
+            } else if (events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP)) {
+                closed = on_readable(conn);
+            }
+            if (!closed) {
+                update_deadline(conn);
+            }
+        }
+
+        wheel_advance(&loop.timers, timeout_now(), on_timer, &loop.timers);
+    }
+}
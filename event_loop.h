@@ -0,0 +1,13 @@
+#ifndef EVENT_LOOP_H
+#define EVENT_LOOP_H
+
+#define MAX_EVENTS 256 // Readiness events fetched per epoll_wait() call
+
+// Run a non-blocking epoll loop on an already listening socket.
+// Every connection is a small state machine driven by readiness events;
+// all of them share the in-memory account table. Safe to run one loop per
+// thread, each on its own listening socket.
+// Returns only on a fatal error (1).
+int run_event_loop(int listen_socket);
+
+#endif
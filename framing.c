@@ -0,0 +1,198 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "framing.h"
+#include "bank.h"
+#include "metrics.h"
+#include "trace.h"
+
+void stream_init(RequestStream* stream, uint32_t client) {
+    stream->protocol = STREAM_UNDECIDED;
+    stream->input_start = 0;
+    stream->input_len = 0;
+    stream->discarding = 0;
+    session_init(&stream->session, client);
+    stream->output_len = 0;
+    stream->output_sent = 0;
+    stream->pending_count = 0;
+}
+
+char* stream_read_buffer(RequestStream* stream, size_t* room) {
+    // Move the unexecuted tail to the front to make room behind it
+    if (stream->input_start > 0) {
+        memmove(stream->input, stream->input + stream->input_start, stream->input_len - stream->input_start);
+        stream->input_len -= stream->input_start;
+        stream->input_start = 0;
+    }
+    *room = INPUT_BUFFER_SIZE - stream->input_len;
+    return stream->input + stream->input_len;
+}
+
+void stream_received(RequestStream* stream, size_t length) {
+    stream->input_len += length;
+
+    if (stream->protocol == STREAM_UNDECIDED && stream->input_len > 0) {
+        if ((unsigned char)stream->input[0] == BIN_MAGIC) {
+            stream->protocol = STREAM_BINARY;
+            stream->input_start = 1; // The magic byte is not part of a frame
+        } else {
+            stream->protocol = STREAM_TEXT;
+        }
+    }
+    if (stream->protocol == STREAM_BINARY) {
+        return; // Frames are fixed-size, so never over-long
+    }
+
+    // A full buffer without a complete request can never complete: answer
+    // with an error and drop input up to the end of that request
+    if (stream->input_start == 0 && stream->input_len == INPUT_BUFFER_SIZE &&
+        memchr(stream->input, ';', stream->input_len) == NULL &&
+        memchr(stream->input, '\n', stream->input_len) == NULL) {
+        if (!stream->discarding && OUTPUT_BUFFER_SIZE - stream->output_len >= RESPONSE_SIZE) {
+            stream->output_len += snprintf(stream->output + stream->output_len, RESPONSE_SIZE,
+                                           "ERROR Request too long.;\n");
+        }
+        stream->discarding = 1;
+        stream->input_len = 0;
+    }
+}
+
+// Note a reply just appended to output: count it if it is an error (error
+// is its code, 0 if it has none, -1 if it is not one) and hold the start
+// time of its request until the output is sent. A streamed STATEMENT is
+// timed to the send of its first part.
+static void track_reply(RequestStream* stream, Command command, int error, uint64_t start) {
+    if (error >= 0) {
+        metrics_error(error < METRICS_ERROR_CODES ? error : 0); // Binary statuses past 9 have no text code
+    }
+    if (stream->pending_count == MAX_PENDING_REPLIES) {
+        metrics_request(command, metrics_now() - start); // Cannot happen; time it as executed
+        return;
+    }
+    stream->pending_command[stream->pending_count] = (unsigned char)command;
+    stream->pending_start[stream->pending_count] = start;
+    stream->pending_count++;
+}
+
+// Execute the request in input[start, end) and append its response
+static void execute(RequestStream* stream, size_t start, size_t end) {
+    uint64_t began = metrics_now();
+    uint64_t traced = trace_begin();
+    char* reply = stream->output + stream->output_len;
+    size_t len = process_request(stream->input + start, end - start, reply, RESPONSE_SIZE, &stream->session);
+    stream->output_len += len;
+    trace_end(TRACE_REQUEST, stream->session.command, traced);
+
+    // "ERROR n message" or "ERROR message"
+    int error = -1;
+    if (len >= 5 && memcmp(reply, "ERROR", 5) == 0) {
+        error = len >= 8 && reply[6] >= '1' && reply[6] <= '9' && reply[7] == ' ' ? reply[6] - '0' : 0;
+    }
+    track_reply(stream, stream->session.command, error, began);
+}
+
+// Command of a binary opcode, for the metrics
+static Command frame_command(unsigned char opcode) {
+    switch (opcode) {
+    case BIN_OP_DEPOSIT: return CMD_DEPOSIT;
+    case BIN_OP_WITHDRAW: return CMD_WITHDRAW;
+    case BIN_OP_BALANCE: return CMD_BALANCE;
+    case BIN_OP_CLOSE: return CMD_CLOSE;
+    case BIN_OP_QUIT: return CMD_QUIT;
+    case BIN_OP_LOGIN: return CMD_LOGIN;
+    case BIN_OP_LOGOUT: return CMD_LOGOUT;
+    default: return CMD_UNKNOWN;
+    }
+}
+
+// Execute the complete frames of a binary stream
+static int process_frames(RequestStream* stream) {
+    int executed = 0;
+    while (!stream->session.quit && stream->input_len - stream->input_start >= BIN_FRAME_SIZE &&
+           OUTPUT_BUFFER_SIZE - stream->output_len >= BIN_FRAME_SIZE) {
+        uint64_t began = metrics_now();
+        uint64_t traced = trace_begin();
+        const char* request = stream->input + stream->input_start;
+        char* response = stream->output + stream->output_len;
+        stream->session.quit = process_frame(request, response, &stream->session);
+        BinFrame reply;
+        memcpy(&reply, response, sizeof(reply));
+        trace_end(TRACE_REQUEST, frame_command(reply.opcode), traced);
+        track_reply(stream, frame_command(reply.opcode), reply.status != BIN_OK ? reply.status : -1, began);
+        stream->input_start += BIN_FRAME_SIZE;
+        stream->output_len += BIN_FRAME_SIZE;
+        executed++;
+    }
+    return executed;
+}
+
+int stream_process(RequestStream* stream) {
+    int executed = 0;
+
+    // Responses leave together, so their changes can be made durable
+    // together: one log sync for the whole pipeline
+    bank_begin_commit_group();
+
+    if (stream->protocol == STREAM_BINARY) {
+        executed = process_frames(stream);
+    }
+
+    while (stream->protocol == STREAM_TEXT && !stream->session.quit && OUTPUT_BUFFER_SIZE - stream->output_len >= RESPONSE_SIZE) {
+        if (stream->session.streaming) {
+            // The reply in progress goes out before the next one starts
+            stream->output_len += continue_reply(&stream->session, stream->output + stream->output_len, RESPONSE_SIZE);
+            executed++;
+            continue;
+        }
+
+        size_t start = stream->input_start;
+        size_t end = start;
+        while (end < stream->input_len && stream->input[end] != ';' && stream->input[end] != '\n') {
+            end++;
+        }
+        if (end == stream->input_len) {
+            break; // Incomplete: wait for more input
+        }
+
+        int terminated = stream->input[end] == ';';
+        stream->input_start = end + 1;
+        if (stream->discarding) {
+            stream->discarding = 0; // End of the over-long request
+            continue;
+        }
+
+        if (terminated) {
+            execute(stream, start, end + 1);
+            executed++;
+        } else {
+            // A line without ';': blank lines between requests are
+            // skipped, anything else is answered with the format error
+            size_t i = start;
+            while (i < end && (stream->input[i] == ' ' || stream->input[i] == '\t' || stream->input[i] == '\r')) {
+                i++;
+            }
+            if (i < end) {
+                execute(stream, start, end);
+                executed++;
+            }
+        }
+    }
+
+    bank_end_commit_group();
+    return executed;
+}
+
+void stream_sent(RequestStream* stream, size_t n) {
+    stream->output_sent += n;
+    if (stream->output_sent == stream->output_len) {
+        stream->output_len = 0;
+        stream->output_sent = 0;
+        if (stream->pending_count > 0) {
+            uint64_t now = metrics_now();
+            for (int i = 0; i < stream->pending_count; i++) {
+                metrics_request(stream->pending_command[i], now - stream->pending_start[i]);
+            }
+            stream->pending_count = 0;
+        }
+    }
+}
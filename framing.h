@@ -0,0 +1,75 @@
+#ifndef FRAMING_H
+#define FRAMING_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "protocol.h"
+#include "binary_protocol.h"
+
+#define INPUT_BUFFER_SIZE (16 * 1024)  // Room for a few hundred pipelined requests
+#define OUTPUT_BUFFER_SIZE (16 * 1024) // Responses coalesced into one send()
+#define MAX_PENDING_REPLIES (OUTPUT_BUFFER_SIZE / 16) // Replies are all longer than 16 bytes
+
+// Per-connection request stream. Bytes read from the socket are appended
+// to `input` whatever their boundaries; every complete ';'-terminated
+// request in it is executed in order and its response appended to
+// `output`, so a client can pipeline many requests per round trip and a
+// request split over several reads is put back together.
+//
+// A newline ends a request that lacks its ';' (it is answered with the
+// usual error), so an interactive client is never left waiting.
+//
+// A reply longer than RESPONSE_SIZE (a long STATEMENT) is produced a part
+// at a time as output room frees up; requests behind it wait.
+//
+// The first byte received picks the protocol: BIN_MAGIC switches the
+// stream to fixed-size binary frames (see binary_protocol.h), anything
+// else is text.
+typedef enum {
+    STREAM_UNDECIDED, // Nothing received yet
+    STREAM_TEXT,
+    STREAM_BINARY
+} StreamProtocol;
+
+typedef struct {
+    StreamProtocol protocol;
+    char input[INPUT_BUFFER_SIZE];
+    size_t input_start;  // First byte not yet executed
+    size_t input_len;    // End of buffered input
+    int discarding;      // Dropping the rest of an over-long request
+    Session session;     // session.quit: QUIT answered (or a bad frame), nothing after it is executed
+    char output[OUTPUT_BUFFER_SIZE];
+    size_t output_len;
+    size_t output_sent;
+    // The requests whose replies are in output, for the latency metrics:
+    // their commands and when each began to be parsed. They are timed
+    // when the output has all been sent.
+    int pending_count;
+    unsigned char pending_command[MAX_PENDING_REPLIES];
+    uint64_t pending_start[MAX_PENDING_REPLIES];
+} RequestStream;
+
+// client: the peer's IPv4 address (network order), for rate limits
+void stream_init(RequestStream* stream, uint32_t client);
+
+// Where to read more input, and how many bytes fit (0 if the buffer is
+// full of requests waiting for output room)
+char* stream_read_buffer(RequestStream* stream, size_t* room);
+void stream_received(RequestStream* stream, size_t length);
+
+// Execute buffered requests until none is complete, the output has no
+// room for another response, or QUIT was answered.
+// Returns the number of requests executed (parts of a long reply count
+// as requests), 0 if no progress was made.
+int stream_process(RequestStream* stream);
+
+// Bytes of output waiting to be sent
+static inline size_t stream_unsent(const RequestStream* stream) {
+    return stream->output_len - stream->output_sent;
+}
+
+// Record that n bytes of output went out; the buffer is reused once all
+// of it has
+void stream_sent(RequestStream* stream, size_t n);
+
+#endif
@@ -0,0 +1,336 @@
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "ledger.h"
+
+_Static_assert(sizeof(LedgerChunk) <= LEDGER_CHUNK_SIZE, "a chunk must fit in LEDGER_CHUNK_SIZE");
+_Static_assert(sizeof(LedgerFileHeader) <= LEDGER_CHUNK_SIZE, "the file header must fit in chunk 0");
+
+static void ledger_lock(Ledger* ledger) {
+    if (pthread_mutex_lock(&ledger->lock) == EOWNERDEAD) {
+        // Allocation only moves counters forward; carry on
+        fprintf(stderr, "Warning: recovered the ledger lock from a terminated process.\n");
+        pthread_mutex_consistent(&ledger->lock);
+    }
+}
+
+void ledger_init(Ledger* ledger) {
+    memset(ledger, 0, sizeof(*ledger));
+    ledger->fd = -1;
+}
+
+int ledger_open(Ledger* ledger, const char* path, int shared) {
+    ledger_init(ledger);
+    snprintf(ledger->path, sizeof(ledger->path), "%s", path);
+
+    int fd = open(path, O_RDWR | O_CREAT, 0644);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        perror("Error opening ledger");
+        if (fd >= 0) close(fd);
+        return 1;
+    }
+
+    // One reservation for the largest possible file: chunk addresses never
+    // change as it grows, in this process or in forked children
+    char* base = mmap(NULL, (size_t)LEDGER_MAX_CHUNKS * LEDGER_CHUNK_SIZE, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_NORESERVE, fd, 0);
+    if (base == MAP_FAILED) {
+        perror("Failed to map ledger");
+        close(fd);
+        return 1;
+    }
+
+    LedgerFileHeader* header = (LedgerFileHeader*)base;
+    uint32_t chunks = st.st_size / LEDGER_CHUNK_SIZE;
+    if (chunks == 0) {
+        // New file
+        if (ftruncate(fd, (off_t)LEDGER_GROW_CHUNKS * LEDGER_CHUNK_SIZE) != 0) {
+            perror("Error sizing ledger");
+            munmap(base, (size_t)LEDGER_MAX_CHUNKS * LEDGER_CHUNK_SIZE);
+            close(fd);
+            return 1;
+        }
+        chunks = LEDGER_GROW_CHUNKS;
+        memcpy(header->magic, LEDGER_MAGIC, sizeof(header->magic));
+        header->version = LEDGER_VERSION;
+        header->chunk_size = LEDGER_CHUNK_SIZE;
+    } else if (memcmp(header->magic, LEDGER_MAGIC, sizeof(header->magic)) != 0 ||
+               header->version != LEDGER_VERSION || header->chunk_size != LEDGER_CHUNK_SIZE) {
+        fprintf(stderr, "Error: %s is not a version %d ledger.\n", path, LEDGER_VERSION);
+        munmap(base, (size_t)LEDGER_MAX_CHUNKS * LEDGER_CHUNK_SIZE);
+        close(fd);
+        return 1;
+    }
+
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    if (shared) {
+        pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    }
+    pthread_mutex_init(&ledger->lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+
+    ledger->fd = fd;
+    ledger->base = base;
+    ledger->file_chunks = chunks;
+    ledger->used_chunks = chunks; // Until ledger_rebuild() finds the end
+    return 0;
+}
+
+// Return chunk to the free list; caller holds the lock or is single-threaded
+static void free_chunk(Ledger* ledger, uint32_t chunk) {
+    LedgerChunkHeader* header = &ledger_chunk(ledger, chunk)->header;
+    memset(header, 0, sizeof(*header));
+    header->next = ledger->free_head;
+    ledger->free_head = chunk;
+}
+
+// Insert chunk into the chain of its owner, keeping id order. Chunks
+// usually arrive in id order, so this is an append.
+// Returns 0, or 1 if the chunk duplicates entries the chain already has.
+static int link_chunk(Ledger* ledger, LedgerChain* chain, uint32_t chunk) {
+    LedgerChunkHeader* header = &ledger_chunk(ledger, chunk)->header;
+
+    uint32_t after = chain->tail;
+    while (after != 0 && ledger_chunk(ledger, after)->header.first_id > header->first_id) {
+        after = ledger_chunk(ledger, after)->header.prev;
+    }
+    uint32_t before = after != 0 ? ledger_chunk(ledger, after)->header.next : chain->head;
+
+    if (after != 0) {
+        const LedgerChunkHeader* a = &ledger_chunk(ledger, after)->header;
+        if (a->first_id + a->count > header->first_id) {
+            return 1;
+        }
+    }
+    if (before != 0) {
+        uint64_t limit = ledger_chunk(ledger, before)->header.first_id;
+        if (header->first_id + header->count > limit) {
+            header->count = limit - header->first_id;
+        }
+    }
+    if (header->count == 0) {
+        return 1;
+    }
+
+    header->prev = after;
+    header->next = before;
+    if (after != 0) {
+        ledger_chunk(ledger, after)->header.next = chunk;
+    } else {
+        chain->head = chunk;
+    }
+    if (before != 0) {
+        ledger_chunk(ledger, before)->header.prev = chunk;
+    } else {
+        chain->tail = chunk;
+    }
+    return 0;
+}
+
+void ledger_rebuild(Ledger* ledger, LedgerOwnerCheck check, LedgerChain* (*chain_of)(int slot, void* ctx), void* ctx) {
+    if (ledger->fd < 0) {
+        return;
+    }
+
+    uint32_t end = 1;
+    ledger->free_head = 0;
+    for (uint32_t chunk = 1; chunk < ledger->file_chunks; chunk++) {
+        LedgerChunkHeader* header = &ledger_chunk(ledger, chunk)->header;
+        if (header->owner == 0) {
+            continue;
+        }
+
+        int slot = (int)header->owner - 1;
+        int64_t expected = check(slot, header->serial, ctx);
+
+        // Entries past what the account recorded were never committed
+        if (expected >= 0 && header->first_id < (uint64_t)expected) {
+            uint64_t keep = (uint64_t)expected - header->first_id;
+            if (header->count > LEDGER_CHUNK_ENTRIES) {
+                header->count = LEDGER_CHUNK_ENTRIES;
+            }
+            if (header->count > keep) {
+                header->count = keep;
+            }
+            if (header->count > 0 && link_chunk(ledger, chain_of(slot, ctx), chunk) == 0) {
+                end = chunk + 1;
+                continue;
+            }
+        }
+        header->owner = 0; // Reclaimed below
+    }
+
+    // A history must run from entry 0 without gaps: a chunk the kernel had
+    // not written back before a crash leaves a hole that log replay
+    // cannot fill in, since appends go at the end. Cut each chain at its
+    // first hole and let replay rebuild the rest.
+    for (uint32_t chunk = 1; chunk < end; chunk++) {
+        LedgerChunkHeader* header = &ledger_chunk(ledger, chunk)->header;
+        if (header->owner == 0 || header->prev != 0) {
+            continue; // Not the head of a chain
+        }
+        LedgerChain* chain = chain_of((int)header->owner - 1, ctx);
+        uint32_t c = chunk;
+        uint64_t next_id = 0;
+        while (c != 0 && ledger_chunk(ledger, c)->header.first_id == next_id) {
+            next_id += ledger_chunk(ledger, c)->header.count;
+            chain->tail = c;
+            c = ledger_chunk(ledger, c)->header.next;
+        }
+        if (c == chunk) {
+            chain->head = chain->tail = 0;
+        } else {
+            ledger_chunk(ledger, chain->tail)->header.next = 0;
+        }
+        while (c != 0) {
+            uint32_t next = ledger_chunk(ledger, c)->header.next;
+            ledger_chunk(ledger, c)->header.owner = 0;
+            c = next;
+        }
+    }
+
+    // Free chunks below the last one in use, lowest first out; the ones
+    // above it are handed out in order
+    for (uint32_t chunk = end; chunk-- > 1;) {
+        if (ledger_chunk(ledger, chunk)->header.owner == 0) {
+            free_chunk(ledger, chunk);
+        }
+    }
+    ledger->used_chunks = end;
+}
+
+// Take a free chunk, growing the file if needed
+// Returns the chunk, or 0 if the ledger is full
+static uint32_t alloc_chunk(Ledger* ledger) {
+    ledger_lock(ledger);
+    uint32_t chunk = ledger->free_head;
+    if (chunk != 0) {
+        ledger->free_head = ledger_chunk(ledger, chunk)->header.next;
+    } else {
+        if (ledger->used_chunks == ledger->file_chunks) {
+            uint32_t grown = ledger->file_chunks + LEDGER_GROW_CHUNKS;
+            if (grown > LEDGER_MAX_CHUNKS || ftruncate(ledger->fd, (off_t)grown * LEDGER_CHUNK_SIZE) != 0) {
+                pthread_mutex_unlock(&ledger->lock);
+                fprintf(stderr, "Error: the ledger cannot grow; history is not being recorded.\n");
+                return 0;
+            }
+            ledger->file_chunks = grown;
+        }
+        chunk = ledger->used_chunks++;
+    }
+    pthread_mutex_unlock(&ledger->lock);
+    return chunk;
+}
+
+uint64_t ledger_end(const Ledger* ledger, const LedgerChain* chain) {
+    if (ledger->fd < 0 || chain->tail == 0) {
+        return 0;
+    }
+    const LedgerChunkHeader* tail = &ledger_chunk(ledger, chain->tail)->header;
+    return tail->first_id + __atomic_load_n(&tail->count, __ATOMIC_ACQUIRE);
+}
+
+int64_t ledger_last_time(const Ledger* ledger, const LedgerChain* chain) {
+    if (ledger->fd < 0 || chain->tail == 0) {
+        return 0;
+    }
+    const LedgerChunk* tail = ledger_chunk(ledger, chain->tail);
+    return tail->entries[tail->header.count - 1].time_us;
+}
+
+int ledger_append(Ledger* ledger, LedgerChain* chain, int slot, uint64_t serial,
+                  uint64_t id, const LedgerEntry* entry) {
+    if (ledger->fd < 0) {
+        return 0;
+    }
+    if (chain->tail != 0 && id < ledger_end(ledger, chain)) {
+        return 0; // Already recorded (replaying the log)
+    }
+
+    LedgerChunk* tail = chain->tail != 0 ? ledger_chunk(ledger, chain->tail) : NULL;
+    if (tail == NULL || tail->header.count == LEDGER_CHUNK_ENTRIES || tail->header.first_id + tail->header.count != id) {
+        uint32_t chunk = alloc_chunk(ledger);
+        if (chunk == 0) {
+            return 1;
+        }
+        LedgerChunk* fresh = ledger_chunk(ledger, chunk);
+        memset(&fresh->header, 0, sizeof(fresh->header));
+        fresh->header.owner = slot + 1;
+        fresh->header.prev = chain->tail;
+        fresh->header.first_id = id;
+        fresh->header.serial = serial;
+
+        // Readers walking the chain see the new chunk only once it is set up
+        if (tail != NULL) {
+            __atomic_store_n(&tail->header.next, chunk, __ATOMIC_RELEASE);
+        } else {
+            chain->head = chunk;
+        }
+        chain->tail = chunk;
+        tail = fresh;
+    }
+
+    tail->entries[tail->header.count] = *entry;
+    __atomic_store_n(&tail->header.count, tail->header.count + 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+void ledger_seek(const Ledger* ledger, const LedgerChain* chain, uint64_t id, uint32_t* chunk, uint32_t* index) {
+    *chunk = 0;
+    *index = 0;
+    if (ledger->fd < 0 || chain->head == 0 || id >= ledger_end(ledger, chain)) {
+        return;
+    }
+
+    uint32_t c;
+    if (id < ledger_end(ledger, chain) / 2) {
+        // Forward from the oldest chunk to the one holding id (or, past a
+        // gap in the history, the next one that exists)
+        c = chain->head;
+        while (1) {
+            const LedgerChunkHeader* h = &ledger_chunk(ledger, c)->header;
+            if (h->first_id + __atomic_load_n(&h->count, __ATOMIC_ACQUIRE) > id) {
+                break;
+            }
+            c = __atomic_load_n(&h->next, __ATOMIC_ACQUIRE);
+        }
+    } else {
+        // Backward from the newest
+        c = chain->tail;
+        while (ledger_chunk(ledger, c)->header.first_id > id) {
+            uint32_t prev = ledger_chunk(ledger, c)->header.prev;
+            if (prev == 0) {
+                break;
+            }
+            const LedgerChunkHeader* p = &ledger_chunk(ledger, prev)->header;
+            if (p->first_id + p->count <= id) {
+                break; // id falls in a gap: start at c
+            }
+            c = prev;
+        }
+    }
+
+    uint64_t first = ledger_chunk(ledger, c)->header.first_id;
+    *chunk = c;
+    *index = id > first ? (uint32_t)(id - first) : 0;
+}
+
+int ledger_sync(Ledger* ledger) {
+    if (ledger->fd < 0) {
+        return 0;
+    }
+    uint32_t used = __atomic_load_n(&ledger->used_chunks, __ATOMIC_ACQUIRE);
+    if (msync(ledger->base, (size_t)used * LEDGER_CHUNK_SIZE, MS_SYNC) != 0) {
+        perror("Error syncing ledger");
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,136 @@
+#ifndef LEDGER_H
+#define LEDGER_H
+
+#include <stdint.h>
+#include <pthread.h>
+
+#define LEDGER_MAGIC "BANKLEDG"
+#define LEDGER_VERSION 1
+#define LEDGER_CHUNK_SIZE 512
+#define LEDGER_MAX_CHUNKS (1u << 27)  // 64 GB of history
+#define LEDGER_GROW_CHUNKS 2048       // File growth step (1 MB)
+#define LEDGER_MAX_PATH 4096
+
+// Kinds of ledger entries
+typedef enum {
+    LEDGER_OPEN = 1,     // Initial deposit
+    LEDGER_DEPOSIT,
+    LEDGER_WITHDRAWAL,
+    LEDGER_TRANSFER_IN,
+    LEDGER_TRANSFER_OUT
+} LedgerType;
+
+// One transaction of an account. Entries are numbered from 0 in the order
+// they were recorded (the entry id); ids are not stored, they follow from
+// the entry's place in its chunk.
+typedef struct {
+    int64_t time_us;   // Wall-clock time, microseconds since the epoch; 0 if unknown
+    int64_t amount;    // Hundredths, positive; the type gives the direction
+    int64_t balance;   // Hundredths, the balance the entry left
+    uint32_t type;     // LedgerType
+    uint32_t reserved; // Zero
+} LedgerEntry;
+
+// Per-account, append-only transaction history.
+//
+// The ledger file is an array of LEDGER_CHUNK_SIZE chunks. Chunk 0 holds
+// the file header; every other chunk belongs to one account (or is free)
+// and holds a run of its consecutive entries. An account's chunks form a
+// doubly linked chain in id order. The file is mapped MAP_SHARED and
+// written through the mapping, so forked children share it, and history
+// nobody reads is ordinary file-backed page cache: once synced by a
+// checkpoint, the kernel can drop it under memory pressure.
+//
+// The log, not this file, is what makes an entry durable: every logged
+// change carries its entry, and the ledger is synced before the log
+// records it covers are dropped. On startup, ledger_rebuild() relinks the
+// chains from the chunk headers and cuts each account's history back to
+// the entry count the snapshot recorded (or to its first hole); log
+// replay then re-appends anything newer. Chunks of closed accounts are
+// reclaimed then too.
+typedef struct {
+    uint32_t owner;      // Slot + 1; 0 if the chunk is free
+    uint32_t next;       // Next chunk of the account (0: none); rebuilt on startup
+    uint32_t prev;       // Previous chunk of the account; rebuilt on startup
+    uint32_t count;      // Entries in use
+    uint64_t first_id;   // Id of entries[0]
+    uint64_t serial;     // Owner's serial, telling it from earlier accounts of the slot
+    uint64_t reserved;   // Zero
+} LedgerChunkHeader;
+
+#define LEDGER_CHUNK_ENTRIES ((LEDGER_CHUNK_SIZE - sizeof(LedgerChunkHeader)) / sizeof(LedgerEntry))
+
+typedef struct {
+    LedgerChunkHeader header;
+    LedgerEntry entries[LEDGER_CHUNK_ENTRIES];
+} LedgerChunk;
+
+// Chunk 0
+typedef struct {
+    char magic[8];    // LEDGER_MAGIC, not NUL-terminated
+    uint32_t version; // LEDGER_VERSION
+    uint32_t chunk_size;
+} LedgerFileHeader;
+
+// Where an account's chain starts and ends; kept with the account's slot
+// and guarded by its lock
+typedef struct {
+    uint32_t head;
+    uint32_t tail;
+} LedgerChain;
+
+// Plain data, placed in the bank table so it is shared after a fork
+typedef struct {
+    pthread_mutex_t lock;  // Chunk allocation
+    int fd;                // -1: no ledger, every call is a no-op
+    char* base;            // LEDGER_MAX_CHUNKS chunks of address space
+    uint32_t file_chunks;  // Chunks the file is long
+    uint32_t used_chunks;  // Chunks handed out, header included
+    uint32_t free_head;    // Free chunks, linked through header.next
+    char path[LEDGER_MAX_PATH];
+} Ledger;
+
+static inline LedgerChunk* ledger_chunk(const Ledger* ledger, uint32_t chunk) {
+    return (LedgerChunk*)(ledger->base + (size_t)chunk * LEDGER_CHUNK_SIZE);
+}
+
+// Mark the ledger as absent (tools that only convert account files)
+void ledger_init(Ledger* ledger);
+
+// Open or create the ledger file at path and map it (MAP_SHARED, before
+// any fork). Chains are not linked until ledger_rebuild().
+// Returns 0 on success, 1 on failure.
+int ledger_open(Ledger* ledger, const char* path, int shared);
+
+// Called by ledger_rebuild() for every chunk owner: returns the number of
+// entries the owning account should have (its history is cut back to
+// that), or -1 if the slot no longer holds the account with that serial
+typedef int64_t (*LedgerOwnerCheck)(int slot, uint64_t serial, void* ctx);
+
+// Relink every chain from the chunk headers, storing them through chain_of
+// (the LedgerChain of a slot), and put chunks of vanished accounts on the
+// free list. Chains must start out empty. Single-threaded, at startup.
+void ledger_rebuild(Ledger* ledger, LedgerOwnerCheck check, LedgerChain* (*chain_of)(int slot, void* ctx), void* ctx);
+
+// Record entry `id` of the account in slot (with the given serial), whose
+// chain is `chain`; caller holds the account lock. An id the chain already
+// holds is ignored (log replay), a gap starts a new chunk.
+// Returns 0 on success, 1 if the ledger is full or cannot grow.
+int ledger_append(Ledger* ledger, LedgerChain* chain, int slot, uint64_t serial,
+                  uint64_t id, const LedgerEntry* entry);
+
+// Id after the last entry of the chain (0 if it is empty)
+uint64_t ledger_end(const Ledger* ledger, const LedgerChain* chain);
+
+// Time of the last entry of the chain, 0 if it is empty
+int64_t ledger_last_time(const Ledger* ledger, const LedgerChain* chain);
+
+// Position of entry id: *chunk (0 if the chain does not reach it) and the
+// index within it. Walks from whichever end of the chain is closer.
+void ledger_seek(const Ledger* ledger, const LedgerChain* chain, uint64_t id, uint32_t* chunk, uint32_t* index);
+
+// Make every entry written so far durable
+// Returns 0 on success, 1 on failure.
+int ledger_sync(Ledger* ledger);
+
+#endif
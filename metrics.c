@@ -0,0 +1,343 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+
+#include "metrics.h"
+
+// Upper bounds of the latency buckets, in nanoseconds
+static const uint64_t bucket_bounds[METRICS_BUCKETS] = {
+    10000, 25000, 50000, 100000, 250000, 500000,
+    1000000, 2500000, 5000000, 10000000, 25000000, 50000000,
+    100000000, 250000000, 500000000, 1000000000
+};
+
+typedef struct {
+    int next_shard; // Shards handed out so far; wraps around in fork mode
+    MetricsShard shards[METRICS_SHARDS];
+} MetricsTable;
+
+static MetricsTable* metrics = NULL;
+static __thread MetricsShard* my_shard = NULL;
+
+// A forked child must not keep adding to the shard of the thread that
+// forked it, or all children would share one
+static void forget_shard(void) {
+    my_shard = NULL;
+}
+
+int metrics_init(int shared) {
+    int flags = MAP_ANONYMOUS | (shared ? MAP_SHARED : MAP_PRIVATE);
+    MetricsTable* t = mmap(NULL, sizeof(MetricsTable), PROT_READ | PROT_WRITE, flags, -1, 0);
+    if (t == MAP_FAILED) {
+        perror("Failed to map metrics");
+        return 1;
+    }
+    pthread_atfork(NULL, NULL, forget_shard);
+    metrics = t;
+    return 0;
+}
+
+uint64_t metrics_now(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ull + now.tv_nsec;
+}
+
+// The calling thread's shard, claimed on first use. Once every shard is
+// taken, new threads and processes share them; adds are atomic, so that
+// only costs some contention.
+static inline MetricsShard* shard(void) {
+    if (my_shard == NULL && metrics != NULL) {
+        int n = __atomic_fetch_add(&metrics->next_shard, 1, __ATOMIC_RELAXED);
+        my_shard = &metrics->shards[n % METRICS_SHARDS];
+    }
+    return my_shard;
+}
+
+static inline void add(uint64_t* counter, uint64_t n) {
+    __atomic_fetch_add(counter, n, __ATOMIC_RELAXED);
+}
+
+static void observe(MetricsHistogram* hist, uint64_t ns) {
+    int b = 0;
+    while (b < METRICS_BUCKETS && ns > bucket_bounds[b]) {
+        b++;
+    }
+    add(&hist->buckets[b], 1);
+    add(&hist->sum_ns, ns);
+}
+
+void metrics_request(int command, uint64_t ns) {
+    MetricsShard* s = shard();
+    if (s != NULL && command >= 0 && command < METRICS_MAX_COMMANDS) {
+        add(&s->requests[command], 1);
+        observe(&s->latency[command], ns);
+    }
+}
+
+void metrics_error(int code) {
+    MetricsShard* s = shard();
+    if (s != NULL && code >= 0 && code < METRICS_ERROR_CODES) {
+        add(&s->errors[code], 1);
+    }
+}
+
+void metrics_accepted(void) {
+    MetricsShard* s = shard();
+    if (s != NULL) {
+        add(&s->accepted, 1);
+    }
+}
+
+void metrics_closed(void) {
+    MetricsShard* s = shard();
+    if (s != NULL) {
+        add(&s->closed, 1);
+    }
+}
+
+void metrics_rejected(void) {
+    MetricsShard* s = shard();
+    if (s != NULL) {
+        add(&s->rejected, 1);
+    }
+}
+
+void metrics_timed_out(int reason) {
+    MetricsShard* s = shard();
+    if (s != NULL && reason >= 0 && reason < METRICS_TIMEOUT_REASONS) {
+        add(&s->timed_out[reason], 1);
+    }
+}
+
+void metrics_rate_limited(int rate_class) {
+    MetricsShard* s = shard();
+    if (s != NULL && rate_class >= 0 && rate_class < METRICS_RATE_CLASSES) {
+        add(&s->rate_limited[rate_class], 1);
+    }
+}
+
+void metrics_syscalls(int n) {
+    MetricsShard* s = shard();
+    if (s != NULL) {
+        add(&s->syscalls, n);
+    }
+}
+
+void metrics_log_write(uint64_t ns) {
+    MetricsShard* s = shard();
+    if (s != NULL) {
+        observe(&s->log_write, ns);
+    }
+}
+
+void metrics_log_sync(uint64_t ns) {
+    MetricsShard* s = shard();
+    if (s != NULL) {
+        observe(&s->log_sync, ns);
+    }
+}
+
+static uint64_t load(const uint64_t* counter) {
+    return __atomic_load_n(counter, __ATOMIC_RELAXED);
+}
+
+// Sum of one counter over every shard; offset is its place in MetricsShard
+static uint64_t total(size_t offset) {
+    uint64_t sum = 0;
+    for (int i = 0; i < METRICS_SHARDS; i++) {
+        sum += load((const uint64_t*)((const char*)&metrics->shards[i] + offset));
+    }
+    return sum;
+}
+
+// One histogram, summed over the shards, as _bucket/_sum/_count lines
+static void write_histogram(FILE* out, const char* name, const char* labels, size_t offset) {
+    uint64_t cumulative = 0;
+    for (int b = 0; b <= METRICS_BUCKETS; b++) {
+        cumulative += total(offset + offsetof(MetricsHistogram, buckets) + b * sizeof(uint64_t));
+        if (b < METRICS_BUCKETS) {
+            fprintf(out, "%s_bucket{%s%sle=\"%g\"} %llu\n", name, labels, labels[0] ? "," : "",
+                    bucket_bounds[b] / 1e9, (unsigned long long)cumulative);
+        } else {
+            fprintf(out, "%s_bucket{%s%sle=\"+Inf\"} %llu\n", name, labels, labels[0] ? "," : "",
+                    (unsigned long long)cumulative);
+        }
+    }
+    double sum = total(offset + offsetof(MetricsHistogram, sum_ns)) / 1e9;
+    fprintf(out, "%s_sum%s%s%s %.9f\n", name, labels[0] ? "{" : "", labels, labels[0] ? "}" : "", sum);
+    fprintf(out, "%s_count%s%s%s %llu\n", name, labels[0] ? "{" : "", labels, labels[0] ? "}" : "",
+            (unsigned long long)cumulative);
+}
+
+void metrics_write(FILE* out, const char* const* command_names, int command_count) {
+    if (metrics == NULL) {
+        return;
+    }
+    char labels[64];
+
+    fprintf(out, "# HELP bank_requests_total Requests executed, by command.\n");
+    fprintf(out, "# TYPE bank_requests_total counter\n");
+    for (int c = 0; c < command_count && c < METRICS_MAX_COMMANDS; c++) {
+        if (command_names[c] != NULL) {
+            fprintf(out, "bank_requests_total{command=\"%s\"} %llu\n", command_names[c],
+                    (unsigned long long)total(offsetof(MetricsShard, requests) + c * sizeof(uint64_t)));
+        }
+    }
+
+    fprintf(out, "# HELP bank_request_duration_seconds From the start of parsing a request to the end of sending its reply.\n");
+    fprintf(out, "# TYPE bank_request_duration_seconds histogram\n");
+    for (int c = 0; c < command_count && c < METRICS_MAX_COMMANDS; c++) {
+        if (command_names[c] != NULL) {
+            snprintf(labels, sizeof(labels), "command=\"%s\"", command_names[c]);
+            write_histogram(out, "bank_request_duration_seconds", labels,
+                            offsetof(MetricsShard, latency) + c * sizeof(MetricsHistogram));
+        }
+    }
+
+    fprintf(out, "# HELP bank_errors_total Error replies, by ERROR code (\"none\": malformed requests).\n");
+    fprintf(out, "# TYPE bank_errors_total counter\n");
+    for (int code = 0; code < METRICS_ERROR_CODES; code++) {
+        uint64_t n = total(offsetof(MetricsShard, errors) + code * sizeof(uint64_t));
+        if (code == 0) {
+            fprintf(out, "bank_errors_total{code=\"none\"} %llu\n", (unsigned long long)n);
+        } else if (n > 0) {
+            fprintf(out, "bank_errors_total{code=\"%d\"} %llu\n", code, (unsigned long long)n);
+        }
+    }
+
+    uint64_t accepted = total(offsetof(MetricsShard, accepted));
+    uint64_t closed = total(offsetof(MetricsShard, closed));
+    fprintf(out, "# HELP bank_connections_accepted_total Client connections accepted.\n");
+    fprintf(out, "# TYPE bank_connections_accepted_total counter\n");
+    fprintf(out, "bank_connections_accepted_total %llu\n", (unsigned long long)accepted);
+    fprintf(out, "# HELP bank_connections_active Client connections open now.\n");
+    fprintf(out, "# TYPE bank_connections_active gauge\n");
+    // The two sums are not taken at one instant
+    fprintf(out, "bank_connections_active %llu\n", (unsigned long long)(accepted > closed ? accepted - closed : 0));
+    fprintf(out, "# HELP bank_connections_rejected_total Client connections turned away over the connection cap.\n");
+    fprintf(out, "# TYPE bank_connections_rejected_total counter\n");
+    fprintf(out, "bank_connections_rejected_total %llu\n", (unsigned long long)total(offsetof(MetricsShard, rejected)));
+    static const char* const timeout_reasons[METRICS_TIMEOUT_REASONS] = { "idle", "request" };
+    fprintf(out, "# HELP bank_connections_timed_out_total Client connections closed for sitting idle or stalling a request.\n");
+    fprintf(out, "# TYPE bank_connections_timed_out_total counter\n");
+    for (int reason = 0; reason < METRICS_TIMEOUT_REASONS; reason++) {
+        fprintf(out, "bank_connections_timed_out_total{reason=\"%s\"} %llu\n", timeout_reasons[reason],
+                (unsigned long long)total(offsetof(MetricsShard, timed_out[reason])));
+    }
+    static const char* const rate_classes[METRICS_RATE_CLASSES] = { "connect", "read", "write" };
+    fprintf(out, "# HELP bank_rate_limited_total Connections and requests refused over a per-address or per-account rate.\n");
+    fprintf(out, "# TYPE bank_rate_limited_total counter\n");
+    for (int c = 0; c < METRICS_RATE_CLASSES; c++) {
+        fprintf(out, "bank_rate_limited_total{class=\"%s\"} %llu\n", rate_classes[c],
+                (unsigned long long)total(offsetof(MetricsShard, rate_limited[c])));
+    }
+
+    fprintf(out, "# HELP bank_loop_syscalls_total System calls made by the event loops for client connections.\n");
+    fprintf(out, "# TYPE bank_loop_syscalls_total counter\n");
+    fprintf(out, "bank_loop_syscalls_total %llu\n", (unsigned long long)total(offsetof(MetricsShard, syscalls)));
+
+    fprintf(out, "# HELP bank_log_write_duration_seconds write() of buffered log records.\n");
+    fprintf(out, "# TYPE bank_log_write_duration_seconds histogram\n");
+    write_histogram(out, "bank_log_write_duration_seconds", "", offsetof(MetricsShard, log_write));
+    fprintf(out, "# HELP bank_log_sync_duration_seconds fdatasync() of the log.\n");
+    fprintf(out, "# TYPE bank_log_sync_duration_seconds histogram\n");
+    write_histogram(out, "bank_log_sync_duration_seconds", "", offsetof(MetricsShard, log_sync));
+}
+
+typedef struct {
+    int listen_socket;
+    const char* const* command_names;
+    int command_count;
+} HttpServer;
+
+// Answer each connection with the metrics, one at a time: a scrape every
+// few seconds needs nothing more
+static void* http_main(void* arg) {
+    HttpServer* server = arg;
+    while (1) {
+        int fd = accept(server->listen_socket, NULL, NULL);
+        if (fd < 0) {
+            if (errno != EINTR) {
+                perror("Error accepting metrics connection");
+            }
+            continue;
+        }
+        // The request itself does not matter, but is read so that closing
+        // does not reset the connection under the reply
+        char request[1024];
+        struct timeval timeout = { 1, 0 };
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        (void)!read(fd, request, sizeof(request));
+
+        char* body = NULL;
+        size_t length = 0;
+        FILE* out = open_memstream(&body, &length);
+        if (out != NULL) {
+            metrics_write(out, server->command_names, server->command_count);
+            fclose(out);
+            char header[128];
+            int n = snprintf(header, sizeof(header),
+                             "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\n"
+                             "Content-Length: %zu\r\n\r\n", length);
+            if (send(fd, header, n, MSG_NOSIGNAL) == n) {
+                for (size_t sent = 0; sent < length;) {
+                    ssize_t s = send(fd, body + sent, length - sent, MSG_NOSIGNAL);
+                    if (s <= 0) {
+                        break;
+                    }
+                    sent += s;
+                }
+            }
+            free(body);
+        }
+        close(fd);
+    }
+    return NULL;
+}
+
+int metrics_start_http(int port, const char* const* command_names, int command_count) {
+    static HttpServer server;
+    server.command_names = command_names;
+    server.command_count = command_count;
+
+    server.listen_socket = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (server.listen_socket < 0) {
+        perror("Error creating metrics socket");
+        return 1;
+    }
+    int reuse = 1;
+    setsockopt(server.listen_socket, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+
+    // Loopback only: the metrics are for the operator, not for clients
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (bind(server.listen_socket, (struct sockaddr*)&addr, sizeof(addr)) < 0 ||
+        listen(server.listen_socket, 16) < 0) {
+        perror("Error listening on the metrics port");
+        close(server.listen_socket);
+        return 1;
+    }
+
+    pthread_t thread;
+    int err = pthread_create(&thread, NULL, http_main, &server);
+    if (err != 0) {
+        fprintf(stderr, "Error starting metrics thread: %s\n", strerror(err));
+        close(server.listen_socket);
+        return 1;
+    }
+    pthread_detach(thread);
+    return 0;
+}
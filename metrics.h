@@ -0,0 +1,82 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+#define METRICS_MAX_COMMANDS 16
+#define METRICS_ERROR_CODES 10 // ERROR 1-9; slot 0 counts errors without a code
+#define METRICS_BUCKETS 16     // Latency buckets, 10 us to 1 s, plus +Inf
+#define METRICS_SHARDS 64
+#define METRICS_TIMEOUT_REASONS 2 // Idle, request (see TimeoutReason in admission.h)
+#define METRICS_RATE_CLASSES 3    // Connect, read, write (see RateClass in rate_limit.h)
+
+// Latency histogram. Buckets are not cumulative here; they are summed
+// into Prometheus' cumulative form when written out.
+typedef struct {
+    uint64_t buckets[METRICS_BUCKETS + 1];
+    uint64_t sum_ns;
+} MetricsHistogram;
+
+// Counters of one thread (or, in fork mode, of a few processes). Each
+// thread adds to its own shard, on its own cache lines, so counting costs
+// an uncontended atomic add; a reader sums the shards.
+typedef struct {
+    uint64_t requests[METRICS_MAX_COMMANDS];
+    MetricsHistogram latency[METRICS_MAX_COMMANDS];
+    uint64_t errors[METRICS_ERROR_CODES];
+    uint64_t accepted;
+    uint64_t closed;
+    uint64_t rejected;
+    uint64_t timed_out[METRICS_TIMEOUT_REASONS];
+    uint64_t rate_limited[METRICS_RATE_CLASSES];
+    uint64_t syscalls;
+    MetricsHistogram log_write;
+    MetricsHistogram log_sync;
+} __attribute__((aligned(64))) MetricsShard;
+
+// Map the shards. With shared set they live in a MAP_SHARED mapping, so
+// forked children count into memory the parent reads. Call once, before
+// any fork; until then (and in tools that never call it) every
+// metrics_* call is a no-op.
+// Returns 0 on success, 1 on failure.
+int metrics_init(int shared);
+
+// Monotonic clock in nanoseconds, for the durations passed below
+uint64_t metrics_now(void);
+
+// One request of command (below METRICS_MAX_COMMANDS) took ns
+void metrics_request(int command, uint64_t ns);
+
+// A reply carried ERROR code (0 for an error without a code)
+void metrics_error(int code);
+
+void metrics_accepted(void);
+void metrics_closed(void);
+
+// A connection was turned away over the connection cap
+void metrics_rejected(void);
+
+// A connection was closed for a TimeoutReason
+void metrics_timed_out(int reason);
+
+// A connection or request was refused over the rate of a RateClass
+void metrics_rate_limited(int rate_class);
+
+// An event loop made n system calls for client connections
+void metrics_syscalls(int n);
+
+// A log write() / fdatasync() took ns
+void metrics_log_write(uint64_t ns);
+void metrics_log_sync(uint64_t ns);
+
+// Write every metric in the Prometheus text exposition format. Command i
+// is labelled command_names[i]; NULL names are left out.
+void metrics_write(FILE* out, const char* const* command_names, int command_count);
+
+// Serve metrics_write() over HTTP on 127.0.0.1:port from a background
+// thread, for Prometheus to scrape (any path answers).
+// Returns 0 on success, 1 on failure.
+int metrics_start_http(int port, const char* const* command_names, int command_count);
+
+#endif
@@ -0,0 +1,292 @@
+// Microbenchmarks of the core operations of banking.c at growing account
+// populations.
+//
+//   microbench [-n max_accounts] [-o ops] [-d directory]
+//
+// For each population from 100 up to max_accounts (default 1,000,000; the
+// full range goes to 10,000,000, which needs about 8 GB of memory and
+// ledger file), a child process opens that many accounts and times:
+//
+//   find_account_index       lookups of random accounts
+//   open_account             the last opens of the population, logged
+//   deposit, withdraw        on random accounts, logged
+//   statement                statement_begin() plus the last 5 entries
+//   rate_limit_allow         the rate limit buckets of a random client
+//                            address and account, as dispatch takes them
+//   rate_limit_refuse        a request of one address over its limit
+//   save_accounts_to_file    whole text saves of the population
+//   load_accounts_from_file  whole text loads of it
+//
+// and reports, per operation, nanoseconds, heap allocations (malloc,
+// calloc and realloc calls) and bytes written (write() and friends, so
+// log records and files but not stores through the ledger mapping).
+// Changes are logged as the server does, but without syncs, so the
+// numbers show CPU cost rather than the disk. Files go in a scratch
+// directory (default /tmp), removed afterwards.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include "bank.h"
+#include "rate_limit.h"
+
+#define BENCH_PIN 4321
+#define MAX_TIMED_OPENS 100000
+#define MAX_FILE_ROUNDS 20 // Text saves/loads per population, fewer for big ones
+
+// Heap calls, counted by replacing the allocator entry points with ones
+// that forward to glibc's. Atomic since the log and ledger have threads.
+extern void* __libc_malloc(size_t size);
+extern void* __libc_calloc(size_t count, size_t size);
+extern void* __libc_realloc(void* ptr, size_t size);
+
+static unsigned long allocations;
+
+void* malloc(size_t size) {
+    __atomic_add_fetch(&allocations, 1, __ATOMIC_RELAXED);
+    return __libc_malloc(size);
+}
+
+void* calloc(size_t count, size_t size) {
+    __atomic_add_fetch(&allocations, 1, __ATOMIC_RELAXED);
+    return __libc_calloc(count, size);
+}
+
+void* realloc(void* ptr, size_t size) {
+    __atomic_add_fetch(&allocations, 1, __ATOMIC_RELAXED);
+    return __libc_realloc(ptr, size);
+}
+
+// Bytes this process has passed to write() and similar calls
+static unsigned long long bytes_written(void) {
+    unsigned long long wchar = 0;
+    char buf[512];
+    int fd = open("/proc/self/io", O_RDONLY);
+    if (fd < 0) {
+        return 0;
+    }
+    ssize_t n = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    if (n > 0) {
+        buf[n] = '\0';
+        char* line = strstr(buf, "wchar:");
+        if (line != NULL) {
+            wchar = strtoull(line + 6, NULL, 10);
+        }
+    }
+    return wchar;
+}
+
+typedef struct {
+    struct timespec start;
+    unsigned long allocations;
+    unsigned long long written;
+} Probe;
+
+static void probe_start(Probe* probe) {
+    probe->allocations = __atomic_load_n(&allocations, __ATOMIC_RELAXED);
+    probe->written = bytes_written();
+    clock_gettime(CLOCK_MONOTONIC, &probe->start);
+}
+
+// Print the cost per op of what ran since probe_start()
+static void probe_report(const Probe* probe, int population, const char* operation, long ops) {
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double ns = (end.tv_sec - probe->start.tv_sec) * 1e9 + (end.tv_nsec - probe->start.tv_nsec);
+    unsigned long allocs = __atomic_load_n(&allocations, __ATOMIC_RELAXED) - probe->allocations;
+    unsigned long long written = bytes_written() - probe->written;
+    printf("%10d  %-24s %8ld %14.1f %10.2f %12.1f\n", population, operation, ops, ns / ops,
+           (double)allocs / ops, (double)written / ops);
+    fflush(stdout);
+}
+
+static char (*numbers)[MAX_ACCOUNT_NUMBER_LEN];
+static unsigned int seed = 1;
+
+static int open_one(int i) {
+    Account acc = open_account("Bench", "0", "savings", 1000000000.0, BENCH_PIN);
+    if (!acc.is_active) {
+        fprintf(stderr, "Could not open account %d\n", i);
+        return 1;
+    }
+    memcpy(numbers[i], acc.account_number, MAX_ACCOUNT_NUMBER_LEN);
+    return 0;
+}
+
+// Run every benchmark at one population; in a child process, so that each
+// population starts from an empty table and gives its memory back
+static int run_population(int population, long ops, const char* dir) {
+    char ledger[4096], snapshot[4096], log[4096], text[4096];
+    snprintf(ledger, sizeof(ledger), "%s/microbench.ledger", dir);
+    snprintf(snapshot, sizeof(snapshot), "%s/microbench.snap", dir);
+    snprintf(log, sizeof(log), "%s/microbench.log", dir);
+    snprintf(text, sizeof(text), "%s/microbench.txt", dir);
+    unlink(ledger);
+    unlink(log);
+
+    numbers = calloc(population, sizeof(*numbers));
+    bank_set_pin_iterations(1); // Time the table, not PIN hashing
+    if (numbers == NULL || bank_init(0, DEFAULT_SHARDS) != 0 || bank_open_ledger(ledger) != 0) {
+        return 1;
+    }
+    Probe probe;
+
+    // Fill up to the timed opens without a log, as loading would
+    int timed_opens = population < MAX_TIMED_OPENS ? population : MAX_TIMED_OPENS;
+    for (int i = 0; i < population - timed_opens; i++) {
+        if (open_one(i) != 0) {
+            return 1;
+        }
+    }
+    if (bank_open_log(snapshot, log, WAL_SYNC_NEVER, 0) != 0) {
+        return 1;
+    }
+    probe_start(&probe);
+    for (int i = population - timed_opens; i < population; i++) {
+        if (open_one(i) != 0) {
+            return 1;
+        }
+    }
+    probe_report(&probe, population, "open_account", timed_opens);
+
+    // Random accounts, picked before timing
+    int* picks = malloc(ops * sizeof(int));
+    if (picks == NULL) {
+        return 1;
+    }
+    for (long i = 0; i < ops; i++) {
+        picks[i] = rand_r(&seed) % population;
+    }
+
+    volatile int sink = 0;
+    probe_start(&probe);
+    for (long i = 0; i < ops; i++) {
+        sink += find_account_index(numbers[picks[i]], BENCH_PIN);
+    }
+    probe_report(&probe, population, "find_account_index", ops);
+
+    probe_start(&probe);
+    for (long i = 0; i < ops; i++) {
+        sink += deposit(numbers[picks[i]], BENCH_PIN, 500.0);
+    }
+    probe_report(&probe, population, "deposit", ops);
+
+    probe_start(&probe);
+    for (long i = 0; i < ops; i++) {
+        sink += withdraw(numbers[picks[i]], BENCH_PIN, 500.0);
+    }
+    probe_report(&probe, population, "withdraw", ops);
+
+    StatementQuery query = { 0, MAX_TRANSACTIONS, 0, INT64_MAX, 1 };
+    probe_start(&probe);
+    for (long i = 0; i < ops; i++) {
+        StatementCursor cursor;
+        StatementEntry entry;
+        double balance;
+        uint64_t total;
+        if (statement_begin(numbers[picks[i]], BENCH_PIN, &query, &cursor, &balance, &total) == 0) {
+            while (statement_next(&cursor, &entry)) {
+                sink += entry.type;
+            }
+        }
+    }
+    probe_report(&probe, population, "statement", ops);
+
+    // At a rate no bucket reaches, then for one flooding address
+    if (rate_limit_init(0) != 0) {
+        return 1;
+    }
+    rate_limit_set(RATE_WRITE, RATE_LIMIT_MAX_RATE, RATE_LIMIT_MAX_RATE);
+    probe_start(&probe);
+    for (long i = 0; i < ops; i++) {
+        sink += rate_limit_allow(RATE_WRITE, rate_key_address((uint32_t)picks[i]), 1) &&
+                rate_limit_allow(RATE_WRITE, rate_key_account(numbers[picks[i]]), 1);
+    }
+    probe_report(&probe, population, "rate_limit_allow", ops);
+
+    rate_limit_set(RATE_READ, 1, 1);
+    probe_start(&probe);
+    for (long i = 0; i < ops; i++) {
+        sink += rate_limit_allow(RATE_READ, rate_key_address(1), 1);
+    }
+    probe_report(&probe, population, "rate_limit_refuse", ops);
+
+    int rounds = 1000000 / population;
+    rounds = rounds < 1 ? 1 : rounds > MAX_FILE_ROUNDS ? MAX_FILE_ROUNDS : rounds;
+    probe_start(&probe);
+    for (int i = 0; i < rounds; i++) {
+        if (save_accounts_to_file(text) != 0) {
+            return 1;
+        }
+    }
+    probe_report(&probe, population, "save_accounts_to_file", rounds);
+
+    // Into a fresh table without a ledger, which drops the history the
+    // text file carries instead of queueing it for an import each round
+    if (bank_init(0, DEFAULT_SHARDS) != 0) {
+        return 1;
+    }
+    probe_start(&probe);
+    for (int i = 0; i < rounds; i++) {
+        if (load_accounts_from_file(text) != 0) {
+            return 1;
+        }
+    }
+    probe_report(&probe, population, "load_accounts_from_file", rounds);
+
+    unlink(text);
+    unlink(ledger);
+    unlink(log);
+    unlink(snapshot);
+    return 0;
+}
+
+static void usage(const char* prog) {
+    fprintf(stderr, "Usage: %s [-n max_accounts] [-o ops] [-d directory]\n", prog);
+}
+
+int main(int argc, char* argv[]) {
+    int max_accounts = 1000000;
+    long ops = 200000;
+    const char* dir = "/tmp";
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:o:d:")) != -1) {
+        switch (opt) {
+        case 'n': max_accounts = atoi(optarg); break;
+        case 'o': ops = atol(optarg); break;
+        case 'd': dir = optarg; break;
+        default:
+            usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+    if (max_accounts < 100 || max_accounts > MAX_ACCOUNTS || ops < 1) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    printf("%10s  %-24s %8s %14s %10s %12s\n", "accounts", "operation", "ops", "ns/op", "allocs/op", "bytes/op");
+    fflush(stdout);
+    for (long population = 100; population <= max_accounts; population *= 10) {
+        pid_t pid = fork();
+        if (pid < 0) {
+            perror("fork");
+            return EXIT_FAILURE;
+        }
+        if (pid == 0) {
+            _exit(run_population((int)population, ops, dir) == 0 ? EXIT_SUCCESS : EXIT_FAILURE);
+        }
+        int status;
+        if (waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+            fprintf(stderr, "Benchmark at %ld accounts failed.\n", population);
+            return EXIT_FAILURE;
+        }
+    }
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,95 @@
+#include <stdio.h>
+#include <string.h>
+#include <openssl/crypto.h>
+#include <openssl/evp.h>
+#include <openssl/rand.h>
+
+#include "pin_hash.h"
+
+// The digits of pin, as a client types them
+static int pin_digits(int pin, char* digits) {
+    return snprintf(digits, 16, "%d", pin);
+}
+
+static int derive(int pin, const uint8_t* salt, uint32_t iterations, uint8_t* out) {
+    char digits[16];
+    int len = pin_digits(pin, digits);
+    return PKCS5_PBKDF2_HMAC(digits, len, salt, PIN_SALT_LEN, (int)iterations, EVP_sha256(),
+                             PIN_HASH_LEN, out) == 1 ? 0 : 1;
+}
+
+int pin_hash_create(int pin, int iterations, PinHash* out) {
+    memset(out, 0, sizeof(*out));
+    if (iterations < 1 || RAND_bytes(out->salt, PIN_SALT_LEN) != 1) {
+        return 1;
+    }
+    out->iterations = (uint32_t)iterations;
+    return derive(pin, out->salt, out->iterations, out->hash);
+}
+
+int pin_hash_verify(const PinHash* hash, int pin) {
+    uint8_t derived[PIN_HASH_LEN];
+    if (hash->iterations == 0 || derive(pin, hash->salt, hash->iterations, derived) != 0) {
+        return 0; // Never matches a PIN still in the clear
+    }
+    return CRYPTO_memcmp(derived, hash->hash, PIN_HASH_LEN) == 0;
+}
+
+void pin_hash_set_plain(PinHash* hash, int pin) {
+    memset(hash, 0, sizeof(*hash));
+    memcpy(hash->hash, &pin, sizeof(pin));
+}
+
+int pin_hash_plain(const PinHash* hash) {
+    int pin;
+    memcpy(&pin, hash->hash, sizeof(pin));
+    return pin;
+}
+
+static void to_hex(const uint8_t* bytes, size_t n, char* out) {
+    static const char digits[] = "0123456789abcdef";
+    for (size_t i = 0; i < n; i++) {
+        out[2 * i] = digits[bytes[i] >> 4];
+        out[2 * i + 1] = digits[bytes[i] & 15];
+    }
+    out[2 * n] = '\0';
+}
+
+// Returns 0 on success, 1 if text does not start with 2 * n hex digits
+static int from_hex(const char* text, uint8_t* bytes, size_t n) {
+    for (size_t i = 0; i < 2 * n; i++) {
+        char c = text[i];
+        int value = c >= '0' && c <= '9' ? c - '0' : c >= 'a' && c <= 'f' ? c - 'a' + 10 : -1;
+        if (value < 0) {
+            return 1;
+        }
+        bytes[i / 2] = (uint8_t)(i % 2 == 0 ? value << 4 : bytes[i / 2] | value);
+    }
+    return 0;
+}
+
+void pin_hash_format(const PinHash* hash, char* text) {
+    int n = snprintf(text, PIN_HASH_TEXT_LEN, PIN_HASH_PREFIX "%u$", hash->iterations);
+    to_hex(hash->salt, PIN_SALT_LEN, text + n);
+    n += 2 * PIN_SALT_LEN;
+    text[n++] = '$';
+    to_hex(hash->hash, PIN_HASH_LEN, text + n);
+}
+
+int pin_hash_parse(const char* text, PinHash* hash) {
+    size_t prefix = strlen(PIN_HASH_PREFIX);
+    unsigned int iterations;
+    int n;
+    memset(hash, 0, sizeof(*hash));
+    if (strncmp(text, PIN_HASH_PREFIX, prefix) != 0 ||
+        sscanf(text + prefix, "%u$%n", &iterations, &n) != 1 || iterations == 0) {
+        return 1;
+    }
+    text += prefix + n;
+    if (from_hex(text, hash->salt, PIN_SALT_LEN) != 0 || text[2 * PIN_SALT_LEN] != '$' ||
+        from_hex(text + 2 * PIN_SALT_LEN + 1, hash->hash, PIN_HASH_LEN) != 0) {
+        return 1;
+    }
+    hash->iterations = iterations;
+    return 0;
+}
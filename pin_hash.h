@@ -0,0 +1,45 @@
+#ifndef PIN_HASH_H
+#define PIN_HASH_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define PIN_SALT_LEN 16
+#define PIN_HASH_LEN 32
+#define DEFAULT_PIN_ITERATIONS 10000 // A few ms of PBKDF2 per check
+#define PIN_HASH_PREFIX "pbkdf2-sha256$"
+// pin_hash_format() output at its longest, NUL included
+#define PIN_HASH_TEXT_LEN (sizeof(PIN_HASH_PREFIX "4294967295$$") + 2 * (PIN_SALT_LEN + PIN_HASH_LEN))
+
+// A PIN as stored: PBKDF2-HMAC-SHA256 of its decimal digits with a random
+// salt. The cost is kept with each hash, so raising it affects new hashes
+// only and every stored one still verifies.
+//
+// iterations == 0 marks a PIN read from an older format, still in the
+// clear in the first bytes of hash; loading hashes it (see
+// pin_hash_plain()) before anything can log in.
+typedef struct {
+    uint32_t iterations;
+    uint8_t salt[PIN_SALT_LEN];
+    uint8_t hash[PIN_HASH_LEN];
+} PinHash;
+
+// Hash pin with a new random salt and `iterations` rounds
+// Returns 0 on success, 1 on failure (no randomness available).
+int pin_hash_create(int pin, int iterations, PinHash* out);
+
+// Whether pin is the PIN stored in hash. Costs as much as creating it.
+int pin_hash_verify(const PinHash* hash, int pin);
+
+// Store pin in the clear, marked for hashing (see above)
+void pin_hash_set_plain(PinHash* hash, int pin);
+// The PIN of a hash set by pin_hash_set_plain()
+int pin_hash_plain(const PinHash* hash);
+
+// Text form for the accounts file: "pbkdf2-sha256$iterations$salt$hash"
+// in hex. text must have room for PIN_HASH_TEXT_LEN bytes.
+void pin_hash_format(const PinHash* hash, char* text);
+// Returns 0 on success, 1 if text is not in that form
+int pin_hash_parse(const char* text, PinHash* hash);
+
+#endif
@@ -0,0 +1,804 @@
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#include "bank.h"
+#include "ledger.h"
+#include "protocol.h"
+#include "rate_limit.h"
+#include "trace.h"
+
+#define MAX_COMMAND_ECHO 49 // Characters of an unknown command echoed back
+
+#define MAX_AMOUNT_UNITS 1000000000000LL // Whole units accepted in an amount
+#define MAX_STATEMENT_NUMBER 999999999999999999ULL // Offsets, limits and times (seconds)
+#define MAX_STATEMENT_LINE 128 // Longest line of a STATEMENT entry
+
+static int admin_pin = -1; // AUDIT is refused until protocol_set_admin_pin()
+static int session_timeout = DEFAULT_SESSION_TIMEOUT;
+
+// One comma-separated field of a request, trimmed and NUL-terminated in
+// place, so it points into the request buffer
+typedef struct {
+    char* text;
+    size_t len;
+} Field;
+
+const char* const command_names[CMD_COUNT] = {
+    "unknown", "open", "close", "deposit", "withdraw", "balance",
+    "statement", "batch", "transfer", "audit", "login", "logout", "quit"
+};
+
+_Static_assert(MAX_ARGS >= 4 * MAX_BATCH_ITEMS, "a full BATCH must fit in MAX_ARGS");
+
+static inline int is_space(char c) {
+    return c == ' ' || c == '\t' || c == '\r' || c == '\n' || c == '\v' || c == '\f';
+}
+
+// Split request[0, length) into at most max_fields fields at the commas.
+// Each field is trimmed and terminated by overwriting the byte after it
+// (its comma, the final ';', or trailing whitespace), so the request must
+// end with ';'.
+// Returns the number of fields, or max_fields + 1 if there are more (the
+// first max_fields are still split).
+static int split_fields(char* request, size_t length, Field* fields, int max_fields) {
+    char* p = request;
+    char* end = request + length - 1; // The ';'
+    int count = 0;
+
+    while (count < max_fields) {
+        while (p < end && is_space(*p)) {
+            p++;
+        }
+        char* comma = p < end ? memchr(p, ',', (size_t)(end - p)) : NULL;
+        char* stop = comma != NULL ? comma : end;
+        char* last = stop;
+        while (last > p && is_space(last[-1])) {
+            last--;
+        }
+        *last = '\0';
+        fields[count].text = p;
+        fields[count].len = last - p;
+        count++;
+        if (comma == NULL) {
+            return count;
+        }
+        p = comma + 1;
+    }
+    return max_fields + 1;
+}
+
+// Compare a field with a lowercase word of the same length, ignoring case
+static inline int word_is(const char* text, const char* word, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        // OR-ing in 0x20 lowercases letters and never turns anything else
+        // into a lowercase letter
+        if ((text[i] | 0x20) != word[i]) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Commands have distinct lengths except OPEN/QUIT, CLOSE/BATCH/AUDIT/LOGIN,
+// DEPOSIT/BALANCE and WITHDRAW/TRANSFER, which the first letter tells apart, so one switch and one comparison
+// identify any of them
+static Command lookup_command(const Field* field) {
+    const char* t = field->text;
+    switch (field->len) {
+    case 4:
+        if ((t[0] | 0x20) == 'o') return word_is(t, "open", 4) ? CMD_OPEN : CMD_UNKNOWN;
+        return word_is(t, "quit", 4) ? CMD_QUIT : CMD_UNKNOWN;
+    case 5:
+        if ((t[0] | 0x20) == 'c') return word_is(t, "close", 5) ? CMD_CLOSE : CMD_UNKNOWN;
+        if ((t[0] | 0x20) == 'a') return word_is(t, "audit", 5) ? CMD_AUDIT : CMD_UNKNOWN;
+        if ((t[0] | 0x20) == 'l') return word_is(t, "login", 5) ? CMD_LOGIN : CMD_UNKNOWN;
+        return word_is(t, "batch", 5) ? CMD_BATCH : CMD_UNKNOWN;
+    case 6:
+        return word_is(t, "logout", 6) ? CMD_LOGOUT : CMD_UNKNOWN;
+    case 7:
+        if ((t[0] | 0x20) == 'd') return word_is(t, "deposit", 7) ? CMD_DEPOSIT : CMD_UNKNOWN;
+        return word_is(t, "balance", 7) ? CMD_BALANCE : CMD_UNKNOWN;
+    case 8:
+        if ((t[0] | 0x20) == 'w') return word_is(t, "withdraw", 8) ? CMD_WITHDRAW : CMD_UNKNOWN;
+        return word_is(t, "transfer", 8) ? CMD_TRANSFER : CMD_UNKNOWN;
+    case 9:
+        return word_is(t, "statement", 9) ? CMD_STATEMENT : CMD_UNKNOWN;
+    default:
+        return CMD_UNKNOWN;
+    }
+}
+
+// Parse a PIN: one to nine decimal digits
+// Returns 0 on success, 1 if the field is not a valid PIN
+static int parse_pin(const Field* field, int* pin) {
+    if (field->len == 0 || field->len > 9) {
+        return 1;
+    }
+    int value = 0;
+    for (size_t i = 0; i < field->len; i++) {
+        unsigned int digit = (unsigned char)field->text[i] - '0';
+        if (digit > 9) {
+            return 1;
+        }
+        value = value * 10 + digit;
+    }
+    *pin = value;
+    return 0;
+}
+
+// Parse a STATEMENT offset, limit or time: 1 to 18 decimal digits
+// Returns 0 on success, 1 if the field is not a valid number
+static int parse_number(const Field* field, uint64_t* number) {
+    if (field->len == 0 || field->len > 18) {
+        return 1;
+    }
+    uint64_t value = 0;
+    for (size_t i = 0; i < field->len; i++) {
+        unsigned int digit = (unsigned char)field->text[i] - '0';
+        if (digit > 9) {
+            return 1;
+        }
+        value = value * 10 + digit;
+    }
+    *number = value;
+    return 0;
+}
+
+// Parse an amount: decimal digits with up to two decimal places (no sign,
+// exponent or spaces), at most MAX_AMOUNT_UNITS. Parsed in hundredths so
+// "500.10" is exact before the conversion to double.
+// Returns 0 on success, 1 if the field is not a valid amount
+static int parse_amount(const Field* field, double* amount) {
+    const char* p = field->text;
+    const char* end = p + field->len;
+    int64_t units = 0;
+    int digits = 0;
+
+    for (; p < end && *p != '.'; p++) {
+        unsigned int digit = (unsigned char)*p - '0';
+        if (digit > 9 || units >= MAX_AMOUNT_UNITS) {
+            return 1;
+        }
+        units = units * 10 + digit;
+        digits++;
+    }
+    if (units > MAX_AMOUNT_UNITS) {
+        return 1;
+    }
+
+    int64_t hundredths = units * 100;
+    if (p < end) {
+        p++; // '.'
+        int decimals = end - p;
+        if (decimals == 0 || decimals > 2) {
+            return 1;
+        }
+        for (int scale = 10; p < end; p++, scale /= 10) {
+            unsigned int digit = (unsigned char)*p - '0';
+            if (digit > 9) {
+                return 1;
+            }
+            hundredths += digit * scale;
+        }
+    } else if (digits == 0) {
+        return 1;
+    }
+
+    *amount = hundredths / 100.0;
+    return 0;
+}
+
+// Copy a fixed reply into response; the length is known at compile time
+#define REPLY(text) reply(response, response_size, text, sizeof(text) - 1)
+
+static size_t reply(char* response, size_t response_size, const char* text, size_t len) {
+    if (len >= response_size) {
+        len = response_size - 1;
+    }
+    memcpy(response, text, len);
+    response[len] = '\0';
+    return len;
+}
+
+// snprintf a reply into response
+// Returns the length written (truncated replies count only what fit)
+static size_t format_reply(char* response, size_t response_size, const char* format, ...) {
+    va_list args;
+    va_start(args, format);
+    int n = vsnprintf(response, response_size, format, args);
+    va_end(args);
+    if (n < 0) {
+        response[0] = '\0';
+        return 0;
+    }
+    return (size_t)n < response_size ? (size_t)n : response_size - 1;
+}
+
+static size_t handle_open(const Field* args, int arg_count, char* response, size_t response_size) {
+    // Expected format: open,name,national_id,account_type,initial_deposit,pin;
+    if (arg_count != 5) {
+        return REPLY("ERROR Invalid OPEN command format. Usage: OPEN,name,national_id,account_type,initial_deposit,pin;\n");
+    }
+
+    const Field* account_type = &args[2];
+    const char* type;
+    if (account_type->len == 7 && word_is(account_type->text, "savings", 7)) {
+        type = "savings";
+    } else if (account_type->len == 8 && word_is(account_type->text, "checking", 8)) {
+        type = "checking";
+    } else {
+        return REPLY("ERROR Invalid account type. Use 'savings' or 'checking'.\n");
+    }
+
+    double initial_deposit;
+    if (parse_amount(&args[3], &initial_deposit) != 0) {
+        return REPLY("ERROR Invalid amount. Use digits with at most two decimal places.;\n");
+    }
+    int pin;
+    if (parse_pin(&args[4], &pin) != 0) {
+        return REPLY("ERROR Invalid PIN. Use up to 9 digits.;\n");
+    }
+
+    Account new_acc = open_account(args[0].text, args[1].text, type, initial_deposit, pin);
+    if (new_acc.is_active) {
+        return format_reply(response, response_size, "OK,Account Number:%s,PIN:%d;\n",
+                            new_acc.account_number, pin);
+    }
+    // Failure (e.g., national ID already exists)
+    return REPLY("ERROR 2 Failed to open account. National ID may already exist or invalid deposit amount.\n");
+}
+
+// Seconds on the session clock (CLOCK_MONOTONIC_COARSE: no system call)
+static uint64_t session_clock(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+    return (uint64_t)now.tv_sec;
+}
+
+void session_login(Session* session, const char* account_number, const AccountHandle* handle) {
+    session->logged_in = 1;
+    session->account = *handle;
+    snprintf(session->account_number, sizeof(session->account_number), "%s", account_number);
+    session->login_expires = session_clock() + (uint64_t)session_timeout;
+}
+
+void session_logout(Session* session) {
+    session->logged_in = 0;
+    session->account_number[0] = '\0';
+}
+
+SessionAccess session_account(const Session* session, const char* account_number, AccountHandle* handle) {
+    if (!session->logged_in || strcmp(session->account_number, account_number) != 0) {
+        return SESSION_OTHER;
+    }
+    if (session_clock() >= session->login_expires) {
+        return SESSION_EXPIRED;
+    }
+    *handle = session->account;
+    return SESSION_ACCOUNT;
+}
+
+// Find the account a command acts on (args[0]): by the PIN in args[1] if
+// with_pin is set, which costs a PIN hash, otherwise through the
+// session's LOGIN to it
+// Returns 0 with *handle set, 1 on account not found/PIN incorrect, 8 if
+// the session is not logged in to the account.
+static int authenticate(const Session* session, const Field* args, int with_pin, AccountHandle* handle) {
+    if (with_pin) {
+        int pin;
+        return parse_pin(&args[1], &pin) == 0 && bank_login(args[0].text, pin, handle) == 0 ? 0 : 1;
+    }
+    return session_account(session, args[0].text, handle) == SESSION_ACCOUNT ? 0 : 8;
+}
+
+// Reply to an authenticate() failure
+static size_t refuse(int error, char* response, size_t response_size) {
+    if (error == 8) {
+        return REPLY("ERROR 8 Not logged in to this account, or the session expired. LOGIN first.;\n");
+    }
+    return REPLY("ERROR 1 Account not found or incorrect PIN.;\n");
+}
+
+static size_t handle_login(const Field* args, int arg_count, char* response, size_t response_size,
+                           Session* session) {
+    // Expected format: login,account_number,pin;
+    if (arg_count != 2) {
+        return REPLY("ERROR Invalid LOGIN command format. Usage: LOGIN,account_number,pin;\n");
+    }
+
+    AccountHandle handle;
+    if (authenticate(session, args, 1, &handle) != 0) {
+        return REPLY("ERROR 1 Account not found or incorrect PIN.;\n");
+    }
+    session_login(session, args[0].text, &handle);
+    return format_reply(response, response_size, "OK,Logged in to account %s for %d seconds.;\n",
+                        args[0].text, session_timeout);
+}
+
+static size_t handle_logout(int arg_count, char* response, size_t response_size, Session* session) {
+    // Expected format: logout;
+    if (arg_count != 0) {
+        return REPLY("ERROR Invalid LOGOUT command format. Usage: LOGOUT;\n");
+    }
+    session_logout(session);
+    return REPLY("OK,Logged out.;\n");
+}
+
+// The commands below name an account and either give its PIN or, after
+// a LOGIN to that account, leave the PIN out
+static size_t handle_close(const Field* args, int arg_count, char* response, size_t response_size,
+                           Session* session) {
+    // Expected format: close,account_number,pin; or close,account_number;
+    if (arg_count != 1 && arg_count != 2) {
+        return REPLY("ERROR Invalid CLOSE command format. Usage: CLOSE,account_number,pin; or, logged in, CLOSE,account_number;\n");
+    }
+
+    AccountHandle handle;
+    int error = authenticate(session, args, arg_count == 2, &handle);
+    if (error != 0) {
+        return refuse(error, response, response_size);
+    }
+    if (close_account_as(&handle) != 0) {
+        return REPLY("ERROR 1 Account not found or incorrect PIN.;\n");
+    }
+    if (session->logged_in && strcmp(session->account_number, args[0].text) == 0) {
+        session_logout(session); // Nothing left to be logged in to
+    }
+    return format_reply(response, response_size, "OK,Account %s closed successfully.;\n", args[0].text);
+}
+
+static size_t handle_withdraw(const Field* args, int arg_count, char* response, size_t response_size,
+                              Session* session) {
+    // Expected format: withdraw,account_number,pin,amount; or withdraw,account_number,amount;
+    if (arg_count != 2 && arg_count != 3) {
+        return REPLY("ERROR Invalid WITHDRAW command format. Usage: WITHDRAW,account_number,pin,amount; or, logged in, WITHDRAW,account_number,amount;\n");
+    }
+
+    double amount;
+    if (parse_amount(&args[arg_count - 1], &amount) != 0) {
+        return REPLY("ERROR Invalid amount. Use digits with at most two decimal places.;\n");
+    }
+    AccountHandle handle;
+    int error = authenticate(session, args, arg_count == 3, &handle);
+    if (error != 0) {
+        return refuse(error, response, response_size);
+    }
+
+    int result = withdraw_as(&handle, amount);
+    switch (result) {
+    case 0:
+        return REPLY("OK,Withdrawal successful.;\n");
+    case 1:
+        return REPLY("ERROR 1 Account not found or incorrect PIN.;\n");
+    case 3:
+        return REPLY("ERROR 3 Insufficient funds or minimum balance requirement not met.;\n");
+    case 4:
+        return REPLY("ERROR 4 Withdrawal amount must be a positive multiple of 500.;\n");
+    default:
+        return format_reply(response, response_size, "ERROR Unknown withdrawal error code: %d.;\n", result);
+    }
+}
+
+static size_t handle_deposit(const Field* args, int arg_count, char* response, size_t response_size,
+                             Session* session) {
+    // Expected format: deposit,account_number,pin,amount; or deposit,account_number,amount;
+    if (arg_count != 2 && arg_count != 3) {
+        return REPLY("ERROR Invalid DEPOSIT command format. Usage: DEPOSIT,account_number,pin,amount; or, logged in, DEPOSIT,account_number,amount;\n");
+    }
+
+    double amount;
+    if (parse_amount(&args[arg_count - 1], &amount) != 0) {
+        return REPLY("ERROR Invalid amount. Use digits with at most two decimal places.;\n");
+    }
+    AccountHandle handle;
+    int error = authenticate(session, args, arg_count == 3, &handle);
+    if (error != 0) {
+        return refuse(error, response, response_size);
+    }
+
+    int result = deposit_as(&handle, amount);
+    switch (result) {
+    case 0:
+        return REPLY("OK,Deposit successful.;\n");
+    case 1:
+        return REPLY("ERROR 1 Account not found or incorrect PIN.;\n");
+    case 3:
+        return REPLY("ERROR 3 Minimum deposit amount is 500.;\n");
+    default:
+        return format_reply(response, response_size, "ERROR Unknown deposit error code: %d.;\n", result);
+    }
+}
+
+static size_t handle_transfer(const Field* args, int arg_count, char* response, size_t response_size,
+                              Session* session) {
+    // Expected format: transfer,from_account,pin,to_account,amount; or transfer,from_account,to_account,amount;
+    if (arg_count != 3 && arg_count != 4) {
+        return REPLY("ERROR Invalid TRANSFER command format. Usage: TRANSFER,from_account,pin,to_account,amount; or, logged in, TRANSFER,from_account,to_account,amount;\n");
+    }
+
+    double amount;
+    if (parse_amount(&args[arg_count - 1], &amount) != 0) {
+        return REPLY("ERROR Invalid amount. Use digits with at most two decimal places.;\n");
+    }
+    AccountHandle handle;
+    int error = authenticate(session, args, arg_count == 4, &handle);
+    if (error != 0) {
+        return refuse(error, response, response_size);
+    }
+
+    int result = transfer_as(&handle, args[arg_count - 2].text, amount);
+    switch (result) {
+    case 0:
+        return REPLY("OK,Transfer successful.;\n");
+    case 1:
+        return REPLY("ERROR 1 Account not found or incorrect PIN.;\n");
+    case 2:
+        return REPLY("ERROR 2 Destination account not found.;\n");
+    case 3:
+        return REPLY("ERROR 3 Insufficient funds or minimum balance requirement not met.;\n");
+    case 4:
+        return REPLY("ERROR 4 Transfer amount must be a positive multiple of 500.;\n");
+    case 5:
+        return REPLY("ERROR 5 Cannot transfer to the same account.;\n");
+    default:
+        return format_reply(response, response_size, "ERROR Unknown transfer error code: %d.;\n", result);
+    }
+}
+
+static size_t handle_balance(const Field* args, int arg_count, char* response, size_t response_size,
+                             Session* session) {
+    // Expected format: balance,account_number,pin; or balance,account_number;
+    if (arg_count != 1 && arg_count != 2) {
+        return REPLY("ERROR Invalid BALANCE command format. Usage: BALANCE,account_number,pin; or, logged in, BALANCE,account_number;\n");
+    }
+
+    AccountHandle handle;
+    int error = authenticate(session, args, arg_count == 2, &handle);
+    if (error != 0) {
+        return refuse(error, response, response_size);
+    }
+    double balance = check_balance_as(&handle); // -1.0 on error
+    if (balance < 0.0) {
+        return REPLY("ERROR 1 Account not found or incorrect PIN.;\n");
+    }
+    return format_reply(response, response_size, "OK,Balance:%.2f;\n", balance);
+}
+
+static const char* entry_type_name(int type) {
+    switch (type) {
+    case LEDGER_OPEN: return "Opening deposit";
+    case LEDGER_DEPOSIT: return "Deposit";
+    case LEDGER_WITHDRAWAL: return "Withdrawal";
+    case LEDGER_TRANSFER_IN: return "Transfer in";
+    case LEDGER_TRANSFER_OUT: return "Transfer out";
+    default: return "Unknown";
+    }
+}
+
+// Format a time in microseconds since the epoch as UTC
+static void format_time(int64_t time_us, char* buffer, size_t size) {
+    time_t seconds = (time_t)(time_us / 1000000);
+    struct tm tm;
+    if (gmtime_r(&seconds, &tm) == NULL || strftime(buffer, size, "%Y-%m-%d %H:%M:%S UTC", &tm) == 0) {
+        snprintf(buffer, size, "%lld s", (long long)seconds);
+    }
+}
+
+// Append statement entries to response[0, len) until the statement ends
+// (then close the reply) or the next line might not fit (then leave
+// session->streaming set, to continue in the next response)
+// Returns the new length.
+static size_t write_statement_entries(Session* session, char* response, size_t len, size_t response_size) {
+    StatementEntry entry;
+    while (len + MAX_STATEMENT_LINE + 3 <= response_size) {
+        if (!statement_next(&session->statement, &entry)) {
+            memcpy(response + len, ";\n", 3);
+            session->streaming = 0;
+            return len + 2;
+        }
+        char when[32] = "time unknown"; // Imported from an older format
+        if (entry.time_us != 0) {
+            format_time(entry.time_us, when, sizeof(when));
+        }
+        len += snprintf(response + len, response_size - len, "%llu. %s: %.2f (balance %.2f, %s)\n",
+                        (unsigned long long)entry.id + 1, entry_type_name(entry.type),
+                        entry.amount, entry.balance, when);
+    }
+    session->streaming = 1;
+    return len;
+}
+
+size_t continue_reply(Session* session, char* response, size_t response_size) {
+    response[0] = '\0';
+    return session->streaming ? write_statement_entries(session, response, 0, response_size) : 0;
+}
+
+// Seconds since the epoch to microseconds, plus extra, saturating
+static int64_t to_microseconds(uint64_t seconds, int64_t extra) {
+    return seconds >= (uint64_t)(INT64_MAX / 1000000) ? INT64_MAX : (int64_t)seconds * 1000000 + extra;
+}
+
+static size_t handle_statement(const Field* args, int arg_count, char* response, size_t response_size,
+                               Session* session) {
+    // Expected format: statement,account_number[,pin][,offset,limit[,from,to]];
+    // (the PIN is left out after a LOGIN, so an even count has one)
+    int with_pin = arg_count % 2 == 0;
+    const Field* query_args = args + (with_pin ? 2 : 1);
+    int query_count = arg_count - (with_pin ? 2 : 1);
+    uint64_t offset = 0, limit = MAX_TRANSACTIONS, from = 0, to = MAX_STATEMENT_NUMBER;
+    if (arg_count < 1 || arg_count > 6 ||
+        (query_count >= 2 && (parse_number(&query_args[0], &offset) != 0 || parse_number(&query_args[1], &limit) != 0 || limit == 0)) ||
+        (query_count == 4 && (parse_number(&query_args[2], &from) != 0 || parse_number(&query_args[3], &to) != 0 || from > to))) {
+        return REPLY("ERROR Invalid STATEMENT command format (times in Unix seconds). Usage: STATEMENT,account_number,pin[,offset,limit[,from,to]]; or, logged in, STATEMENT,account_number[,offset,limit[,from,to]];\n");
+    }
+
+    AccountHandle handle;
+    int error = authenticate(session, args, with_pin, &handle);
+    if (error != 0) {
+        return refuse(error, response, response_size);
+    }
+
+    StatementQuery query;
+    query.offset = offset;
+    query.limit = limit;
+    query.latest = query_count == 0;
+    query.from_us = to_microseconds(from, 0);
+    query.to_us = to_microseconds(to, 999999); // Through the end of that second
+
+    double balance;
+    uint64_t total;
+    if (statement_begin_as(&handle, &query, &session->statement, &balance, &total) != 0) {
+        return REPLY("ERROR 1 Account not found or incorrect PIN.;\n");
+    }
+
+    // Entries follow the header, as many per response as fit
+    size_t len = format_reply(response, response_size, "OK,Statement for Account %s (Balance: %.2f):\n",
+                              args[0].text, balance);
+    if (total == 0) {
+        len += format_reply(response + len, response_size - len, "No transactions yet.;\n");
+        return len;
+    }
+    if (query.latest) {
+        uint64_t shown = session->statement.end < limit ? session->statement.end : limit;
+        len += format_reply(response + len, response_size - len, "Last %llu Transactions:\n", (unsigned long long)shown);
+    } else if (query_count == 4) {
+        char first[32], last[32];
+        format_time(query.from_us, first, sizeof(first));
+        format_time(query.to_us, last, sizeof(last));
+        len += format_reply(response + len, response_size - len,
+                            "Transactions from %s to %s (offset %llu, limit %llu) of %llu:\n", first, last,
+                            (unsigned long long)offset, (unsigned long long)limit, (unsigned long long)total);
+    } else {
+        len += format_reply(response + len, response_size - len, "Transactions (offset %llu, limit %llu) of %llu:\n",
+                            (unsigned long long)offset, (unsigned long long)limit, (unsigned long long)total);
+    }
+    return write_statement_entries(session, response, len, response_size);
+}
+
+static size_t handle_batch(const Field* args, int arg_count, char* response, size_t response_size) {
+    // Expected format: batch,D|W,account_number,pin,amount,...;
+    if (arg_count > 4 * MAX_BATCH_ITEMS) {
+        return REPLY("ERROR Too many BATCH items (at most 256).;\n");
+    }
+    if (arg_count == 0 || arg_count % 4 != 0) {
+        return REPLY("ERROR Invalid BATCH command format (1-256 items). Usage: BATCH,D|W,account_number,pin,amount,...;\n");
+    }
+
+    BatchItem items[MAX_BATCH_ITEMS];
+    int statuses[MAX_BATCH_ITEMS];
+    int count = arg_count / 4;
+    for (int i = 0; i < count; i++) {
+        const Field* item = &args[i * 4];
+        if (item[0].len != 1 || ((item[0].text[0] | 0x20) != 'd' && (item[0].text[0] | 0x20) != 'w')) {
+            return REPLY("ERROR Invalid BATCH command format (1-256 items). Usage: BATCH,D|W,account_number,pin,amount,...;\n");
+        }
+        items[i].withdrawal = (item[0].text[0] | 0x20) == 'w';
+        items[i].account_number = item[1].text;
+        if (parse_pin(&item[2], &items[i].pin) != 0) {
+            items[i].pin = -1; // Matches no account: reported as status 1
+        }
+        if (parse_amount(&item[3], &items[i].amount) != 0) {
+            return REPLY("ERROR Invalid amount. Use digits with at most two decimal places.;\n");
+        }
+    }
+
+    int result = apply_batch(items, count, statuses);
+    size_t len = result == 0 ? REPLY("OK,Batch applied:") : REPLY("ERROR 5 Batch rejected:");
+    // Per-item codes are single digits
+    for (int i = 0; i < count && len + 4 < response_size; i++) {
+        if (i > 0) {
+            response[len++] = ',';
+        }
+        response[len++] = '0' + statuses[i];
+    }
+    memcpy(response + len, ";\n", 3);
+    return len + 2;
+}
+
+// Hundredths as a decimal amount, exactly (a double would round totals
+// beyond 2^53 hundredths)
+static int format_hundredths(char* out, size_t size, int64_t hundredths) {
+    uint64_t magnitude = hundredths < 0 ? -(uint64_t)hundredths : (uint64_t)hundredths;
+    return snprintf(out, size, "%s%llu.%02llu", hundredths < 0 ? "-" : "",
+                    (unsigned long long)(magnitude / 100), (unsigned long long)(magnitude % 100));
+}
+
+static size_t handle_audit(const Field* args, int arg_count, char* response, size_t response_size) {
+    // Expected format: audit,admin_pin;
+    static const char* bucket_names[AUDIT_BUCKETS] = {
+        "below 1,000", "1,000 to 10,000", "10,000 to 100,000", "100,000 to 1,000,000",
+        "1,000,000 to 10,000,000", "10,000,000 to 100,000,000", "100,000,000 to 1,000,000,000",
+        "1,000,000,000 and up"
+    };
+    if (arg_count != 1) {
+        return REPLY("ERROR Invalid AUDIT command format. Usage: AUDIT,admin_pin;\n");
+    }
+    int pin;
+    if (admin_pin < 0 || parse_pin(&args[0], &pin) != 0 || pin != admin_pin) {
+        return REPLY("ERROR 6 Not authorized.;\n");
+    }
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    BankAudit audit;
+    bank_audit(&audit);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double ms = (end.tv_sec - start.tv_sec) * 1e3 + (end.tv_nsec - start.tv_nsec) / 1e6;
+
+    char total[32], min[32], max[32];
+    format_hundredths(total, sizeof(total), audit.total);
+    format_hundredths(min, sizeof(min), audit.min);
+    format_hundredths(max, sizeof(max), audit.max);
+    size_t len = format_reply(response, response_size,
+                              "OK,Audit of %llu accounts (%.3f ms):\nTotal deposits: %s\n"
+                              "Lowest balance: %s\nHighest balance: %s\nAccounts by type:\n",
+                              (unsigned long long)audit.accounts, ms, total, min, max);
+    for (int i = 0; i < audit.type_count; i++) {
+        len += format_reply(response + len, response_size - len, "  %s: %llu\n",
+                            audit.types[i].name[0] != '\0' ? audit.types[i].name : "other",
+                            (unsigned long long)audit.types[i].accounts);
+    }
+    len += format_reply(response + len, response_size - len, "Accounts by balance:\n");
+    for (int k = 0; k < AUDIT_BUCKETS; k++) {
+        len += format_reply(response + len, response_size - len, "  %s: %llu\n",
+                            bucket_names[k], (unsigned long long)audit.histogram[k]);
+    }
+    len += format_reply(response + len, response_size - len, ";\n");
+    return len;
+}
+
+// Take the tokens of a request from the buckets of its client's address
+// and of the account it names
+// Returns 1 if within both rates, 0 if not.
+static int within_rate(const Session* session, Command command, const Field* args, int arg_count) {
+    RateClass rate_class;
+    switch (command) {
+    case CMD_BALANCE:
+    case CMD_STATEMENT:
+    case CMD_LOGIN:
+    case CMD_AUDIT:
+        rate_class = RATE_READ;
+        break;
+    case CMD_OPEN:
+    case CMD_CLOSE:
+    case CMD_DEPOSIT:
+    case CMD_WITHDRAW:
+    case CMD_TRANSFER:
+    case CMD_BATCH:
+        rate_class = RATE_WRITE;
+        break;
+    default:
+        return 1; // LOGOUT, QUIT and malformed requests cost nothing to answer
+    }
+    if (!rate_limit_enabled(rate_class)) {
+        return 1;
+    }
+
+    int cost = command == CMD_BATCH && arg_count >= 4 ? arg_count / 4 : 1; // A token per item
+    if (!rate_limit_allow(rate_class, rate_key_address(session->client), cost)) {
+        return 0;
+    }
+    // OPEN, AUDIT and BATCH name no single account
+    int named = command != CMD_OPEN && command != CMD_AUDIT && command != CMD_BATCH && arg_count >= 1;
+    return !named || rate_limit_allow(rate_class, rate_key_account(args[0].text), 1);
+}
+
+void protocol_set_admin_pin(int pin) {
+    admin_pin = pin;
+}
+
+void protocol_set_session_timeout(int seconds) {
+    session_timeout = seconds;
+}
+
+void session_init(Session* session, uint32_t client) {
+    session->quit = 0;
+    session->client = client;
+    session->streaming = 0;
+    session_logout(session);
+}
+
+size_t process_request(char* request, size_t length, char* response, size_t response_size, Session* session) {
+    session->quit = 0;
+    session->command = CMD_UNKNOWN;
+    uint64_t parse = trace_begin();
+
+    // --- Protocol Parsing: COMMAND,arg1,arg2,...,argN; ---
+
+    // Check for the terminating semicolon, ignoring trailing whitespace
+    while (length > 0 && is_space(request[length - 1])) {
+        length--;
+    }
+    if (length == 0 || request[length - 1] != ';') {
+        return REPLY("ERROR Invalid protocol format: Missing terminating semicolon ';'.\n");
+    }
+
+    // The first field is the command, the rest are arguments
+    Field fields[MAX_ARGS + 1];
+    int field_count = split_fields(request, length, fields, MAX_ARGS + 1);
+    const Field* args = fields + 1;
+    int arg_count = field_count - 1;
+
+    // --- Command Handling based on parsed fields ---
+
+    session->command = lookup_command(&fields[0]);
+    trace_end(TRACE_PARSE, 0, parse);
+
+    // No command takes more than MAX_ARGS arguments. The BATCH handler
+    // only looks at the count then, to say there are too many items.
+    if (field_count > MAX_ARGS + 1) {
+        if (session->command == CMD_BATCH) {
+            return handle_batch(args, arg_count, response, response_size);
+        }
+        return REPLY("ERROR Invalid protocol format: Too many fields.;\n");
+    }
+
+    // Over its rate, a request is refused before it reaches the accounts
+    if (!within_rate(session, session->command, args, arg_count)) {
+        return REPLY("ERROR 9 Too many requests, slow down.;\n");
+    }
+    switch (session->command) {
+    case CMD_OPEN:
+        return handle_open(args, arg_count, response, response_size);
+    case CMD_CLOSE:
+        return handle_close(args, arg_count, response, response_size, session);
+    case CMD_WITHDRAW:
+        return handle_withdraw(args, arg_count, response, response_size, session);
+    case CMD_DEPOSIT:
+        return handle_deposit(args, arg_count, response, response_size, session);
+    case CMD_BALANCE:
+        return handle_balance(args, arg_count, response, response_size, session);
+    case CMD_STATEMENT:
+        return handle_statement(args, arg_count, response, response_size, session);
+    case CMD_TRANSFER:
+        return handle_transfer(args, arg_count, response, response_size, session);
+    case CMD_BATCH:
+        return handle_batch(args, arg_count, response, response_size);
+    case CMD_AUDIT:
+        return handle_audit(args, arg_count, response, response_size);
+    case CMD_LOGIN:
+        return handle_login(args, arg_count, response, response_size, session);
+    case CMD_LOGOUT:
+        return handle_logout(arg_count, response, response_size, session);
+    case CMD_QUIT:
+        if (arg_count != 0) {
+            return REPLY("ERROR Invalid QUIT command format. Usage: QUIT;\n");
+        }
+        session->quit = 1; // Caller closes the connection after sending
+        return REPLY("OK,Connection terminated.;\n");
+    default: {
+        // Echo the command back in lowercase, as it was matched
+        char command[MAX_COMMAND_ECHO + 1];
+        size_t len = fields[0].len < MAX_COMMAND_ECHO ? fields[0].len : MAX_COMMAND_ECHO;
+        for (size_t i = 0; i < len; i++) {
+            char c = fields[0].text[i];
+            command[i] = c >= 'A' && c <= 'Z' ? c + ('a' - 'A') : c;
+        }
+        command[len] = '\0';
+        return format_reply(response, response_size, "ERROR Unknown command: %s;\n", command);
+    }
+    }
+}
@@ -0,0 +1,86 @@
+#ifndef PROTOCOL_H
+#define PROTOCOL_H
+
+#include <stddef.h>
+#include "bank.h"
+
+#define BUFFER_SIZE 1024
+#define RESPONSE_SIZE (BUFFER_SIZE * 2) // Room for any reply, or for one part of a STATEMENT
+#define MAX_ARGS 1024 // Maximum number of arguments expected (BATCH: four per item)
+#define DEFAULT_SESSION_TIMEOUT 900 // Seconds a LOGIN lasts
+
+typedef enum {
+    CMD_UNKNOWN,
+    CMD_OPEN,
+    CMD_CLOSE,
+    CMD_DEPOSIT,
+    CMD_WITHDRAW,
+    CMD_BALANCE,
+    CMD_STATEMENT,
+    CMD_BATCH,
+    CMD_TRANSFER,
+    CMD_AUDIT,
+    CMD_LOGIN,
+    CMD_LOGOUT,
+    CMD_QUIT,
+    CMD_COUNT
+} Command;
+
+// Lowercase names of the commands, for metrics
+extern const char* const command_names[CMD_COUNT];
+
+// Per-connection protocol state
+typedef struct {
+    int quit;                  // QUIT answered; nothing after it is executed
+    uint32_t client;           // IPv4 address of the peer (network order), for rate limits
+    Command command;           // Of the last request (CMD_UNKNOWN if malformed)
+    int streaming;             // A STATEMENT reply is still being written
+    StatementCursor statement; // Where it is
+    // LOGIN: the account whose PIN the client proved, usable without the
+    // PIN until login_expires (seconds, CLOCK_MONOTONIC_COARSE)
+    int logged_in;
+    AccountHandle account;
+    char account_number[MAX_ACCOUNT_NUMBER_LEN];
+    uint64_t login_expires;
+} Session;
+
+void session_init(Session* session, uint32_t client);
+
+// Log a session in to the account of handle, replacing any earlier login
+void session_login(Session* session, const char* account_number, const AccountHandle* handle);
+void session_logout(Session* session);
+
+// What a session knows of account_number
+typedef enum {
+    SESSION_ACCOUNT,   // Logged in to it: *handle is set
+    SESSION_OTHER,     // Not logged in, or logged in to another account
+    SESSION_EXPIRED    // Logged in to it, but the login has expired
+} SessionAccess;
+
+SessionAccess session_account(const Session* session, const char* account_number, AccountHandle* handle);
+
+// How long a LOGIN lasts, from the LOGIN on; DEFAULT_SESSION_TIMEOUT
+// until called. Call before any fork.
+void protocol_set_session_timeout(int seconds);
+
+// Allow the AUDIT admin command to clients giving this PIN; it is refused
+// to everyone until this is called. Call before any fork.
+void protocol_set_admin_pin(int pin);
+
+// Parse and execute one "COMMAND,arg1,...,argN;" request of `length`
+// bytes (trailing whitespace allowed). The request need not be
+// NUL-terminated; it is tokenized in place, so it is modified.
+// The reply is written to `response` and NUL-terminated.
+// Returns the length of the reply. session->command is set to the
+// request's command, session->quit if the client asked to QUIT, and
+// session->streaming if the reply (a STATEMENT of any length) continues
+// beyond this response, see continue_reply().
+size_t process_request(char* request, size_t length, char* response, size_t response_size, Session* session);
+
+// Write the next part of a streaming reply, while session->streaming is
+// set; the reply is complete once it is cleared. Nothing else may be
+// written to the connection in between.
+// Returns the length written.
+size_t continue_reply(Session* session, char* response, size_t response_size);
+
+#endif
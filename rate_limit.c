@@ -0,0 +1,191 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/mman.h>
+
+#include "rate_limit.h"
+#include "metrics.h"
+
+// A bucket is one word: the tag of its key (18 bits, never 0, so that 0
+// is an empty bucket), its class (2 bits) and the time in microseconds,
+// modulo 2^44 (about 200 days), at which it will be full again
+#define TIME_BITS 44
+#define TIME_MASK (((uint64_t)1 << TIME_BITS) - 1)
+#define CLASS_SHIFT TIME_BITS
+#define TAG_SHIFT (TIME_BITS + 2)
+#define ID_MASK (~TIME_MASK)
+#define GROUP 8 // Buckets a key may use: one cache line
+#define MAX_BURST 1000000
+
+_Static_assert(RATE_CLASSES <= 4, "a class must fit in two bits");
+_Static_assert(RATE_CLASSES == METRICS_RATE_CLASSES, "every class must be counted");
+
+const char* const rate_class_names[RATE_CLASSES] = { "connect", "read", "write" };
+
+typedef struct {
+    uint64_t interval; // Microseconds per token, 0 if unlimited
+    uint64_t window;   // interval * burst: how far ahead of now a bucket may be
+} ClassLimit;
+
+static ClassLimit limits[RATE_CLASSES];
+static uint64_t* buckets = NULL;
+
+int rate_limit_init(int shared) {
+    void* map = mmap(NULL, RATE_LIMIT_SLOTS * sizeof(uint64_t), PROT_READ | PROT_WRITE,
+                     (shared ? MAP_SHARED : MAP_PRIVATE) | MAP_ANONYMOUS, -1, 0);
+    if (map == MAP_FAILED) {
+        perror("Error mapping rate limit buckets");
+        return 1;
+    }
+    buckets = map;
+    return 0;
+}
+
+void rate_limit_set(RateClass rate_class, int rate, int burst) {
+    if (rate <= 0) {
+        limits[rate_class] = (ClassLimit){ 0, 0 };
+        return;
+    }
+    uint64_t interval = 1000000 / (uint64_t)rate;
+    limits[rate_class].interval = interval > 0 ? interval : 1;
+    limits[rate_class].window = limits[rate_class].interval * (uint64_t)(burst > 0 ? burst : 1);
+}
+
+int rate_limit_parse(const char* spec) {
+    int rates[RATE_CLASSES] = { 0 }, bursts[RATE_CLASSES] = { 0 }, given[RATE_CLASSES] = { 0 };
+    char copy[256];
+    if (snprintf(copy, sizeof(copy), "%s", spec) >= (int)sizeof(copy)) {
+        return 1;
+    }
+
+    char* save = NULL;
+    for (char* item = strtok_r(copy, ",", &save); item != NULL; item = strtok_r(NULL, ",", &save)) {
+        char* value = strchr(item, '=');
+        if (value == NULL) {
+            return 1;
+        }
+        *value++ = '\0';
+        int c = 0;
+        while (c < RATE_CLASSES && strcmp(item, rate_class_names[c]) != 0) {
+            c++;
+        }
+        char* end;
+        long rate = strtol(value, &end, 10);
+        long burst = rate;
+        if (*end == '/') {
+            burst = strtol(end + 1, &end, 10);
+        }
+        if (c == RATE_CLASSES || end == value || *end != '\0' || rate < 1 || rate > RATE_LIMIT_MAX_RATE ||
+            burst < 1 || burst > MAX_BURST) {
+            return 1;
+        }
+        rates[c] = (int)rate;
+        bursts[c] = (int)burst;
+        given[c] = 1;
+    }
+
+    for (int c = 0; c < RATE_CLASSES; c++) {
+        if (given[c]) {
+            rate_limit_set(c, rates[c], bursts[c]);
+        }
+    }
+    return 0;
+}
+
+int rate_limit_enabled(RateClass rate_class) {
+    return buckets != NULL && limits[rate_class].interval != 0;
+}
+
+static uint64_t now_us(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000 + (uint64_t)now.tv_nsec / 1000;
+}
+
+// Mix the bits of a key (splitmix64's finalizer)
+static inline uint64_t mix(uint64_t x) {
+    x ^= x >> 30;
+    x *= 0xbf58476d1ce4e5b9ULL;
+    x ^= x >> 27;
+    x *= 0x94d049bb133111ebULL;
+    return x ^ (x >> 31);
+}
+
+// How far ahead of now a bucket word's time is, modulo 2^44. A bucket
+// already full is behind now, which wraps to far ahead: beyond any window.
+static inline uint64_t ahead_of(uint64_t word, uint64_t now) {
+    return ((word & TIME_MASK) - now) & TIME_MASK;
+}
+
+// Whether a bucket word may be taken over: empty, or full again (a full
+// bucket and no bucket limit the same way)
+static inline int reusable(uint64_t word, uint64_t now) {
+    if (word == 0) {
+        return 1;
+    }
+    int rate_class = (int)((word >> CLASS_SHIFT) & 3);
+    return rate_class >= RATE_CLASSES || ahead_of(word, now) > limits[rate_class].window;
+}
+
+int rate_limit_allow(RateClass rate_class, uint64_t key, int cost) {
+    const ClassLimit* limit = &limits[rate_class];
+    if (buckets == NULL || limit->interval == 0) {
+        return 1;
+    }
+    uint64_t h = mix(key);
+    uint64_t tag = h >> TAG_SHIFT;
+    uint64_t id = ((tag != 0 ? tag : 1) << TAG_SHIFT) | ((uint64_t)rate_class << CLASS_SHIFT);
+    uint64_t* group = buckets + ((h & (RATE_LIMIT_SLOTS - 1)) & ~(uint64_t)(GROUP - 1));
+    uint64_t need = (uint64_t)(cost < 1 ? 1 : cost > RATE_LIMIT_MAX_COST ? RATE_LIMIT_MAX_COST : cost) * limit->interval;
+
+    while (1) {
+        uint64_t now = now_us() & TIME_MASK;
+        uint64_t* bucket = NULL;
+        uint64_t* spare = NULL;
+        uint64_t seen = 0, spare_seen = 0;
+        for (int i = 0; i < GROUP; i++) {
+            uint64_t word = __atomic_load_n(&group[i], __ATOMIC_RELAXED);
+            if ((word & ID_MASK) == id) {
+                bucket = &group[i];
+                seen = word;
+                break;
+            }
+            if (spare == NULL && reusable(word, now)) {
+                spare = &group[i];
+                spare_seen = word;
+            }
+        }
+        if (bucket == NULL && spare == NULL) {
+            return 1; // Every bucket of the line is limiting someone
+        }
+
+        // The bucket is drawn down by moving its full time ahead; it may
+        // not get further ahead than the burst allows
+        uint64_t ahead = 0;
+        if (bucket != NULL) {
+            ahead = ahead_of(seen, now);
+            ahead = ahead <= limit->window ? ahead : 0;
+        } else {
+            bucket = spare;
+            seen = spare_seen;
+        }
+        if (ahead + need > limit->window) {
+            metrics_rate_limited(rate_class);
+            return 0;
+        }
+        uint64_t word = id | ((now + ahead + need) & TIME_MASK);
+        if (__atomic_compare_exchange_n(bucket, &seen, word, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+            return 1;
+        }
+        // Another request changed the bucket (or took it over): look again
+    }
+}
+
+uint64_t rate_key_account(const char* account_number) {
+    uint64_t h = 0xcbf29ce484222325ULL; // FNV-1a
+    for (const char* p = account_number; *p != '\0'; p++) {
+        h = (h ^ (unsigned char)*p) * 0x100000001b3ULL;
+    }
+    return h | ((uint64_t)1 << 63); // Apart from every address key
+}
@@ -0,0 +1,55 @@
+#ifndef RATE_LIMIT_H
+#define RATE_LIMIT_H
+
+#include <stdint.h>
+
+#define RATE_LIMIT_SLOTS (1 << 16) // Buckets in the table, 8 bytes each
+#define RATE_LIMIT_MAX_RATE 1000000 // Per second
+#define RATE_LIMIT_MAX_COST 256     // Tokens one request may take (a full BATCH)
+
+// What a bucket limits. Each class has its own rate; a client address
+// and an account each get a bucket per class.
+typedef enum {
+    RATE_CONNECT, // New connections, per client address
+    RATE_READ,    // BALANCE, STATEMENT, LOGIN, AUDIT
+    RATE_WRITE,   // OPEN, CLOSE, DEPOSIT, WITHDRAW, TRANSFER, BATCH (a token per item)
+    RATE_CLASSES
+} RateClass;
+
+extern const char* const rate_class_names[RATE_CLASSES];
+
+// Map the bucket table. With shared set it lives in a MAP_SHARED mapping,
+// so forked children draw from the buckets the parent sees. Call once,
+// before any fork; until then (and in tools that never call it) every
+// request is allowed.
+// Returns 0 on success, 1 on failure.
+int rate_limit_init(int shared);
+
+// Allow `rate` tokens per second in a class, with bursts of up to `burst`
+// at once; rate 0 (the default) leaves the class unlimited. Call before
+// any fork.
+void rate_limit_set(RateClass rate_class, int rate, int burst);
+
+// Parse "class=rate[/burst],..." (classes connect, read and write; burst
+// defaults to one second's worth) and apply it with rate_limit_set()
+// Returns 0 on success, 1 if spec is malformed (nothing is applied).
+int rate_limit_parse(const char* spec);
+
+// Whether a class is limited at all, to skip building keys when not
+int rate_limit_enabled(RateClass rate_class);
+
+// Take cost tokens from the bucket of key in a class. The buckets are
+// token buckets kept as the time they will next be full (GCRA), one word
+// each, updated with a single compare-and-swap: no locks, and a bucket
+// that has refilled costs nothing to keep. A key whose bucket cannot be
+// placed (its cache line of buckets all busy) is allowed.
+// Returns 1 if allowed, 0 if over the limit (nothing is taken then).
+int rate_limit_allow(RateClass rate_class, uint64_t key, int cost);
+
+// Keys of a client address (IPv4, network order) and of an account
+static inline uint64_t rate_key_address(uint32_t address) {
+    return (uint64_t)address | ((uint64_t)1 << 32);
+}
+uint64_t rate_key_account(const char* account_number);
+
+#endif
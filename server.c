@@ -1,327 +1,236 @@
-/* CONCEPTUAL SERVER ALGORITHM (CONCURRENT CONNECTION-ORIENTED WITH PROCESSES)*/
+/* CONCEPTUAL SERVER ALGORITHM (CONCURRENT CONNECTION-ORIENTED)*/
 /* 
     1. Create a socket
     2. Bind the socket to an address and port
     3. Put the socket in passive listening mode
-    4. Accept a connection from a client
-    5. Fork a new process to handle the client
-    6. In the child process:
-    REPEAT:
-        a. Read data from the client
-        b. Parse the command and arguments
-        c. Execute the command (e.g., open, close, withdraw) by calling the appropriate function
-        d. Prepare the response based on the command execution result
-        e. Send the response back to the client
-    If the command is "quit", break the loop and close the client socket 
-    7. In the parent process:
-        a. Close the client socket and continue listening for new connections
+    4. Serve clients in one of two modes:
+
+    EPOLL MODE (default): one process owns the account table
+        a. Register the listening socket with epoll
+        b. On readiness, accept new connections or advance the
+           connection's state machine (read request -> execute -> send)
+        c. Responses that do not fit in the socket buffer are finished
+           when the socket becomes writable again
+
+    FORK MODE (-m fork):
+        a. Accept a connection from a client
+        b. Fork a new process to handle the client
+        c. In the child process:
+        REPEAT:
+            i.   Read data from the client
+            ii.  Parse the command and arguments
+            iii. Execute the command (e.g., open, close, withdraw) by calling the appropriate function
+            iv.  Prepare the response based on the command execution result
+            v.   Send the response back to the client
+        If the command is "quit", break the loop and close the client socket 
+        d. In the parent process:
+            i. Close the client socket and continue listening for new connections
 */
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
 #include <unistd.h>
+#include <poll.h>
 #include <arpa/inet.h>
 #include <sys/socket.h>
+#include <sys/time.h>
 #include <sys/wait.h>
 #include <signal.h>
 #include <time.h>
-#include <ctype.h>
+#include <fcntl.h>
 
 #include "bank.h"
+#include "framing.h"
+#include "event_loop.h"
+#include "workers.h"
+#include "uring_loop.h"
+#include "admission.h"
+#include "metrics.h"
+#include "rate_limit.h"
+#include "trace.h"
 
 #define PORT 8080
-#define BUFFER_SIZE 1024
-#define ACCOUNTS_DATA_FILE "accounts_data.txt"
-#define MAX_ARGS 10 // Define maximum number of arguments expected
-
-// Signal handler to reap zombie processes
+#define LISTEN_BACKLOG SOMAXCONN // Default; absorbs connection spikes (capped by net.core.somaxconn)
+#define ACCOUNTS_DATA_FILE "accounts_data.txt"      // Text format, read only to migrate
+#define ACCOUNTS_SNAPSHOT_FILE "accounts_data.snap" // Binary snapshot
+#define ACCOUNTS_LOG_FILE "accounts_data.log"       // Changes since the last snapshot
+#define ACCOUNTS_LEDGER_FILE "accounts_data.ledger" // Transaction history
+#define CHECKPOINT_INTERVAL 60                      // Seconds between background snapshots
+
+// Signal handler to reap zombie processes; each was serving a client
 void sigchld_handler(int sig) {
-    while (waitpid(-1, NULL, WNOHANG) > 0);
-}
-
-// Trim leading and trailing whitespace
-void trim_whitespace(char *str) {
-    char *end;
-
-    // Trim leading space
-    while(isspace((unsigned char)*str)) str++;
-
-    if(*str == 0) // All spaces?
-        return;
-
-    // Trim trailing space
-    end = str + strlen(str) - 1;
-    while(end > str && isspace((unsigned char)*end)) end--;
-
-    // Write new null terminator
-    *(end+1) = 0;
-}
-
-// Convert string to lowercase
-void to_lowercase(char *str) {
-    for (int i = 0; str[i]; i++) {
-        str[i] = tolower((unsigned char)str[i]);
+    while (waitpid(-1, NULL, WNOHANG) > 0) {
+        admission_leave();
     }
 }
 
-// handle a single client connection
-void handle_client(int client_socket) {
-    char buffer[BUFFER_SIZE] = {0};
+// handle a single client connection (fork mode)
+void handle_client(int client_socket, uint32_t client_address) {
+    static RequestStream stream; // One client per process
+    size_t room;
     ssize_t bytes_read;
+    uint64_t busy_since = 0;
 
-    while (1) {
-        memset(buffer, 0, BUFFER_SIZE);
-
-        // Read from client
-        bytes_read = read(client_socket, buffer, BUFFER_SIZE - 1);
-        if (bytes_read <= 0) {
-            break; // Connection closed or error
-        }
-        buffer[bytes_read] = '\0';
-
-        // Trim whitespace from the whole received string first
-        trim_whitespace(buffer);
-
-        char command[50] = {0};
-        char args[MAX_ARGS][100] = {0};
-        int arg_count = 0;
-        char response[BUFFER_SIZE * 2] = {0}; // Increased buffer size for potential statement output
-
-        // --- Protocol Parsing: COMMAND,arg1,arg2,...,argN; ---
-
-        // Check for the terminating semicolon
-        int len = strlen(buffer);
-        if (len == 0 || buffer[len - 1] != ';') {
-            snprintf(response, sizeof(response), "ERROR Invalid protocol format: Missing terminating semicolon ';'.\n");
-            send(client_socket, response, strlen(response), 0);
-            continue; 
-        }
+    // A client that stops reading its replies stalls the sends: give up on
+    // it like on a stalled request
+    if (connection_limits.request_timeout > 0) {
+        struct timeval timeout = { connection_limits.request_timeout, 0 };
+        setsockopt(client_socket, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    }
 
-        // Remove the semicolon for easier parsing
-        buffer[len - 1] = '\0';
-
-        // Use strtok to split the string by commas
-        char *token = strtok(buffer, ",");
-        int token_index = 0;
-        // Parse the command and arguments
-        // The first token is the command, the rest are arguments
-        while (token != NULL && token_index < MAX_ARGS + 1) {
-            trim_whitespace(token); // Trim whitespace from each token
-            if (token_index == 0) {
-                // First token is the command
-                strncpy(command, token, sizeof(command) - 1);
-                command[sizeof(command) - 1] = '\0';
-                to_lowercase(command); // Commands are case-insensitive
-            } else {
-                // Subsequent tokens are arguments
-                strncpy(args[arg_count], token, sizeof(args[arg_count]) - 1);
-                args[arg_count][sizeof(args[arg_count]) - 1] = '\0';
-                arg_count++;
+    stream_init(&stream, client_address);
+    while (!stream.session.quit) {
+        // Wait for the client no longer than its idle or request deadline
+        uint64_t now = timeout_now();
+        int busy = stream_busy(&stream);
+        uint64_t deadline = connection_deadline(now, busy, busy_since);
+        if (deadline != 0) {
+            struct pollfd pfd = { client_socket, POLLIN, 0 };
+            int ready = poll(&pfd, 1, deadline > now ? (int)(deadline - now) * TIMEOUT_TICK_MS : 0);
+            if (ready < 0 && errno == EINTR) {
+                continue;
+            }
+            if (ready == 0) {
+                metrics_timed_out(busy ? TIMEOUT_REQUEST : TIMEOUT_IDLE);
+                return;
             }
-            token = strtok(NULL, ",");
-            token_index++;
         }
 
-        // --- Command Handling based on parsed tokens ---
-
-        if (strcmp(command, "open") == 0) {
-            // Expected format: open,name,national_id,account_type,initial_deposit,pin;
-            if (arg_count == 5) {
-                char* name = args[0];
-                char* national_id = args[1];
-                char* account_type = args[2];
-                double initial_deposit = atof(args[3]);
-                int pin = atoi(args[4]);
-
-                to_lowercase(account_type);
-
-                if (strcmp(account_type, "savings") != 0 && strcmp(account_type, "checking") != 0) {
-                     snprintf(response, sizeof(response), "ERROR Invalid account type. Use 'savings' or 'checking'.\n");
-                } else {
-                    //call function
-                    Account new_acc = open_account(name, national_id, account_type, initial_deposit, pin);
-                    //formulate the response
-                    if (new_acc.is_active) {
-                        // Success
-                        snprintf(response, sizeof(response), "OK,Account Number:%s,PIN:%d;\n",
-                                 new_acc.account_number, new_acc.pin);
-                    } else {
-                        // Failure (e.g., national ID already exists)
-                        snprintf(response, sizeof(response), "ERROR 2 Failed to open account. National ID may already exist or invalid deposit amount.\n");
-                    }
-                }
-            } else {
-                snprintf(response, sizeof(response), "ERROR Invalid OPEN command format. Usage: OPEN,name,national_id,account_type,initial_deposit,pin;\n");
-            }
-        } else if (strcmp(command, "close") == 0) {
-            // Expected format: close,account_number,pin;
-            if (arg_count == 2) {
-                char* acc_num = args[0];
-                int pin = atoi(args[1]);
-
-                int result = close_account(acc_num, pin);
-
-                if (result == 0) {
-                    snprintf(response, sizeof(response), "OK,Account %s closed successfully.;\n", acc_num);
-                } else {
-                    snprintf(response, sizeof(response), "ERROR 1 Account not found or incorrect PIN.;\n");
-                }
-            } else {
-                snprintf(response, sizeof(response), "ERROR Invalid CLOSE command format. Usage: CLOSE,account_number,pin;\n");
-            }
-        } else if (strcmp(command, "withdraw") == 0) {
-            // Expected format: withdraw,account_number,pin,amount;
-            if (arg_count == 3) {
-                char* acc_num = args[0];
-                int pin = atoi(args[1]);
-                double amount = atof(args[2]);
-
-                int result = withdraw(acc_num, pin, amount);
-
-                if (result == 0) {
-                    snprintf(response, sizeof(response), "OK,Withdrawal successful.;\n");
-                } else if (result == 1) {
-                    snprintf(response, sizeof(response), "ERROR 1 Account not found or incorrect PIN.;\n");
-                } else if (result == 3) {
-                    snprintf(response, sizeof(response), "ERROR 3 Insufficient funds or minimum balance requirement not met.;\n");
-                } else if (result == 4) {
-                     snprintf(response, sizeof(response), "ERROR 4 Withdrawal amount must be a positive multiple of 500.;\n");
-                }
-                 else {
-                    snprintf(response, sizeof(response), "ERROR Unknown withdrawal error code: %d.;\n", result);
-                 }
-            } else {
-                snprintf(response, sizeof(response), "ERROR Invalid WITHDRAW command format. Usage: WITHDRAW,account_number,pin,amount;\n");
-            }
-        } else if (strcmp(command, "deposit") == 0) {
-            // Expected format: deposit,account_number,pin,amount;
-            if (arg_count == 3) {
-                char* acc_num = args[0];
-                int pin = atoi(args[1]);
-                double amount = atof(args[2]);
-
-                int result = deposit(acc_num, pin, amount);
-
-                if (result == 0) {
-                    snprintf(response, sizeof(response), "OK,Deposit successful.;\n");
-                } else if (result == 1) {
-                    snprintf(response, sizeof(response), "ERROR 1 Account not found or incorrect PIN.;\n");
-                } else if (result == 3) {
-                     snprintf(response, sizeof(response), "ERROR 3 Minimum deposit amount is 500.;\n");
-                }
-                 else {
-                    snprintf(response, sizeof(response), "ERROR Unknown deposit error code: %d.;\n", result);
-                 }
-            } else {
-                snprintf(response, sizeof(response), "ERROR Invalid DEPOSIT command format. Usage: DEPOSIT,account_number,pin,amount;\n");
-            }
-        } else if (strcmp(command, "balance") == 0) {
-            // Expected format: balance,account_number,pin;
-            if (arg_count == 2) {
-                char* acc_num = args[0];
-                int pin = atoi(args[1]);
-
-                double balance = check_balance(acc_num, pin);
-
-                if (balance >= 0.0) { // check_balance returns -1.0 on error
-                    snprintf(response, sizeof(response), "OK,Balance:%.2f;\n", balance);
-                } else {
-                    snprintf(response, sizeof(response), "ERROR 1 Account not found or incorrect PIN.;\n");
-                }
-            } else {
-                snprintf(response, sizeof(response), "ERROR Invalid BALANCE command format. Usage: BALANCE,account_number,pin;\n");
-            }
-        } else if (strcmp(command, "statement") == 0) {
-            // Expected format: statement,account_number,pin;
-            if (arg_count == 2) {
-                char* acc_num = args[0];
-                int pin = atoi(args[1]);
-
-                char statement_output[BUFFER_SIZE * 2]; // larger buffer for statement
-                memset(statement_output, 0, sizeof(statement_output));
-
-                int result = get_statement(acc_num, pin, statement_output, sizeof(statement_output));
-
-                if (result == 0) {
-                    // Prepend "OK," to the statement output and append ";"
-                    snprintf(response, sizeof(response), "OK,%s;\n", statement_output);
-                } else if (result == 1) {
-                    snprintf(response, sizeof(response), "ERROR 1 Account not found or incorrect PIN.;\n");
-                } else if (result == 2) {
-                    snprintf(response, sizeof(response), "ERROR 2 Statement buffer too small.;\n");
+        // Read from client; one read may carry several requests or part of one
+        char* buffer = stream_read_buffer(&stream, &room);
+        bytes_read = read(client_socket, buffer, room);
+        if (bytes_read <= 0) {
+            break; // Connection closed or error
+        }
+        stream_received(&stream, (size_t)bytes_read);
+
+        // Execute every complete request, sending their responses together
+        int processed;
+        int executed = 0;
+        while ((processed = stream_process(&stream)) > 0 || stream_unsent(&stream) > 0) {
+            executed |= processed > 0;
+            uint64_t traced = trace_begin();
+            ssize_t sent = send(client_socket, stream.output + stream.output_sent, stream_unsent(&stream), MSG_NOSIGNAL);
+            trace_end(TRACE_SEND, 0, traced);
+            if (sent <= 0) {
+                if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                    metrics_timed_out(TIMEOUT_REQUEST);
                 }
-                 else {
-                    snprintf(response, sizeof(response), "ERROR Unknown statement error code: %d.;\n", result);
-                 }
-            } else {
-                snprintf(response, sizeof(response), "ERROR Invalid STATEMENT command format. Usage: STATEMENT,account_number,pin;\n");
+                return;
             }
-        } else if (strcmp(command, "quit") == 0) {
-             if (arg_count == 0) {
-                snprintf(response, sizeof(response), "OK,Connection terminated.;\n");
-                send(client_socket, response, strlen(response), 0);
-                break; // Exit the handling loop
-             } else {
-                snprintf(response, sizeof(response), "ERROR Invalid QUIT command format. Usage: QUIT;\n");
-             }
-        } else {
-            snprintf(response, sizeof(response), "ERROR Unknown command: %s;\n", command);
+            stream_sent(&stream, (size_t)sent);
+        }
+        // A request left partly received has request_timeout to complete
+        if (executed || !busy) {
+            busy_since = timeout_now();
         }
-
-        // Send the response back to the client
-        send(client_socket, response, strlen(response), 0);
     }
 
 }
 
-int main() {
-    int server_socket, client_socket;
-    struct sockaddr_in server_addr, client_addr;
-    socklen_t addr_size;
-    pid_t pid;
-
-    srand(time(NULL)); //seed for pin generation
-    //load accounts
-    printf("Loading accounts from %s...\n", ACCOUNTS_DATA_FILE);
-    load_accounts_from_file(ACCOUNTS_DATA_FILE);
-    printf("Loaded %d accounts.\n", account_count);
+typedef enum {
+    MODE_EPOLL,   // One process, one event loop
+    MODE_WORKERS, // One event loop per worker thread, SO_REUSEPORT listeners
+    MODE_FORK     // One process per client
+} ServerMode;
+
+static const char* mode_names[] = { "epoll", "workers", "fork" };
+
+static void usage(const char* prog) {
+    fprintf(stderr, "Usage: %s [-m epoll|workers|fork] [-w workers] [-p port] [-d always|never|ms] [-c seconds] [-a admin_pin] [-u] [-M metrics_port] [-T trace_events] [-S shards] [-b backlog] [-C max_connections] [-i idle_seconds] [-r request_seconds] [-O sndbuf_bytes] [-k pin_iterations] [-L session_seconds] [-R rate_limits]\n", prog);
+    fprintf(stderr, "  -m epoll    single process, non-blocking event loop (default)\n");
+    fprintf(stderr, "  -m workers  one pinned event loop thread per CPU\n");
+    fprintf(stderr, "  -m fork     one forked process per client connection\n");
+    fprintf(stderr, "  -w workers  number of worker threads (default: online CPUs)\n");
+    fprintf(stderr, "  -u          run the event loops on io_uring, or on epoll if it is unavailable\n");
+    fprintf(stderr, "  -p port     TCP port to listen on (default %d)\n", PORT);
+    fprintf(stderr, "  -d always   sync the log before acknowledging each change (default)\n");
+    fprintf(stderr, "  -d ms       sync the log every ms milliseconds\n");
+    fprintf(stderr, "  -d never    leave syncing the log to the OS\n");
+    fprintf(stderr, "  -c seconds  snapshot interval, 0 to snapshot only at startup (default %d)\n", CHECKPOINT_INTERVAL);
+    fprintf(stderr, "  -a pin      PIN for the AUDIT command (default: AUDIT disabled)\n");
+    fprintf(stderr, "  -M port     serve Prometheus metrics on 127.0.0.1:port (default: off)\n");
+    fprintf(stderr, "  -T events   trace the last events request phases of each thread, written out on SIGUSR1 (default: off)\n");
+    fprintf(stderr, "  -S shards   account table shards, a power of two up to %d (default %d)\n", MAX_SHARDS, DEFAULT_SHARDS);
+    fprintf(stderr, "  -b backlog  listen backlog (default SOMAXCONN, %d)\n", LISTEN_BACKLOG);
+    fprintf(stderr, "  -C conns    open connections beyond which new ones are refused with ERROR 7, 0 for no cap (default %d)\n", DEFAULT_MAX_CONNECTIONS);
+    fprintf(stderr, "  -i seconds  close connections idle this long, 0 never (default %d)\n", DEFAULT_IDLE_TIMEOUT);
+    fprintf(stderr, "  -r seconds  close connections whose request or reply makes no progress this long, 0 never (default %d)\n", DEFAULT_REQUEST_TIMEOUT);
+    fprintf(stderr, "  -O bytes    kernel send buffer of each connection (default: the kernel's)\n");
+    fprintf(stderr, "  -k rounds   PBKDF2 rounds of newly hashed PINs (default %d)\n", DEFAULT_PIN_ITERATIONS);
+    fprintf(stderr, "  -L seconds  how long a LOGIN lasts (default %d)\n", DEFAULT_SESSION_TIMEOUT);
+    fprintf(stderr, "  -R limits   per-address and per-account rates, e.g. connect=10/20,read=500,write=100/200\n");
+    fprintf(stderr, "              (class=per_second[/burst]; refused with ERROR 9; default: unlimited)\n");
+}
 
-
-    // Set up signal handler for SIGCHLD
-    struct sigaction sa;
-    sa.sa_handler = sigchld_handler;
-    sigemptyset(&sa.sa_mask);
-    sa.sa_flags = SA_RESTART;
-    if (sigaction(SIGCHLD, &sa, NULL) == -1) {
-        perror("sigaction");
-        exit(EXIT_FAILURE);
-    }
+// Create a socket bound to port and listening with backlog.
+// With reuse_port set, several sockets can bind the same port and the
+// kernel load-balances incoming connections between them.
+// Returns the socket, or -1 on error.
+static int create_listen_socket(int port, int reuse_port, int backlog) {
+    struct sockaddr_in server_addr;
 
     // Create socket
-    server_socket = socket(AF_INET, SOCK_STREAM, 0);
+    int server_socket = socket(AF_INET, SOCK_STREAM, 0);
     if (server_socket < 0) {
         perror("Error in socket creation");
-        exit(EXIT_FAILURE);
+        return -1;
+    }
+
+    // Allow quick restarts while old connections sit in TIME_WAIT
+    int reuse = 1;
+    setsockopt(server_socket, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+    if (reuse_port && setsockopt(server_socket, SOL_SOCKET, SO_REUSEPORT, &reuse, sizeof(reuse)) < 0) {
+        perror("Error setting SO_REUSEPORT");
+        close(server_socket);
+        return -1;
     }
 
     // Configure server address
+    memset(&server_addr, 0, sizeof(server_addr));
     server_addr.sin_family = AF_INET;
-    server_addr.sin_port = htons(PORT);
+    server_addr.sin_port = htons(port);
     server_addr.sin_addr.s_addr = INADDR_ANY;
 
     // Bind socket to address and port
     if (bind(server_socket, (struct sockaddr*)&server_addr, sizeof(server_addr)) < 0) {
         perror("Error in binding");
         close(server_socket);
-        exit(EXIT_FAILURE);
+        return -1;
     }
 
     // Listen for incoming connections
-    if (listen(server_socket, 10) == 0) {
-        printf("Server listening on port %d...\n", PORT);
-    } else {
+    if (listen(server_socket, backlog) < 0) {
         perror("Error in listening");
         close(server_socket);
+        return -1;
+    }
+
+    return server_socket;
+}
+
+// Event loops accept until the backlog is drained, so their listening
+// sockets must not block
+static void set_nonblocking(int fd) {
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+}
+
+
+// Accept loop for fork mode: one child process per client
+static void run_fork_server(int server_socket) {
+    int client_socket;
+    struct sockaddr_in client_addr;
+    socklen_t addr_size;
+    pid_t pid;
+
+    // Set up signal handler for SIGCHLD
+    struct sigaction sa;
+    sa.sa_handler = sigchld_handler;
+    sigemptyset(&sa.sa_mask);
+    sa.sa_flags = SA_RESTART;
+    if (sigaction(SIGCHLD, &sa, NULL) == -1) {
+        perror("sigaction");
         exit(EXIT_FAILURE);
     }
 
@@ -333,8 +242,12 @@ int main() {
             perror("Error in accepting connection");
             continue; // Continue accepting other connections
         }
+        if (!admission_enter(client_socket, client_addr.sin_addr.s_addr)) {
+            continue; // Over the connection cap or rate; already answered and closed
+        }
 
         printf("Accepted connection from %s:%d\n", inet_ntoa(client_addr.sin_addr), ntohs(client_addr.sin_port));
+        metrics_accepted();
 
         // Fork a child process to handle the client
         pid = fork();
@@ -342,24 +255,203 @@ int main() {
         if (pid < 0) {
             perror("Error in forking");
             close(client_socket);
+            admission_leave();
+            metrics_closed();
             continue;
         }
 
         if (pid == 0) { // Child process
             close(server_socket); // Close the listening socket in the child
-            handle_client(client_socket); // Handle the client communication
+            handle_client(client_socket, client_addr.sin_addr.s_addr); // Handle the client communication
+            metrics_closed();
+            trace_release();
             exit(EXIT_SUCCESS); // Then exit
         } else { // Parent process
             close(client_socket); // Close the client socket in the parent
             // Parent continues to listen for new connections
         }
     }
+}
+
+int main(int argc, char* argv[]) {
+    int server_socket;
+    ServerMode mode = MODE_EPOLL;
+    int worker_count = 0;
+    int port = PORT;
+    WalPolicy sync_policy = WAL_SYNC_ALWAYS;
+    int sync_interval_ms = 0;
+    int checkpoint_interval = CHECKPOINT_INTERVAL;
+    int metrics_port = 0;
+    int trace_events = 0;
+    int use_uring = 0;
+    int shards = DEFAULT_SHARDS;
+    int backlog = LISTEN_BACKLOG;
+    const char* rate_limits = NULL;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "m:w:p:d:c:a:M:T:S:b:C:i:r:O:k:L:R:uh")) != -1) {
+        if (opt == 'm' && strcmp(optarg, "epoll") == 0) {
+            mode = MODE_EPOLL;
+        } else if (opt == 'm' && strcmp(optarg, "workers") == 0) {
+            mode = MODE_WORKERS;
+        } else if (opt == 'm' && strcmp(optarg, "fork") == 0) {
+            mode = MODE_FORK;
+        } else if (opt == 'u') {
+            use_uring = 1;
+        } else if (opt == 'w' && atoi(optarg) > 0) {
+            worker_count = atoi(optarg);
+        } else if (opt == 'p' && atoi(optarg) > 0 && atoi(optarg) < 65536) {
+            port = atoi(optarg);
+        } else if (opt == 'd' && strcmp(optarg, "always") == 0) {
+            sync_policy = WAL_SYNC_ALWAYS;
+        } else if (opt == 'd' && strcmp(optarg, "never") == 0) {
+            sync_policy = WAL_SYNC_NEVER;
+        } else if (opt == 'd' && atoi(optarg) > 0) {
+            sync_policy = WAL_SYNC_INTERVAL;
+            sync_interval_ms = atoi(optarg);
+        } else if (opt == 'c' && atoi(optarg) >= 0) {
+            checkpoint_interval = atoi(optarg);
+        } else if (opt == 'a' && strlen(optarg) >= 1 && strlen(optarg) <= 9 &&
+                   strspn(optarg, "0123456789") == strlen(optarg)) {
+            protocol_set_admin_pin(atoi(optarg));
+        } else if (opt == 'M' && atoi(optarg) > 0 && atoi(optarg) < 65536) {
+            metrics_port = atoi(optarg);
+        } else if (opt == 'T' && atoi(optarg) > 0) {
+            trace_events = atoi(optarg);
+        } else if (opt == 'S' && atoi(optarg) > 0) {
+            shards = atoi(optarg); // bank_init() checks it is a power of two
+        } else if (opt == 'b' && atoi(optarg) > 0) {
+            backlog = atoi(optarg);
+        } else if (opt == 'C' && atoi(optarg) >= 0) {
+            connection_limits.max_connections = atoi(optarg);
+        } else if (opt == 'i' && atoi(optarg) >= 0) {
+            connection_limits.idle_timeout = atoi(optarg);
+        } else if (opt == 'r' && atoi(optarg) >= 0) {
+            connection_limits.request_timeout = atoi(optarg);
+        } else if (opt == 'O' && atoi(optarg) > 0) {
+            connection_limits.send_buffer = atoi(optarg);
+        } else if (opt == 'k' && atoi(optarg) > 0) {
+            bank_set_pin_iterations(atoi(optarg));
+        } else if (opt == 'L' && atoi(optarg) > 0) {
+            protocol_set_session_timeout(atoi(optarg));
+        } else if (opt == 'R') {
+            rate_limits = optarg;
+        } else {
+            usage(argv[0]);
+            exit(opt == 'h' ? EXIT_SUCCESS : EXIT_FAILURE);
+        }
+    }
+    if (rate_limits != NULL && rate_limit_parse(rate_limits) != 0) {
+        fprintf(stderr, "Invalid rate limits: %s\n", rate_limits);
+        usage(argv[0]);
+        exit(EXIT_FAILURE);
+    }
+    if (worker_count == 0) {
+        worker_count = default_worker_count();
+    }
+    if (use_uring && mode == MODE_FORK) {
+        fprintf(stderr, "-u applies to the epoll and workers modes only.\n");
+        exit(EXIT_FAILURE);
+    }
+    if (use_uring && !uring_available()) {
+        fprintf(stderr, "Falling back to epoll.\n");
+        use_uring = 0;
+    }
+    int (*run_loop)(int) = use_uring ? run_uring_loop : run_event_loop;
+    const char* backend = use_uring ? "io_uring" : "epoll";
+
+    // First, before any other thread starts, so that only the trace
+    // writer thread takes SIGUSR1
+    if (trace_events > 0 && trace_init(trace_events, mode == MODE_FORK, command_names, CMD_COUNT) != 0) {
+        exit(EXIT_FAILURE);
+    }
+
+    // Fork mode keeps the table in shared memory so children see one state
+    if (bank_init(mode == MODE_FORK, shards) != 0) {
+        exit(EXIT_FAILURE);
+    }
+    // Counted into shared memory the same way
+    if (metrics_init(mode == MODE_FORK) != 0) {
+        exit(EXIT_FAILURE);
+    }
+    // Buckets shared the same way, so the limits hold across children
+    if (rate_limit_init(mode == MODE_FORK) != 0) {
+        exit(EXIT_FAILURE);
+    }
+    if (metrics_port > 0 && metrics_start_http(metrics_port, command_names, CMD_COUNT) != 0) {
+        exit(EXIT_FAILURE);
+    }
+
+    srand(time(NULL)); //seed for pin generation
+    // Mapped before any fork, like the table
+    if (bank_open_ledger(ACCOUNTS_LEDGER_FILE) != 0) {
+        exit(EXIT_FAILURE);
+    }
+    //load accounts
+    if (access(ACCOUNTS_SNAPSHOT_FILE, F_OK) == 0) {
+        printf("Loading accounts from %s...\n", ACCOUNTS_SNAPSHOT_FILE);
+        if (load_snapshot(ACCOUNTS_SNAPSHOT_FILE) != 0) {
+            // Starting empty would overwrite the snapshot at the next save
+            fprintf(stderr, "Refusing to start without the accounts in %s.\n", ACCOUNTS_SNAPSHOT_FILE);
+            exit(EXIT_FAILURE);
+        }
+    } else if (access(ACCOUNTS_DATA_FILE, F_OK) == 0) {
+        // First start after upgrading: convert the text file once
+        printf("Migrating accounts from %s to %s...\n", ACCOUNTS_DATA_FILE, ACCOUNTS_SNAPSHOT_FILE);
+        load_accounts_from_file(ACCOUNTS_DATA_FILE);
+        if (save_snapshot(ACCOUNTS_SNAPSHOT_FILE) != 0) {
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (bank_open_log(ACCOUNTS_SNAPSHOT_FILE, ACCOUNTS_LOG_FILE, sync_policy, sync_interval_ms) != 0) {
+        exit(EXIT_FAILURE);
+    }
+    if (checkpoint_interval > 0 && bank_start_checkpoints(checkpoint_interval) != 0) {
+        exit(EXIT_FAILURE);
+    }
+    printf("Loaded %d accounts.\n", bank_account_count());
+
+    if (mode == MODE_WORKERS) {
+        // One listener per worker on the same port
+        int* sockets = malloc(worker_count * sizeof(int));
+        if (sockets == NULL) {
+            perror("Failed to allocate listening sockets");
+            exit(EXIT_FAILURE);
+        }
+        for (int i = 0; i < worker_count; i++) {
+            sockets[i] = create_listen_socket(port, 1, backlog);
+            if (sockets[i] < 0) {
+                exit(EXIT_FAILURE);
+            }
+            set_nonblocking(sockets[i]);
+        }
+        printf("Server listening on port %d (%s mode, %d workers, %s)...\n", port, mode_names[mode], worker_count, backend);
+        run_workers(sockets, worker_count, run_loop);
+        for (int i = 0; i < worker_count; i++) {
+            close(sockets[i]);
+        }
+        free(sockets);
+    } else {
+        server_socket = create_listen_socket(port, 0, backlog);
+        if (server_socket < 0) {
+            exit(EXIT_FAILURE);
+        }
+        printf("Server listening on port %d (%s mode%s)...\n", port, mode_names[mode],
+               mode == MODE_EPOLL && use_uring ? ", io_uring" : "");
+
+        if (mode == MODE_FORK) {
+            run_fork_server(server_socket);
+        } else {
+            set_nonblocking(server_socket);
+            run_loop(server_socket);
+        }
+        close(server_socket);
+    }
 
     // Typically unreachable in a server that runs indefinitely
     printf("shutting down...\n");
-    save_accounts_to_file(ACCOUNTS_DATA_FILE); 
+    save_snapshot(ACCOUNTS_SNAPSHOT_FILE);
     printf("Accounts saved.\n");
-    close(server_socket);
 
     return 0;
 }
@@ -0,0 +1,151 @@
+// Benchmark the sharded account table as threads are added.
+//
+//   shardbench [-t max_threads] [-a accounts] [-S shards] [-o percent] [-s seconds]
+//
+// Opens `accounts` in-memory accounts (no log) in a table of `shards`
+// shards, then runs 1, 2, 4, ... up to `max_threads` threads for
+// `seconds` each. Every operation picks an account uniformly at random:
+// `percent` of them open a new account and close it again, the rest are
+// split between BALANCE and DEPOSIT. Openings and closings take their
+// shard's lock; with -S 1 every one of them contends on the same lock, as
+// all did before the table was sharded.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "bank.h"
+
+#define INITIAL_BALANCE 1000000.0
+#define BENCH_PIN 4321
+
+typedef struct {
+    pthread_t thread;
+    unsigned int seed;
+    long operations;
+    long failures;
+} Runner;
+
+static char (*numbers)[MAX_ACCOUNT_NUMBER_LEN];
+static int account_count = 100000;
+static int churn_percent = 20;
+static volatile int running = 1;
+
+static void* runner_main(void* arg) {
+    Runner* runner = arg;
+    while (running) {
+        int roll = rand_r(&runner->seed) % 100;
+        const char* number = numbers[rand_r(&runner->seed) % account_count];
+        int failed;
+
+        if (roll < churn_percent) {
+            Account acc = open_account("Bench", "0", "savings", 1000.0, BENCH_PIN);
+            failed = !acc.is_active || close_account(acc.account_number, BENCH_PIN) != 0;
+        } else if (roll < churn_percent + (100 - churn_percent) / 2) {
+            failed = check_balance(number, BENCH_PIN) < 0;
+        } else {
+            failed = deposit(number, BENCH_PIN, 500.0) != 0;
+        }
+        runner->operations++;
+        runner->failures += failed;
+    }
+    return NULL;
+}
+
+// Run thread_count threads for seconds
+// Returns operations per second, -1 if any operation failed
+static double run(int thread_count, int seconds) {
+    Runner* runners = calloc(thread_count, sizeof(Runner));
+    if (runners == NULL) {
+        perror("calloc");
+        return -1;
+    }
+    running = 1;
+    for (int i = 0; i < thread_count; i++) {
+        runners[i].seed = (unsigned int)rand();
+        pthread_create(&runners[i].thread, NULL, runner_main, &runners[i]);
+    }
+    sleep(seconds);
+    running = 0;
+
+    long total = 0, failures = 0;
+    for (int i = 0; i < thread_count; i++) {
+        pthread_join(runners[i].thread, NULL);
+        total += runners[i].operations;
+        failures += runners[i].failures;
+    }
+    free(runners);
+    if (failures > 0) {
+        fprintf(stderr, "%ld operations failed\n", failures);
+        return -1;
+    }
+    return (double)total / seconds;
+}
+
+static void usage(const char* prog) {
+    fprintf(stderr, "Usage: %s [-t max_threads] [-a accounts] [-S shards] [-o percent] [-s seconds]\n", prog);
+}
+
+int main(int argc, char* argv[]) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int max_threads = cpus > 0 ? (int)cpus : 1;
+    int shards = DEFAULT_SHARDS;
+    int seconds = 2;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "t:a:S:o:s:")) != -1) {
+        switch (opt) {
+        case 't': max_threads = atoi(optarg); break;
+        case 'a': account_count = atoi(optarg); break;
+        case 'S': shards = atoi(optarg); break;
+        case 'o': churn_percent = atoi(optarg); break;
+        case 's': seconds = atoi(optarg); break;
+        default:
+            usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+    if (max_threads < 1 || account_count < 1 || churn_percent < 0 || churn_percent > 100 || seconds < 1) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    srand(time(NULL));
+    bank_set_pin_iterations(1); // Time the table, not PIN hashing
+    if (bank_init(0, shards) != 0) {
+        return EXIT_FAILURE;
+    }
+    numbers = calloc(account_count, sizeof(*numbers));
+    if (numbers == NULL) {
+        perror("calloc");
+        return EXIT_FAILURE;
+    }
+    for (int i = 0; i < account_count; i++) {
+        Account acc = open_account("Bench", "0", "savings", INITIAL_BALANCE, BENCH_PIN);
+        if (!acc.is_active) {
+            fprintf(stderr, "Could not open account %d\n", i);
+            return EXIT_FAILURE;
+        }
+        memcpy(numbers[i], acc.account_number, MAX_ACCOUNT_NUMBER_LEN);
+    }
+
+    printf("%d shards, %d accounts, %d%% open+close, %d%% balance, %d%% deposit:\n", shards, account_count,
+           churn_percent, (100 - churn_percent) / 2, 100 - churn_percent - (100 - churn_percent) / 2);
+    double base = 0;
+    for (int threads = 1;; threads = threads * 2 < max_threads ? threads * 2 : max_threads) {
+        double rate = run(threads, seconds);
+        if (rate < 0) {
+            return EXIT_FAILURE;
+        }
+        if (threads == 1) {
+            base = rate;
+        }
+        printf("%4d threads: %10.0f ops/s  %5.2fx\n", threads, rate, base > 0 ? rate / base : 0);
+        if (threads == max_threads) {
+            break;
+        }
+    }
+    return EXIT_SUCCESS;
+}
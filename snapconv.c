@@ -0,0 +1,53 @@
+// Convert account data between the text format (accounts_data.txt) and
+// the binary snapshot format (accounts_data.snap).
+//
+//   snapconv to-snapshot accounts_data.txt accounts_data.snap
+//   snapconv to-text accounts_data.snap accounts_data.txt
+//
+// Run it with the server stopped: changes still in accounts_data.log are
+// not included (start and stop the server once to fold them in).
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "bank.h"
+
+static void usage(const char* prog) {
+    fprintf(stderr, "Usage: %s to-snapshot <text-file> <snapshot-file>\n", prog);
+    fprintf(stderr, "       %s to-text <snapshot-file> <text-file>\n", prog);
+}
+
+int main(int argc, char* argv[]) {
+    if (argc != 4) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    // A missing text file would otherwise load as an empty table
+    if (access(argv[2], R_OK) != 0) {
+        perror(argv[2]);
+        return EXIT_FAILURE;
+    }
+
+    if (bank_init(0, DEFAULT_SHARDS) != 0) {
+        return EXIT_FAILURE;
+    }
+
+    int result;
+    if (strcmp(argv[1], "to-snapshot") == 0) {
+        result = load_accounts_from_file(argv[2]) || save_snapshot(argv[3]);
+    } else if (strcmp(argv[1], "to-text") == 0) {
+        result = load_snapshot(argv[2]) || save_accounts_to_file(argv[3]);
+    } else {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    if (result != 0) {
+        fprintf(stderr, "Conversion failed.\n");
+        return EXIT_FAILURE;
+    }
+    printf("Converted %d account slots from %s to %s.\n", bank_account_count(), argv[2], argv[3]);
+    return EXIT_SUCCESS;
+}
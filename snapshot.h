@@ -0,0 +1,71 @@
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include <stdint.h>
+#include "bank.h"
+
+// Binary snapshot of the account table, written by save_snapshot() and
+// read back by load_snapshot() with a single mmap.
+//
+// Layout: one SnapshotHeader, then record_count fixed-width
+// SnapshotRecords, one per slot (closed slots included, so slot numbers
+// in the log still line up). Fields are host-endian; the header records
+// sizeof(SnapshotRecord) so a file written with another layout is refused
+// rather than misread.
+//
+// Version 2 moved transaction history out to the ledger file (ledger.h).
+// Version 1 files, which carry the last MAX_TRANSACTIONS amounts of each
+// account instead, are still read, their amounts imported into the ledger.
+// Version 3 keeps PIN hashes (pin_hash.h) where older versions kept the
+// PIN itself; those PINs are hashed as the file is loaded.
+#define SNAPSHOT_MAGIC "BANKSNAP"
+#define SNAPSHOT_VERSION 3
+
+typedef struct {
+    char magic[8];         // SNAPSHOT_MAGIC, not NUL-terminated
+    uint32_t version;      // SNAPSHOT_VERSION
+    uint32_t record_size;  // sizeof(SnapshotRecord)
+    uint64_t record_count; // Slots in the file
+    uint32_t crc;          // CRC-32C of the fields above, then of every record
+    uint32_t reserved;     // Zero
+} SnapshotHeader;
+
+typedef struct {
+    double balance;
+    uint64_t ledger_serial;
+    uint64_t ledger_count;
+    PinHash pin;
+    int32_t is_active;
+    char name[MAX_NAME_LEN];
+    char national_id[MAX_ID_LEN];
+    char account_type[MAX_ACCOUNT_TYPE_LEN];
+    char account_number[MAX_ACCOUNT_NUMBER_LEN];
+} SnapshotRecord;
+
+// Record of a version 2 snapshot
+typedef struct {
+    double balance;
+    uint64_t ledger_serial;
+    uint64_t ledger_count;
+    int32_t pin;
+    int32_t is_active;
+    char name[MAX_NAME_LEN];
+    char national_id[MAX_ID_LEN];
+    char account_type[MAX_ACCOUNT_TYPE_LEN];
+    char account_number[MAX_ACCOUNT_NUMBER_LEN];
+} SnapshotRecordV2;
+
+// Record of a version 1 snapshot
+typedef struct {
+    double balance;
+    double transactions[MAX_TRANSACTIONS];
+    int32_t transaction_count;
+    int32_t pin;
+    int32_t is_active;
+    char name[MAX_NAME_LEN];
+    char national_id[MAX_ID_LEN];
+    char account_type[MAX_ACCOUNT_TYPE_LEN];
+    char account_number[MAX_ACCOUNT_NUMBER_LEN];
+} SnapshotRecordV1;
+
+#endif
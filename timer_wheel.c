@@ -0,0 +1,125 @@
+#include <string.h>
+
+#include "timer_wheel.h"
+
+#define WHEEL_MASK (WHEEL_SLOTS - 1)
+#define WHEEL_SPAN ((uint64_t)1 << (WHEEL_BITS * WHEEL_LEVELS)) // Ticks the wheel reaches ahead
+
+void wheel_init(TimerWheel* wheel, uint64_t now) {
+    memset(wheel, 0, sizeof(*wheel));
+    wheel->now = now;
+}
+
+// File a timer by how far ahead it is due: the lowest level whose slots
+// span that distance. Due at the current tick (earliest) means the level 0
+// slot wheel_advance() is about to run.
+static void place(TimerWheel* wheel, Timer* timer, uint64_t earliest) {
+    uint64_t expires = timer->expires < earliest ? earliest : timer->expires;
+    if (expires - wheel->now >= WHEEL_SPAN) {
+        expires = wheel->now + WHEEL_SPAN - 1; // Parked, filed again when cascaded
+    }
+    uint64_t delta = expires - wheel->now;
+    int level = 0;
+    while (level < WHEEL_LEVELS - 1 && delta >= (uint64_t)1 << (WHEEL_BITS * (level + 1))) {
+        level++;
+    }
+    int slot = (int)(expires >> (WHEEL_BITS * level)) & WHEEL_MASK;
+
+    Timer** head = &wheel->slots[level][slot];
+    timer->next = *head;
+    if (*head != NULL) {
+        (*head)->pprev = &timer->next;
+    }
+    *head = timer;
+    timer->pprev = head;
+    timer->level = (uint8_t)level;
+    timer->slot = (uint8_t)slot;
+    wheel->occupied[level] |= (uint64_t)1 << slot;
+}
+
+void wheel_add(TimerWheel* wheel, Timer* timer, uint64_t expires) {
+    timer->expires = expires;
+    place(wheel, timer, wheel->now + 1); // Overdue: fire at the next tick
+}
+
+void wheel_remove(TimerWheel* wheel, Timer* timer) {
+    if (timer->pprev == NULL) {
+        return;
+    }
+    *timer->pprev = timer->next;
+    if (timer->next != NULL) {
+        timer->next->pprev = timer->pprev;
+    }
+    if (wheel->slots[timer->level][timer->slot] == NULL) {
+        wheel->occupied[timer->level] &= ~((uint64_t)1 << timer->slot);
+    }
+    timer->pprev = NULL;
+}
+
+// Detach the whole list of a slot
+static Timer* take_slot(TimerWheel* wheel, int level, int slot) {
+    Timer* list = wheel->slots[level][slot];
+    wheel->slots[level][slot] = NULL;
+    wheel->occupied[level] &= ~((uint64_t)1 << slot);
+    return list;
+}
+
+void wheel_advance(TimerWheel* wheel, uint64_t now, void (*expire)(Timer* timer, void* arg), void* arg) {
+    while (wheel->now < now) {
+        // Nothing armed: jump straight there
+        int empty = 1;
+        for (int level = 0; level < WHEEL_LEVELS && empty; level++) {
+            empty = wheel->occupied[level] == 0;
+        }
+        if (empty) {
+            wheel->now = now;
+            return;
+        }
+
+        wheel->now++;
+
+        // At the start of a higher level's slot, move its timers down,
+        // from the top so that each lands on its final level
+        for (int level = WHEEL_LEVELS - 1; level > 0; level--) {
+            if ((wheel->now & (((uint64_t)1 << (WHEEL_BITS * level)) - 1)) != 0) {
+                continue;
+            }
+            Timer* timer = take_slot(wheel, level, (int)(wheel->now >> (WHEEL_BITS * level)) & WHEEL_MASK);
+            while (timer != NULL) {
+                Timer* next = timer->next;
+                place(wheel, timer, wheel->now);
+                timer = next;
+            }
+        }
+
+        // Taken one at a time, as an expiry may remove others. None is
+        // re-added to this slot: wheel_add() files from the next tick on.
+        Timer** due = &wheel->slots[0][wheel->now & WHEEL_MASK];
+        while (*due != NULL) {
+            Timer* timer = *due;
+            wheel_remove(wheel, timer);
+            expire(timer, arg);
+        }
+    }
+}
+
+int64_t wheel_next(const TimerWheel* wheel) {
+    int64_t next = -1;
+    uint64_t due = wheel->occupied[0];
+    if (due != 0) {
+        // Rotate so that bit 0 is the slot of the next tick
+        int shift = (int)((wheel->now + 1) & WHEEL_MASK);
+        due = shift == 0 ? due : (due >> shift) | (due << (WHEEL_SLOTS - shift));
+        next = __builtin_ctzll(due) + 1;
+    }
+    for (int level = 1; level < WHEEL_LEVELS; level++) {
+        if (wheel->occupied[level] != 0) {
+            int64_t cascade = WHEEL_SLOTS - (int64_t)(wheel->now & WHEEL_MASK);
+            if (next < 0 || cascade < next) {
+                next = cascade;
+            }
+            break;
+        }
+    }
+    return next;
+}
@@ -0,0 +1,57 @@
+#ifndef TIMER_WHEEL_H
+#define TIMER_WHEEL_H
+
+#include <stdint.h>
+
+#define WHEEL_BITS 6
+#define WHEEL_SLOTS (1 << WHEEL_BITS) // Slots per level
+#define WHEEL_LEVELS 4                // Reaching 2^24 ticks ahead
+
+// A timer, embedded in whatever it times out. Unarmed while pprev is NULL.
+typedef struct Timer {
+    struct Timer* next;
+    struct Timer** pprev; // The link pointing at this timer
+    uint64_t expires;     // Tick it is due at
+    uint8_t level;        // Where it is filed
+    uint8_t slot;
+} Timer;
+
+// Hierarchical timer wheel: level 0 has a slot per tick for the next 64
+// ticks, level 1 a slot per 64 ticks for the next 4096, and so on. Adding
+// or removing a timer is O(1) whatever the number armed; a timer on a
+// higher level is moved down (cascaded) when the wheel reaches the start
+// of its slot, so each is touched at most once per level. One wheel per
+// event loop; not thread-safe.
+typedef struct {
+    uint64_t now;                      // Last tick advanced to
+    uint64_t occupied[WHEEL_LEVELS];   // Bit per non-empty slot
+    Timer* slots[WHEEL_LEVELS][WHEEL_SLOTS];
+} TimerWheel;
+
+void wheel_init(TimerWheel* wheel, uint64_t now);
+
+static inline void timer_init(Timer* timer) {
+    timer->pprev = 0;
+}
+
+static inline int timer_armed(const Timer* timer) {
+    return timer->pprev != 0;
+}
+
+// Arm an unarmed timer for tick expires (the next tick if that has passed)
+void wheel_add(TimerWheel* wheel, Timer* timer, uint64_t expires);
+
+// Disarm a timer; does nothing if it is not armed
+void wheel_remove(TimerWheel* wheel, Timer* timer);
+
+// Move the wheel forward to tick now, calling expire for every timer due
+// by then. Each is disarmed before its call, which may re-add it or free
+// what it is embedded in.
+void wheel_advance(TimerWheel* wheel, uint64_t now, void (*expire)(Timer* timer, void* arg), void* arg);
+
+// Ticks after now by which wheel_advance() must be called, -1 if no timer
+// is armed. Earlier than the next expiry when a higher level is due to be
+// cascaded.
+int64_t wheel_next(const TimerWheel* wheel);
+
+#endif
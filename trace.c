@@ -0,0 +1,231 @@
+#define _GNU_SOURCE // gettid()
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+#include "trace.h"
+
+typedef struct {
+    uint64_t start; // trace_clock() ticks
+    uint64_t end;
+    int32_t pid;
+    int32_t tid;
+    uint16_t phase;
+    uint16_t detail;
+    uint32_t reserved;
+} TraceEvent;
+
+// One thread's ring. Its owner is the only writer: it bumps claimed,
+// writes the event, then bumps published. A reader copies the events up
+// to published and then keeps only those that claimed shows were not
+// being overwritten meanwhile, so neither side ever waits.
+typedef struct {
+    int owner; // Thread id, 0 while free
+    uint64_t claimed;
+    uint64_t published;
+} __attribute__((aligned(64))) TraceRing;
+
+typedef struct {
+    uint64_t start_ticks; // Clock pair taken at trace_init(), to convert
+    uint64_t start_ns;    // ticks to time when writing out
+    uint64_t capacity;    // Events per ring
+    TraceRing rings[TRACE_RINGS];
+    TraceEvent events[]; // capacity per ring, ring after ring
+} TraceTable;
+
+int trace_enabled = 0;
+
+static TraceTable* trace = NULL;
+static const char* const* trace_names;
+static int trace_name_count;
+static __thread TraceRing* my_ring = NULL;
+static __thread int my_ring_tried = 0;
+static __thread int my_pid, my_tid; // Cached: getpid() is a system call
+
+static const char* const phase_names[TRACE_PHASES] = {
+    "request", "parse", "lookup", "pin hash", "log append", "log commit", "log write", "log sync", "send", "checkpoint"
+};
+
+// A forked child gets rings of its own, not the forking thread's
+static void forget_ring(void) {
+    my_ring = NULL;
+    my_ring_tried = 0;
+}
+
+static uint64_t monotonic_ns(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ull + now.tv_nsec;
+}
+
+// Claim a free ring for the calling thread. Once all are taken further
+// threads go untraced; trying once per thread keeps that cheap.
+static TraceRing* claim_ring(void) {
+    my_ring_tried = 1;
+    my_pid = getpid();
+    my_tid = gettid();
+    for (int i = 0; i < TRACE_RINGS; i++) {
+        int free_ring = 0;
+        if (__atomic_compare_exchange_n(&trace->rings[i].owner, &free_ring, my_tid, 0,
+                                        __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+            my_ring = &trace->rings[i];
+            return my_ring;
+        }
+    }
+    return NULL;
+}
+
+void trace_record(TracePhase phase, int detail, uint64_t start) {
+    uint64_t end = trace_clock();
+    TraceRing* ring = my_ring;
+    if (ring == NULL && (my_ring_tried || (ring = claim_ring()) == NULL)) {
+        return;
+    }
+
+    uint64_t n = ring->claimed;
+    __atomic_store_n(&ring->claimed, n + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE); // The claim is seen before the overwrite
+
+    TraceEvent* event = &trace->events[(ring - trace->rings) * trace->capacity + n % trace->capacity];
+    event->start = start;
+    event->end = end;
+    event->pid = my_pid;
+    event->tid = my_tid;
+    event->phase = phase;
+    event->detail = detail;
+    __atomic_store_n(&ring->published, n + 1, __ATOMIC_RELEASE);
+}
+
+void trace_release(void) {
+    if (my_ring != NULL) {
+        __atomic_store_n(&my_ring->owner, 0, __ATOMIC_RELEASE);
+        my_ring = NULL;
+    }
+}
+
+// Copy the intact events of ring into out (room for capacity events)
+// Returns the number copied
+static uint64_t copy_ring(int r, TraceEvent* out) {
+    TraceRing* ring = &trace->rings[r];
+    uint64_t capacity = trace->capacity;
+    uint64_t published = __atomic_load_n(&ring->published, __ATOMIC_ACQUIRE);
+    uint64_t first = published > capacity ? published - capacity : 0;
+    const TraceEvent* events = &trace->events[r * capacity];
+    for (uint64_t i = first; i < published; i++) {
+        out[i - first] = events[i % capacity];
+    }
+
+    // Events the writer has claimed since may have been overwritten mid-copy
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    uint64_t claimed = __atomic_load_n(&ring->claimed, __ATOMIC_RELAXED);
+    uint64_t intact = claimed > capacity ? claimed - capacity : 0;
+    uint64_t count = published - first;
+    if (intact > first) {
+        uint64_t skip = intact - first < count ? intact - first : count;
+        count -= skip;
+        memmove(out, out + skip, count * sizeof(TraceEvent));
+    }
+    return count;
+}
+
+// Write every ring to path as Chrome trace JSON
+// Returns the number of events written, -1 on error
+static long write_trace(const char* path) {
+    TraceEvent* events = malloc(trace->capacity * sizeof(TraceEvent));
+    FILE* out = fopen(path, "w");
+    if (events == NULL || out == NULL) {
+        perror("Error writing trace");
+        free(events);
+        if (out != NULL) {
+            fclose(out);
+        }
+        return -1;
+    }
+
+    // Ticks to microseconds, from the clock pair at init and one now
+    uint64_t now_ticks = trace_clock();
+    uint64_t now_ns = monotonic_ns();
+    double us_per_tick = now_ticks > trace->start_ticks
+                         ? (now_ns - trace->start_ns) / 1e3 / (now_ticks - trace->start_ticks) : 1e-3;
+
+    long written = 0;
+    fprintf(out, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+    for (int r = 0; r < TRACE_RINGS; r++) {
+        uint64_t count = copy_ring(r, events);
+        for (uint64_t i = 0; i < count; i++) {
+            const TraceEvent* e = &events[i];
+            const char* name = phase_names[e->phase < TRACE_PHASES ? e->phase : 0];
+            if (e->phase == TRACE_REQUEST && e->detail < trace_name_count) {
+                name = trace_names[e->detail];
+            }
+            double ts = (double)(e->start - trace->start_ticks) * us_per_tick;
+            double dur = (double)(e->end - e->start) * us_per_tick;
+            fprintf(out, "%s{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":%d,\"tid\":%d}",
+                    written > 0 ? ",\n" : "", name, phase_names[e->phase < TRACE_PHASES ? e->phase : 0],
+                    ts, dur, e->pid, e->tid);
+            written++;
+        }
+    }
+    fprintf(out, "\n]}\n");
+    free(events);
+    if (fclose(out) != 0) {
+        perror("Error writing trace");
+        return -1;
+    }
+    return written;
+}
+
+static void* writer_thread(void* arg) {
+    sigset_t* signals = arg;
+    for (int n = 1;; n++) {
+        int sig;
+        if (sigwait(signals, &sig) != 0) {
+            continue;
+        }
+        char path[64];
+        snprintf(path, sizeof(path), "trace-%d-%d.json", (int)getpid(), n);
+        long events = write_trace(path);
+        if (events >= 0) {
+            printf("Trace of %ld events written to %s\n", events, path);
+            fflush(stdout);
+        }
+    }
+    return NULL;
+}
+
+int trace_init(int events_per_ring, int shared, const char* const* command_names, int command_count) {
+    size_t size = sizeof(TraceTable) + (size_t)TRACE_RINGS * events_per_ring * sizeof(TraceEvent);
+    int flags = MAP_ANONYMOUS | (shared ? MAP_SHARED : MAP_PRIVATE);
+    TraceTable* t = mmap(NULL, size, PROT_READ | PROT_WRITE, flags, -1, 0);
+    if (t == MAP_FAILED) {
+        perror("Failed to map trace buffers");
+        return 1;
+    }
+    t->capacity = events_per_ring;
+    t->start_ticks = trace_clock();
+    t->start_ns = monotonic_ns();
+    trace = t;
+    trace_names = command_names;
+    trace_name_count = command_count;
+
+    static sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &signals, NULL);
+    pthread_t thread;
+    int err = pthread_create(&thread, NULL, writer_thread, &signals);
+    if (err != 0) {
+        fprintf(stderr, "Error starting trace writer: %s\n", strerror(err));
+        return 1;
+    }
+    pthread_detach(thread);
+
+    pthread_atfork(NULL, NULL, forget_ring);
+    trace_enabled = 1;
+    return 0;
+}
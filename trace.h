@@ -0,0 +1,72 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+#include <time.h>
+
+#define TRACE_RINGS 256 // Threads (or fork mode processes) traced at once
+
+// Phases of a request, and the background work that can hold one up
+typedef enum {
+    TRACE_REQUEST,    // A whole request; detail is its command
+    TRACE_PARSE,      // Splitting a text request into fields
+    TRACE_LOOKUP,     // Finding the account(s) and taking their locks
+    TRACE_PIN_HASH,   // Checking a PIN against its hash
+    TRACE_LOG_APPEND, // Adding the change to the log buffer
+    TRACE_LOG_COMMIT, // Waiting for logged changes to be durable
+    TRACE_LOG_WRITE,  // A leader's write() of buffered log records
+    TRACE_LOG_SYNC,   // A leader's fdatasync() of the log
+    TRACE_SEND,       // send() of a batch of replies
+    TRACE_CHECKPOINT, // A background snapshot
+    TRACE_PHASES
+} TracePhase;
+
+// Set by trace_init(); read on every trace_begin()
+extern int trace_enabled;
+
+// Timestamp in ticks: the TSC where there is one, converted to time only
+// when a trace is written out
+static inline uint64_t trace_clock(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    return __builtin_ia32_rdtsc();
+#else
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ull + now.tv_nsec;
+#endif
+}
+
+void trace_record(TracePhase phase, int detail, uint64_t start);
+
+// Start timing a phase. Returns 0 when tracing is off, which makes the
+// matching trace_end() a no-op: untraced, a phase costs one branch.
+static inline uint64_t trace_begin(void) {
+    return trace_enabled ? trace_clock() : 0;
+}
+
+// Record the phase begun at start, in the calling thread's ring
+static inline void trace_end(TracePhase phase, int detail, uint64_t start) {
+    if (start != 0) {
+        trace_record(phase, detail, start);
+    }
+}
+
+// Turn tracing on, keeping the last events_per_ring phases of each thread
+// in a ring buffer, and start a thread that writes every ring out as a
+// Chrome trace (trace-<pid>-<n>.json, viewable in Perfetto or
+// chrome://tracing) each time the process gets SIGUSR1. Requests are
+// named command_names[detail].
+//
+// With shared set the rings are MAP_SHARED, so forked children record
+// into rings the parent writes out. Call before starting any other thread:
+// SIGUSR1 is blocked in the caller and every thread it starts, leaving
+// the signal to the writer thread.
+// Returns 0 on success, 1 on failure.
+int trace_init(int events_per_ring, int shared, const char* const* command_names, int command_count);
+
+// Give the calling thread's ring back for another thread or process to
+// reuse; its events stay until they are overwritten. Fork mode children
+// call this before exiting.
+void trace_release(void);
+
+#endif
@@ -0,0 +1,124 @@
+// Benchmark transfer() under cross-account contention.
+//
+//   transferbench [-t threads] [-a accounts] [-s seconds] [-g]
+//
+// Opens `accounts` in-memory accounts (no log) and runs `threads` threads
+// that each move 500 between random pairs of them, in both directions, for
+// `seconds`. Few accounts means most transfers collide. -g runs every
+// transfer under one global mutex instead, for comparison with the
+// per-account ordered locking. At the end the total balance is checked:
+// transfers move money, they never create or destroy it.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "bank.h"
+
+#define INITIAL_BALANCE 1000000000.0
+#define BENCH_PIN 4321
+
+typedef struct {
+    pthread_t thread;
+    unsigned int seed;
+    long transfers;
+} Runner;
+
+static char (*numbers)[MAX_ACCOUNT_NUMBER_LEN];
+static int account_count = 8;
+static int global_lock = 0;
+static pthread_mutex_t big_lock = PTHREAD_MUTEX_INITIALIZER;
+static volatile int running = 1;
+
+static void* runner_main(void* arg) {
+    Runner* runner = arg;
+    while (running) {
+        int from = rand_r(&runner->seed) % account_count;
+        int to = rand_r(&runner->seed) % (account_count - 1);
+        to += to >= from; // Any account but from
+
+        if (global_lock) {
+            pthread_mutex_lock(&big_lock);
+        }
+        if (transfer(numbers[from], BENCH_PIN, numbers[to], 500.0) == 0) {
+            runner->transfers++;
+        }
+        if (global_lock) {
+            pthread_mutex_unlock(&big_lock);
+        }
+    }
+    return NULL;
+}
+
+static void usage(const char* prog) {
+    fprintf(stderr, "Usage: %s [-t threads] [-a accounts] [-s seconds] [-g]\n", prog);
+}
+
+int main(int argc, char* argv[]) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int thread_count = cpus > 0 ? (int)cpus : 1;
+    int seconds = 3;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "t:a:s:g")) != -1) {
+        switch (opt) {
+        case 't': thread_count = atoi(optarg); break;
+        case 'a': account_count = atoi(optarg); break;
+        case 's': seconds = atoi(optarg); break;
+        case 'g': global_lock = 1; break;
+        default:
+            usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+    if (thread_count < 1 || account_count < 2 || seconds < 1) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    srand(time(NULL));
+    bank_set_pin_iterations(1); // Time the table, not PIN hashing
+    if (bank_init(0, DEFAULT_SHARDS) != 0) {
+        return EXIT_FAILURE;
+    }
+    numbers = calloc(account_count, sizeof(*numbers));
+    Runner* runners = calloc(thread_count, sizeof(Runner));
+    if (numbers == NULL || runners == NULL) {
+        perror("calloc");
+        return EXIT_FAILURE;
+    }
+    for (int i = 0; i < account_count; i++) {
+        Account acc = open_account("Bench", "0", "savings", INITIAL_BALANCE, BENCH_PIN);
+        if (!acc.is_active) {
+            fprintf(stderr, "Could not open account %d\n", i);
+            return EXIT_FAILURE;
+        }
+        memcpy(numbers[i], acc.account_number, MAX_ACCOUNT_NUMBER_LEN);
+    }
+
+    for (int i = 0; i < thread_count; i++) {
+        runners[i].seed = (unsigned int)rand();
+        pthread_create(&runners[i].thread, NULL, runner_main, &runners[i]);
+    }
+    sleep(seconds);
+    running = 0;
+
+    long total = 0;
+    for (int i = 0; i < thread_count; i++) {
+        pthread_join(runners[i].thread, NULL);
+        total += runners[i].transfers;
+    }
+
+    double money = 0;
+    for (int i = 0; i < account_count; i++) {
+        money += check_balance(numbers[i], BENCH_PIN);
+    }
+    int conserved = money == INITIAL_BALANCE * account_count;
+
+    printf("%s locking, %d threads, %d accounts: %ld transfers in %d s, %.0f transfers/s%s\n",
+           global_lock ? "global" : "per-account", thread_count, account_count, total, seconds,
+           (double)total / seconds, conserved ? "" : " -- TOTAL BALANCE CHANGED");
+    return conserved ? EXIT_SUCCESS : EXIT_FAILURE;
+}
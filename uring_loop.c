@@ -0,0 +1,684 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+
+#include "uring_loop.h"
+#include "framing.h"
+#include "admission.h"
+#include "timer_wheel.h"
+#include "metrics.h"
+#include "trace.h"
+
+// Completions carry the connection in user_data, with the operation in
+// the low bits malloc() leaves clear
+enum {
+    OP_ACCEPT = 0, // With a NULL connection
+    OP_RECV = 1,
+    OP_WRITE = 2,
+    OP_CANCEL = 3, // With a NULL connection; nothing to do on completion
+    OP_MASK = 3
+};
+
+// A receive buffer whose data is not all copied into its stream yet.
+// Buffers held by a connection are chained in arrival order.
+typedef struct {
+    int next; // Buffer id, -1 at the end of the chain
+    uint16_t offset;
+    uint16_t length;
+} HeldBuffer;
+
+typedef struct Connection {
+    Timer timer; // First, so an expired timer is its connection
+    int fd;
+    int slot;       // Registered buffer holding stream.output, -1 if none was free
+    int recv_armed; // Multishot receive queued
+    int cancelling; // ...and a cancel of it submitted
+    int writing;    // Write of output in flight
+    int closing;    // Shut down; freed once nothing is in flight
+    int starved;    // Receive ended for lack of buffers, waiting on the starved list
+    struct Connection* next_starved;
+    uint64_t send_traced;
+    // Received data that did not fit in the input buffer yet: a chain of
+    // buffer ids, oldest first
+    int held_first;
+    int held_last;
+    int held_count;
+    // Timeouts, as in the epoll loop
+    int busy;
+    int progressed;
+    uint64_t busy_since;
+    uint64_t deadline;
+    RequestStream stream;
+} Connection;
+
+// One loop per thread, like the epoll loops
+typedef struct {
+    int fd;
+    int listen_socket;
+
+    // Submission queue: SQEs are filled at sq_local_tail and handed to
+    // the kernel by the next io_uring_enter()
+    unsigned* sq_head;
+    unsigned* sq_tail;
+    unsigned sq_mask;
+    unsigned sq_entries;
+    unsigned sq_local_tail;
+    unsigned sq_submitted;
+    struct io_uring_sqe* sqes;
+
+    unsigned* cq_head;
+    unsigned* cq_tail;
+    unsigned cq_mask;
+    struct io_uring_cqe* cqes;
+
+    void* ring;
+    size_t ring_size;
+    size_t sqes_size;
+
+    // Receive buffers lent to the kernel, which picks one per completion
+    struct io_uring_buf_ring* buf_ring;
+    char* recv_buffers;
+    uint16_t buf_tail;
+    HeldBuffer held[URING_RECV_BUFFERS];
+    int recycled; // A buffer went back since the starved were last re-armed
+    Connection* starved;
+
+    int free_slots[URING_FIXED_BUFFERS];
+    int free_slot_count;
+
+    TimerWheel timers;
+} UringLoop;
+
+static int uring_setup(unsigned entries, struct io_uring_params* params) {
+    return (int)syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags, void* arg, size_t size) {
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, arg, size);
+}
+
+static int uring_register(int fd, unsigned opcode, void* arg, unsigned count) {
+    return (int)syscall(__NR_io_uring_register, fd, opcode, arg, count);
+}
+
+// Hand receive buffer id back to the kernel
+static void recycle_buffer(UringLoop* loop, uint16_t id) {
+    struct io_uring_buf* buf = &loop->buf_ring->bufs[loop->buf_tail & (URING_RECV_BUFFERS - 1)];
+    buf->addr = (uint64_t)(uintptr_t)(loop->recv_buffers + (size_t)id * URING_RECV_BUFFER_SIZE);
+    buf->len = URING_RECV_BUFFER_SIZE;
+    buf->bid = id;
+    loop->buf_tail++;
+    __atomic_store_n(&loop->buf_ring->tail, loop->buf_tail, __ATOMIC_RELEASE);
+    loop->recycled = 1;
+}
+
+static void uring_close(UringLoop* loop) {
+    if (loop->ring != NULL) {
+        munmap(loop->ring, loop->ring_size);
+    }
+    if (loop->sqes != NULL) {
+        munmap(loop->sqes, loop->sqes_size);
+    }
+    if (loop->buf_ring != NULL) {
+        munmap(loop->buf_ring, URING_RECV_BUFFERS * sizeof(struct io_uring_buf));
+    }
+    if (loop->recv_buffers != NULL) {
+        munmap(loop->recv_buffers, (size_t)URING_RECV_BUFFERS * URING_RECV_BUFFER_SIZE);
+    }
+    if (loop->fd >= 0) {
+        close(loop->fd);
+    }
+}
+
+// Create the ring, its receive buffers and an empty registered buffer table
+// Returns 0 on success, -errno on failure (with whatever was set up undone)
+static int uring_open(UringLoop* loop) {
+    memset(loop, 0, sizeof(*loop));
+    loop->fd = -1;
+
+    // Only this thread submits, and completions are worked off when it
+    // asks for them rather than by interrupting it (Linux 6.1); older
+    // kernels get a plain ring
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    params.flags = IORING_SETUP_CQSIZE | IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN;
+    params.cq_entries = URING_ENTRIES * 4;
+    loop->fd = uring_setup(URING_ENTRIES, &params);
+    if (loop->fd < 0 && errno == EINVAL) {
+        memset(&params, 0, sizeof(params));
+        params.flags = IORING_SETUP_CQSIZE;
+        params.cq_entries = URING_ENTRIES * 4;
+        loop->fd = uring_setup(URING_ENTRIES, &params);
+    }
+    if (loop->fd < 0) {
+        return -errno;
+    }
+    if (!(params.features & IORING_FEAT_SINGLE_MMAP) || !(params.features & IORING_FEAT_NODROP) ||
+        !(params.features & IORING_FEAT_EXT_ARG)) {
+        uring_close(loop);
+        return -EOPNOTSUPP;
+    }
+
+    size_t sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    size_t cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    loop->ring_size = sq_size > cq_size ? sq_size : cq_size;
+    loop->ring = mmap(NULL, loop->ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      loop->fd, IORING_OFF_SQ_RING);
+    loop->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    loop->sqes = mmap(NULL, loop->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      loop->fd, IORING_OFF_SQES);
+    if (loop->ring == MAP_FAILED || loop->sqes == MAP_FAILED) {
+        int err = errno;
+        loop->ring = loop->ring == MAP_FAILED ? NULL : loop->ring;
+        loop->sqes = loop->sqes == MAP_FAILED ? NULL : loop->sqes;
+        uring_close(loop);
+        return -err;
+    }
+    char* ring = loop->ring;
+    loop->sq_head = (unsigned*)(ring + params.sq_off.head);
+    loop->sq_tail = (unsigned*)(ring + params.sq_off.tail);
+    loop->sq_mask = *(unsigned*)(ring + params.sq_off.ring_mask);
+    loop->sq_entries = params.sq_entries;
+    loop->sq_local_tail = *loop->sq_tail;
+    loop->sq_submitted = loop->sq_local_tail;
+    unsigned* sq_array = (unsigned*)(ring + params.sq_off.array);
+    for (unsigned i = 0; i < params.sq_entries; i++) {
+        sq_array[i] = i; // SQE i always sits in slot i
+    }
+    loop->cq_head = (unsigned*)(ring + params.cq_off.head);
+    loop->cq_tail = (unsigned*)(ring + params.cq_off.tail);
+    loop->cq_mask = *(unsigned*)(ring + params.cq_off.ring_mask);
+    loop->cqes = (struct io_uring_cqe*)(ring + params.cq_off.cqes);
+
+    // Receive buffers, registered as buffer group 0
+    loop->buf_ring = mmap(NULL, URING_RECV_BUFFERS * sizeof(struct io_uring_buf), PROT_READ | PROT_WRITE,
+                          MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    loop->recv_buffers = mmap(NULL, (size_t)URING_RECV_BUFFERS * URING_RECV_BUFFER_SIZE, PROT_READ | PROT_WRITE,
+                              MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (loop->buf_ring == MAP_FAILED || loop->recv_buffers == MAP_FAILED) {
+        int err = errno;
+        loop->buf_ring = loop->buf_ring == MAP_FAILED ? NULL : loop->buf_ring;
+        loop->recv_buffers = loop->recv_buffers == MAP_FAILED ? NULL : loop->recv_buffers;
+        uring_close(loop);
+        return -err;
+    }
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uint64_t)(uintptr_t)loop->buf_ring;
+    reg.ring_entries = URING_RECV_BUFFERS;
+    reg.bgid = 0;
+    if (uring_register(loop->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+        int err = errno;
+        uring_close(loop);
+        return -err;
+    }
+    for (int id = 0; id < URING_RECV_BUFFERS; id++) {
+        recycle_buffer(loop, id);
+    }
+
+    // Output buffers are registered one connection at a time
+    struct io_uring_rsrc_register table;
+    memset(&table, 0, sizeof(table));
+    table.nr = URING_FIXED_BUFFERS;
+    table.flags = IORING_RSRC_REGISTER_SPARSE;
+    if (uring_register(loop->fd, IORING_REGISTER_BUFFERS2, &table, sizeof(table)) < 0) {
+        int err = errno;
+        uring_close(loop);
+        return -err;
+    }
+    for (int i = 0; i < URING_FIXED_BUFFERS; i++) {
+        loop->free_slots[i] = URING_FIXED_BUFFERS - 1 - i;
+    }
+    loop->free_slot_count = URING_FIXED_BUFFERS;
+    return 0;
+}
+
+// Submit the queued SQEs and wait for at least min_complete completions,
+// or for timeout_ms if that is not negative
+// Returns 0 on success, 1 on a fatal error
+static int uring_submit(UringLoop* loop, unsigned min_complete, int timeout_ms) {
+    __atomic_store_n(loop->sq_tail, loop->sq_local_tail, __ATOMIC_RELEASE);
+    unsigned to_submit = loop->sq_local_tail - loop->sq_submitted;
+    int submitted;
+    if (timeout_ms >= 0 && min_complete > 0) {
+        struct __kernel_timespec ts = { timeout_ms / 1000, (long long)(timeout_ms % 1000) * 1000000 };
+        struct io_uring_getevents_arg arg;
+        memset(&arg, 0, sizeof(arg));
+        arg.ts = (uint64_t)(uintptr_t)&ts;
+        submitted = uring_enter(loop->fd, to_submit, min_complete, IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG,
+                                &arg, sizeof(arg));
+    } else {
+        submitted = uring_enter(loop->fd, to_submit, min_complete, IORING_ENTER_GETEVENTS, NULL, 0);
+    }
+    metrics_syscalls(1);
+    if (submitted < 0) {
+        // Interrupted, timed out, or completions must be reaped first
+        if (errno == EINTR || errno == ETIME || errno == EBUSY || errno == EAGAIN) {
+            return 0;
+        }
+        perror("io_uring_enter");
+        return 1;
+    }
+    loop->sq_submitted += submitted;
+    return 0;
+}
+
+static struct io_uring_sqe* get_sqe(UringLoop* loop) {
+    // A full queue is submitted early, without waiting
+    while (loop->sq_local_tail - __atomic_load_n(loop->sq_head, __ATOMIC_ACQUIRE) >= loop->sq_entries) {
+        uring_submit(loop, 0, -1);
+    }
+    struct io_uring_sqe* sqe = &loop->sqes[loop->sq_local_tail & loop->sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+    loop->sq_local_tail++;
+    return sqe;
+}
+
+static void arm_accept(UringLoop* loop) {
+    struct io_uring_sqe* sqe = get_sqe(loop);
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = loop->listen_socket;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_CLOEXEC;
+    sqe->user_data = OP_ACCEPT;
+}
+
+static void arm_recv(UringLoop* loop, Connection* conn) {
+    struct io_uring_sqe* sqe = get_sqe(loop);
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = conn->fd;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = 0;
+    sqe->user_data = (uintptr_t)conn | OP_RECV;
+    conn->recv_armed = 1;
+    conn->cancelling = 0;
+}
+
+static void cancel_recv(UringLoop* loop, Connection* conn) {
+    struct io_uring_sqe* sqe = get_sqe(loop);
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->addr = (uintptr_t)conn | OP_RECV;
+    sqe->user_data = OP_CANCEL;
+    conn->cancelling = 1;
+}
+
+// Send the unsent output; from the registered buffer when there is one
+static void submit_write(UringLoop* loop, Connection* conn) {
+    RequestStream* stream = &conn->stream;
+    struct io_uring_sqe* sqe = get_sqe(loop);
+    sqe->fd = conn->fd;
+    sqe->addr = (uintptr_t)(stream->output + stream->output_sent);
+    sqe->len = stream_unsent(stream);
+    if (conn->slot >= 0) {
+        sqe->opcode = IORING_OP_WRITE_FIXED;
+        sqe->buf_index = conn->slot;
+    } else {
+        sqe->opcode = IORING_OP_SEND;
+        sqe->msg_flags = MSG_NOSIGNAL;
+    }
+    sqe->user_data = (uintptr_t)conn | OP_WRITE;
+    conn->writing = 1;
+    conn->send_traced = trace_begin();
+}
+
+// Point registered buffer slot at buffer (NULL to clear it)
+// Returns 0 on success, 1 on failure
+static int update_slot(UringLoop* loop, int slot, void* buffer, size_t length) {
+    struct iovec iov = { buffer, length };
+    struct io_uring_rsrc_update2 update;
+    memset(&update, 0, sizeof(update));
+    update.offset = slot;
+    update.data = (uint64_t)(uintptr_t)&iov;
+    update.nr = 1;
+    metrics_syscalls(1);
+    return uring_register(loop->fd, IORING_REGISTER_BUFFERS_UPDATE, &update, sizeof(update)) == 1 ? 0 : 1;
+}
+
+static void leave_starved(UringLoop* loop, Connection* conn) {
+    for (Connection** p = &loop->starved; *p != NULL; p = &(*p)->next_starved) {
+        if (*p == conn) {
+            *p = conn->next_starved;
+            break;
+        }
+    }
+    conn->starved = 0;
+}
+
+// Free the connection once it is shut down and the kernel is done with it
+static void finish_close(UringLoop* loop, Connection* conn) {
+    if (!conn->closing || conn->recv_armed || conn->writing) {
+        return;
+    }
+    for (int i = 0, id = conn->held_first; i < conn->held_count; i++, id = loop->held[id].next) {
+        recycle_buffer(loop, id);
+    }
+    if (conn->slot >= 0) {
+        update_slot(loop, conn->slot, NULL, 0);
+        loop->free_slots[loop->free_slot_count++] = conn->slot;
+    }
+    close(conn->fd);
+    free(conn);
+    admission_leave();
+    metrics_closed();
+    metrics_syscalls(1);
+}
+
+// Stop the connection's I/O: the shutdown ends its receive and any write
+static void start_close(UringLoop* loop, Connection* conn) {
+    if (!conn->closing) {
+        conn->closing = 1;
+        wheel_remove(&loop->timers, &conn->timer);
+        if (conn->starved) {
+            leave_starved(loop, conn);
+        }
+        shutdown(conn->fd, SHUT_RDWR);
+        metrics_syscalls(1);
+    }
+    finish_close(loop, conn);
+}
+
+// Copy held receive buffers into the input buffer as far as they fit
+// Returns 1 if anything was copied
+static int feed_input(UringLoop* loop, Connection* conn) {
+    int fed = 0;
+    while (conn->held_count > 0) {
+        int id = conn->held_first;
+        HeldBuffer* held = &loop->held[id];
+        size_t room;
+        char* buffer = stream_read_buffer(&conn->stream, &room);
+        if (room == 0) {
+            break;
+        }
+        size_t n = room < held->length ? room : held->length;
+        memcpy(buffer, loop->recv_buffers + (size_t)id * URING_RECV_BUFFER_SIZE + held->offset, n);
+        stream_received(&conn->stream, n);
+        held->offset += n;
+        held->length -= n;
+        fed = 1;
+        if (held->length == 0) {
+            conn->held_first = held->next;
+            conn->held_count--;
+            recycle_buffer(loop, id);
+        }
+    }
+    return fed;
+}
+
+// Work out the connection's deadline, moving its timer only if the
+// deadline came forward
+static void update_deadline(UringLoop* loop, Connection* conn) {
+    uint64_t now = timeout_now();
+    int busy = stream_busy(&conn->stream) || conn->held_count > 0;
+    if (busy && (!conn->busy || conn->progressed)) {
+        conn->busy_since = now;
+    }
+    conn->busy = busy;
+    conn->progressed = 0;
+    conn->deadline = connection_deadline(now, busy, conn->busy_since);
+
+    if (conn->deadline == 0) {
+        wheel_remove(&loop->timers, &conn->timer);
+    } else if (!timer_armed(&conn->timer) || conn->deadline < conn->timer.expires) {
+        wheel_remove(&loop->timers, &conn->timer);
+        wheel_add(&loop->timers, &conn->timer, conn->deadline);
+    }
+}
+
+// Timer callback: shut the connection down if its deadline has come, else
+// re-arm for the deadline it has moved to
+static void on_timer(Timer* timer, void* arg) {
+    Connection* conn = (Connection*)timer;
+    UringLoop* loop = arg;
+    if (conn->deadline > loop->timers.now) {
+        wheel_add(&loop->timers, timer, conn->deadline);
+        return;
+    }
+    metrics_timed_out(conn->busy ? TIMEOUT_REQUEST : TIMEOUT_IDLE);
+    start_close(loop, conn);
+}
+
+// Execute what has arrived, send the replies, and keep the receive armed
+// while the connection keeps up
+static void pump(UringLoop* loop, Connection* conn) {
+    RequestStream* stream = &conn->stream;
+    int progress = 1;
+    while (progress && !stream->session.quit) {
+        progress = feed_input(loop, conn);
+        if (stream_process(stream) > 0) {
+            conn->progressed = progress = 1;
+        }
+    }
+
+    if (stream_unsent(stream) > 0) {
+        if (!conn->writing) {
+            submit_write(loop, conn);
+        }
+    } else if (stream->session.quit) {
+        start_close(loop, conn);
+        return;
+    }
+
+    // A client that sends without reading its replies fills the input and
+    // output buffers; stop taking its data until they drain
+    if (conn->held_count >= URING_MAX_HELD) {
+        if (conn->recv_armed && !conn->cancelling) {
+            cancel_recv(loop, conn);
+        }
+    } else if (!conn->recv_armed && !conn->starved) {
+        arm_recv(loop, conn);
+    }
+    update_deadline(loop, conn);
+}
+
+static void on_accept(UringLoop* loop, int res, unsigned flags) {
+    if (!(flags & IORING_CQE_F_MORE)) {
+        arm_accept(loop); // The multishot accept ended; queue another
+    }
+    if (res < 0) {
+        fprintf(stderr, "Error in accepting connection: %s\n", strerror(-res));
+        return;
+    }
+    // The multishot accept gives no address: ask for it
+    struct sockaddr_in client_addr;
+    socklen_t addr_size = sizeof(client_addr);
+    if (getpeername(res, (struct sockaddr*)&client_addr, &addr_size) != 0) {
+        memset(&client_addr, 0, sizeof(client_addr));
+    }
+    metrics_syscalls(1);
+    if (!admission_enter(res, client_addr.sin_addr.s_addr)) {
+        return; // Over the connection cap or rate; already answered and closed
+    }
+    metrics_accepted();
+    printf("Accepted connection from %s:%d\n", inet_ntoa(client_addr.sin_addr), ntohs(client_addr.sin_port));
+
+    Connection* conn = malloc(sizeof(Connection));
+    if (conn == NULL) {
+        perror("Failed to allocate connection");
+        close(res);
+        admission_leave();
+        metrics_closed();
+        return;
+    }
+    memset(conn, 0, offsetof(Connection, stream));
+    conn->fd = res;
+    conn->slot = -1;
+    stream_init(&conn->stream, client_addr.sin_addr.s_addr);
+
+    if (loop->free_slot_count > 0) {
+        int slot = loop->free_slots[loop->free_slot_count - 1];
+        if (update_slot(loop, slot, conn->stream.output, OUTPUT_BUFFER_SIZE) == 0) {
+            conn->slot = slot;
+            loop->free_slot_count--;
+        }
+    }
+    arm_recv(loop, conn);
+    update_deadline(loop, conn);
+}
+
+static void on_recv(UringLoop* loop, Connection* conn, int res, unsigned flags) {
+    if (!(flags & IORING_CQE_F_MORE)) {
+        conn->recv_armed = 0;
+    }
+    if (res > 0 && (flags & IORING_CQE_F_BUFFER)) {
+        uint16_t id = flags >> IORING_CQE_BUFFER_SHIFT;
+        if (conn->closing) {
+            recycle_buffer(loop, id);
+        } else {
+            HeldBuffer* held = &loop->held[id];
+            held->next = -1;
+            held->offset = 0;
+            held->length = res;
+            if (conn->held_count++ == 0) {
+                conn->held_first = id;
+            } else {
+                loop->held[conn->held_last].next = id;
+            }
+            conn->held_last = id;
+        }
+    } else if (res == -ENOBUFS) {
+        // Every buffer is taken; armed again once one comes back
+        if (!conn->closing && !conn->starved) {
+            conn->starved = 1;
+            conn->next_starved = loop->starved;
+            loop->starved = conn;
+        }
+    } else if (res != -ECANCELED && !conn->closing) {
+        start_close(loop, conn); // Connection closed or error
+        return;
+    }
+
+    if (conn->closing) {
+        finish_close(loop, conn);
+    } else {
+        pump(loop, conn);
+    }
+}
+
+static void on_write(UringLoop* loop, Connection* conn, int res) {
+    conn->writing = 0;
+    trace_end(TRACE_SEND, 0, conn->send_traced);
+    if (conn->closing) {
+        finish_close(loop, conn);
+        return;
+    }
+    if (res <= 0) {
+        start_close(loop, conn);
+        return;
+    }
+    stream_sent(&conn->stream, (size_t)res);
+    conn->progressed = 1; // Replies being read count as progress
+    pump(loop, conn);
+}
+
+// Re-arm the receives that ran out of buffers, now that some are back
+static void feed_starved(UringLoop* loop) {
+    Connection* conn = loop->starved;
+    loop->starved = NULL;
+    loop->recycled = 0;
+    while (conn != NULL) {
+        Connection* next = conn->next_starved;
+        conn->starved = 0;
+        pump(loop, conn);
+        conn = next;
+    }
+}
+
+int uring_available(void) {
+    UringLoop loop;
+    int err = uring_open(&loop);
+    if (err != 0) {
+        fprintf(stderr, "io_uring is not available: %s\n", strerror(-err));
+        return 0;
+    }
+
+    // Multishot receive is the newest piece: try one on a socket pair
+    int pair[2];
+    int ok = 0;
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, pair) == 0) {
+        Connection probe;
+        memset(&probe, 0, offsetof(Connection, stream));
+        probe.fd = pair[0];
+        arm_recv(&loop, &probe);
+        uring_submit(&loop, 0, -1);
+        if (write(pair[1], "x", 1) == 1 && uring_submit(&loop, 1, -1) == 0) {
+            unsigned head = *loop.cq_head;
+            if (head != __atomic_load_n(loop.cq_tail, __ATOMIC_ACQUIRE)) {
+                const struct io_uring_cqe* cqe = &loop.cqes[head & loop.cq_mask];
+                ok = cqe->res == 1 && (cqe->flags & IORING_CQE_F_MORE);
+            }
+        }
+        close(pair[0]);
+        close(pair[1]);
+    }
+    uring_close(&loop);
+    if (!ok) {
+        fprintf(stderr, "io_uring is not available: no multishot receive (Linux 6.0 or later needed)\n");
+    }
+    return ok;
+}
+
+int run_uring_loop(int listen_socket) {
+    UringLoop* loop = malloc(sizeof(UringLoop));
+    if (loop == NULL) {
+        perror("Failed to allocate io_uring loop");
+        return 1;
+    }
+    int err = uring_open(loop);
+    if (err != 0) {
+        fprintf(stderr, "io_uring_setup: %s\n", strerror(-err));
+        free(loop);
+        return 1;
+    }
+    loop->listen_socket = listen_socket;
+    wheel_init(&loop->timers, timeout_now());
+
+    // Fixed-buffer writes are write()s: a connection reset would raise
+    // SIGPIPE instead of failing the write
+    signal(SIGPIPE, SIG_IGN);
+
+    arm_accept(loop);
+    while (1) {
+        // Sleep no longer than the timer wheel allows
+        int64_t ticks = wheel_next(&loop->timers);
+        if (uring_submit(loop, 1, ticks < 0 ? -1 : (int)ticks * TIMEOUT_TICK_MS) != 0) {
+            uring_close(loop);
+            free(loop);
+            return 1;
+        }
+
+        unsigned head = *loop->cq_head;
+        while (head != __atomic_load_n(loop->cq_tail, __ATOMIC_ACQUIRE)) {
+            const struct io_uring_cqe* cqe = &loop->cqes[head & loop->cq_mask];
+            uint64_t user_data = cqe->user_data;
+            int res = cqe->res;
+            unsigned flags = cqe->flags;
+            __atomic_store_n(loop->cq_head, ++head, __ATOMIC_RELEASE);
+
+            Connection* conn = (Connection*)(uintptr_t)(user_data & ~(uint64_t)OP_MASK);
+            switch (user_data & OP_MASK) {
+            case OP_ACCEPT: on_accept(loop, res, flags); break;
+            case OP_RECV: on_recv(loop, conn, res, flags); break;
+            case OP_WRITE: on_write(loop, conn, res); break;
+            default: break;
+            }
+        }
+
+        if (loop->starved != NULL && loop->recycled) {
+            feed_starved(loop);
+        }
+        wheel_advance(&loop->timers, timeout_now(), on_timer, loop);
+    }
+}
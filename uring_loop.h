@@ -0,0 +1,27 @@
+#ifndef URING_LOOP_H
+#define URING_LOOP_H
+
+#define URING_ENTRIES 1024          // Submission queue slots; the completion queue has 4x as many
+#define URING_RECV_BUFFERS 1024     // Receive buffers the kernel picks from (a power of two)
+#define URING_RECV_BUFFER_SIZE 4096
+#define URING_FIXED_BUFFERS 4096    // Connections whose output buffer is registered
+#define URING_MAX_HELD 8            // Received buffers a connection may hold before it stops receiving
+
+// Whether the kernel supports everything run_uring_loop() uses: io_uring
+// with provided buffer rings, multishot accept and receive and sparse
+// registered buffers (Linux 6.0 or later). Prints the reason if not.
+// Returns 1 if it does, 0 if not.
+int uring_available(void);
+
+// Same contract as run_event_loop(), with io_uring doing the socket I/O.
+// A multishot accept and one multishot receive per connection stay
+// queued, received data lands in buffers the loop lends the kernel, and
+// replies go out with fixed-buffer writes from each connection's
+// registered output buffer. One io_uring_enter() submits every send and
+// re-arm of a pass and waits for the next completions, so the loop makes
+// about one system call per batch of events instead of one per read,
+// send and wakeup.
+// Returns only on a fatal error (1).
+int run_uring_loop(int listen_socket);
+
+#endif
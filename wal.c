@@ -0,0 +1,327 @@
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "wal.h"
+#include "crc32c.h"
+#include "metrics.h"
+#include "trace.h"
+
+// On-disk framing of one record, followed by `length` payload bytes.
+// The checksum covers type, length and payload, so a record cut short by
+// a crash is detected and replay stops there.
+typedef struct {
+    uint32_t crc;
+    uint16_t type;
+    uint16_t length;
+} WalRecordHeader;
+
+static uint32_t record_crc(uint16_t type, uint16_t length, const void* payload) {
+    uint32_t crc = crc32c(0, &type, sizeof(type));
+    crc = crc32c(crc, &length, sizeof(length));
+    return crc32c(crc, payload, length);
+}
+
+// Generation of the log file this process's descriptor points at
+static unsigned int local_generation = 0;
+
+static void wal_lock(Wal* wal) {
+    if (pthread_mutex_lock(&wal->lock) == EOWNERDEAD) {
+        // A process died inside wal_append()/wal_commit(). The counters are
+        // only changed together with the data they describe, so carry on.
+        fprintf(stderr, "Warning: recovered the log lock from a terminated process.\n");
+        pthread_mutex_consistent(&wal->lock);
+    }
+}
+
+off_t wal_replay(const char* path, WalApply apply, void* ctx) {
+    FILE* file = fopen(path, "rb");
+    if (file == NULL) {
+        return errno == ENOENT ? 0 : -1; // No log yet
+    }
+
+    off_t intact = 0;
+    int replayed = 0;
+    WalRecordHeader header;
+    char payload[WAL_MAX_RECORD];
+    while (fread(&header, sizeof(header), 1, file) == 1) {
+        if (header.length > WAL_MAX_RECORD ||
+            fread(payload, 1, header.length, file) != header.length ||
+            record_crc(header.type, header.length, payload) != header.crc) {
+            fprintf(stderr, "Warning: log %s is torn after %d records; discarding the rest.\n", path, replayed);
+            break;
+        }
+        apply(header.type, payload, header.length, ctx);
+        intact += sizeof(header) + header.length;
+        replayed++;
+    }
+
+    fclose(file);
+    return intact;
+}
+
+// The descriptor to write the log through; caller holds the lock. Forked
+// children share the number of the parent's descriptor but not the
+// descriptor itself, so after a rotation made by another process they
+// point it at the new file.
+static int log_fd(Wal* wal) {
+    if (local_generation != wal->generation) {
+        int fd = open(wal->path, O_WRONLY | O_APPEND);
+        if (fd >= 0) {
+            dup2(fd, wal->fd);
+            close(fd);
+        } else {
+            perror("Error reopening rotated log");
+        }
+        local_generation = wal->generation;
+    }
+    return wal->fd;
+}
+
+// write() all of buffer to fd
+// Returns 0 on success, 1 on failure
+static int write_all(int fd, const char* buffer, size_t length) {
+    size_t written = 0;
+    while (written < length) {
+        ssize_t n = write(fd, buffer + written, length - written);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            perror("Error writing log");
+            return 1;
+        }
+        written += n;
+    }
+    return 0;
+}
+
+// Write the active half to the log and, if sync is set, make it durable.
+// Called with the lock held and no flush running; drops the lock while
+// doing I/O so other threads can keep appending to the other half.
+static void flush_locked(Wal* wal, int sync) {
+    char* buffer = wal->buffers[wal->active];
+    size_t length = wal->filled;
+    uint64_t end = wal->appended_lsn;
+    int fd = log_fd(wal);
+
+    wal->active = !wal->active;
+    wal->filled = 0;
+    wal->flushing = 1;
+    pthread_mutex_unlock(&wal->lock);
+
+    uint64_t started = metrics_now();
+    uint64_t traced = trace_begin();
+    int failed = write_all(fd, buffer, length);
+    uint64_t written = metrics_now();
+    metrics_log_write(written - started);
+    trace_end(TRACE_LOG_WRITE, 0, traced);
+    if (!failed && sync) {
+        traced = trace_begin();
+        if (fdatasync(fd) != 0) {
+            perror("Error syncing log");
+            failed = 1;
+        }
+        metrics_log_sync(metrics_now() - written);
+        trace_end(TRACE_LOG_SYNC, 0, traced);
+    }
+
+    wal_lock(wal);
+    wal->written_lsn = end;
+    if (sync) {
+        wal->durable_lsn = end;
+    }
+    wal->failed |= failed;
+    wal->flushing = 0;
+    pthread_cond_broadcast(&wal->flushed);
+}
+
+// Background flusher for WAL_SYNC_INTERVAL
+static void* flusher_main(void* arg) {
+    Wal* wal = arg;
+    struct timespec interval = { wal->interval_ms / 1000, (wal->interval_ms % 1000) * 1000000L };
+
+    while (1) {
+        nanosleep(&interval, NULL);
+        wal_lock(wal);
+        if (!wal->flushing && wal->durable_lsn < wal->appended_lsn) {
+            flush_locked(wal, 1);
+        }
+        pthread_mutex_unlock(&wal->lock);
+    }
+    return NULL;
+}
+
+Wal* wal_open(const char* path, off_t keep, int shared, WalPolicy policy, int interval_ms) {
+    int fd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0644);
+    if (fd < 0) {
+        perror("Error opening log");
+        return NULL;
+    }
+    // Drop a torn tail so new records follow the last intact one
+    if (ftruncate(fd, keep) != 0) {
+        perror("Error truncating log");
+        close(fd);
+        return NULL;
+    }
+
+    int flags = MAP_ANONYMOUS | (shared ? MAP_SHARED : MAP_PRIVATE);
+    Wal* wal = mmap(NULL, sizeof(Wal), PROT_READ | PROT_WRITE, flags, -1, 0);
+    if (wal == MAP_FAILED) {
+        perror("Failed to map log buffer");
+        close(fd);
+        return NULL;
+    }
+
+    pthread_mutexattr_t mattr;
+    pthread_mutexattr_init(&mattr);
+    pthread_mutexattr_setrobust(&mattr, PTHREAD_MUTEX_ROBUST);
+    pthread_condattr_t cattr;
+    pthread_condattr_init(&cattr);
+    if (shared) {
+        pthread_mutexattr_setpshared(&mattr, PTHREAD_PROCESS_SHARED);
+        pthread_condattr_setpshared(&cattr, PTHREAD_PROCESS_SHARED);
+    }
+    pthread_mutex_init(&wal->lock, &mattr);
+    pthread_cond_init(&wal->flushed, &cattr);
+    pthread_mutexattr_destroy(&mattr);
+    pthread_condattr_destroy(&cattr);
+
+    wal->fd = fd;
+    snprintf(wal->path, sizeof(wal->path), "%s", path);
+    wal->policy = policy;
+    wal->interval_ms = interval_ms > 0 ? interval_ms : 1;
+    wal->appended_lsn = wal->written_lsn = wal->durable_lsn = keep;
+
+    if (policy == WAL_SYNC_INTERVAL) {
+        pthread_t thread;
+        int err = pthread_create(&thread, NULL, flusher_main, wal);
+        if (err != 0) {
+            fprintf(stderr, "Error starting log flusher: %s\n", strerror(err));
+            return NULL;
+        }
+        pthread_detach(thread);
+    }
+    return wal;
+}
+
+uint64_t wal_append(Wal* wal, uint16_t type, const void* payload, size_t length) {
+    WalRecordHeader header = { record_crc(type, length, payload), type, (uint16_t)length };
+    size_t total = sizeof(header) + length;
+
+    wal_lock(wal);
+    // Active half full: flush it ourselves, or wait for the running flush
+    // to free the other half
+    while (wal->filled + total > WAL_BUFFER_SIZE) {
+        if (!wal->flushing) {
+            flush_locked(wal, 0);
+        } else {
+            pthread_cond_wait(&wal->flushed, &wal->lock);
+        }
+    }
+
+    char* dest = wal->buffers[wal->active] + wal->filled;
+    memcpy(dest, &header, sizeof(header));
+    memcpy(dest + sizeof(header), payload, length);
+    wal->filled += total;
+    wal->appended_lsn += total;
+    uint64_t lsn = wal->appended_lsn;
+    pthread_mutex_unlock(&wal->lock);
+    return lsn;
+}
+
+void sync_parent_dir(const char* path) {
+    char dir[4096];
+    const char* slash = strrchr(path, '/');
+    if (slash == NULL) {
+        strcpy(dir, ".");
+    } else {
+        snprintf(dir, sizeof(dir), "%.*s", (int)(slash - path), path);
+    }
+    int fd = open(dir[0] ? dir : "/", O_RDONLY | O_DIRECTORY);
+    if (fd >= 0) {
+        fsync(fd);
+        close(fd);
+    }
+}
+
+uint64_t wal_position(Wal* wal) {
+    wal_lock(wal);
+    uint64_t lsn = wal->appended_lsn;
+    pthread_mutex_unlock(&wal->lock);
+    return lsn;
+}
+
+// Switch the log to a fresh file at wal->path, keeping the current one as
+// old_path. Caller holds the lock and no flush is running.
+// Returns 0 on success, 1 on failure
+static int rotate_locked(Wal* wal, const char* old_path) {
+    int fd = log_fd(wal);
+
+    // Everything up to the switch must be in the old file, as durable as
+    // the policy promised its committers
+    if (write_all(fd, wal->buffers[wal->active], wal->filled) != 0 ||
+        (wal->policy != WAL_SYNC_NEVER && fdatasync(fd) != 0)) {
+        wal->failed = 1;
+        return 1;
+    }
+    wal->filled = 0;
+    wal->written_lsn = wal->appended_lsn;
+    if (wal->policy != WAL_SYNC_NEVER) {
+        wal->durable_lsn = wal->appended_lsn;
+    }
+    pthread_cond_broadcast(&wal->flushed);
+
+    if (rename(wal->path, old_path) != 0) {
+        perror("Error rotating log");
+        return 1;
+    }
+    int fresh = open(wal->path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644);
+    if (fresh < 0) {
+        perror("Error opening rotated log");
+        rename(old_path, wal->path); // Keep logging to the old file
+        return 1;
+    }
+    dup2(fresh, wal->fd);
+    close(fresh);
+    sync_parent_dir(wal->path);
+    wal->generation++;
+    local_generation = wal->generation;
+    return 0;
+}
+
+int wal_mark(Wal* wal, const char* old_path, uint64_t* marker) {
+    wal_lock(wal);
+    while (wal->flushing) {
+        pthread_cond_wait(&wal->flushed, &wal->lock);
+    }
+    int result = old_path != NULL ? rotate_locked(wal, old_path) : 0;
+    if (result == 0) {
+        __atomic_store_n(marker, wal->appended_lsn, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&wal->lock);
+    return result;
+}
+
+int wal_commit(Wal* wal, uint64_t lsn) {
+    if (wal->policy == WAL_SYNC_INTERVAL) {
+        return 0; // The flusher thread will get to it
+    }
+
+    int sync = wal->policy == WAL_SYNC_ALWAYS;
+    wal_lock(wal);
+    while ((sync ? wal->durable_lsn : wal->written_lsn) < lsn) {
+        if (!wal->flushing) {
+            flush_locked(wal, sync); // Lead: flush everyone's records
+        } else {
+            pthread_cond_wait(&wal->flushed, &wal->lock); // Ride along with the next flush
+        }
+    }
+    int failed = wal->failed;
+    pthread_mutex_unlock(&wal->lock);
+    return failed;
+}
@@ -0,0 +1,96 @@
+#ifndef WAL_H
+#define WAL_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/types.h>
+#include <pthread.h>
+
+#define WAL_BUFFER_SIZE (1 << 20) // Bytes buffered per half of the double buffer
+#define WAL_MAX_RECORD (32 * 1024) // Largest payload accepted by wal_append()
+#define WAL_MAX_PATH 4096
+
+// When committed records reach the disk
+typedef enum {
+    WAL_SYNC_ALWAYS,   // fdatasync before every commit returns
+    WAL_SYNC_INTERVAL, // a background thread writes and syncs every interval_ms
+    WAL_SYNC_NEVER     // written at commit, left to the OS to flush
+} WalPolicy;
+
+// Append-only write-ahead log with group commit.
+//
+// Records are appended to an in-memory buffer under a short lock. A
+// committer that finds its record not yet on disk becomes the leader if
+// no flush is running: it swaps the double buffer, drops the lock, and
+// writes (and syncs) everything buffered so far with one write() and one
+// fdatasync(). Committers arriving meanwhile fill the other half and wait;
+// the next leader flushes all of them together.
+//
+// Positions in the log are LSNs: the number of bytes logged up to and
+// including a record, counted across file rotations.
+//
+// The struct is plain data in its own mapping; in shared mode that mapping
+// is MAP_SHARED and the locks process-shared, so forked children commit
+// through the same buffer and file descriptor.
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t flushed;  // Signalled when a leader finishes
+    int fd;                  // Same number in every process, see log_fd()
+    unsigned int generation; // Bumped each time the log file is rotated
+    char path[WAL_MAX_PATH];
+    WalPolicy policy;
+    int interval_ms;
+    int flushing;            // A leader is writing the inactive half
+    int failed;              // Sticky: a write or sync has failed
+    int active;              // Half being filled
+    size_t filled;           // Bytes in the active half
+    uint64_t appended_lsn;   // End of the last appended record
+    uint64_t written_lsn;    // End of what has been handed to write()
+    uint64_t durable_lsn;    // End of what has been synced
+    char buffers[2][WAL_BUFFER_SIZE];
+} Wal;
+
+// Called by wal_replay() for each intact record, in log order
+typedef void (*WalApply)(uint16_t type, const void* payload, size_t length, void* ctx);
+
+// Feed every intact record of the log at path to apply. Stops at the first
+// torn or corrupt record (the tail of a crashed write).
+// Returns the length of the intact prefix (0 if there is no log), -1 on error.
+off_t wal_replay(const char* path, WalApply apply, void* ctx);
+
+// Open the log at path for appending, first cutting it to `keep` bytes
+// (0 after a checkpoint, the intact prefix otherwise). Must be called
+// before any fork in shared mode. With WAL_SYNC_INTERVAL a flusher thread
+// is started in the calling process.
+// Returns the log, or NULL on failure.
+Wal* wal_open(const char* path, off_t keep, int shared, WalPolicy policy, int interval_ms);
+
+// Add a record to the buffer; it is not durable until committed.
+// Appends for one account must be made under that account's lock so the
+// log keeps their order.
+// Returns the LSN to pass to wal_commit().
+uint64_t wal_append(Wal* wal, uint16_t type, const void* payload, size_t length);
+
+// End of the log so far
+uint64_t wal_position(Wal* wal);
+
+// Mark the end of the log for a checkpoint. The mark is stored in *marker
+// while the log lock is held, so any record appended afterwards sees it
+// once wal_append() returns, and has a higher LSN. With old_path set, the
+// records up to the mark are first flushed and synced, the file is renamed
+// to old_path, and later records go to a fresh file at the original path;
+// old_path can be deleted once the checkpoint is safely on disk.
+// Returns 0 on success, 1 if the log could not be rotated (nothing is
+// marked then).
+int wal_mark(Wal* wal, const char* old_path, uint64_t* marker);
+
+// Wait until everything up to lsn is as durable as the policy promises
+// (synced for ALWAYS, written for NEVER, nothing for INTERVAL).
+// Returns 0 on success, 1 if the log could not be written.
+int wal_commit(Wal* wal, uint64_t lsn);
+
+// fsync the directory holding path, making files created or renamed in it
+// durable
+void sync_parent_dir(const char* path);
+
+#endif
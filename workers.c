@@ -0,0 +1,81 @@
+#define _GNU_SOURCE // CPU_SET, pthread_setaffinity_np()
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+
+#include "workers.h"
+
+typedef struct {
+    pthread_t thread;
+    int id;
+    int listen_socket;
+    int cpu; // CPU to pin to, -1 to leave unpinned
+    int (*run_loop)(int listen_socket);
+} Worker;
+
+int default_worker_count(void) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    return cpus > 0 ? (int)cpus : 1;
+}
+
+static void* worker_main(void* arg) {
+    Worker* worker = arg;
+
+    if (worker->cpu >= 0) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(worker->cpu, &set);
+        int err = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+        if (err != 0) {
+            fprintf(stderr, "Warning: could not pin worker %d to CPU %d: %s\n", worker->id, worker->cpu, strerror(err));
+        }
+    }
+
+    worker->run_loop(worker->listen_socket);
+    return NULL;
+}
+
+int run_workers(const int* listen_sockets, int worker_count, int (*run_loop)(int listen_socket)) {
+    Worker* workers = calloc(worker_count, sizeof(Worker));
+    if (workers == NULL) {
+        perror("Failed to allocate workers");
+        return 1;
+    }
+
+    // Spread workers over the CPUs this process may run on
+    cpu_set_t allowed;
+    int allowed_count = 0;
+    int allowed_cpus[CPU_SETSIZE];
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) == 0) {
+        for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+            if (CPU_ISSET(cpu, &allowed)) {
+                allowed_cpus[allowed_count++] = cpu;
+            }
+        }
+    }
+
+    int started = 0;
+    for (int i = 0; i < worker_count; i++) {
+        workers[i].id = i;
+        workers[i].listen_socket = listen_sockets[i];
+        workers[i].run_loop = run_loop;
+        workers[i].cpu = allowed_count > 0 ? allowed_cpus[i % allowed_count] : -1;
+
+        int err = pthread_create(&workers[i].thread, NULL, worker_main, &workers[i]);
+        if (err != 0) {
+            fprintf(stderr, "Error starting worker %d: %s. Continuing with %d workers.\n", i, strerror(err), started);
+            break;
+        }
+        started++;
+    }
+
+    for (int i = 0; i < started; i++) {
+        pthread_join(workers[i].thread, NULL);
+    }
+
+    free(workers);
+    return started > 0 ? 0 : 1;
+}
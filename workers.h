@@ -0,0 +1,14 @@
+#ifndef WORKERS_H
+#define WORKERS_H
+
+// Number of workers to start when none is requested: one per online CPU
+int default_worker_count(void);
+
+// Start one thread per listening socket, each pinned to a CPU and running
+// its own run_loop (run_event_loop() or run_uring_loop()). The sockets are expected to share
+// a port through SO_REUSEPORT so the kernel spreads new connections over
+// the workers. Blocks until every worker has exited.
+// Returns 0 once the workers have exited, 1 if none could be started.
+int run_workers(const int* listen_sockets, int worker_count, int (*run_loop)(int listen_socket));
+
+#endif